@@ -46,52 +46,21 @@ function runHelper(args, timeout = 15000) {
   });
 }
 
-/* in-memory saved metadata */
-const savedList = []; // entries: { oldpid, cmdArgs (array|null), exe, tty, cwd, name, savedAt }
-
-/* helper: read /proc/<pid>/cmdline as argv array (returns null on failure) */
-async function readCmdlineArgs(pid) {
-  try {
-    const buf = await fsPromises.readFile(`/proc/${pid}/cmdline`);
-    if (!buf || buf.length === 0) return null;
-    const parts = buf.toString("utf8").split("\0").filter(Boolean);
-    return parts.length ? parts : null;
-  } catch (e) {
-    return null;
-  }
-}
-
-/* helper: read cwd symlink (best-effort) */
-async function readCwd(pid) {
-  try {
-    const p = await fsPromises.readlink(`/proc/${pid}/cwd`);
-    return p || "/";
-  } catch (e) {
-    return "/";
-  }
+/* saved metadata lives in the on-disk catalog the helper (and the CLI) keep,
+ * so it survives restarts; `snapshot_user saved [pid]` prints entries as JSON lines:
+ * { oldpid, name, exe, tty, cwd, dump, argv (array|null), tree, frozen, savedAt, cgroup,
+ *   attrs: { policy, priority, nice, cpus, mempolicy, homeNode } | null } */
+function parseJsonLines(stdout) {
+  return stdout.split("\n").filter(l => l.startsWith("{")).map(l => JSON.parse(l));
 }
 
-/* helper: read exe path */
-async function readExe(pid) {
+async function readSaved(oldpid) {
   try {
-    const p = await fsPromises.readlink(`/proc/${pid}/exe`);
-    return p || "";
+    const { stdout } = await runHelper(oldpid ? ["saved", String(oldpid)] : ["saved"], 8000);
+    return parseJsonLines(stdout);
   } catch (e) {
-    return "";
-  }
-}
-
-/* helper: read controlling tty (fd0 or fd1) */
-async function readTty(pid) {
-  try {
-    let p = "";
-    try { p = await fsPromises.readlink(`/proc/${pid}/fd/0`); } catch(e) { p = ""; }
-    if (!p) {
-      try { p = await fsPromises.readlink(`/proc/${pid}/fd/1`); } catch(e) { p = ""; }
-    }
-    return p || "";
-  } catch (e) {
-    return "";
+    if (oldpid && e.err && e.err.code === 8) return []; // not in the catalog
+    throw e;
   }
 }
 
@@ -127,74 +96,60 @@ app.get("/api/processes", requireAuth, async (req, res) => {
   }
 });
 
+/* kernel registry as the module sees it: `snapshot_user list` prints one JSON object per entry */
+async function readRegistry() {
+  const { stdout } = await runHelper(["list"], 8000);
+  return parseJsonLines(stdout);
+}
+
+app.get("/api/registry", requireAuth, async (req, res) => {
+  try {
+    res.json({ entries: await readRegistry() });
+  } catch (e) {
+    res.status(500).json({ error: "registry read failed", detail: e.stderr || e.err?.message || String(e) });
+  }
+});
+
 /* list saved snapshots */
 app.get("/api/saved", requireAuth, async (req, res) => {
   try {
-    // return a lightweight view to frontend
-    const out = savedList.map(s => ({
-      oldpid: s.oldpid,
-      name: s.name,
-      tty: s.tty,
-      exe: s.exe,
-      savedAt: s.savedAt
-    }));
+    // the catalog only keeps what is needed to respawn; kernel state comes from the registry
+    let registry = null;
+    try { registry = new Map((await readRegistry()).map(r => [r.origPid, r])); } catch (e) { registry = null; }
+    const out = (await readSaved()).reverse().map(s => {
+      const k = registry ? registry.get(s.oldpid) : undefined;
+      return {
+        oldpid: s.oldpid,
+        name: s.name,
+        tty: s.tty,
+        exe: s.exe,
+        savedAt: s.savedAt,
+        inKernel: registry ? !!k : null,
+        frozen: k ? k.frozen : s.frozen
+      };
+    });
     res.json({ saved: out });
   } catch (e) {
     res.status(500).json({ error: e.message });
   }
 });
 
-/* snapshot endpoint: read metadata, call helper, then kill process and save metadata */
+/* snapshot endpoint: the helper reads the metadata, kills the tree and saves it in the catalog */
 app.post("/api/snapshot", requireAuth, async (req, res) => {
   const pid = Number(req.body.pid);
   if (!Number.isInteger(pid) || pid <= 0) return res.status(400).json({ error: "invalid pid" });
 
-  // capture metadata BEFORE killing
-  let cmdArgs = null;
-  let exe = "";
-  let cwd = "/";
-  let tty = "";
-  try {
-    cmdArgs = await readCmdlineArgs(pid);
-    exe = await readExe(pid);
-    cwd = await readCwd(pid);
-    tty = await readTty(pid);
-  } catch (e) {
-    console.warn("metadata read failed:", e);
-  }
-
-  // name heuristic
-  let name = (cmdArgs && cmdArgs.length) ? cmdArgs[0] : (exe ? exe.split("/").pop() : `pid:${pid}`);
-
   try {
-    // call helper to snapshot at kernel level
-    const { stdout } = await runHelper(["snapshot", String(pid)], 8000);
-
-    // attempt to kill the process and its children (best-effort)
-    let killErr = null;
-    try {
-      execSync(`pkill -TERM -P ${pid} || true; kill -9 ${pid} || true`, {
-        stdio: "ignore",
-        timeout: 3000,
-      });
-    } catch (err) {
-      killErr = String(err && err.message ? err.message : err);
-      console.error("kill step failed:", err);
-    }
-
-    // push metadata to saved list
-    const entry = {
-      oldpid: pid,
-      cmdArgs: cmdArgs || null,
-      exe: exe || "",
-      tty: tty || "",
-      cwd: cwd || "/",
-      name: name || (`pid:${pid}`),
-      savedAt: Date.now()
-    };
-    savedList.unshift(entry);
-
-    return res.json({ ok: true, out: stdout.trim(), killErr, saved: { oldpid: entry.oldpid, name: entry.name, tty: entry.tty, exe: entry.exe } });
+    // the kernel stops, records and kills the process and all its descendants in one ioctl
+    const { stdout } = await runHelper(["snapshot-tree", String(pid)], 8000);
+    // pidfd-confirmed exits: "reap <exited> <killed after grace> <survivors>"
+    const reap = /^reap (\d+) (\d+) (\d+)$/m.exec(stdout);
+    const reaped = reap ? { exited: Number(reap[1]), killed: Number(reap[2]), survivors: Number(reap[3]) } : null;
+    // the helper read argv/exe/cwd/tty before the kill and put them in the catalog
+    const entry = parseJsonLines(stdout)[0] || { oldpid: pid, name: `pid:${pid}`, tty: "", exe: "" };
+
+    const killErr = reaped && reaped.survivors ? `${reaped.survivors} process(es) survived SIGKILL` : null;
+    return res.json({ ok: true, out: stdout.trim(), killErr, reaped, saved: { oldpid: entry.oldpid, name: entry.name, tty: entry.tty, exe: entry.exe } });
   } catch (e) {
     return res.status(500).json({ error: "snapshot failed", detail: e.stderr || e.err?.message || String(e) });
   }
@@ -207,8 +162,12 @@ app.post("/api/restore", requireAuth, async (req, res) => {
   let newpid = Number(req.body.newpid) || 0;
   if (!Number.isInteger(oldpid) || oldpid <= 0) return res.status(400).json({ error: "invalid oldpid" });
 
-  const idx = savedList.findIndex(s => s.oldpid === oldpid);
-  const meta = idx >= 0 ? savedList[idx] : null;
+  let meta = null;
+  try {
+    meta = (await readSaved(oldpid))[0] || null;
+  } catch (e) {
+    return res.status(500).json({ error: "catalog read failed", detail: e.stderr || e.err?.message || String(e) });
+  }
 
   // helper: safe which using execSync (no require(), we are ESM)
   const whichSync = (bin) => {
@@ -225,16 +184,17 @@ app.post("/api/restore", requireAuth, async (req, res) => {
     // decide command and args
     let cmd = null;
     let args = [];
-    if (meta.cmdArgs && meta.cmdArgs.length) {
-      cmd = meta.cmdArgs[0];
-      args = meta.cmdArgs.slice(1);
+    if (meta.argv && meta.argv.length) {
+      cmd = meta.argv[0];
+      args = meta.argv.slice(1);
     } else if (meta.exe) {
       cmd = meta.exe;
       args = [];
     }
 
     // ==== spawn restored program preferably inside a terminal emulator ====
-    if (cmd && (!newpid || newpid === 0)) {
+    // (a frozen entry is thawed in place by restore <oldpid> 0 instead)
+    if (cmd && !meta.frozen && (!newpid || newpid === 0)) {
       const termCandidates = [
         { bin: "terminator", argsBuilder: (c, a) => ["-x", c, ...a] },
         { bin: "gnome-terminal", argsBuilder: (c, a) => ["--", c, ...a] },
@@ -249,9 +209,15 @@ app.post("/api/restore", requireAuth, async (req, res) => {
       const envXauth = process.env.RESTORE_XAUTH || process.env.XAUTHORITY || (process.env.HOME ? `${process.env.HOME}/.Xauthority` : undefined);
       const restoreUser = process.env.RESTORE_USER || process.env.USER || null;
 
-      // sanitize program + args
-      const program = cmd;
-      const programArgs = Array.isArray(args) ? args : [];
+      // sanitize program + args; run them through `snapshot_user apply`, which takes on the
+      // saved scheduling, affinity, NUMA policy, rlimits and cgroups before it execs them.
+      // They travel on its command line (applySpec): the restore below drops the catalog
+      // entry long before a terminal emulator gets around to starting apply
+      const savedArgs = Array.isArray(args) ? args : [];
+      const spec = typeof meta.applySpec === "string" && /^[0-9a-f]*:[0-9a-f]*$/.test(meta.applySpec) ? [meta.applySpec] : [];
+      const [program, programArgs] = fs.existsSync(HELPER_ABS)
+        ? [HELPER_ABS, ["apply", String(oldpid), ...spec, "--", cmd, ...savedArgs]]
+        : [cmd, savedArgs];
 
       // Builder for safe env for spawn
       const buildEnv = () => {
@@ -355,7 +321,10 @@ app.post("/api/restore", requireAuth, async (req, res) => {
   // call helper restore ioctl with (oldpid, newpid)
   try {
     const { stdout } = await runHelper(["restore", String(oldpid), String(newpid)], 20000);
-    if (idx >= 0) savedList.splice(idx, 1);
+    if (meta && meta.tree && meta.tree.length) {
+      await runHelper(["batch", ...meta.tree.map(p => `restore:${p}:0`)], 8000).catch(e => console.warn("tree release failed", e.stderr || e));
+    }
+    // a successful restore also dropped the catalog entry
     return res.json({ ok: true, out: stdout.trim(), spawnedPid: newpid });
   } catch (e) {
     console.error("restore helper failed", e);
@@ -366,14 +335,54 @@ app.post("/api/restore", requireAuth, async (req, res) => {
 
 
 
-/* logs endpoint: read helper logs & spawn logs */
+/* kernel event stream: one long-lived `snapshot_user events` child, fanned out to
+ * Server-Sent Events clients so the frontend reacts to exits/rebinds without polling */
+const eventClients = new Set();
+let eventHelper = null;
+
+function startEventHelper() {
+  if (eventHelper) return;
+  const cmd = useSudo ? "sudo" : HELPER_ABS;
+  const cmdArgs = useSudo ? [HELPER_ABS, "events"] : ["events"];
+  eventHelper = spawnChild(cmd, cmdArgs, { stdio: ["ignore", "pipe", "pipe"] });
+  let partial = "";
+  eventHelper.stdout.on("data", chunk => {
+    const lines = (partial + chunk.toString()).split("\n");
+    partial = lines.pop();
+    for (const line of lines) {
+      if (!line.startsWith("{")) continue;
+      for (const res of eventClients) res.write(`data: ${line}\n\n`);
+    }
+  });
+  eventHelper.stderr.on("data", d => console.warn("[events]", d.toString().trim()));
+  eventHelper.on("exit", code => {
+    console.warn("[events] helper exited", code);
+    eventHelper = null;
+    if (eventClients.size) setTimeout(startEventHelper, 1000);
+  });
+}
+
+app.get("/api/events", requireAuth, (req, res) => {
+  res.writeHead(200, { "Content-Type": "text/event-stream", "Cache-Control": "no-cache", Connection: "keep-alive" });
+  res.write(": connected\n\n");
+  eventClients.add(res);
+  startEventHelper();
+  req.on("close", () => {
+    eventClients.delete(res);
+    if (!eventClients.size && eventHelper) eventHelper.kill("SIGTERM");
+  });
+});
+
+/* logs endpoint: the binary event log shared by the helper and the CLI
+ * (snapshots, restores, spawn/attach results; `snapshot_user log` decodes it
+ * into JSON lines { timeNs, src, writer, op, pid, pid2, err, durUs, aux, mock };
+ * spawn results are its "spawn" records) plus the text output of detached restores */
 app.get("/api/logs", requireAuth, async (req, res) => {
   try {
-    const attach = await fsPromises.readFile("/tmp/snapshot_attach_log", "utf8").catch(()=>"");
-    const spawn = await fsPromises.readFile("/tmp/snapshot_spawn_log", "utf8").catch(()=>"");
-    const execerr = await fsPromises.readFile("/tmp/snapshot_exec_err", "utf8").catch(()=>"");
+    const { stdout } = await runHelper(["log"], 8000);
+    const events = parseJsonLines(stdout);
     const restoreOut = await fsPromises.readFile("/tmp/restore.out", "utf8").catch(()=>"");
-    res.json({ attach, spawn, execerr, restoreOut });
+    res.json({ events, restoreOut });
   } catch (e) {
     res.status(500).json({ error: e.message });
   }
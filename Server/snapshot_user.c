@@ -1,5 +1,5 @@
 // snapshot_user.c  (improved logging)
-// Compile: gcc -O2 -Wall -o snapshot_user snapshot_user.c
+// Compile: gcc -O2 -Wall -pthread -o snapshot_user snapshot_user.c ../user/pidterm.c ../user/catalog.c ../user/binlog.c ../user/procattr.c
 
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -13,31 +13,29 @@
 #include <sys/types.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
 
-#define DEVICE "/dev/snapshotctl"
-#define LOGPATH "/tmp/snapshot_user.log"
+#include "../module/snapshot_uapi.h"
+#include "../user/pidterm.h"
+#include "../user/catalog.h"
+#include "../user/binlog.h"
+#include "../user/procattr.h"
 
-struct snap_ioc { pid_t oldpid; pid_t newpid; };
+#define DEVICE "/dev/snapshotctl"
+static double t_start; /* ms, when the command started */
 
-#define IOCTL_SNAPSHOT _IOW('s', 1, int)
-#define IOCTL_RESTORE  _IOW('s', 2, struct snap_ioc)
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
 
-static void log_msg(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    FILE *f = fopen(LOGPATH, "a");
-    if (f) {
-        char tbuf[64];
-        time_t now = time(NULL);
-        struct tm tm;
-        localtime_r(&now, &tm);
-        strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
-        fprintf(f, "[%s] ", tbuf);
-        vfprintf(f, fmt, ap);
-        fprintf(f, "\n");
-        fclose(f);
-    }
-    va_end(ap);
+/* one event log record; the duration is the command's so far */
+static void log_op(int op, int pid, int pid2, int err, uint32_t aux) {
+    binlog_put(op, pid, pid2, err, now_ms() - t_start, aux);
 }
 
 /* helpers */
@@ -57,12 +55,429 @@ int try_ioctl_snapshot_val(int fd, int pid) {
     return -errno;
 }
 
+/* parse "snapshot:<pid>" or "restore:<oldpid>:<newpid>" */
+static int parse_batch_item(const char *s, struct snap_batch_item *it) {
+    char *end;
+    memset(it, 0, sizeof(*it));
+    if (strncmp(s, "snapshot:", 9) == 0) {
+        it->op = SNAP_OP_SNAPSHOT;
+        it->pid = (__s32)strtol(s + 9, &end, 10);
+        return (end != s + 9 && *end == '\0' && it->pid > 0) ? 0 : -1;
+    }
+    if (strncmp(s, "restore:", 8) == 0) {
+        it->op = SNAP_OP_RESTORE;
+        it->pid = (__s32)strtol(s + 8, &end, 10);
+        if (end == s + 8 || *end != ':' || it->pid <= 0) return -1;
+        s = end + 1;
+        it->newpid = (__s32)strtol(s, &end, 10);
+        return (end != s && *end == '\0' && it->newpid >= 0) ? 0 : -1;
+    }
+    return -1;
+}
+
+static void print_batch_item(const struct snap_batch_item *it, const char *suffix) {
+    if (it->op == SNAP_OP_SNAPSHOT) {
+        if (it->result == 0) printf("OK snapshot %d%s\n", it->pid, suffix);
+        else printf("ERR snapshot %d: %s\n", it->pid, strerror(-it->result));
+    } else {
+        if (it->result == 0) printf("OK restore %d -> %d%s\n", it->pid, it->newpid, suffix);
+        else printf("ERR restore %d -> %d: %s\n", it->pid, it->newpid, strerror(-it->result));
+    }
+}
+
+/* map the kernel image at its offset and optionally write it out unchanged */
+static int dump_image(int fd, const struct snap_req *req, const char *outpath) {
+    void *map = mmap(NULL, req->image_size, PROT_READ, MAP_SHARED, fd, (off_t)req->image_offset);
+    if (map == MAP_FAILED) return -errno;
+    const struct snap_image_hdr *hdr = map;
+    if (hdr->magic != SNAP_IMAGE_MAGIC || hdr->version != SNAP_IMAGE_VERSION) {
+        munmap(map, req->image_size);
+        return -EPROTO;
+    }
+    printf("image pid=%d runs=%llu pages=%llu bytes=%llu\n", hdr->pid,
+           (unsigned long long)hdr->nr_runs, (unsigned long long)hdr->nr_pages,
+           (unsigned long long)req->image_size);
+    int rc = 0;
+    if (outpath) {
+        int out = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (out < 0) rc = -errno;
+        const char *p = map;
+        size_t left = req->image_size;
+        while (out >= 0 && left > 0) {
+            ssize_t w = write(out, p, left);
+            if (w < 0) { if (errno == EINTR) continue; rc = -errno; break; }
+            p += w; left -= (size_t)w;
+        }
+        if (out >= 0) close(out);
+    }
+    munmap(map, req->image_size);
+    return rc;
+}
+
+/* s as a JSON string literal */
+static void print_json_str(const char *s) {
+    putchar('"');
+    for (const char *c = s; *c; c++) {
+        if (*c == '"' || *c == '\\') printf("\\%c", *c);
+        else if ((unsigned char)*c < 0x20) printf("\\u%04x", (unsigned char)*c);
+        else putchar(*c);
+    }
+    putchar('"');
+}
+
+/* one registry entry as a JSON object on its own line (server.js parses these) */
+static void print_info_json(const struct snap_info *in) {
+    char comm[SNAP_COMM_LEN + 1];
+    memcpy(comm, in->comm, SNAP_COMM_LEN);
+    comm[SNAP_COMM_LEN] = '\0';
+    printf("{\"pid\":%d,\"origPid\":%d,\"uid\":%u,\"frozen\":%s,\"continued\":%s,\"rebound\":%s,"
+           "\"savedAtMs\":%llu,\"threads\":%u,\"imageSize\":%llu,\"comm\":",
+           in->pid, in->orig_pid, in->uid,
+           (in->state & SNAP_STATE_FROZEN) ? "true" : "false",
+           (in->state & SNAP_STATE_CONTINUED) ? "true" : "false",
+           (in->state & SNAP_STATE_REBOUND) ? "true" : "false",
+           (unsigned long long)(in->time_ns / 1000000), in->nr_threads,
+           (unsigned long long)in->image_size);
+    print_json_str(comm);
+    printf("}\n");
+}
+
+static void print_hex(const void *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) printf("%02x", ((const unsigned char *)buf)[i]);
+}
+
+/* decode len hex digits at s into out (len / 2 bytes); 0 or -EINVAL */
+static int unhex(const char *s, size_t len, unsigned char *out) {
+    if (len % 2) return -EINVAL;
+    for (size_t i = 0; i < len; i += 2) {
+        unsigned v;
+        if (!isxdigit((unsigned char)s[i]) || !isxdigit((unsigned char)s[i + 1]) ||
+            sscanf(s + i, "%2x", &v) != 1)
+            return -EINVAL;
+        out[i / 2] = (unsigned char)v;
+    }
+    return 0;
+}
+
+/* one catalog entry as a JSON object on its own line. applySpec carries the
+   attribute blob and cgroups ("<hex>:<hex>") for "apply <oldpid> <spec>", so
+   a restored program does not depend on the entry outliving the restore */
+static void print_saved_json(const CatalogEntry *e) {
+    printf("{\"oldpid\":%d,\"savedAt\":%llu,\"frozen\":%s,\"name\":", e->pid,
+           (unsigned long long)e->saved_at_ms, (e->flags & CATALOG_F_FROZEN) ? "true" : "false");
+    print_json_str(e->name);
+    printf(",\"exe\":");
+    print_json_str(e->exe);
+    printf(",\"tty\":");
+    print_json_str(e->tty);
+    printf(",\"cwd\":");
+    print_json_str(e->cwd);
+    printf(",\"dump\":");
+    print_json_str(e->dump);
+    printf(",\"argv\":");
+    if (e->argv) {
+        printf("[");
+        for (const char *a = e->argv; *a; a += strlen(a) + 1) {
+            if (a != e->argv) putchar(',');
+            print_json_str(a);
+        }
+        printf("]");
+    } else {
+        printf("null");
+    }
+    printf(",\"tree\":[");
+    for (uint32_t i = 0; i < e->ntree; i++) printf(i ? ",%d" : "%d", e->tree[i]);
+    printf("],\"cgroup\":");
+    print_json_str(e->cgroup);
+    const ProcAttrs *a = procattr_from(e->attrs, e->attrs_len);
+    char attrs[1024];
+    if (a) procattr_json(a, attrs, sizeof(attrs));
+    printf(",\"attrs\":%s,\"applySpec\":\"", a ? attrs : "null");
+    if (a) print_hex(e->attrs, e->attrs_len);
+    putchar(':');
+    print_hex(e->cgroup, strlen(e->cgroup));
+    printf("\"}\n");
+}
+
+/* what a restore needs, read from /proc before pid is killed; strings are
+   malloc'd (argv '\0' separated), free with free_meta() */
+typedef struct {
+    char *argv;
+    size_t argv_len;
+    char *exe, *cwd, *tty, *name;
+    ProcAttrs attrs;
+    int have_attrs;
+    char cgroup[2048];
+} ProcMeta;
+
+static char *read_link(int pid, const char *what) {
+    char path[64], buf[4096];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, what);
+    ssize_t r = readlink(path, buf, sizeof(buf) - 1);
+    if (r < 0) r = 0;
+    buf[r] = '\0';
+    return strdup(buf);
+}
+
+static void read_meta(int pid, ProcMeta *m) {
+    char path[64];
+    memset(m, 0, sizeof(*m));
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        size_t cap = 4096;
+        m->argv = malloc(cap + 1);
+        ssize_t r;
+        while (m->argv && (r = read(fd, m->argv + m->argv_len, cap - m->argv_len)) > 0) {
+            m->argv_len += (size_t)r;
+            if (m->argv_len == cap) {
+                char *p = realloc(m->argv, cap * 2 + 1);
+                if (!p) break;
+                m->argv = p;
+                cap *= 2;
+            }
+        }
+        close(fd);
+        if (m->argv) m->argv[m->argv_len] = '\0';
+    }
+    m->exe = read_link(pid, "exe");
+    m->cwd = read_link(pid, "cwd");
+    m->tty = read_link(pid, "fd/0");
+    if (m->tty && !m->tty[0]) {
+        free(m->tty);
+        m->tty = read_link(pid, "fd/1");
+    }
+    m->have_attrs = procattr_capture(pid, &m->attrs) == 0;
+    if (procattr_cgroup(pid, m->cgroup, sizeof(m->cgroup)) < 0) m->cgroup[0] = '\0';
+    /* name as the server always showed it: argv[0], else the exe's basename */
+    const char *base = m->exe ? strrchr(m->exe, '/') : NULL;
+    if (m->argv_len && m->argv[0])
+        m->name = strdup(m->argv);
+    else if (base && base[1])
+        m->name = strdup(base + 1);
+    else if (asprintf(&m->name, "pid:%d", pid) < 0)
+        m->name = NULL;
+}
+
+static void free_meta(ProcMeta *m) {
+    free(m->argv);
+    free(m->exe);
+    free(m->cwd);
+    free(m->tty);
+    free(m->name);
+}
+
+/* record pid in the catalog and print the entry; 0 or -errno */
+static int save_meta(int pid, const ProcMeta *m, uint32_t flags, const pid_t *tree, uint32_t ntree) {
+    Catalog *cat;
+    CatalogEntry e = { .pid = pid, .flags = flags, .name = m->name, .exe = m->exe, .tty = m->tty,
+                       .cwd = m->cwd, .argv = m->argv_len ? m->argv : NULL, .argv_len = (uint32_t)m->argv_len,
+                       .ntree = ntree, .tree = tree, .cgroup = m->cgroup,
+                       .attrs = m->have_attrs ? &m->attrs : NULL, .attrs_len = sizeof(m->attrs) };
+    int rc = catalog_open(catalog_default_path(), &cat);
+    if (rc < 0) return rc;
+    rc = catalog_put(cat, &e);
+    if (rc == 0 && catalog_get(cat, pid, &e) == 0) print_saved_json(&e);
+    catalog_close(cat);
+    return rc;
+}
+
+/* saved [pid] / saved-rm <pid>: the catalog needs no device */
+static int catalog_cmd(int argc, char **argv) {
+    Catalog *cat;
+    int rm = strcmp(argv[1], "saved-rm") == 0;
+    if ((rm && argc < 3) || (argc > 2 && !is_number(argv[2]))) {
+        fprintf(stderr, "invalid pid\n");
+        return 4;
+    }
+    int rc = catalog_open(catalog_default_path(), &cat);
+    if (rc < 0) {
+        fprintf(stderr, "catalog %s: %s\n", catalog_default_path(), strerror(-rc));
+        log_op(BINLOG_OP_CATALOG, 0, 0, -rc, 0);
+        return 6;
+    }
+    if (rm) {
+        rc = catalog_remove(cat, atoi(argv[2]));
+        if (rc == 0) printf("OK saved-rm %s\n", argv[2]);
+        else fprintf(stderr, "saved-rm %s: %s\n", argv[2], strerror(-rc));
+    } else if (argc > 2) {
+        CatalogEntry e;
+        rc = catalog_get(cat, atoi(argv[2]), &e);
+        if (rc == 0) {
+            print_saved_json(&e);
+            printf("OK saved 1\n");
+        } else {
+            fprintf(stderr, "saved %s: %s\n", argv[2], strerror(-rc));
+        }
+    } else {
+        CatalogEntry *v;
+        int n = catalog_list(cat, &v);
+        rc = n < 0 ? n : 0;
+        for (int i = 0; i < n; i++) print_saved_json(&v[i]);
+        if (n >= 0) {
+            free(v);
+            printf("OK saved %d\n", n);
+        }
+    }
+    catalog_close(cat);
+    return rc == 0 ? 0 : rc == -ENOENT ? 8 : 6;
+}
+
+/* apply <oldpid> [spec] -- prog [args]: take on oldpid's saved attributes and
+   exec prog (searched in PATH). spec is the entry's applySpec (see "saved");
+   without it they are read from the catalog, which a restore may already have
+   emptied. Whatever cannot be applied is reported on stderr and in the event
+   log, and prog runs anyway; only a failed exec fails. */
+static int apply_cmd(int argc, char **argv) {
+    int dash = argc > 3 && strcmp(argv[3], "--") == 0 ? 3 : argc > 4 && strcmp(argv[4], "--") == 0 ? 4 : 0;
+    if (!dash || dash + 1 >= argc || !is_number(argv[2])) {
+        fprintf(stderr, "usage: %s apply <oldpid> [spec] -- prog [args...]\n", argv[0]);
+        return 4;
+    }
+    int oldpid = atoi(argv[2]);
+    unsigned failed = 0;
+    Catalog *cat = NULL;
+    CatalogEntry e;
+    static unsigned char blob[sizeof(ProcAttrs)];
+    static char cgroup[4096];
+    const ProcAttrs *attrs = NULL;
+    const char *cgroups = NULL;
+    int rc;
+    if (dash == 4) {
+        const char *spec = argv[3], *colon = strchr(spec, ':');
+        size_t alen = colon ? (size_t)(colon - spec) : 0, clen = colon ? strlen(colon + 1) : 0;
+        rc = -EINVAL;
+        if (colon && alen / 2 <= sizeof(blob) && clen / 2 < sizeof(cgroup) && unhex(spec, alen, blob) == 0 &&
+            unhex(colon + 1, clen, (unsigned char *)cgroup) == 0) {
+            rc = 0;
+            cgroup[clen / 2] = '\0';
+            attrs = alen ? procattr_from(blob, alen / 2) : NULL;
+            cgroups = cgroup;
+            if (alen && !attrs) rc = -EINVAL;
+        }
+    } else {
+        rc = catalog_open(catalog_default_path(), &cat);
+        if (rc == 0) rc = catalog_get(cat, oldpid, &e);
+        if (rc == 0) {
+            attrs = procattr_from(e.attrs, e.attrs_len);
+            cgroups = e.cgroup;
+        }
+    }
+    if (rc == 0) {
+        int fds[PROCATTR_MAX_CGROUPS];
+        int n = procattr_open_cgroups(cgroups, fds, PROCATTR_MAX_CGROUPS);
+        if (n < 0) {
+            failed |= PROCATTR_CGROUP;
+            n = 0;
+        }
+        failed |= procattr_apply(attrs, fds, n);
+        for (int i = 0; i < n; i++) close(fds[i]);
+        if (failed) fprintf(stderr, "apply %d: could not reapply PROCATTR_* 0x%x\n", oldpid, failed);
+        log_op(BINLOG_OP_ATTRS, getpid(), oldpid, 0, failed);
+    } else {
+        fprintf(stderr, "apply %d: %s, running without saved attributes\n", oldpid, strerror(-rc));
+        log_op(BINLOG_OP_ATTRS, getpid(), oldpid, -rc, 0);
+    }
+    catalog_close(cat);
+    binlog_close(); /* exec would drop whatever is still queued */
+    execvp(argv[dash + 1], argv + dash + 1);
+    fprintf(stderr, "apply %d: exec %s: %s\n", oldpid, argv[dash + 1], strerror(errno));
+    return 127;
+}
+
+/* stream events from a private kernel ring as JSON lines until killed */
+static int stream_events(int fd, unsigned nr) {
+    static const char *names[] = { "?", "snapshot", "rebind", "release", "exit" };
+    struct snap_ring_setup rs = { .nr_events = nr };
+    if (ioctl(fd, IOCTL_EVENTS, &rs) < 0) return -errno;
+    void *map = mmap(NULL, rs.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)rs.mmap_offset);
+    if (map == MAP_FAILED) return -errno;
+    struct snap_ring_hdr *hdr = map;
+    const struct snap_event *ev = (const void *)((char *)map + hdr->event_offset);
+    __u64 mask = hdr->nr_events - 1, lost = 0;
+
+    printf("OK events nr=%u\n", rs.nr_events);
+    fflush(stdout);
+    for (;;) {
+        __u64 head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        __u64 tail = hdr->tail;
+        for (; tail != head; tail++) {
+            const struct snap_event *e = &ev[tail & mask];
+            printf("{\"seq\":%llu,\"timeNs\":%llu,\"type\":\"%s\",\"pid\":%d,\"newpid\":%d,\"arg\":%d}\n",
+                   (unsigned long long)e->seq, (unsigned long long)e->time_ns,
+                   e->type < sizeof(names) / sizeof(names[0]) ? names[e->type] : "?", e->pid, e->newpid, e->arg);
+        }
+        __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+        if (hdr->lost != lost) {
+            lost = hdr->lost;
+            printf("{\"type\":\"lost\",\"count\":%llu}\n", (unsigned long long)lost);
+        }
+        fflush(stdout);
+
+        struct pollfd p = { .fd = fd, .events = POLLIN };
+        if (poll(&p, 1, -1) < 0 && errno != EINTR) return -errno;
+    }
+}
+
+/* pt_regs word index of the user ip/sp, for printing */
+#if defined(__x86_64__)
+#define REG_IP 16
+#define REG_SP 19
+#elif defined(__aarch64__)
+#define REG_IP 32
+#define REG_SP 31
+#endif
+
+/* print the per-thread state the kernel recorded for a frozen pid; returns
+   the number of threads or -errno */
+static int print_threads(int fd, int pid) {
+    struct snap_threads q = { .pid = pid, .count = 0, .threads = 0 };
+    if (ioctl(fd, IOCTL_GET_THREADS, &q) < 0) return -errno;
+    struct snap_thread *th = calloc(q.count ? q.count : 1, sizeof(*th));
+    if (!th) return -ENOMEM;
+    q.threads = (__u64)(uintptr_t)th;
+    if (ioctl(fd, IOCTL_GET_THREADS, &q) < 0) { int e = errno; free(th); return -e; }
+    printf("pid %d: %u threads\n", pid, q.count);
+    for (__u32 i = 0; i < q.count; i++) {
+        printf("  tid=%d%s sigmask=%#llx tls=%#llx", th[i].tid, (th[i].flags & SNAP_THREAD_LEADER) ? " (leader)" : "",
+               (unsigned long long)th[i].sigmask, (unsigned long long)th[i].tls);
+#ifdef REG_IP
+        if (th[i].nr_regs > REG_IP && th[i].nr_regs > REG_SP)
+            printf(" ip=%#llx sp=%#llx", (unsigned long long)th[i].regs[REG_IP], (unsigned long long)th[i].regs[REG_SP]);
+#endif
+        printf("\n");
+    }
+    free(th);
+    return (int)q.count;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "usage: %s snapshot <pid> | restore <oldpid> <newpid>\n", argv[0]);
+        fprintf(stderr, "usage: %s snapshot <pid> | snapshot-mem <pid> [outfile] | restore <oldpid> <newpid>"
+                " | snapshot-tree <pid> | freeze <pid> | threads <pid> | list | query <pid> | events [nr] | batch snapshot:<pid>|restore:<oldpid>:<newpid> ..."
+                " | saved [pid] | saved-rm <pid> | apply <oldpid> -- prog [args] | log\n", argv[0]);
         return 2;
     }
     const char *cmd = argv[1];
+    if (strcmp(cmd, "log") == 0) {
+        /* the event log as JSON lines */
+        int lfd = open(binlog_default_path(), O_RDONLY | O_CLOEXEC);
+        long n = lfd < 0 ? -errno : binlog_dump(lfd, stdout, 1);
+        if (lfd >= 0) close(lfd);
+        if (n == -ENOENT) n = 0; /* nothing logged yet */
+        if (n < 0) {
+            fprintf(stderr, "log %s: %s\n", binlog_default_path(), strerror((int)-n));
+            return 6;
+        }
+        printf("OK log %ld\n", n);
+        return 0;
+    }
+    t_start = now_ms();
+    binlog_open(binlog_default_path(), BINLOG_SRC_HELPER); /* logging is best effort */
+    if (strcmp(cmd, "saved") == 0 || strcmp(cmd, "saved-rm") == 0)
+        return catalog_cmd(argc, argv);
+    if (strcmp(cmd, "apply") == 0)
+        return apply_cmd(argc, argv);
     const char *modeenv = getenv("SNAPSHOT_ARG_MODE"); // "ptr" | "val" | "both" | "mock"
     const char *mockenv = getenv("SNAPSHOT_MOCK");
     int mock = (mockenv && (strcmp(mockenv, "1") == 0 || strcasecmp(mockenv, "true") == 0));
@@ -72,43 +487,41 @@ int main(int argc, char **argv) {
         fd = open(DEVICE, O_RDWR);
         if (fd < 0) {
             fprintf(stderr, "open %s failed: %s\n", DEVICE, strerror(errno));
-            log_msg("open %s failed: %s", DEVICE, strerror(errno));
+            log_op(BINLOG_OP_OPEN, 0, 0, errno, 0);
             return 3;
         }
     } else {
-        log_msg("MOCK mode active (SNAPSHOT_MOCK=%s)", mockenv);
+        binlog_set_flags(BINLOG_F_MOCK);
     }
 
     if (strcmp(cmd, "snapshot") == 0) {
         if (argc < 3 || !is_number(argv[2])) {
             fprintf(stderr, "invalid pid\n");
             if (fd>=0) close(fd);
-            log_msg("snapshot: invalid pid arg");
+            log_op(BINLOG_OP_SNAPSHOT, 0, 0, EINVAL, 0);
             return 4;
         }
         int pid = atoi(argv[2]);
-        log_msg("cmd=snapshot pid=%d mock=%d modeenv=%s", pid, mock, modeenv?modeenv:"(none)");
-
         if (mock) {
             fprintf(stderr, "MOCK: snapshot %d\n", pid);
             printf("OK snapshot %d (mock)\n", pid);
             if (fd>=0) close(fd);
-            log_msg("MOCK snapshot %d OK", pid);
+            log_op(BINLOG_OP_SNAPSHOT, pid, 0, 0, 0);
             return 0;
         }
 
         if (modeenv && strcmp(modeenv, "ptr") == 0) {
             int r = try_ioctl_snapshot_ptr(fd, pid);
-            if (r == 0) { printf("OK snapshot %d (mode=ptr)\n", pid); log_msg("snapshot %d ok (mode=ptr)", pid); close(fd); return 0; }
+            if (r == 0) { printf("OK snapshot %d (mode=ptr)\n", pid); log_op(BINLOG_OP_SNAPSHOT, pid, 0, 0, 1); close(fd); return 0; }
             fprintf(stderr, "ptr-mode failed: %s\n", strerror(-r));
-            log_msg("snapshot %d ptr-mode failed: %s", pid, strerror(-r));
+            log_op(BINLOG_OP_SNAPSHOT, pid, 0, -r, 1);
             close(fd);
             return 5;
         } else if (modeenv && strcmp(modeenv, "val") == 0) {
             int r = try_ioctl_snapshot_val(fd, pid);
-            if (r == 0) { printf("OK snapshot %d (mode=val)\n", pid); log_msg("snapshot %d ok (mode=val)", pid); close(fd); return 0; }
+            if (r == 0) { printf("OK snapshot %d (mode=val)\n", pid); log_op(BINLOG_OP_SNAPSHOT, pid, 0, 0, 2); close(fd); return 0; }
             fprintf(stderr, "val-mode failed: %s\n", strerror(-r));
-            log_msg("snapshot %d val-mode failed: %s", pid, strerror(-r));
+            log_op(BINLOG_OP_SNAPSHOT, pid, 0, -r, 2);
             close(fd);
             return 5;
         }
@@ -116,52 +529,306 @@ int main(int argc, char **argv) {
         int r = try_ioctl_snapshot_ptr(fd, pid);
         if (r == 0) {
             printf("OK snapshot %d (tried ptr)\n", pid);
-            log_msg("snapshot %d OK (tried ptr)", pid);
+            log_op(BINLOG_OP_SNAPSHOT, pid, 0, 0, 1);
             close(fd);
             return 0;
         }
         int r2 = try_ioctl_snapshot_val(fd, pid);
         if (r2 == 0) {
             printf("OK snapshot %d (tried val)\n", pid);
-            log_msg("snapshot %d OK (tried val)", pid);
+            log_op(BINLOG_OP_SNAPSHOT, pid, 0, 0, 2);
             close(fd);
             return 0;
         }
 
         fprintf(stderr, "ioctl snapshot failed (ptr: %s, val: %s)\n",
                 strerror(-r), strerror(-r2));
-        log_msg("snapshot %d failed (ptr: %s, val: %s)", pid, strerror(-r), strerror(-r2));
+        log_op(BINLOG_OP_SNAPSHOT, pid, 0, -r, 1);
+        log_op(BINLOG_OP_SNAPSHOT, pid, 0, -r2, 2);
         close(fd);
         return 5;
     } else if (strcmp(cmd, "restore") == 0) {
         if (argc < 4 || !is_number(argv[2]) || !is_number(argv[3])) {
             fprintf(stderr, "invalid args\n");
             if (fd>=0) close(fd);
-            log_msg("restore: invalid args");
+            log_op(BINLOG_OP_RESTORE, 0, 0, EINVAL, 0);
             return 4;
         }
         struct snap_ioc ioc; ioc.oldpid = (pid_t)atoi(argv[2]); ioc.newpid = (pid_t)atoi(argv[3]);
-        log_msg("cmd=restore oldpid=%d newpid=%d mock=%d", (int)ioc.oldpid, (int)ioc.newpid, mock);
         if (mock) {
             fprintf(stderr, "MOCK: restore %d -> %d\n", (int)ioc.oldpid, (int)ioc.newpid);
             printf("OK restore %d -> %d (mock)\n",(int)ioc.oldpid,(int)ioc.newpid);
             if (fd>=0) close(fd);
-            log_msg("MOCK restore %d -> %d OK", (int)ioc.oldpid,(int)ioc.newpid);
+            log_op(BINLOG_OP_RESTORE, ioc.oldpid, ioc.newpid, 0, 0);
             return 0;
         }
         if (ioctl(fd, IOCTL_RESTORE, &ioc) < 0) {
             fprintf(stderr, "ioctl restore failed: %s\n", strerror(errno));
-            log_msg("ioctl restore failed old=%d new=%d err=%s", (int)ioc.oldpid, (int)ioc.newpid, strerror(errno));
+            log_op(BINLOG_OP_RESTORE, ioc.oldpid, ioc.newpid, errno, 0);
             close(fd);
             return 6;
         }
         printf("OK restore %d -> %d\n", (int)ioc.oldpid, (int)ioc.newpid);
-        log_msg("restore OK %d -> %d", (int)ioc.oldpid, (int)ioc.newpid);
+        log_op(BINLOG_OP_RESTORE, ioc.oldpid, ioc.newpid, 0, 0);
+        Catalog *cat;
+        if (catalog_open(catalog_default_path(), &cat) == 0) {
+            catalog_remove(cat, ioc.oldpid);
+            catalog_close(cat);
+        }
         close(fd);
         return 0;
+    } else if (strcmp(cmd, "snapshot-tree") == 0) {
+        /* record pid and all descendants and kill them (children SIGTERM, root SIGKILL),
+           then confirm the exits through pidfds pinned beforehand, SIGKILLing
+           descendants that outlive SNAPSHOT_KILL_GRACE_MS */
+        if (argc < 3 || !is_number(argv[2])) {
+            fprintf(stderr, "invalid pid\n");
+            if (fd>=0) close(fd);
+            log_op(BINLOG_OP_SNAPSHOT_TREE, 0, 0, EINVAL, 0);
+            return 4;
+        }
+        int pid = atoi(argv[2]);
+        ProcMeta meta;
+        read_meta(pid, &meta);
+        if (mock) {
+            printf("tree %d 0 0\n", pid);
+            save_meta(pid, &meta, 0, NULL, 0);
+            free_meta(&meta);
+            printf("OK snapshot-tree %d 1 (mock)\n", pid);
+            return 0;
+        }
+        static struct snap_tree_item items[SNAP_TREE_MAX];
+        struct snap_tree tr = { .pid = pid, .sig = SIGKILL, .child_sig = SIGTERM, .count = SNAP_TREE_MAX,
+                                .items = (__u64)(uintptr_t)items };
+        PidTree pt = { 0 };
+        int pinned = pidtree_collect(pid, &pt);
+        if (pinned < 0) {
+            /* without the pidfds the exits could not be confirmed: kill nothing */
+            fprintf(stderr, "snapshot-tree %d: pinning the tree failed: %s\n", pid, strerror(-pinned));
+            log_op(BINLOG_OP_SNAPSHOT_TREE, pid, 0, -pinned, 0);
+            free_meta(&meta);
+            close(fd);
+            return 5;
+        }
+        int ok = ioctl(fd, IOCTL_SNAPSHOT_TREE, &tr);
+        if (ok < 0) {
+            fprintf(stderr, "ioctl snapshot-tree failed: %s\n", strerror(errno));
+            log_op(BINLOG_OP_SNAPSHOT_TREE, pid, 0, errno, 0);
+            pidtree_free(&pt);
+            free_meta(&meta);
+            close(fd);
+            return 5;
+        }
+        pid_t desc[SNAP_TREE_MAX];
+        uint32_t ndesc = 0;
+        for (__u32 i = 0; i < tr.count; i++) {
+            printf("tree %d %d %d\n", items[i].pid, items[i].ppid, items[i].result);
+            if (i > 0 && items[i].result == 0) desc[ndesc++] = items[i].pid;
+        }
+        /* the saved entry (a JSON line) is what a later restore, by us or the CLI, works from */
+        int crc = save_meta(pid, &meta, 0, desc, ndesc);
+        free_meta(&meta);
+        if (crc < 0) {
+            fprintf(stderr, "catalog: %s\n", strerror(-crc));
+            log_op(BINLOG_OP_CATALOG, pid, 0, -crc, 0);
+        }
+        PidTermStats ps;
+        pidtree_wait(&pt, pidterm_grace_from_env(), &ps);
+        pidtree_free(&pt);
+        printf("reap %d %d %d\n", ps.exited, ps.killed, ps.survivors);
+        binlog_put(BINLOG_OP_REAP, pid, 0, ps.survivors ? ETIMEDOUT : 0, ps.seconds * 1e3, ps.killed);
+        printf("OK snapshot-tree %d %d\n", pid, ok);
+        log_op(BINLOG_OP_SNAPSHOT_TREE, pid, 0, 0, ok);
+        close(fd);
+        return 0;
+    } else if (strcmp(cmd, "snapshot-mem") == 0) {
+        /* snapshot with a kernel-held memory image, then map it (no read() copies) */
+        if (argc < 3 || !is_number(argv[2])) {
+            fprintf(stderr, "invalid pid\n");
+            if (fd>=0) close(fd);
+            log_op(BINLOG_OP_SNAPSHOT_MEM, 0, 0, EINVAL, 0);
+            return 4;
+        }
+        struct snap_req req;
+        memset(&req, 0, sizeof(req));
+        req.pid = atoi(argv[2]);
+        req.flags = SNAP_F_MEMIMAGE;
+        const char *outpath = argc > 3 ? argv[3] : NULL;
+        if (mock) {
+            printf("OK snapshot-mem %d (mock)\n", req.pid);
+            return 0;
+        }
+        if (ioctl(fd, IOCTL_SNAPSHOT_EX, &req) < 0) {
+            fprintf(stderr, "ioctl snapshot-mem failed: %s\n", strerror(errno));
+            log_op(BINLOG_OP_SNAPSHOT_MEM, req.pid, 0, errno, 0);
+            close(fd);
+            return 5;
+        }
+        int r = dump_image(fd, &req, outpath);
+        if (r < 0) {
+            fprintf(stderr, "image map/write failed: %s\n", strerror(-r));
+            log_op(BINLOG_OP_SNAPSHOT_MEM, req.pid, 0, -r, 0);
+            close(fd);
+            return 6;
+        }
+        printf("OK snapshot-mem %d\n", req.pid);
+        log_op(BINLOG_OP_SNAPSHOT_MEM, req.pid, 0, 0, (uint32_t)(req.image_size >> 10));
+        close(fd);
+        return 0;
+    } else if (strcmp(cmd, "freeze") == 0 || strcmp(cmd, "threads") == 0) {
+        /* freeze: stop in place and record every thread; restore <pid> 0 thaws */
+        int freeze = strcmp(cmd, "freeze") == 0;
+        int op = freeze ? BINLOG_OP_FREEZE : BINLOG_OP_THREADS;
+        if (argc < 3 || !is_number(argv[2])) {
+            fprintf(stderr, "invalid pid\n");
+            if (fd>=0) close(fd);
+            log_op(op, 0, 0, EINVAL, 0);
+            return 4;
+        }
+        int pid = atoi(argv[2]);
+        if (mock) {
+            printf("OK %s %d (mock)\n", cmd, pid);
+            return 0;
+        }
+        if (freeze) {
+            struct snap_req req;
+            ProcMeta meta;
+            memset(&req, 0, sizeof(req));
+            req.pid = pid;
+            req.flags = SNAP_F_FREEZE | SNAP_F_THREADS;
+            read_meta(pid, &meta);
+            if (ioctl(fd, IOCTL_SNAPSHOT_EX, &req) < 0) {
+                fprintf(stderr, "ioctl freeze failed: %s\n", strerror(errno));
+                log_op(BINLOG_OP_FREEZE, pid, 0, errno, 0);
+                free_meta(&meta);
+                close(fd);
+                return 5;
+            }
+            save_meta(pid, &meta, CATALOG_F_FROZEN, NULL, 0);
+            free_meta(&meta);
+        }
+        int r = print_threads(fd, pid);
+        if (r < 0) {
+            fprintf(stderr, "thread query failed: %s\n", strerror(-r));
+            log_op(op, pid, 0, -r, 0);
+            close(fd);
+            return 6;
+        }
+        printf("OK %s %d\n", cmd, pid);
+        log_op(op, pid, 0, 0, (uint32_t)r);
+        close(fd);
+        return 0;
+    } else if (strcmp(cmd, "list") == 0) {
+        /* whole registry straight from the kernel: one read() per 1 MiB of entries */
+        if (mock) {
+            printf("OK list 0 (mock)\n");
+            return 0;
+        }
+        static struct snap_info buf[4096];
+        long total = 0;
+        for (;;) {
+            ssize_t r = read(fd, buf, sizeof(buf));
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "registry read failed: %s\n", strerror(errno));
+                log_op(BINLOG_OP_LIST, 0, 0, errno, 0);
+                close(fd);
+                return 6;
+            }
+            if (r == 0) break;
+            for (size_t i = 0; i < (size_t)r / sizeof(buf[0]); i++) print_info_json(&buf[i]);
+            total += r / (ssize_t)sizeof(buf[0]);
+        }
+        printf("OK list %ld\n", total);
+        log_op(BINLOG_OP_LIST, 0, 0, 0, (uint32_t)total);
+        close(fd);
+        return 0;
+    } else if (strcmp(cmd, "events") == 0) {
+        unsigned nr = (argc > 2 && is_number(argv[2])) ? (unsigned)atoi(argv[2]) : 1024;
+        log_op(BINLOG_OP_EVENTS, 0, 0, 0, nr);
+        if (mock) {
+            printf("OK events nr=%u (mock)\n", nr);
+            return 0;
+        }
+        int r = stream_events(fd, nr);
+        fprintf(stderr, "event stream failed: %s\n", strerror(-r));
+        log_op(BINLOG_OP_EVENTS, 0, 0, -r, nr);
+        close(fd);
+        return 6;
+    } else if (strcmp(cmd, "query") == 0) {
+        if (argc < 3 || !is_number(argv[2])) {
+            fprintf(stderr, "invalid pid\n");
+            if (fd>=0) close(fd);
+            log_op(BINLOG_OP_QUERY, 0, 0, EINVAL, 0);
+            return 4;
+        }
+        struct snap_info in;
+        memset(&in, 0, sizeof(in));
+        in.pid = atoi(argv[2]);
+        if (mock) {
+            printf("OK query %d (mock)\n", in.pid);
+            return 0;
+        }
+        if (ioctl(fd, IOCTL_QUERY, &in) < 0) {
+            fprintf(stderr, "ioctl query failed: %s\n", strerror(errno));
+            log_op(BINLOG_OP_QUERY, in.pid, 0, errno, 0);
+            close(fd);
+            return errno == ENOENT ? 8 : 6;
+        }
+        print_info_json(&in);
+        printf("OK query %d\n", in.pid);
+        close(fd);
+        return 0;
+    } else if (strcmp(cmd, "batch") == 0) {
+        /* all items go to the kernel in one IOCTL_BATCH; one output line per item */
+        int n = argc - 2;
+        if (n < 1 || n > SNAP_BATCH_MAX) {
+            fprintf(stderr, "invalid batch size\n");
+            if (fd>=0) close(fd);
+            log_op(BINLOG_OP_BATCH, 0, 0, EINVAL, 0);
+            return 4;
+        }
+        struct snap_batch_item *items = calloc(n, sizeof(*items));
+        if (!items) {
+            if (fd>=0) close(fd);
+            return 3;
+        }
+        for (int i = 0; i < n; i++) {
+            if (parse_batch_item(argv[i + 2], &items[i]) < 0) {
+                fprintf(stderr, "invalid batch item: %s\n", argv[i + 2]);
+                log_op(BINLOG_OP_BATCH, 0, 0, EINVAL, 0);
+                free(items);
+                if (fd>=0) close(fd);
+                return 4;
+            }
+        }
+        if (mock) {
+            for (int i = 0; i < n; i++) print_batch_item(&items[i], " (mock)");
+            free(items);
+            log_op(BINLOG_OP_BATCH, 0, 0, 0, n);
+            return 0;
+        }
+        struct snap_batch b = { .count = (__u32)n, .flags = 0, .items = (__u64)(uintptr_t)items };
+        int ok = ioctl(fd, IOCTL_BATCH, &b);
+        if (ok < 0) {
+            fprintf(stderr, "ioctl batch failed: %s\n", strerror(errno));
+            log_op(BINLOG_OP_BATCH, 0, 0, errno, 0);
+            free(items);
+            close(fd);
+            return 6;
+        }
+        for (int i = 0; i < n; i++) {
+            print_batch_item(&items[i], "");
+            binlog_put(items[i].op == SNAP_OP_SNAPSHOT ? BINLOG_OP_SNAPSHOT : BINLOG_OP_RESTORE, items[i].pid,
+                       items[i].op == SNAP_OP_SNAPSHOT ? 0 : items[i].newpid, -items[i].result, 0, 0);
+        }
+        log_op(BINLOG_OP_BATCH, 0, 0, 0, ok);
+        free(items);
+        close(fd);
+        return ok == n ? 0 : 7;
     } else {
         fprintf(stderr, "unknown command\n");
-        log_msg("unknown command: %s", cmd);
+        log_op(BINLOG_OP_USAGE, 0, 0, EINVAL, 0);
         if(fd>=0) close(fd);
         return 2;
     }
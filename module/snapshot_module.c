@@ -1,6 +1,6 @@
 // snapshot_module.c
 // Lightweight snapshot registry: validate PID, hold task ref, then release on restore/rebind.
-// NOT a full memory/register checkpoint-restore. Provides safe ioctl-based plumbing.
+// NOT a full checkpoint-restore: fds, signal handlers and other kernel state are never captured.
 
 #include <linux/module.h>
 #include <linux/kernel.h>
@@ -13,220 +13,2189 @@
 #include <linux/slab.h>
 #include <linux/uidgid.h>
 #include <linux/ioctl.h>
+#include <linux/xarray.h>
+#include <linux/ktime.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/cred.h>
+#include <linux/capability.h>
+#include <linux/string.h>
+#include <linux/jiffies.h>
+#include <linux/sched/task_stack.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/ratelimit.h>
+#include <linux/ptrace.h>
+#include <linux/pagewalk.h>
+#include <linux/version.h>
+/* IORING_OP_URING_CMD (snapshot_uring_cmd) is built from 6.5 on, the first
+ * kernel with io_uring_sqe_cmd(); its declarations moved to
+ * <linux/io_uring/cmd.h> in 6.7. Older kernels get the module without it and
+ * io_uring fails the command with -EOPNOTSUPP.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define SNAP_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
+#include <asm/ptrace.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+/* the mmap paths use the 6.3 vm_flags accessors */
+static inline void vm_flags_set(struct vm_area_struct *vma, vm_flags_t flags)
+{
+    vma->vm_flags |= flags;
+}
+
+static inline void vm_flags_clear(struct vm_area_struct *vma, vm_flags_t flags)
+{
+    vma->vm_flags &= ~flags;
+}
+#endif
+
+#include "snapshot_uapi.h"
+
+#define CREATE_TRACE_POINTS
+#include "snapshot_trace.h"
+
+#define DEVICE_NAME "snapshotctl"
+
+/* ioctl numbers and argument structs live in snapshot_uapi.h */
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("snapshotter");
+MODULE_DESCRIPTION("Lightweight snapshot registry kernel module (validation & refs)");
+
+/* Locking:
+ * - lookups are lock-free: xa_load() under rcu_read_lock(), entries are
+ *   freed through call_rcu() so a looked-up entry stays valid until unlock.
+ * - the shared registry is split into SNAP_SHARDS xarrays by pid hash; slot
+ *   updates only take the owning shard's xa_lock. A file that opened a
+ *   private session (IOCTL_SESSION) has a one-shard registry of its own.
+ * - removing an entry from its slot (xa_erase) is how a caller claims it;
+ *   only one concurrent restore/rebind of the same pid can win.
+ * - e->lock protects pid/task/uid/comm/image for readers that did not claim it.
+ * - e->threads is written before the entry is published and never changed;
+ *   it is freed with the entry after a grace period, so RCU readers may copy it.
+ * - event rings sit on snap_rings (RCU list, snap_rings_lock for add/remove);
+ *   producers only take the ring's own lock, with irqs off because exit
+ *   events are emitted from the pidfd wakeup under tasklist_lock. An event
+ *   only goes to the rings of files working on the registry it happened in.
+ */
+struct snap_image;
+struct snap_reg;
+struct snap_file;
+
+/* watches the exit of an entry's task through its tgid's pidfd waitqueue */
+struct snap_watch {
+    struct wait_queue_entry wq;
+    struct pid *pid;            /* tgid whose wait_pidfd wq is queued on, NULL if idle */
+    struct task_struct *task;   /* the entry's task while queued */
+    pid_t key;                  /* registry key reported in the exit event */
+    struct snap_reg *reg;       /* registry the exit event belongs to */
+    int fired;
+};
+
+struct snap_entry {
+    spinlock_t lock;
+    pid_t pid;
+    pid_t orig_pid;           /* pid the snapshot was taken of */
+    u64 time_ns;              /* CLOCK_REALTIME at snapshot */
+    struct task_struct *task; /* held reference */
+    kuid_t uid;
+    kuid_t reader;            /* caller allowed to read image/threads, see may_access_image() */
+    char comm[TASK_COMM_LEN];
+    struct snap_image *image; /* optional memory image (SNAP_F_MEMIMAGE) */
+    bool frozen;              /* thread group stopped in place (SNAP_F_FREEZE) */
+    u64 stop_switches;        /* the group's context switches once it had stopped */
+    u32 nr_threads;
+    struct snap_thread *threads; /* per-thread state (SNAP_F_THREADS), kvmalloc */
+    struct snap_watch watch;
+    struct rcu_head rcu;
+};
+
+/* per-file event ring, mapped into userspace at SNAP_RING_OFFSET */
+struct snap_ring {
+    struct list_head node;      /* on snap_rings */
+    struct snap_file *owner;    /* gets the events of owner->reg */
+    spinlock_t lock;            /* serializes producers */
+    wait_queue_head_t wait;
+    struct snap_ring_hdr *hdr;  /* vmalloc_user: header page + events */
+    struct snap_event *ev;
+    u32 mask;
+    unsigned long size;
+};
+
+/* Memory image: a vmalloc'd header (struct snap_image_hdr + runs) followed by
+ * one private copy per captured page. Mapped read-only into userspace through
+ * snapshot_mmap(); every mapping holds a reference so the image outlives the
+ * registry entry if userspace still has it mapped.
+ */
+struct snap_image {
+    struct kref ref;
+    kuid_t reader;              /* the entry's reader, checked again at mmap */
+    void *hdr;                  /* hdr_pages * PAGE_SIZE, vmalloc */
+    unsigned long hdr_pages;
+    unsigned long nr_pages;     /* data pages */
+    struct xarray data;         /* data page index -> struct page */
+};
+
+#define SNAP_IMAGE_PGOFF_SHIFT (SNAP_IMAGE_SHIFT - PAGE_SHIFT)
+#define SNAP_IMAGE_PGOFF_MASK ((1UL << SNAP_IMAGE_PGOFF_SHIFT) - 1)
+#define SNAP_GUP_BATCH 64
+#define SNAP_SPAN_BATCH 64
+#define SNAP_STOP_TIMEOUT_MS 500
+#define SNAP_TREE_TIMEOUT_MS 2000 /* all of a tree's stops together */
+#define SNAP_READ_MAX (1 << 20)
+#define SNAP_TREE_PASSES 8
+
+#define SNAP_SHARD_BITS 6
+#define SNAP_SHARDS (1 << SNAP_SHARD_BITS)
+
+struct snap_shard {
+    struct xarray xa;
+} ____cacheline_aligned_in_smp;
+
+/* a registry: pid -> snap_entry, entries come from snap_cache */
+struct snap_reg {
+    struct snap_shard *shards;
+    unsigned int shard_bits;
+    long max;                   /* entry quota, 0 = unlimited */
+    atomic_long_t count;
+};
+
+/* per open file: the registry it works on and its optional event ring */
+struct snap_file {
+    struct snap_reg *reg;       /* &snap_global or &session */
+    struct snap_ring *ring;     /* IOCTL_EVENTS, NULL until set up */
+    struct snap_reg session;
+    struct snap_shard session_shard;
+};
+
+static struct snap_shard snap_shards[SNAP_SHARDS];
+static struct snap_reg snap_global = {
+    .shards = snap_shards,
+    .shard_bits = SNAP_SHARD_BITS,
+    .count = ATOMIC_LONG_INIT(0),
+};
+static struct kmem_cache *snap_cache;
+
+static LIST_HEAD(snap_rings);
+static DEFINE_SPINLOCK(snap_rings_lock);
+static atomic64_t snap_event_seq = ATOMIC64_INIT(0);
+
+static int major = 0;
+
+/* run a registry insert/lookup/claim microbenchmark with this many entries at load */
+static unsigned int bench_entries = 0;
+module_param(bench_entries, uint, 0444);
+MODULE_PARM_DESC(bench_entries, "registry microbenchmark size at load (0 = off)");
+
+/* per-operation messages are behind a static key: a patched-out branch
+ * unless verbose=1. Unexpected failures use pr_err_ratelimited() instead.
+ */
+static DEFINE_STATIC_KEY_FALSE(snap_verbose);
+
+#define snap_log(...)                                   \
+    do {                                                \
+        if (static_branch_unlikely(&snap_verbose))      \
+            pr_info(__VA_ARGS__);                       \
+    } while (0)
+
+#define snap_log_err(...)                               \
+    do {                                                \
+        if (static_branch_unlikely(&snap_verbose))      \
+            pr_err(__VA_ARGS__);                        \
+    } while (0)
+
+static int snap_verbose_set(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int err = kstrtobool(val, &on);
+
+    if (err)
+        return err;
+    if (on)
+        static_branch_enable(&snap_verbose);
+    else
+        static_branch_disable(&snap_verbose);
+    return 0;
+}
+
+static int snap_verbose_get(char *buf, const struct kernel_param *kp)
+{
+    return sysfs_emit(buf, "%c\n", static_key_enabled(&snap_verbose) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops snap_verbose_ops = {
+    .set = snap_verbose_set,
+    .get = snap_verbose_get,
+};
+module_param_cb(verbose, &snap_verbose_ops, NULL, 0644);
+MODULE_PARM_DESC(verbose, "log every registry operation (default off)");
+
+/* per-CPU ioctl statistics, summed when debugfs is read. Ops are indexed by
+ * _IOC_NR() of the ioctl (0 = unknown), latencies go into log2(ns) buckets.
+ */
+#define SNAP_STAT_OPS 10
+#define SNAP_HIST_BUCKETS 32
+
+enum snap_err_reason {
+    SNAP_ERR_INVAL,
+    SNAP_ERR_EXIST,
+    SNAP_ERR_NOENT,
+    SNAP_ERR_PERM,
+    SNAP_ERR_FAULT,
+    SNAP_ERR_NOMEM,
+    SNAP_ERR_SRCH,
+    SNAP_ERR_BUSY,
+    SNAP_ERR_AGAIN,
+    SNAP_ERR_DQUOT,
+    SNAP_ERR_OTHER,
+    SNAP_NR_ERR
+};
+
+static const char *const snap_op_names[SNAP_STAT_OPS] = {
+    "unknown", "snapshot", "restore", "batch", "snapshot_ex",
+    "get_threads", "query", "events", "snapshot_tree", "session",
+};
+
+static const char *const snap_err_names[SNAP_NR_ERR] = {
+    "EINVAL", "EEXIST", "ENOENT", "EPERM", "EFAULT",
+    "ENOMEM", "ESRCH", "EBUSY", "EAGAIN", "EDQUOT", "other",
+};
+
+struct snap_stats {
+    u64 calls[SNAP_STAT_OPS];
+    u64 errors[SNAP_STAT_OPS][SNAP_NR_ERR];
+    u64 hist[SNAP_STAT_OPS][SNAP_HIST_BUCKETS];
+    u64 err_hist[SNAP_NR_ERR][SNAP_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct snap_stats, snap_pcpu_stats);
+static struct dentry *snap_debugfs;
+
+static unsigned int snap_stat_op(unsigned int cmd)
+{
+    unsigned int nr = _IOC_NR(cmd);
+
+    if (_IOC_TYPE(cmd) != 's' || nr >= SNAP_STAT_OPS)
+        return 0;
+    return nr;
+}
+
+static unsigned int snap_err_reason(long ret)
+{
+    switch (ret) {
+    case -EINVAL: return SNAP_ERR_INVAL;
+    case -EEXIST: return SNAP_ERR_EXIST;
+    case -ENOENT: return SNAP_ERR_NOENT;
+    case -EPERM:  return SNAP_ERR_PERM;
+    case -EFAULT: return SNAP_ERR_FAULT;
+    case -ENOMEM: return SNAP_ERR_NOMEM;
+    case -ESRCH:  return SNAP_ERR_SRCH;
+    case -EBUSY:  return SNAP_ERR_BUSY;
+    case -EAGAIN: return SNAP_ERR_AGAIN;
+    case -EDQUOT: return SNAP_ERR_DQUOT;
+    default:      return SNAP_ERR_OTHER;
+    }
+}
+
+static void snap_account(unsigned int cmd, long ret, u64 ns)
+{
+    unsigned int op = snap_stat_op(cmd);
+    unsigned int b = min_t(unsigned int, fls64(ns), SNAP_HIST_BUCKETS - 1);
+
+    this_cpu_inc(snap_pcpu_stats.calls[op]);
+    this_cpu_inc(snap_pcpu_stats.hist[op][b]);
+    if (ret < 0) {
+        unsigned int r = snap_err_reason(ret);
+
+        this_cpu_inc(snap_pcpu_stats.errors[op][r]);
+        this_cpu_inc(snap_pcpu_stats.err_hist[r][b]);
+    }
+}
+
+static inline struct xarray *snap_xa(struct snap_reg *reg, pid_t pid)
+{
+    if (!reg->shard_bits)
+        return &reg->shards[0].xa;
+    return &reg->shards[hash_32((u32)pid, reg->shard_bits)].xa;
+}
+
+/* find snapshot entry for pid; caller holds rcu_read_lock() */
+static struct snap_entry *find_snap(struct snap_reg *reg, pid_t pid)
+{
+    if (pid <= 0)
+        return NULL;
+    return xa_load(snap_xa(reg, pid), (unsigned long)pid);
+}
+
+/* remove the entry for pid from the registry and hand it to the caller; a
+ * slot reserved by a rebind in progress loads as NULL and is left alone
+ */
+static struct snap_entry *claim_snap(struct snap_reg *reg, pid_t pid)
+{
+    struct xarray *xa;
+    struct snap_entry *e;
+
+    if (pid <= 0)
+        return NULL;
+    xa = snap_xa(reg, pid);
+    xa_lock(xa);
+    e = xa_load(xa, (unsigned long)pid);
+    if (e)
+        __xa_erase(xa, (unsigned long)pid);
+    xa_unlock(xa);
+    if (e)
+        atomic_long_dec(&reg->count);
+    return e;
+}
+
+/* lock two shards (possibly the same one) in address order */
+static void snap_lock_pair(struct xarray *a, struct xarray *b)
+{
+    if (a == b) {
+        xa_lock(a);
+        return;
+    }
+    if (a > b)
+        swap(a, b);
+    xa_lock(a);
+    xa_lock_nested(b, SINGLE_DEPTH_NESTING);
+}
+
+static void snap_unlock_pair(struct xarray *a, struct xarray *b)
+{
+    if (a != b)
+        xa_unlock(b);
+    xa_unlock(a);
+}
+
+/* publish an owned entry under pid; -EEXIST if the pid is taken, -EDQUOT if
+ * the registry is at its quota
+ */
+static int publish_snap(struct snap_reg *reg, struct snap_entry *e, pid_t pid)
+{
+    int err;
+
+    if (atomic_long_inc_return(&reg->count) > reg->max && reg->max) {
+        atomic_long_dec(&reg->count);
+        return -EDQUOT;
+    }
+    err = xa_insert(snap_xa(reg, pid), (unsigned long)pid, e, GFP_KERNEL);
+    if (err) {
+        atomic_long_dec(&reg->count);
+        return err == -EBUSY ? -EEXIST : err;
+    }
+    return 0;
+}
+
+static inline struct snap_file *snap_file(struct file *file)
+{
+    return file->private_data;
+}
+
+static void snap_ring_push(struct snap_ring *r, const struct snap_event *ev)
+{
+    unsigned long flags;
+    u64 head;
+
+    spin_lock_irqsave(&r->lock, flags);
+    head = r->hdr->head;
+    if (head - READ_ONCE(r->hdr->tail) >= r->mask + 1) {
+        r->hdr->lost++;
+    } else {
+        r->ev[head & r->mask] = *ev;
+        smp_store_release(&r->hdr->head, head + 1);
+    }
+    spin_unlock_irqrestore(&r->lock, flags);
+    wake_up_interruptible_poll(&r->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* publish an event of reg to the rings of the files working on reg; never
+ * blocks, full rings drop it
+ */
+static void snap_emit(struct snap_reg *reg, u32 type, pid_t pid, pid_t newpid, s32 arg)
+{
+    struct snap_event ev;
+    struct snap_ring *r;
+
+    if (list_empty(&snap_rings))
+        return;
+
+    ev.seq = atomic64_inc_return(&snap_event_seq);
+    ev.time_ns = ktime_get_ns();
+    ev.type = type;
+    ev.pid = pid;
+    ev.newpid = newpid;
+    ev.arg = arg;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(r, &snap_rings, node) {
+        if (READ_ONCE(r->owner->reg) == reg)
+            snap_ring_push(r, &ev);
+    }
+    rcu_read_unlock();
+}
+
+/* pidfd wakeup: runs under the waitqueue lock, possibly with irqs off */
+static int snap_exit_wake(struct wait_queue_entry *wq, unsigned int mode, int sync, void *key)
+{
+    struct snap_watch *w = container_of(wq, struct snap_watch, wq);
+
+    if (READ_ONCE(w->task->exit_state) && !xchg(&w->fired, 1))
+        snap_emit(w->reg, SNAP_EV_EXIT, w->key, 0, w->task->exit_code);
+    return 0;
+}
+
+static void watch_attach(struct snap_watch *w, struct task_struct *task, pid_t key,
+                         struct snap_reg *reg)
+{
+    /* a reaped leader has no tgid left; the delayed put keeps it valid under rcu */
+    rcu_read_lock();
+    w->pid = get_pid(task_tgid(task));
+    rcu_read_unlock();
+    w->task = task;
+    w->key = key;
+    w->reg = reg;
+    w->fired = 0;
+    if (!w->pid) {
+        w->fired = 1;
+        snap_emit(reg, SNAP_EV_EXIT, key, 0, task->exit_code);
+        return;
+    }
+    init_waitqueue_func_entry(&w->wq, snap_exit_wake);
+    add_wait_queue(&w->pid->wait_pidfd, &w->wq);
+
+    /* it may have exited before we were queued */
+    if (READ_ONCE(task->exit_state) && !xchg(&w->fired, 1))
+        snap_emit(reg, SNAP_EV_EXIT, key, 0, task->exit_code);
+}
+
+/* once this returns snap_exit_wake() is not running and will not run */
+static void watch_detach(struct snap_watch *w)
+{
+    if (!w->pid)
+        return;
+    remove_wait_queue(&w->pid->wait_pidfd, &w->wq);
+    put_pid(w->pid);
+    w->pid = NULL;
+    w->task = NULL;
+}
+
+static void snap_free_rcu(struct rcu_head *rcu)
+{
+    struct snap_entry *e = container_of(rcu, struct snap_entry, rcu);
+
+    /* dropped only now: RCU readers (fill_info, snap_continued) may still be
+     * looking at e->task and its signal_struct
+     */
+    if (e->task)
+        put_task_struct(e->task);
+    kvfree(e->threads);
+    kmem_cache_free(snap_cache, e);
+}
+
+static void snap_image_release(struct kref *ref)
+{
+    struct snap_image *img = container_of(ref, struct snap_image, ref);
+    struct page *page;
+    unsigned long idx;
+
+    xa_for_each(&img->data, idx, page)
+        __free_page(page);
+    xa_destroy(&img->data);
+    vfree(img->hdr);
+    kfree(img);
+}
+
+static inline void put_image(struct snap_image *img)
+{
+    if (img)
+        kref_put(&img->ref, snap_image_release);
+}
+
+/* stop/continue the whole thread group of task; fails if it already exited */
+static int signal_group(struct task_struct *task, int sig)
+{
+    if (pid_alive(task) && !(task->flags & PF_EXITING))
+        return kill_pid(task_tgid(task), sig, 1);
+    return -ESRCH;
+}
+
+/* context switches of task's whole group so far; a stopped group does not
+ * switch, so a change means it ran
+ */
+static u64 group_switches(struct task_struct *task)
+{
+    struct task_struct *t;
+    u64 n = 0;
+
+    rcu_read_lock();
+    for_each_thread(task, t)
+        n += READ_ONCE(t->nvcsw) + READ_ONCE(t->nivcsw);
+    rcu_read_unlock();
+    return n;
+}
+
+/* a frozen group that something else continued (SIGCONT) since the freeze:
+ * it is out of its group stop, or it ran and was stopped again. The task of
+ * a frozen entry never changes, and its reference is only dropped after a
+ * grace period (snap_free_rcu), so RCU readers may call this.
+ */
+static bool snap_continued(struct snap_entry *e)
+{
+    struct task_struct *task = e->task;
+
+    if (!e->frozen || !task || !pid_alive(task))
+        return false;
+    return !(READ_ONCE(task->signal->flags) & SIGNAL_STOP_STOPPED) ||
+           group_switches(task) != e->stop_switches;
+}
+
+/* kill(2)'s rule: matching real/effective uid against the target's real/saved
+ * uid, or CAP_KILL (checked by the caller once, outside any lock)
+ */
+static bool may_signal(struct task_struct *task, bool cap_kill)
+{
+    const struct cred *cred = current_cred(), *tcred;
+    bool ok;
+
+    if (cap_kill)
+        return true;
+    rcu_read_lock();
+    tcred = __task_cred(task);
+    ok = uid_eq(cred->euid, tcred->suid) || uid_eq(cred->euid, tcred->uid) ||
+         uid_eq(cred->uid, tcred->suid) || uid_eq(cred->uid, tcred->uid);
+    rcu_read_unlock();
+    return ok;
+}
+
+/* drop an owned (already unpublished) entry; a frozen task is thawed so
+ * nothing is ever left stopped behind a released entry
+ */
+static void free_snap(struct snap_entry *e)
+{
+    struct snap_image *img;
+
+    if (e->frozen && e->task)
+        signal_group(e->task, SIGCONT);
+    watch_detach(&e->watch);
+
+    /* RCU readers may still look at e; detach the image under the lock */
+    spin_lock(&e->lock);
+    img = e->image;
+    e->image = NULL;
+    spin_unlock(&e->lock);
+    put_image(img);
+
+    /* the task reference goes with the entry, after a grace period */
+    call_rcu(&e->rcu, snap_free_rcu);
+}
+
+/* point an owned entry of reg at task (whose reference it takes over) and
+ * move the exit watch to it; returns the previously held task so the caller
+ * can drop or reinstate it
+ */
+static struct task_struct *snap_set_task(struct snap_reg *reg, struct snap_entry *e,
+                                         struct task_struct *task, pid_t pid)
+{
+    struct task_struct *old;
+    char comm[TASK_COMM_LEN];
+    kuid_t uid = task_uid(task);
+
+    get_task_comm(comm, task);
+    watch_detach(&e->watch);
+
+    spin_lock(&e->lock);
+    old = e->task;
+    e->task = task;
+    e->pid = pid;
+    e->uid = uid;
+    memcpy(e->comm, comm, sizeof(comm));
+    spin_unlock(&e->lock);
+
+    watch_attach(&e->watch, task, pid, reg);
+    return old;
+}
+
+/* resolve pid to a referenced task_struct, NULL if gone */
+static struct task_struct *get_task_by_pid(pid_t pid)
+{
+    struct pid *pid_struct = find_get_pid(pid);
+    struct task_struct *task;
+
+    if (!pid_struct)
+        return NULL;
+    task = get_pid_task(pid_struct, PIDTYPE_PID);
+    put_pid(pid_struct);
+    return task;
+}
+
+/* memory and registers are readable by the uid that was allowed to ptrace
+ * the task when they were captured, or by a ptrace-capable caller; never by
+ * matching the task's own uid, which a setuid or non-dumpable task keeps
+ */
+static bool may_access_image(kuid_t reader)
+{
+    return uid_eq(current_uid(), reader) || capable(CAP_SYS_PTRACE);
+}
+
+/* append page to the image, extending the current run when contiguous */
+static int image_add_page(struct snap_image *img, struct page *src, unsigned long addr, u32 prot,
+                          struct snap_image_run **runs, unsigned long *nr_runs, unsigned long *max_runs)
+{
+    struct snap_image_run *run = *nr_runs ? &(*runs)[*nr_runs - 1] : NULL;
+    struct page *dst;
+    int err;
+
+    dst = alloc_page(GFP_KERNEL | __GFP_NOWARN);
+    if (!dst)
+        return -ENOMEM;
+    copy_highpage(dst, src);
+
+    err = xa_err(xa_store(&img->data, img->nr_pages, dst, GFP_KERNEL));
+    if (err) {
+        __free_page(dst);
+        return err;
+    }
+
+    if (!run || run->prot != prot || run->vaddr + (run->nr_pages << PAGE_SHIFT) != addr) {
+        if (*nr_runs == *max_runs) {
+            unsigned long n = *max_runs ? *max_runs * 2 : 64;
+            struct snap_image_run *grown = kvmalloc_array(n, sizeof(*grown), GFP_KERNEL);
+
+            if (!grown)
+                return -ENOMEM;
+            if (*runs) {
+                memcpy(grown, *runs, *nr_runs * sizeof(*grown));
+                kvfree(*runs);
+            }
+            *runs = grown;
+            *max_runs = n;
+        }
+        run = &(*runs)[(*nr_runs)++];
+        run->vaddr = addr;
+        run->nr_pages = 0;
+        run->data_page = img->nr_pages;
+        run->prot = prot;
+        run->pad = 0;
+    }
+    run->nr_pages++;
+    img->nr_pages++;
+    return 0;
+}
+
+/* populated ranges found by one page table walk, captured before the next */
+struct snap_span_walk {
+    struct {
+        unsigned long start, end;
+        bool huge;              /* one trans-huge PMD, maybe the huge zero page */
+    } span[SNAP_SPAN_BATCH];
+    unsigned int nr;
+    unsigned long resume;       /* where the walk stopped once span[] was full */
+};
+
+static int snap_add_span(struct snap_span_walk *w, unsigned long start, unsigned long end, bool huge)
+{
+    if (!huge && w->nr && !w->span[w->nr - 1].huge && w->span[w->nr - 1].end == start) {
+        w->span[w->nr - 1].end = end;
+        return 0;
+    }
+    if (w->nr == SNAP_SPAN_BATCH) {
+        w->resume = start;
+        return 1; /* stops the walk */
+    }
+    w->span[w->nr].start = start;
+    w->span[w->nr].end = end;
+    w->span[w->nr++].huge = huge;
+    return 0;
+}
+
+static int snap_pmd_entry(pmd_t *pmd, unsigned long addr, unsigned long next, struct mm_walk *walk)
+{
+    pmd_t val = READ_ONCE(*pmd);
+
+    /* take a THP whole instead of letting the walk split it for its PTEs */
+    if (pmd_trans_huge(val)) {
+        walk->action = ACTION_CONTINUE;
+        return snap_add_span(walk->private, addr, next, true);
+    }
+    return 0;
+}
+
+static int snap_pte_entry(pte_t *pte, unsigned long addr, unsigned long next, struct mm_walk *walk)
+{
+    pte_t val = ptep_get(pte);
+
+    if (!pte_present(val) || is_zero_pfn(pte_pfn(val)))
+        return 0;
+    return snap_add_span(walk->private, addr, next, false);
+}
+
+static const struct mm_walk_ops snap_walk_ops = {
+    .pmd_entry = snap_pmd_entry,
+    .pte_entry = snap_pte_entry,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .walk_lock = PGWALK_RDLOCK,
+#endif
+};
+
+/* copy the pages of one populated span; a page that went away since the walk
+ * is skipped, a huge zero page as a whole
+ */
+static int capture_span(struct mm_struct *mm, struct snap_image *img, struct page **batch,
+                        unsigned long addr, unsigned long end, bool huge, u32 prot,
+                        struct snap_image_run **runs, unsigned long *nr_runs, unsigned long *max_runs)
+{
+    int err = 0;
+
+    while (addr < end && !err) {
+        long want = min_t(unsigned long, (end - addr) >> PAGE_SHIFT, SNAP_GUP_BATCH);
+        long got, i;
+
+        got = get_user_pages_remote(mm, addr, want, FOLL_NOFAULT | FOLL_DUMP, batch, NULL);
+        if (got <= 0) {
+            if (got < 0 && got != -EFAULT)
+                return got;
+            addr = huge ? end : addr + PAGE_SIZE;
+            continue;
+        }
+        for (i = 0; i < got; i++) {
+            if (!err)
+                err = image_add_page(img, batch[i], addr + (i << PAGE_SHIFT), prot,
+                                     runs, nr_runs, max_runs);
+            put_page(batch[i]);
+        }
+        addr += got << PAGE_SHIFT;
+        if (got < want)
+            addr += PAGE_SIZE; /* skip the page GUP stopped at */
+    }
+    return err;
+}
+
+/* walk the target's anonymous VMAs and copy every populated page. The page
+ * tables are walked first so that only populated spans are pinned, with
+ * FOLL_NOFAULT so nothing is faulted in or allocated in the target; holes,
+ * swapped-out pages and the shared zero page are skipped.
+ */
+static int capture_image(struct task_struct *task, pid_t pid, kuid_t reader, struct snap_image **out)
+{
+    struct snap_image_run *runs = NULL;
+    unsigned long nr_runs = 0, max_runs = 0;
+    struct snap_span_walk *walk;
+    struct snap_image_hdr *hdr;
+    struct snap_image *img;
+    struct vm_area_struct *vma;
+    struct mm_struct *mm;
+    struct page **batch;
+    size_t hdr_bytes;
+    int err = 0;
+
+    mm = get_task_mm(task);
+    if (!mm)
+        return -EINVAL;
+
+    img = kzalloc(sizeof(*img), GFP_KERNEL);
+    batch = kmalloc_array(SNAP_GUP_BATCH, sizeof(*batch), GFP_KERNEL);
+    walk = kmalloc(sizeof(*walk), GFP_KERNEL);
+    if (!img || !batch || !walk) {
+        kfree(img);
+        kfree(batch);
+        kfree(walk);
+        mmput(mm);
+        return -ENOMEM;
+    }
+    kref_init(&img->ref);
+    xa_init(&img->data);
+    img->reader = reader;
+
+    if (mmap_read_lock_killable(mm)) {
+        err = -EINTR;
+        goto out;
+    }
+    {
+        VMA_ITERATOR(vmi, mm, 0);
+
+        for_each_vma(vmi, vma) {
+            unsigned long addr = vma->vm_start;
+            u32 prot = vma->vm_flags & (VM_READ | VM_WRITE | VM_EXEC); /* == PROT_* bits */
+
+            /* no anon_vma: nothing was ever faulted in */
+            if (!vma_is_anonymous(vma) || !vma->anon_vma || (vma->vm_flags & (VM_IO | VM_PFNMAP)))
+                continue;
+
+            while (addr < vma->vm_end && !err) {
+                unsigned int i;
+
+                walk->nr = 0;
+                walk->resume = vma->vm_end;
+                err = walk_page_range(mm, addr, vma->vm_end, &snap_walk_ops, walk);
+                if (err < 0)
+                    break;
+                err = 0;
+                for (i = 0; i < walk->nr && !err; i++)
+                    err = capture_span(mm, img, batch, walk->span[i].start, walk->span[i].end,
+                                       walk->span[i].huge, prot, &runs, &nr_runs, &max_runs);
+                addr = walk->resume;
+
+                if (!err && fatal_signal_pending(current))
+                    err = -EINTR;
+                cond_resched();
+            }
+            if (err)
+                break;
+        }
+    }
+    mmap_read_unlock(mm);
+    if (err)
+        goto out;
+
+    hdr_bytes = sizeof(*hdr) + nr_runs * sizeof(*runs);
+    img->hdr_pages = DIV_ROUND_UP(hdr_bytes, PAGE_SIZE);
+    img->hdr = vmalloc_user(img->hdr_pages << PAGE_SHIFT); /* zeroed */
+    if (!img->hdr) {
+        err = -ENOMEM;
+        goto out;
+    }
+    hdr = img->hdr;
+    hdr->magic = SNAP_IMAGE_MAGIC;
+    hdr->version = SNAP_IMAGE_VERSION;
+    hdr->pid = pid;
+    hdr->nr_runs = nr_runs;
+    hdr->nr_pages = img->nr_pages;
+    hdr->data_offset = img->hdr_pages << PAGE_SHIFT;
+    hdr->page_size = PAGE_SIZE;
+    if (nr_runs)
+        memcpy(hdr + 1, runs, nr_runs * sizeof(*runs));
+
+out:
+    kvfree(runs);
+    kfree(batch);
+    kfree(walk);
+    mmput(mm);
+    if (err) {
+        put_image(img);
+        return err;
+    }
+    *out = img;
+    return 0;
+}
+
+/* wait until every live thread of task's group is stopped and off its CPU,
+ * so its saved user registers and TLS base are final; -ETIMEDOUT once past
+ * deadline (jiffies), which callers may share across several groups
+ */
+static int wait_group_stopped(struct task_struct *task, unsigned long deadline)
+{
+    for (;;) {
+        struct task_struct *t;
+        bool running = false;
+
+        rcu_read_lock();
+        for_each_thread(task, t) {
+            if (t->flags & PF_EXITING)
+                continue;
+#ifdef CONFIG_SMP
+            if (READ_ONCE(t->on_cpu)) {
+                running = true;
+                break;
+            }
+#endif
+            if (!task_is_stopped(t)) {
+                running = true;
+                break;
+            }
+        }
+        rcu_read_unlock();
+
+        if (!running)
+            return 0;
+        if (!pid_alive(task))
+            return -ESRCH;
+        if (time_after(jiffies, deadline))
+            return -ETIMEDOUT;
+        if (schedule_timeout_interruptible(1) && fatal_signal_pending(current))
+            return -EINTR;
+    }
+}
+
+static void fill_thread(struct snap_thread *st, struct task_struct *t)
+{
+    struct pt_regs *regs = task_pt_regs(t);
+    size_t n = min(sizeof(*regs), sizeof(st->regs));
+
+    st->tid = task_pid_vnr(t);
+    st->flags = thread_group_leader(t) ? SNAP_THREAD_LEADER : 0;
+    st->sigmask = t->blocked.sig[0];
+#if _NSIG_BPW == 32
+    st->sigmask |= (u64)t->blocked.sig[1] << 32;
+#endif
+#if defined(CONFIG_X86_64)
+    st->tls = t->thread.fsbase;
+    st->tls2 = t->thread.gsbase;
+#elif defined(CONFIG_ARM64)
+    st->tls = t->thread.uw.tp_value;
+#endif
+    memcpy(st->regs, regs, n);
+    st->nr_regs = n / sizeof(st->regs[0]);
+}
+
+/* record every thread of a group wait_group_stopped() has seen stopped;
+ * threads cannot be created while the group is stopped, so the count is stable
+ */
+static int capture_threads(struct task_struct *task, struct snap_thread **out, u32 *nr)
+{
+    struct snap_thread *th;
+    struct task_struct *t;
+    u32 n, i = 0;
+
+    n = min_t(u32, get_nr_threads(task), SNAP_THREADS_MAX);
+    th = kvcalloc(n, sizeof(*th), GFP_KERNEL);
+    if (!th)
+        return -ENOMEM;
+
+    rcu_read_lock();
+    for_each_thread(task, t) {
+        if (i == n)
+            break;
+        if (t->flags & PF_EXITING)
+            continue;
+        fill_thread(&th[i++], t);
+    }
+    rcu_read_unlock();
+
+    *out = th;
+    *nr = i;
+    return 0;
+}
+
+/* take snapshot: validate task exists and is user process; keep task ref */
+static long __do_snapshot(struct snap_reg *reg, pid_t pid, u32 flags, struct snap_req *req)
+{
+    struct task_struct *task;
+    struct snap_entry *e;
+    char comm[TASK_COMM_LEN];
+    kuid_t uid;
+    bool exists;
+    int err;
+
+    /* cheap lock-free precheck; publish_snap() is the authoritative one */
+    rcu_read_lock();
+    exists = find_snap(reg, pid) != NULL;
+    rcu_read_unlock();
+    if (exists) {
+        snap_log_err("snapshot_module: pid %d already has a snapshot\n", pid);
+        return -EEXIST;
+    }
+
+    /* takes a task reference which the entry keeps */
+    task = get_task_by_pid(pid);
+    if (!task) {
+        snap_log_err("snapshot_module: no task for pid %d\n", pid);
+        return -EINVAL;
+    }
+
+    /* reject kernel threads */
+    if (task->flags & PF_KTHREAD) {
+        snap_log_err("snapshot_module: pid %d is kernel thread, cannot snapshot\n", pid);
+        put_task_struct(task);
+        return -EINVAL;
+    }
+
+    /* require a user mm (user-space process) */
+    if (!task->mm) {
+        snap_log_err("snapshot_module: pid %d has no mm_struct (likely short-lived or kernel thread)\n", pid);
+        put_task_struct(task);
+        return -EINVAL;
+    }
+
+    /* memory and registers need ptrace read access: every uid of the task
+     * matching ours and a dumpable mm, so a setuid or non-dumpable task we
+     * started is refused. The decision goes with the entry.
+     */
+    if ((flags & (SNAP_F_MEMIMAGE | SNAP_F_THREADS)) &&
+        !ptrace_may_access(task, PTRACE_MODE_READ_REALCREDS)) {
+        snap_log_err("snapshot_module: pid %d: no ptrace access to its state\n", pid);
+        put_task_struct(task);
+        return -EPERM;
+    }
+
+    e = kmem_cache_zalloc(snap_cache, GFP_KERNEL);
+    if (!e) {
+        put_task_struct(task);
+        return -ENOMEM;
+    }
+    spin_lock_init(&e->lock);
+    snap_set_task(reg, e, task, pid);
+    e->orig_pid = pid;
+    e->time_ns = ktime_get_real_ns();
+    e->reader = current_uid();
+
+    if (flags & SNAP_F_MEMIMAGE) {
+        err = capture_image(task, pid, e->reader, &e->image);
+        if (err) {
+            pr_err_ratelimited("snapshot_module: memory capture failed for pid %d: %d\n", pid, err);
+            free_snap(e);
+            return err;
+        }
+        snap_log("snapshot_module: captured %lu pages for pid=%d\n", e->image->nr_pages, pid);
+        if (req) {
+            req->image_size = (u64)(e->image->hdr_pages + e->image->nr_pages) << PAGE_SHIFT;
+            req->image_offset = SNAP_IMAGE_OFFSET(pid);
+        }
+    }
+
+    if (flags & SNAP_F_FREEZE) {
+        /* the entry already holds the task ref; SIGSTOP takes it off the CPU */
+        if (!may_signal(task, capable(CAP_KILL))) {
+            free_snap(e);
+            return -EPERM;
+        }
+        err = signal_group(task, SIGSTOP);
+        if (err) {
+            pr_err_ratelimited("snapshot_module: freeze of pid %d failed: %d\n", pid, err);
+            free_snap(e);
+            return err;
+        }
+        e->frozen = true;
+
+        /* a job-control stop: only once it is complete can a SIGCONT from
+         * anyone else be told apart later
+         */
+        err = wait_group_stopped(task, jiffies + msecs_to_jiffies(SNAP_STOP_TIMEOUT_MS));
+        if (err) {
+            pr_err_ratelimited("snapshot_module: pid %d did not stop: %d\n", pid, err);
+            free_snap(e); /* thaws */
+            return err;
+        }
+        e->stop_switches = group_switches(task);
+
+        if (flags & SNAP_F_THREADS) {
+            err = capture_threads(task, &e->threads, &e->nr_threads);
+            if (err) {
+                pr_err_ratelimited("snapshot_module: thread capture failed for pid %d: %d\n", pid, err);
+                free_snap(e); /* thaws */
+                return err;
+            }
+            snap_log("snapshot_module: recorded %u threads for pid=%d\n", e->nr_threads, pid);
+        }
+    }
+
+    /* copy for logging: once published, e may be claimed by another caller */
+    memcpy(comm, e->comm, sizeof(comm));
+    uid = e->uid;
+
+    err = publish_snap(reg, e, pid);
+    if (err) {
+        pr_err_ratelimited("snapshot_module: registry insert failed for pid %d: %d\n", pid, err);
+        free_snap(e);
+        return err;
+    }
+
+    snap_emit(reg, SNAP_EV_SNAPSHOT, pid, 0, flags);
+    snap_log("snapshot_module: recorded snapshot for pid=%d comm=%s uid=%u\n",
+             pid, comm, from_kuid(&init_user_ns, uid));
+
+    return 0;
+}
+
+static long do_snapshot(struct snap_reg *reg, pid_t pid, u32 flags, struct snap_req *req)
+{
+    long ret;
+
+    trace_snapshot_enter(pid, flags);
+    ret = __do_snapshot(reg, pid, flags, req);
+    trace_snapshot_exit(pid, flags, ret);
+    return ret;
+}
+
+/* helper to validate a candidate task for rebind */
+static int validate_user_task(struct task_struct *task)
+{
+    if (!task) return -EINVAL;
+    if (task->flags & PF_KTHREAD) {
+        snap_log_err("snapshot_module: validate: kernel thread\n");
+        return -EINVAL;
+    }
+    if (!task->mm) {
+        snap_log_err("snapshot_module: validate: candidate has no mm\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* restore/rebind:
+ * - if newpid == 0: release stored ref and remove entry
+ * - if newpid != 0: find newpid's task_struct, validate, then replace stored ref with new task
+ */
+static long __do_restore_rebind(struct snap_reg *reg, pid_t oldpid, pid_t newpid)
+{
+    struct snap_entry *e;
+
+    if (newpid == 0) {
+        /* simple release/remove; frozen entries are thawed in place */
+        bool frozen, continued;
+        int gone = 0;
+
+        e = claim_snap(reg, oldpid);
+        if (!e) {
+            snap_log_err("snapshot_module: restore: no snapshot found for old pid %d\n", oldpid);
+            return -EINVAL;
+        }
+        frozen = e->frozen;
+        continued = snap_continued(e);
+        if (frozen) {
+            gone = signal_group(e->task, SIGCONT);
+            e->frozen = false;
+        }
+        free_snap(e);
+        snap_emit(reg, SNAP_EV_RELEASE, oldpid, 0, frozen && !gone ? 1 + continued : 0);
+        if (frozen) {
+            snap_log("snapshot_module: thawed pid=%d%s\n", oldpid,
+                     gone ? " (already exited)" : continued ? " (continued by someone else before)" : "");
+            return gone ? -ESRCH : 0;
+        }
+        snap_log("snapshot_module: removed snapshot entry for pid=%d (restored)\n", oldpid);
+        return 0;
+    } else {
+        struct xarray *oxa = snap_xa(reg, oldpid), *nxa = snap_xa(reg, newpid);
+        struct task_struct *new_task, *old_task;
+        char comm[TASK_COMM_LEN];
+        kuid_t uid;
+        int err;
+
+        new_task = get_task_by_pid(newpid);
+        if (!new_task) {
+            snap_log_err("snapshot_module: rebind: no task for new pid %d\n", newpid);
+            return -EINVAL;
+        }
+
+        /* validate candidate */
+        if (validate_user_task(new_task) < 0) {
+            put_task_struct(new_task);
+            return -EINVAL;
+        }
+
+        /* reserve newpid first: the entry then moves under both shard locks,
+         * is never missing from the registry, and a taken newpid leaves it
+         * untouched at oldpid
+         */
+        err = oldpid > 0 ? xa_insert(nxa, (unsigned long)newpid, NULL, GFP_KERNEL) : -EINVAL;
+        if (err) {
+            snap_log_err("snapshot_module: rebind: new pid %d already registered (%d)\n",
+                         newpid, err);
+            put_task_struct(new_task);
+            return err == -EBUSY ? -EEXIST : err;
+        }
+
+        snap_lock_pair(oxa, nxa);
+        e = xa_load(oxa, (unsigned long)oldpid);
+        if (!e || e->frozen) {
+            snap_unlock_pair(oxa, nxa);
+            xa_release(nxa, (unsigned long)newpid);
+            put_task_struct(new_task);
+            if (!e) {
+                snap_log_err("snapshot_module: restore: no snapshot found for old pid %d\n", oldpid);
+                return -EINVAL;
+            }
+            /* the original process still exists; it can only be thawed */
+            snap_log_err("snapshot_module: rebind: pid %d is frozen in place\n", oldpid);
+            return -EBUSY;
+        }
+        /* the reserved slot needs no allocation */
+        __xa_store(nxa, (unsigned long)newpid, e, GFP_ATOMIC);
+        /* transfer the reference: entry takes new, we drop old once unlocked */
+        old_task = snap_set_task(reg, e, new_task, newpid);
+        __xa_erase(oxa, (unsigned long)oldpid);
+        memcpy(comm, e->comm, sizeof(comm));
+        uid = e->uid;
+        snap_unlock_pair(oxa, nxa);
+
+        if (old_task)
+            put_task_struct(old_task);
+        snap_emit(reg, SNAP_EV_REBIND, oldpid, newpid, 0);
+
+        snap_log("snapshot_module: rebound snapshot oldpid=%d -> newpid=%d comm=%s uid=%u\n",
+                 oldpid, newpid, comm, from_kuid(&init_user_ns, uid));
+
+        return 0;
+    }
+}
+
+static long do_restore_rebind(struct snap_reg *reg, pid_t oldpid, pid_t newpid)
+{
+    long ret;
+
+    trace_snapshot_restore_enter(oldpid, newpid);
+    ret = __do_restore_rebind(reg, oldpid, newpid);
+    trace_snapshot_restore_exit(oldpid, newpid, ret);
+    return ret;
+}
+
+/* batch: copy all items in, run them in order, copy all results out at once */
+static long do_batch(struct snap_reg *reg, struct snap_batch __user *ubatch)
+{
+    struct snap_batch b;
+    struct snap_batch_item *items;
+    long ok = 0;
+    u32 i;
+
+    if (copy_from_user(&b, ubatch, sizeof(b)))
+        return -EFAULT;
+    if (b.flags || b.count == 0 || b.count > SNAP_BATCH_MAX)
+        return -EINVAL;
+
+    items = vmemdup_user(u64_to_user_ptr(b.items), array_size(b.count, sizeof(*items)));
+    if (IS_ERR(items))
+        return PTR_ERR(items);
+
+    for (i = 0; i < b.count; i++) {
+        long r;
+
+        /* a large batch must not hold off the scheduler or a kill; what is
+         * left undone is reported as interrupted
+         */
+        cond_resched();
+        if (fatal_signal_pending(current)) {
+            for (; i < b.count; i++)
+                items[i].result = -EINTR;
+            break;
+        }
+
+        switch (items[i].op) {
+        case SNAP_OP_SNAPSHOT:
+            r = do_snapshot(reg, items[i].pid, 0, NULL);
+            break;
+        case SNAP_OP_RESTORE:
+            r = do_restore_rebind(reg, items[i].pid, items[i].newpid);
+            break;
+        default:
+            r = -EINVAL;
+            break;
+        }
+        items[i].result = (s32)r;
+        if (r == 0)
+            ok++;
+    }
+
+    if (copy_to_user(u64_to_user_ptr(b.items), items, array_size(b.count, sizeof(*items))))
+        ok = -EFAULT;
+    kvfree(items);
+    return ok;
+}
+
+static long do_snapshot_ex(struct snap_reg *reg, struct snap_req __user *ureq)
+{
+    struct snap_req req;
+    long ret;
+    int i;
 
-#define DEVICE_NAME "snapshotctl"
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    for (i = 0; i < ARRAY_SIZE(req.reserved); i++)
+        if (req.reserved[i])
+            return -EINVAL;
+    if (req.flags & ~SNAP_F_ALL)
+        return -EINVAL;
+    if ((req.flags & SNAP_F_THREADS) && !(req.flags & SNAP_F_FREEZE))
+        return -EINVAL; /* registers of a running thread are meaningless */
 
-/* IOCTLs:
- * - IOCTL_SNAPSHOT: arg is pid (passed as integer value)
- * - IOCTL_RESTORE: arg is pointer to struct snap_ioc (oldpid,newpid)
- *   if newpid == 0 => release and remove snapshot entry
- *   if newpid != 0 => attempt to rebind snapshot entry to newpid (transfer ref)
+    req.image_size = 0;
+    req.image_offset = 0;
+    ret = do_snapshot(reg, req.pid, req.flags, &req);
+    if (ret == 0 && copy_to_user(ureq, &req, sizeof(req)))
+        ret = -EFAULT; /* entry stays registered; caller can release it */
+    return ret;
+}
+
+/* copy out the recorded threads of pid's entry. The array is immutable and
+ * RCU-freed, so size it first, then copy under rcu_read_lock(); retry if the
+ * entry was replaced in between.
  */
-struct snap_ioc {
-    pid_t oldpid;
-    pid_t newpid;
-};
+static long do_get_threads(struct snap_reg *reg, struct snap_threads __user *ureq)
+{
+    struct snap_threads req;
+    struct snap_thread *buf = NULL;
+    struct snap_entry *e;
+    u32 total = 0, n = 0;
+    long err;
+    int tries;
 
-#define IOCTL_SNAPSHOT _IOW('s', 1, int)
-#define IOCTL_RESTORE  _IOW('s', 2, struct snap_ioc)
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
 
-MODULE_LICENSE("GPL");
-MODULE_AUTHOR("snapshotter");
-MODULE_DESCRIPTION("Lightweight snapshot registry kernel module (validation & refs)");
+    for (tries = 0; tries < 3; tries++) {
+        rcu_read_lock();
+        e = find_snap(reg, req.pid);
+        total = e ? READ_ONCE(e->nr_threads) : 0;
+        rcu_read_unlock();
+        if (!e)
+            return -ENOENT;
 
-struct snap_entry {
-    pid_t pid;
-    struct task_struct *task; /* held reference */
-    kuid_t uid;
-    char comm[TASK_COMM_LEN];
-};
+        n = min(total, req.count);
+        kvfree(buf);
+        buf = n ? kvmalloc_array(n, sizeof(*buf), GFP_KERNEL) : NULL;
+        if (n && !buf)
+            return -ENOMEM;
 
-#define MAX_SNAPS 64
-static struct snap_entry snaps[MAX_SNAPS];
-static int snaps_count = 0;
+        err = -ENOENT;
+        rcu_read_lock();
+        e = find_snap(reg, req.pid);
+        if (e && e->nr_threads == total) {
+            err = may_access_image(e->reader) ? 0 : -EPERM;
+            if (!err && n)
+                memcpy(buf, e->threads, n * sizeof(*buf));
+        } else if (e) {
+            err = -EAGAIN;
+        }
+        rcu_read_unlock();
+        if (err != -EAGAIN)
+            break;
+    }
+    if (err)
+        goto out;
 
-static int major = 0;
+    req.count = total;
+    if ((n && copy_to_user(u64_to_user_ptr(req.threads), buf, n * sizeof(*buf))) ||
+        copy_to_user(ureq, &req, sizeof(req)))
+        err = -EFAULT;
+out:
+    kvfree(buf);
+    return err;
+}
 
-/* find snapshot index for pid */
-static int find_snap(pid_t pid)
+/* describe e for userspace; caller holds rcu_read_lock() */
+static void fill_info(struct snap_entry *e, struct snap_info *info)
 {
-    int i;
-    for (i = 0; i < snaps_count; i++) {
-        if (snaps[i].pid == pid)
-            return i;
+    memset(info, 0, sizeof(*info));
+
+    spin_lock(&e->lock);
+    info->pid = e->pid;
+    info->uid = from_kuid_munged(current_user_ns(), e->uid);
+    memcpy(info->comm, e->comm, min(sizeof(info->comm), sizeof(e->comm)));
+    if (e->image) {
+        info->state |= SNAP_STATE_IMAGE;
+        info->image_size = (u64)(e->image->hdr_pages + e->image->nr_pages) << PAGE_SHIFT;
     }
-    return -1;
+    spin_unlock(&e->lock);
+
+    /* set before publish and never changed while published */
+    info->orig_pid = e->orig_pid;
+    info->time_ns = e->time_ns;
+    info->nr_threads = e->nr_threads;
+    if (e->frozen)
+        info->state |= SNAP_STATE_FROZEN;
+    if (snap_continued(e))
+        info->state |= SNAP_STATE_CONTINUED;
+    if (e->nr_threads)
+        info->state |= SNAP_STATE_THREADS;
+    if (info->pid != info->orig_pid)
+        info->state |= SNAP_STATE_REBOUND;
 }
 
-/* take snapshot: validate task exists and is user process; keep task ref */
-static long do_snapshot(pid_t pid)
+/* copy out the snap_info of pid's entry */
+static long query_snap(struct snap_reg *reg, pid_t pid, struct snap_info __user *uinfo)
 {
-    struct pid *pid_struct;
-    struct task_struct *task;
+    struct snap_info info;
+    struct snap_entry *e;
 
-    if (snaps_count >= MAX_SNAPS) {
-        pr_err("snapshot_module: snapshot table full\n");
-        return -ENOMEM;
-    }
+    rcu_read_lock();
+    e = find_snap(reg, pid);
+    if (e)
+        fill_info(e, &info);
+    rcu_read_unlock();
+    if (!e)
+        return -ENOENT;
 
-    pid_struct = find_get_pid(pid);
-    if (!pid_struct) {
-        pr_err("snapshot_module: find_get_pid failed for %d\n", pid);
-        return -EINVAL;
-    }
+    if (copy_to_user(uinfo, &info, sizeof(info)))
+        return -EFAULT;
+    return 0;
+}
 
-    task = pid_task(pid_struct, PIDTYPE_PID);
-    put_pid(pid_struct);
+static long do_query(struct snap_reg *reg, struct snap_info __user *uinfo)
+{
+    pid_t pid;
 
-    if (!task) {
-        pr_err("snapshot_module: pid_task returned NULL for %d\n", pid);
-        return -EINVAL;
-    }
+    if (get_user(pid, &uinfo->pid))
+        return -EFAULT;
+    return query_snap(reg, pid, uinfo);
+}
 
-    /* reject kernel threads */
-    if (task->flags & PF_KTHREAD) {
-        pr_err("snapshot_module: pid %d is kernel thread, cannot snapshot\n", pid);
+/* read: packed struct snap_info records. *ppos is a cursor, (shard << 32) |
+ * next pid within the shard, so a listing resumes where the last read stopped.
+ */
+static ssize_t snapshot_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct snap_reg *reg = READ_ONCE(snap_file(file)->reg);
+    unsigned int nr_shards = 1U << reg->shard_bits;
+    unsigned int shard = (u64)*ppos >> 32;
+    unsigned long idx = (u64)*ppos & U32_MAX;
+    size_t max = min_t(size_t, count, SNAP_READ_MAX) / sizeof(struct snap_info);
+    struct snap_info *out;
+    struct snap_entry *e;
+    size_t n = 0;
+
+    if (*ppos < 0)
+        return -EINVAL;
+    if (shard >= nr_shards)
+        return 0;
+    if (!max)
         return -EINVAL;
+
+    out = kvmalloc_array(max, sizeof(*out), GFP_KERNEL);
+    if (!out)
+        return -ENOMEM;
+
+    rcu_read_lock();
+    while (shard < nr_shards && n < max) {
+        e = xa_find(&reg->shards[shard].xa, &idx, ULONG_MAX, XA_PRESENT);
+        if (!e) {
+            shard++;
+            idx = 0;
+            continue;
+        }
+        fill_info(e, &out[n++]);
+        idx++;
     }
+    rcu_read_unlock();
 
-    /* require a user mm (user-space process) */
-    if (!task->mm) {
-        pr_err("snapshot_module: pid %d has no mm_struct (likely short-lived or kernel thread)\n", pid);
-        return -EINVAL;
+    if (n && copy_to_user(buf, out, n * sizeof(*out))) {
+        kvfree(out);
+        return -EFAULT;
     }
+    kvfree(out);
+    *ppos = ((loff_t)shard << 32) | idx;
+    return n * sizeof(struct snap_info);
+}
 
-    /* increase task refcount and store */
-    get_task_struct(task);
+struct tree_proc {
+    struct task_struct *task;   /* held reference */
+    pid_t pid, ppid;
+    bool stopped;               /* already job-stopped before we stopped it: an abort leaves it so */
+};
 
-    snaps[snaps_count].pid = pid;
-    snaps[snaps_count].task = task;
-    snaps[snaps_count].uid = task->cred->uid;
-    get_task_comm(snaps[snaps_count].comm, task);
-    snaps_count++;
+/* task's group is in a completed job-control stop (^Z, SIGSTOP); task is
+ * referenced, which keeps its signal_struct
+ */
+static bool group_stopped(struct task_struct *task)
+{
+    return pid_alive(task) && (READ_ONCE(task->signal->flags) & SIGNAL_STOP_STOPPED);
+}
 
-    pr_info("snapshot_module: recorded snapshot for pid=%d comm=%s uid=%u\n",
-            pid, snaps[snaps_count-1].comm, from_kuid(&init_user_ns, snaps[snaps_count-1].uid));
+/* the tasks of a tree so far: an open-addressing set of 1 << bits slots,
+ * sized at least twice the tree's limit so it never fills
+ */
+struct tree_seen {
+    struct task_struct **slot;
+    unsigned int bits;
+};
 
-    return 0;
+/* add task; false if it was already there */
+static bool tree_seen_add(struct tree_seen *seen, struct task_struct *task)
+{
+    u32 mask = (1U << seen->bits) - 1, i;
+
+    for (i = hash_ptr(task, seen->bits); seen->slot[i]; i = (i + 1) & mask)
+        if (seen->slot[i] == task)
+            return false;
+    seen->slot[i] = task;
+    return true;
 }
 
-/* helper to validate a candidate task for rebind */
-static int validate_user_task(struct task_struct *task)
+/* one pass over the descendants of procs[0] under tasklist_lock: take a
+ * reference on every process not seen yet, then stop the new ones once the
+ * lock is dropped. Holding the lock keeps the children lists stable; a fork
+ * that completes after the pass is found by the next one. Returns how many
+ * were added or -errno.
+ */
+static int tree_pass(struct tree_proc *procs, u32 *nr, u32 max, struct tree_seen *seen, bool cap_kill)
 {
-    if (!task) return -EINVAL;
-    if (task->flags & PF_KTHREAD) {
-        pr_err("snapshot_module: validate: kernel thread\n");
-        return -EINVAL;
-    }
-    if (!task->mm) {
-        pr_err("snapshot_module: validate: candidate has no mm\n");
-        return -EINVAL;
+    u32 first = *nr, i;
+    int err = 0;
+
+    read_lock(&tasklist_lock);
+    for (i = 0; i < *nr && !err; i++) {   /* procs[] grows while we walk it */
+        struct task_struct *t, *c;
+
+        for_each_thread(procs[i].task, t) {
+            list_for_each_entry(c, &t->children, sibling) {
+                if (c->exit_state || (c->flags & PF_KTHREAD) || !tree_seen_add(seen, c))
+                    continue;
+                if (*nr == max) {
+                    err = -ENOSPC;
+                    break;
+                }
+                if (!may_signal(c, cap_kill)) {
+                    err = -EPERM;
+                    break;
+                }
+                get_task_struct(c);
+                procs[*nr].task = c;
+                procs[*nr].pid = task_tgid_vnr(c);
+                procs[*nr].ppid = procs[i].pid;
+                procs[*nr].stopped = group_stopped(c);
+                (*nr)++;
+            }
+            if (err)
+                break;
+        }
     }
-    return 0;
+    read_unlock(&tasklist_lock);
+
+    /* even on error: the caller thaws everything it holds */
+    for (i = first; i < *nr; i++)
+        signal_group(procs[i].task, SIGSTOP);
+    return err ? err : *nr - first;
 }
 
-/* restore/rebind:
- * - if newpid == 0: release stored ref and remove entry
- * - if newpid != 0: find newpid's task_struct, validate, then replace stored ref with new task
+/* stop pid's whole tree, record every process, then signal all of them.
+ * Recording happens with the tree stopped and referenced, so no pid can be
+ * reused between the snapshot and the kill.
  */
-static long do_restore_rebind(pid_t oldpid, pid_t newpid)
+static long do_snapshot_tree(struct snap_reg *reg, struct snap_tree __user *utree)
 {
-    int idx = find_snap(oldpid);
-    if (idx < 0) {
-        pr_err("snapshot_module: restore: no snapshot found for old pid %d\n", oldpid);
+    struct snap_tree_item *items = NULL;
+    struct tree_proc *procs;
+    struct tree_seen seen;
+    struct snap_tree tr;
+    bool cap_kill = capable(CAP_KILL);
+    unsigned long deadline;
+    int sig, child_sig, pass, added;
+    long ok = 0, err = 0;
+    u32 nr = 0, max, i;
+
+    if (copy_from_user(&tr, utree, sizeof(tr)))
+        return -EFAULT;
+    if (tr.flags || tr.pad || tr.count == 0 || tr.count > SNAP_TREE_MAX)
+        return -EINVAL;
+    sig = tr.sig ? tr.sig : SIGKILL;
+    child_sig = tr.child_sig ? tr.child_sig : SIGKILL;
+    if (!valid_signal(sig) || !valid_signal(child_sig))
         return -EINVAL;
+    max = tr.count;
+
+    procs = kvcalloc(max, sizeof(*procs), GFP_KERNEL);
+    seen.bits = ilog2(roundup_pow_of_two(2 * max + 2));
+    seen.slot = kvcalloc(1UL << seen.bits, sizeof(*seen.slot), GFP_KERNEL);
+    if (!procs || !seen.slot) {
+        kvfree(procs);
+        kvfree(seen.slot);
+        return -ENOMEM;
     }
 
-    if (newpid == 0) {
-        /* simple release/remove */
-        if (snaps[idx].task) {
-            put_task_struct(snaps[idx].task);
-            snaps[idx].task = NULL;
-        }
-        snaps_count--;
-        if (idx < snaps_count)
-            snaps[idx] = snaps[snaps_count];
-        pr_info("snapshot_module: removed snapshot entry for pid=%d (restored)\n", oldpid);
-        return 0;
-    } else {
-        struct pid *pid_struct;
-        struct task_struct *new_task;
+    procs[0].task = get_task_by_pid(tr.pid);
+    if (!procs[0].task) {
+        kvfree(procs);
+        kvfree(seen.slot);
+        return -EINVAL;
+    }
+    nr = 1;
+    tree_seen_add(&seen, procs[0].task);
+    err = validate_user_task(procs[0].task);
+    if (!err && !may_signal(procs[0].task, cap_kill))
+        err = -EPERM;
+    procs[0].stopped = group_stopped(procs[0].task);
+    if (!err)
+        err = signal_group(procs[0].task, SIGSTOP);
+    if (err)
+        goto drop;
+    procs[0].pid = tr.pid;
+    procs[0].ppid = 0;
 
-        pid_struct = find_get_pid(newpid);
-        if (!pid_struct) {
-            pr_err("snapshot_module: rebind: find_get_pid failed for new pid %d\n", newpid);
-            return -EINVAL;
+    /* re-walk until a pass over a fully stopped tree finds nothing new. All
+     * the waiting shares one deadline: past it, stops are not waited for.
+     */
+    deadline = jiffies + msecs_to_jiffies(SNAP_TREE_TIMEOUT_MS);
+    for (pass = 0; pass < SNAP_TREE_PASSES; pass++) {
+        if (fatal_signal_pending(current)) {
+            err = -EINTR;
+            break;
+        }
+        added = tree_pass(procs, &nr, max, &seen, cap_kill);
+        if (added < 0) {
+            err = added;
+            break;
         }
-        new_task = pid_task(pid_struct, PIDTYPE_PID);
-        put_pid(pid_struct);
+        for (i = 0; i < nr && err != -EINTR; i++)
+            err = wait_group_stopped(procs[i].task, deadline); /* exiting ones never stop */
+        if (err == -EINTR)
+            break;
+        err = 0;
+        if (added == 0 && pass > 0)
+            break;
+    }
+    if (!err && pass == SNAP_TREE_PASSES)
+        err = -EAGAIN; /* still growing */
+    if (err)
+        goto thaw;
 
-        if (!new_task) {
-            pr_err("snapshot_module: rebind: pid_task NULL for new pid %d\n", newpid);
-            return -EINVAL;
+    items = kvcalloc(nr, sizeof(*items), GFP_KERNEL);
+    if (!items) {
+        err = -ENOMEM;
+        goto thaw;
+    }
+    for (i = 0; i < nr; i++) {
+        items[i].pid = procs[i].pid;
+        items[i].ppid = procs[i].ppid;
+        items[i].result = (s32)do_snapshot(reg, procs[i].pid, 0, NULL);
+        if (items[i].result == 0)
+            ok++;
+        else if (i == 0) {
+            err = items[0].result; /* nothing to restore the tree from: leave it running */
+            goto thaw;
         }
+    }
 
-        /* validate candidate */
-        if (validate_user_task(new_task) < 0)
-            return -EINVAL;
+    /* stopped tasks still take SIGKILL; anything else needs a SIGCONT to act on it */
+    for (i = 0; i < nr; i++) {
+        int s = i ? child_sig : sig;
 
-        /* attempt to transfer the reference: get new, put old */
-        get_task_struct(new_task); /* take ref on new */
-        if (snaps[idx].task)
-            put_task_struct(snaps[idx].task); /* drop old */
+        signal_group(procs[i].task, s);
+        if (s != SIGKILL)
+            signal_group(procs[i].task, SIGCONT);
+    }
+    snap_log("snapshot_module: tree of pid=%d: %u processes, %ld recorded\n", tr.pid, nr, ok);
+    goto drop;
 
-        snaps[idx].task = new_task;
-        snaps[idx].pid = newpid;
-        snaps[idx].uid = new_task->cred->uid;
-        get_task_comm(snaps[idx].comm, new_task);
+thaw:
+    /* only what we stopped: a process the user had stopped stays stopped */
+    for (i = 0; i < nr; i++)
+        if (!procs[i].stopped)
+            signal_group(procs[i].task, SIGCONT);
+drop:
+    for (i = 0; i < nr; i++)
+        put_task_struct(procs[i].task);
+    kvfree(procs);
+    kvfree(seen.slot);
 
-        pr_info("snapshot_module: rebound snapshot oldpid=%d -> newpid=%d comm=%s uid=%u\n",
-                oldpid, newpid, snaps[idx].comm, from_kuid(&init_user_ns, snaps[idx].uid));
+    tr.count = nr;
+    if (put_user(tr.count, &utree->count))
+        err = err ? err : -EFAULT;
+    if (items && copy_to_user(u64_to_user_ptr(tr.items), items, array_size(nr, sizeof(*items))))
+        err = err ? err : -EFAULT;
+    kvfree(items);
+    return err ? err : ok;
+}
 
-        return 0;
+/* give this open file its own event ring */
+static long do_events_setup(struct file *file, struct snap_ring_setup __user *usetup)
+{
+    struct snap_ring_setup setup;
+    struct snap_ring *r;
+    u32 nr;
+
+    if (copy_from_user(&setup, usetup, sizeof(setup)))
+        return -EFAULT;
+    if (!setup.nr_events || setup.nr_events > SNAP_RING_MAX || setup.pad)
+        return -EINVAL;
+    if (READ_ONCE(snap_file(file)->ring))
+        return -EBUSY;
+
+    nr = roundup_pow_of_two(setup.nr_events);
+    r = kzalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+    r->size = PAGE_ALIGN(PAGE_SIZE + (unsigned long)nr * sizeof(struct snap_event));
+    r->hdr = vmalloc_user(r->size); /* zeroed */
+    if (!r->hdr) {
+        kfree(r);
+        return -ENOMEM;
+    }
+    r->hdr->nr_events = nr;
+    r->hdr->event_offset = PAGE_SIZE;
+    r->ev = (void *)r->hdr + PAGE_SIZE;
+    r->mask = nr - 1;
+    r->owner = snap_file(file);
+    spin_lock_init(&r->lock);
+    init_waitqueue_head(&r->wait);
+
+    if (cmpxchg(&snap_file(file)->ring, NULL, r)) {
+        vfree(r->hdr);
+        kfree(r);
+        return -EBUSY;
     }
+    spin_lock(&snap_rings_lock);
+    list_add_tail_rcu(&r->node, &snap_rings);
+    spin_unlock(&snap_rings_lock);
+
+    setup.nr_events = nr;
+    setup.mmap_size = r->size;
+    setup.mmap_offset = SNAP_RING_OFFSET;
+    if (copy_to_user(usetup, &setup, sizeof(setup)))
+        return -EFAULT; /* the ring stays; its size is in the header page */
+    return 0;
+}
+
+/* switch this file to a private one-shard registry with a quota; calls
+ * already running against the shared registry finish there
+ */
+static long do_session(struct file *file, struct snap_session __user *usess)
+{
+    struct snap_file *sf = snap_file(file);
+    struct snap_session sess;
+    long max;
+
+    if (copy_from_user(&sess, usess, sizeof(sess)))
+        return -EFAULT;
+    if (sess.flags)
+        return -EINVAL;
+
+    /* the quota is only ever set once, by the call that wins it */
+    max = sess.max_entries ? sess.max_entries : SNAP_SESSION_DEFAULT_MAX;
+    if (cmpxchg(&sf->session.max, 0, max))
+        return -EBUSY;
+    smp_store_release(&sf->reg, &sf->session);
+    return 0;
 }
 
 /* ioctl: snapshot uses pid passed directly in arg (integer)
  * restore expects pointer to struct snap_ioc passed from userland
+ * batch expects pointer to struct snap_batch, snapshot_ex pointer to struct snap_req,
+ * get_threads pointer to struct snap_threads, query pointer to struct snap_info,
+ * events pointer to struct snap_ring_setup, snapshot_tree pointer to struct snap_tree,
+ * session pointer to struct snap_session
  */
 static long snapshot_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
+    struct snap_reg *reg = READ_ONCE(snap_file(file)->reg);
     long ret = -EINVAL;
+    u64 t0 = ktime_get_ns(), ns;
+
+    trace_snapshot_ioctl_enter(cmd, arg);
 
     switch (cmd) {
     case IOCTL_SNAPSHOT: {
         pid_t pid = (pid_t)arg;
         pr_debug("snapshot_module: ioctl SNAPSHOT pid=%d\n", pid);
-        ret = do_snapshot(pid);
+        ret = do_snapshot(reg, pid, 0, NULL);
         break;
     }
     case IOCTL_RESTORE: {
         struct snap_ioc ioc;
         if (copy_from_user(&ioc, (void __user *)arg, sizeof(ioc))) {
-            pr_err("snapshot_module: restore: copy_from_user failed\n");
+            snap_log_err("snapshot_module: restore: copy_from_user failed\n");
             ret = -EFAULT;
             break;
         }
         pr_debug("snapshot_module: ioctl RESTORE oldpid=%d newpid=%d\n", ioc.oldpid, ioc.newpid);
-        ret = do_restore_rebind(ioc.oldpid, ioc.newpid);
+        ret = do_restore_rebind(reg, ioc.oldpid, ioc.newpid);
         break;
     }
+    case IOCTL_BATCH:
+        ret = do_batch(reg, (struct snap_batch __user *)arg);
+        break;
+    case IOCTL_SNAPSHOT_EX:
+        ret = do_snapshot_ex(reg, (struct snap_req __user *)arg);
+        break;
+    case IOCTL_GET_THREADS:
+        ret = do_get_threads(reg, (struct snap_threads __user *)arg);
+        break;
+    case IOCTL_QUERY:
+        ret = do_query(reg, (struct snap_info __user *)arg);
+        break;
+    case IOCTL_EVENTS:
+        ret = do_events_setup(file, (struct snap_ring_setup __user *)arg);
+        break;
+    case IOCTL_SNAPSHOT_TREE:
+        ret = do_snapshot_tree(reg, (struct snap_tree __user *)arg);
+        break;
+    case IOCTL_SESSION:
+        ret = do_session(file, (struct snap_session __user *)arg);
+        break;
     default:
-        pr_err("snapshot_module: unknown ioctl cmd=%u\n", cmd);
+        pr_err_ratelimited("snapshot_module: unknown ioctl cmd=%u\n", cmd);
+        ret = -EINVAL;
+        break;
+    }
+
+    ns = ktime_get_ns() - t0;
+    snap_account(cmd, ret, ns);
+    trace_snapshot_ioctl_exit(cmd, ret, ns);
+    return ret;
+}
+
+#ifdef SNAP_URING_CMD
+/* IORING_OP_URING_CMD: the single-entry operations without an ioctl argument
+ * block. Completes inline; anything that may sleep for long is bounced to
+ * io-wq with -EAGAIN when io_uring issues it nonblocking.
+ */
+static int snapshot_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    const struct snap_uring_cmd *ucmd = io_uring_sqe_cmd(ioucmd->sqe);
+    struct snap_reg *reg = READ_ONCE(snap_file(ioucmd->file)->reg);
+    unsigned int cmd = ioucmd->cmd_op;
+    struct snap_uring_cmd c;
+    long ret;
+    u64 t0, ns;
+
+    /* read the command once: the SQE may sit in memory userspace can write */
+    c.pid = READ_ONCE(ucmd->pid);
+    c.flags = READ_ONCE(ucmd->flags);
+    c.info = READ_ONCE(ucmd->info);
+
+    if (cmd == IOCTL_SNAPSHOT_EX && (c.flags & (SNAP_F_FREEZE | SNAP_F_MEMIMAGE)) &&
+        (issue_flags & IO_URING_F_NONBLOCK))
+        return -EAGAIN;
+
+    t0 = ktime_get_ns();
+    trace_snapshot_ioctl_enter(cmd, c.pid);
+
+    switch (cmd) {
+    case IOCTL_SNAPSHOT_EX:
         ret = -EINVAL;
+        if (c.flags & ~SNAP_F_ALL)
+            break;
+        if ((c.flags & SNAP_F_THREADS) && !(c.flags & SNAP_F_FREEZE))
+            break;
+        ret = do_snapshot(reg, c.pid, c.flags, NULL);
+        if (ret == 0 && c.info && query_snap(reg, c.pid, u64_to_user_ptr(c.info)))
+            ret = -EFAULT; /* entry stays registered, as with the ioctl */
+        break;
+    case IOCTL_RESTORE:
+        ret = do_restore_rebind(reg, c.pid, c.newpid);
+        break;
+    case IOCTL_QUERY:
+        ret = c.info ? query_snap(reg, c.pid, u64_to_user_ptr(c.info)) : -EINVAL;
+        break;
+    default:
+        ret = -ENOTTY;
         break;
     }
 
+    ns = ktime_get_ns() - t0;
+    snap_account(cmd, ret, ns);
+    trace_snapshot_ioctl_exit(cmd, ret, ns);
     return ret;
 }
+#endif /* SNAP_URING_CMD */
+
+/* debugfs: <debugfs>/snapshot_module/{stats,latency} */
+static void snap_stats_sum(struct snap_stats *sum)
+{
+    int cpu, i, j;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        const struct snap_stats *st = per_cpu_ptr(&snap_pcpu_stats, cpu);
+
+        for (i = 0; i < SNAP_STAT_OPS; i++) {
+            sum->calls[i] += st->calls[i];
+            for (j = 0; j < SNAP_NR_ERR; j++)
+                sum->errors[i][j] += st->errors[i][j];
+            for (j = 0; j < SNAP_HIST_BUCKETS; j++)
+                sum->hist[i][j] += st->hist[i][j];
+        }
+        for (i = 0; i < SNAP_NR_ERR; i++)
+            for (j = 0; j < SNAP_HIST_BUCKETS; j++)
+                sum->err_hist[i][j] += st->err_hist[i][j];
+    }
+}
+
+static int snap_stats_show(struct seq_file *m, void *v)
+{
+    struct snap_stats *sum = kvmalloc(sizeof(*sum), GFP_KERNEL);
+    int i, j;
+
+    if (!sum)
+        return -ENOMEM;
+    snap_stats_sum(sum);
+
+    seq_printf(m, "entries %ld\n", atomic_long_read(&snap_global.count));
+    for (i = 0; i < SNAP_STAT_OPS; i++) {
+        u64 errs = 0;
+
+        if (!sum->calls[i])
+            continue;
+        for (j = 0; j < SNAP_NR_ERR; j++)
+            errs += sum->errors[i][j];
+        seq_printf(m, "%-14s calls %llu errors %llu", snap_op_names[i], sum->calls[i], errs);
+        for (j = 0; j < SNAP_NR_ERR; j++)
+            if (sum->errors[i][j])
+                seq_printf(m, " %s=%llu", snap_err_names[j], sum->errors[i][j]);
+        seq_putc(m, '\n');
+    }
+    kvfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(snap_stats);
+
+/* one block per op and per failure reason: bucket b counts calls that took
+ * [2^(b-1), 2^b) ns; the last bucket is open-ended
+ */
+static void snap_hist_show(struct seq_file *m, const char *name, const u64 *hist)
+{
+    int b;
+
+    seq_printf(m, "%s:\n", name);
+    for (b = 0; b < SNAP_HIST_BUCKETS; b++) {
+        if (!hist[b])
+            continue;
+        if (b == SNAP_HIST_BUCKETS - 1)
+            seq_printf(m, "  >= %llu ns: %llu\n", 1ULL << (b - 1), hist[b]);
+        else
+            seq_printf(m, "  < %llu ns: %llu\n", 1ULL << b, hist[b]);
+    }
+}
+
+static int snap_latency_show(struct seq_file *m, void *v)
+{
+    struct snap_stats *sum = kvmalloc(sizeof(*sum), GFP_KERNEL);
+    int i;
+
+    if (!sum)
+        return -ENOMEM;
+    snap_stats_sum(sum);
+
+    for (i = 0; i < SNAP_STAT_OPS; i++)
+        if (sum->calls[i])
+            snap_hist_show(m, snap_op_names[i], sum->hist[i]);
+    for (i = 0; i < SNAP_NR_ERR; i++) {
+        char name[32];
+        int b;
+
+        for (b = 0; b < SNAP_HIST_BUCKETS && !sum->err_hist[i][b]; b++)
+            ;
+        if (b == SNAP_HIST_BUCKETS)
+            continue;
+        snprintf(name, sizeof(name), "error %s", snap_err_names[i]);
+        snap_hist_show(m, name, sum->err_hist[i]);
+    }
+    kvfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(snap_latency);
+
+/* registry microbenchmark: publish_snap/find_snap/claim_snap on a scratch
+ * registry sharded like snap_global, so the live table is untouched. pids are
+ * spread out to mimic a real pid space.
+ */
+static void snap_registry_bench(unsigned int n)
+{
+    struct snap_reg reg = {
+        .shard_bits = SNAP_SHARD_BITS,
+        .count = ATOMIC_LONG_INIT(0),
+    };
+    struct snap_entry *e;
+    unsigned int i, misses = 0;
+    u64 t0, t_insert, t_lookup, t_claim;
+
+    reg.shards = kvcalloc(SNAP_SHARDS, sizeof(*reg.shards), GFP_KERNEL);
+    if (!reg.shards)
+        return;
+    for (i = 0; i < SNAP_SHARDS; i++)
+        xa_init(&reg.shards[i].xa);
+
+    t0 = ktime_get_ns();
+    for (i = 0; i < n; i++) {
+        e = kmem_cache_zalloc(snap_cache, GFP_KERNEL);
+        if (!e)
+            break;
+        e->pid = (pid_t)(i * 7 + 300);
+        if (publish_snap(&reg, e, e->pid)) {
+            kmem_cache_free(snap_cache, e);
+            break;
+        }
+    }
+    t_insert = ktime_get_ns() - t0;
+    n = i;
+
+    t0 = ktime_get_ns();
+    rcu_read_lock();
+    for (i = 0; i < n; i++) {
+        if (!find_snap(&reg, (pid_t)((n - 1 - i) * 7 + 300)))
+            misses++;
+    }
+    rcu_read_unlock();
+    t_lookup = ktime_get_ns() - t0;
+
+    /* no task, watch or image and never seen by another reader: free directly */
+    t0 = ktime_get_ns();
+    for (i = 0; i < n; i++) {
+        e = claim_snap(&reg, (pid_t)(i * 7 + 300));
+        if (e)
+            kmem_cache_free(snap_cache, e);
+    }
+    t_claim = ktime_get_ns() - t0;
+
+    for (i = 0; i < SNAP_SHARDS; i++)
+        xa_destroy(&reg.shards[i].xa);
+    kvfree(reg.shards);
+
+    if (!n)
+        return;
+    pr_info("snapshot_module: bench entries=%u insert=%llu ns/op lookup=%llu ns/op claim=%llu ns/op misses=%u\n",
+            n, div_u64(t_insert, n), div_u64(t_lookup, n), div_u64(t_claim, n), misses);
+}
+
+static void snap_image_vm_open(struct vm_area_struct *vma)
+{
+    struct snap_image *img = vma->vm_private_data;
+
+    kref_get(&img->ref);
+}
+
+static void snap_image_vm_close(struct vm_area_struct *vma)
+{
+    put_image(vma->vm_private_data);
+}
+
+static vm_fault_t snap_image_fault(struct vm_fault *vmf)
+{
+    struct snap_image *img = vmf->vma->vm_private_data;
+    unsigned long idx = vmf->pgoff & SNAP_IMAGE_PGOFF_MASK;
+    struct page *page;
+
+    if (idx < img->hdr_pages)
+        page = vmalloc_to_page(img->hdr + (idx << PAGE_SHIFT));
+    else
+        page = xa_load(&img->data, idx - img->hdr_pages);
+    if (!page)
+        return VM_FAULT_SIGBUS;
+
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct snap_image_vm_ops = {
+    .open = snap_image_vm_open,
+    .close = snap_image_vm_close,
+    .fault = snap_image_fault,
+};
+
+/* map this file's event ring; the consumer writes hdr->tail, so it is shared rw */
+static int snapshot_mmap_ring(struct file *file, struct vm_area_struct *vma)
+{
+    struct snap_ring *r = READ_ONCE(snap_file(file)->ring);
+
+    if (!r)
+        return -ENOENT;
+    if (vma->vm_flags & VM_EXEC)
+        return -EPERM;
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > r->size)
+        return -EINVAL;
+    vm_flags_clear(vma, VM_MAYEXEC);
+    return remap_vmalloc_range(vma, r->hdr, 0);
+}
+
+/* mmap the memory image of the entry for pid at SNAP_IMAGE_OFFSET(pid);
+ * the kernel's own pages are mapped, nothing is copied
+ */
+static int snapshot_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    pid_t pid = (pid_t)(vma->vm_pgoff >> SNAP_IMAGE_PGOFF_SHIFT);
+    unsigned long first = vma->vm_pgoff & SNAP_IMAGE_PGOFF_MASK;
+    struct snap_reg *reg = READ_ONCE(snap_file(file)->reg);
+    struct snap_image *img = NULL;
+    struct snap_entry *e;
+
+    if (pid == 0)
+        return snapshot_mmap_ring(file, vma);
+
+    if (vma->vm_flags & (VM_WRITE | VM_EXEC))
+        return -EPERM;
+
+    rcu_read_lock();
+    e = find_snap(reg, pid);
+    if (e) {
+        spin_lock(&e->lock);
+        img = e->image;
+        if (img)
+            kref_get(&img->ref);
+        spin_unlock(&e->lock);
+    }
+    rcu_read_unlock();
+    if (!img)
+        return -ENOENT;
+
+    if (!may_access_image(img->reader) ||
+        first + vma_pages(vma) > img->hdr_pages + img->nr_pages) {
+        int err = may_access_image(img->reader) ? -EINVAL : -EPERM;
+
+        put_image(img);
+        return err;
+    }
+
+    vm_flags_clear(vma, VM_MAYWRITE | VM_MAYEXEC);
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_private_data = img; /* reference moves to the vma */
+    vma->vm_ops = &snap_image_vm_ops;
+    return 0;
+}
 
 static int snapshot_open(struct inode *inode, struct file *file)
 {
+    struct snap_file *sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+
+    if (!sf)
+        return -ENOMEM;
+    sf->reg = &snap_global;
+    xa_init(&sf->session_shard.xa);
+    sf->session.shards = &sf->session_shard;
+    sf->session.shard_bits = 0;
+    atomic_long_set(&sf->session.count, 0);
+    file->private_data = sf;
     return 0;
 }
 
 static int snapshot_release(struct inode *inode, struct file *file)
 {
+    struct snap_file *sf = snap_file(file);
+    struct snap_ring *r = sf->ring;
+    struct snap_entry *e;
+    unsigned long idx;
+
+    /* a private session dies with its file: release (and thaw) what it holds */
+    if (sf->reg == &sf->session) {
+        xa_for_each(&sf->session_shard.xa, idx, e) {
+            if (claim_snap(&sf->session, (pid_t)idx) == e) {
+                snap_emit(&sf->session, SNAP_EV_RELEASE, (pid_t)idx, 0,
+                          e->frozen ? 1 + snap_continued(e) : 0);
+                free_snap(e);
+            }
+        }
+    }
+    xa_destroy(&sf->session_shard.xa);
+
+    if (r) {
+        spin_lock(&snap_rings_lock);
+        list_del_rcu(&r->node);
+        spin_unlock(&snap_rings_lock);
+        synchronize_rcu(); /* no producer still writes into it */
+        vfree(r->hdr);
+        kfree(r);
+    }
+    kfree(sf);
+    return 0;
+}
+
+static __poll_t snapshot_poll(struct file *file, poll_table *wait)
+{
+    struct snap_ring *r = READ_ONCE(snap_file(file)->ring);
+
+    if (!r)
+        return EPOLLERR;
+    poll_wait(file, &r->wait, wait);
+    if (smp_load_acquire(&r->hdr->head) != READ_ONCE(r->hdr->tail))
+        return EPOLLIN | EPOLLRDNORM;
     return 0;
 }
 
@@ -234,19 +2203,41 @@ static const struct file_operations snapshot_fops = {
     .owner = THIS_MODULE,
     .open = snapshot_open,
     .release = snapshot_release,
+    .read = snapshot_read,
+    .llseek = default_llseek,
+    .poll = snapshot_poll,
     .unlocked_ioctl = snapshot_ioctl,
+#ifdef SNAP_URING_CMD
+    .uring_cmd = snapshot_uring_cmd,
+#endif
+    .mmap = snapshot_mmap,
 };
 
 static int __init snapshot_init(void)
 {
+    int i;
+
+    snap_cache = KMEM_CACHE(snap_entry, 0);
+    if (!snap_cache)
+        return -ENOMEM;
+    for (i = 0; i < SNAP_SHARDS; i++)
+        xa_init(&snap_shards[i].xa);
+
+    if (bench_entries)
+        snap_registry_bench(bench_entries);
+
+    /* debugfs is optional: errors here only cost the stats files */
+    snap_debugfs = debugfs_create_dir("snapshot_module", NULL);
+    debugfs_create_file("stats", 0444, snap_debugfs, NULL, &snap_stats_fops);
+    debugfs_create_file("latency", 0444, snap_debugfs, NULL, &snap_latency_fops);
+
     major = register_chrdev(0, DEVICE_NAME, &snapshot_fops);
     if (major < 0) {
         pr_err("snapshot_module: register_chrdev failed: %d\n", major);
+        debugfs_remove_recursive(snap_debugfs);
+        kmem_cache_destroy(snap_cache);
         return major;
     }
-    /* zero table */
-    memset(snaps, 0, sizeof(snaps));
-    snaps_count = 0;
 
     pr_info("snapshot_module: registered device /dev/%s with major %d\n", DEVICE_NAME, major);
     return 0;
@@ -254,13 +2245,20 @@ static int __init snapshot_init(void)
 
 static void __exit snapshot_exit(void)
 {
+    struct snap_entry *e;
+    unsigned long idx;
     int i;
+
+    unregister_chrdev(major, DEVICE_NAME);
+    debugfs_remove_recursive(snap_debugfs);
     /* release any held task refs */
-    for (i = 0; i < snaps_count; i++) {
-        if (snaps[i].task)
-            put_task_struct(snaps[i].task);
+    for (i = 0; i < SNAP_SHARDS; i++) {
+        xa_for_each(&snap_shards[i].xa, idx, e)
+            free_snap(e);
+        xa_destroy(&snap_shards[i].xa);
     }
-    unregister_chrdev(major, DEVICE_NAME);
+    rcu_barrier(); /* wait for snap_free_rcu() before destroying the cache */
+    kmem_cache_destroy(snap_cache);
     pr_info("snapshot_module: unloaded\n");
 }
 
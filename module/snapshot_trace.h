@@ -0,0 +1,110 @@
+// snapshot_trace.h
+// Tracepoints of snapshot_module.c (events/snapshot/ in tracefs). Entry/exit
+// pairs for the ioctl dispatcher and the two registry operations.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM snapshot
+
+#if !defined(_SNAPSHOT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SNAPSHOT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(snapshot_ioctl_enter,
+    TP_PROTO(unsigned int cmd, unsigned long arg),
+    TP_ARGS(cmd, arg),
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(unsigned long, arg)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->arg = arg;
+    ),
+    TP_printk("cmd=%#x arg=%#lx", __entry->cmd, __entry->arg)
+);
+
+TRACE_EVENT(snapshot_ioctl_exit,
+    TP_PROTO(unsigned int cmd, long ret, u64 ns),
+    TP_ARGS(cmd, ret, ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(long, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("cmd=%#x ret=%ld ns=%llu", __entry->cmd, __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(snapshot_enter,
+    TP_PROTO(pid_t pid, u32 flags),
+    TP_ARGS(pid, flags),
+    TP_STRUCT__entry(
+        __field(pid_t, pid)
+        __field(u32, flags)
+    ),
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->flags = flags;
+    ),
+    TP_printk("pid=%d flags=%#x", __entry->pid, __entry->flags)
+);
+
+TRACE_EVENT(snapshot_exit,
+    TP_PROTO(pid_t pid, u32 flags, long ret),
+    TP_ARGS(pid, flags, ret),
+    TP_STRUCT__entry(
+        __field(pid_t, pid)
+        __field(u32, flags)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->flags = flags;
+        __entry->ret = ret;
+    ),
+    TP_printk("pid=%d flags=%#x ret=%ld", __entry->pid, __entry->flags, __entry->ret)
+);
+
+TRACE_EVENT(snapshot_restore_enter,
+    TP_PROTO(pid_t oldpid, pid_t newpid),
+    TP_ARGS(oldpid, newpid),
+    TP_STRUCT__entry(
+        __field(pid_t, oldpid)
+        __field(pid_t, newpid)
+    ),
+    TP_fast_assign(
+        __entry->oldpid = oldpid;
+        __entry->newpid = newpid;
+    ),
+    TP_printk("oldpid=%d newpid=%d", __entry->oldpid, __entry->newpid)
+);
+
+TRACE_EVENT(snapshot_restore_exit,
+    TP_PROTO(pid_t oldpid, pid_t newpid, long ret),
+    TP_ARGS(oldpid, newpid, ret),
+    TP_STRUCT__entry(
+        __field(pid_t, oldpid)
+        __field(pid_t, newpid)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->oldpid = oldpid;
+        __entry->newpid = newpid;
+        __entry->ret = ret;
+    ),
+    TP_printk("oldpid=%d newpid=%d ret=%ld", __entry->oldpid, __entry->newpid, __entry->ret)
+);
+
+#endif /* _SNAPSHOT_TRACE_H */
+
+/* this header lives next to the module source, not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE snapshot_trace
+#include <trace/define_trace.h>
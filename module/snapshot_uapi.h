@@ -0,0 +1,278 @@
+// snapshot_uapi.h
+// ioctl ABI of /dev/snapshotctl, shared by snapshot_module.c and the userspace tools
+// (user/cli.c, user/ioctl_stress.c, Server/snapshot_user.c).
+
+#ifndef SNAPSHOT_UAPI_H
+#define SNAPSHOT_UAPI_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#endif
+
+/* IOCTLs:
+ * - IOCTL_SNAPSHOT: arg is pid (passed as integer value)
+ * - IOCTL_RESTORE: arg is pointer to struct snap_ioc (oldpid,newpid)
+ *   if newpid == 0 => release and remove snapshot entry
+ *   if newpid != 0 => attempt to rebind snapshot entry to newpid (transfer ref)
+ * - IOCTL_BATCH: arg is pointer to struct snap_batch; runs every item in
+ *   order and writes each item's result back in a single copy. Returns the
+ *   number of items that succeeded. Items not run because the caller got a
+ *   fatal signal report -EINTR.
+ * - IOCTL_SNAPSHOT_EX: arg is pointer to struct snap_req; like IOCTL_SNAPSHOT
+ *   but takes SNAP_F_* flags and reports what was captured.
+ * - IOCTL_GET_THREADS: arg is pointer to struct snap_threads; copies out the
+ *   per-thread state recorded with SNAP_F_THREADS.
+ * - IOCTL_QUERY: arg is pointer to struct snap_info with pid set; fills in
+ *   the rest for that entry, -ENOENT if there is none.
+ *
+ * - IOCTL_SNAPSHOT_TREE: arg is pointer to struct snap_tree; stops pid and all
+ *   of its descendants, records each in the registry, then signals them all.
+ *   A fork racing with the walk cannot escape: the tree is re-walked until
+ *   no new process appears. Returns the number of processes recorded;
+ *   -ENOSPC (nothing signalled, count = processes found so far) if items[]
+ *   is too small. On any failure the processes it stopped are continued;
+ *   ones that were already job-stopped before the call stay stopped.
+ * - IOCTL_SESSION: arg is pointer to struct snap_session; moves this open file
+ *   from the shared registry to a private one with its own entry quota.
+ *   Every other call on the file then only sees the session's entries, and
+ *   they are all released (frozen ones thawed) when the file is closed.
+ *   Entries recorded in the shared registry before the switch stay there.
+ *   -EBUSY if the file already has a session.
+ * - IOCTL_EVENTS: arg is pointer to struct snap_ring_setup; gives this open
+ *   file its own event ring (once per file), mmap it at SNAP_RING_OFFSET.
+ *   The ring gets the events of the registry the file works on: the shared
+ *   one, or after IOCTL_SESSION only the session's.
+ *
+ * io_uring: IORING_OP_URING_CMD on /dev/snapshotctl with cmd_op
+ * IOCTL_SNAPSHOT_EX, IOCTL_RESTORE or IOCTL_QUERY and a struct snap_uring_cmd
+ * in sqe->cmd runs the same operation against the file's registry, the
+ * result (0 or -errno) arrives in cqe->res. Snapshots that have to wait
+ * (SNAP_F_FREEZE, SNAP_F_MEMIMAGE) complete from io_uring's worker threads;
+ * everything else completes inline at submission. Needs a 6.5 or later
+ * kernel; on older ones the command fails with -EOPNOTSUPP.
+ *
+ * Event ring: struct snap_ring_hdr in the first page, hdr.nr_events struct
+ * snap_event at hdr.event_offset. The kernel advances head (store-release)
+ * and never overwrites unconsumed events: when the ring is full new events
+ * are dropped and counted in lost. The consumer reads events[tail & (nr - 1)]
+ * until tail == head and then stores tail. poll()/epoll report EPOLLIN while
+ * head != tail; a file without a ring polls as EPOLLERR.
+ *
+ * read: returns the registry as a packed array of struct snap_info, only
+ * whole records, up to 1 MiB per call; 0 at the end. The file position is an
+ * opaque cursor that successive read()s advance; lseek(fd, 0, SEEK_SET)
+ * starts a fresh listing.
+ *
+ * With SNAP_F_FREEZE the target is not expected to be killed: the module
+ * stops the whole thread group in place and keeps its task reference.
+ * IOCTL_RESTORE(pid, 0) on such an entry thaws the same process instead of
+ * just releasing the entry; rebinding a frozen entry is rejected. The freeze
+ * is a job-control stop: the ioctl returns once the whole group has stopped
+ * (-ETIMEDOUT and thawed if it does not), and a SIGCONT from anyone else
+ * still resumes it. Such an entry reports SNAP_STATE_CONTINUED from then on.
+ * SNAP_F_THREADS (only together with SNAP_F_FREEZE) waits until every thread
+ * has stopped and records its user registers, blocked signal mask and TLS
+ * base. FPU/SIMD state is not recorded: it stays with the stopped threads and
+ * is intact when they are thawed.
+ *
+ * mmap: with SNAP_F_MEMIMAGE the entry keeps a read-only memory image that
+ * can be mapped from /dev/snapshotctl at SNAP_IMAGE_OFFSET(pid). The mapping
+ * starts with struct snap_image_hdr, followed by hdr.nr_runs struct
+ * snap_image_run, then the page data at hdr.data_offset.
+ */
+struct snap_ioc {
+    pid_t oldpid;
+    pid_t newpid;
+};
+
+/* snap_batch_item.op */
+#define SNAP_OP_SNAPSHOT 1 /* snapshot pid */
+#define SNAP_OP_RESTORE  2 /* restore pid -> newpid (0 = release) */
+
+#define SNAP_BATCH_MAX 4096
+
+struct snap_batch_item {
+    __u32 op;
+    __s32 pid;
+    __s32 newpid;
+    __s32 result; /* out: 0 or -errno */
+};
+
+struct snap_batch {
+    __u32 count;  /* number of items, 1..SNAP_BATCH_MAX */
+    __u32 flags;  /* must be 0 */
+    __u64 items;  /* user pointer to struct snap_batch_item[count] */
+};
+
+/* snap_req.flags */
+#define SNAP_F_MEMIMAGE 0x1 /* capture populated anonymous pages into a kernel image */
+#define SNAP_F_FREEZE   0x2 /* stop the thread group in place; restore thaws it */
+#define SNAP_F_THREADS  0x4 /* with SNAP_F_FREEZE: record per-thread registers */
+#define SNAP_F_ALL      (SNAP_F_MEMIMAGE | SNAP_F_FREEZE | SNAP_F_THREADS)
+
+struct snap_req {
+    __s32 pid;
+    __u32 flags;        /* SNAP_F_* */
+    __u64 image_size;   /* out: bytes mappable at image_offset, 0 without image */
+    __u64 image_offset; /* out: mmap offset of the image */
+    __u64 reserved[4];  /* must be 0 */
+};
+
+#define SNAP_IMAGE_SHIFT 40 /* up to 1 TiB per image */
+#define SNAP_IMAGE_OFFSET(pid) ((__u64)(pid) << SNAP_IMAGE_SHIFT)
+#define SNAP_IMAGE_MAGIC 0x31474d4950414e53ULL /* "SNAPIMG1" */
+#define SNAP_IMAGE_VERSION 1
+
+struct snap_image_hdr {
+    __u64 magic;
+    __u32 version;
+    __s32 pid;          /* pid at capture time */
+    __u64 nr_runs;
+    __u64 nr_pages;     /* data pages */
+    __u64 data_offset;  /* byte offset of data page 0 within the mapping */
+    __u64 page_size;
+};
+
+/* a run of contiguous captured pages in the target's address space */
+struct snap_image_run {
+    __u64 vaddr;
+    __u64 nr_pages;
+    __u64 data_page;    /* index of the run's first page in the data area */
+    __u32 prot;         /* PROT_READ/WRITE/EXEC of the source VMA */
+    __u32 pad;
+};
+
+#define SNAP_TREE_MAX 4096
+
+struct snap_tree_item {
+    __s32 pid;
+    __s32 ppid;         /* parent within the tree, 0 for the root */
+    __s32 result;       /* 0 or -errno from recording it */
+    __u32 pad;
+};
+
+struct snap_tree {
+    __s32 pid;          /* root of the tree */
+    __s32 sig;          /* sent to the root, 0 = SIGKILL */
+    __s32 child_sig;    /* sent to every descendant, 0 = SIGKILL */
+    __u32 flags;        /* must be 0 */
+    __u32 count;        /* in: capacity of items[], out: processes in the tree */
+    __u32 pad;
+    __u64 items;        /* user pointer to struct snap_tree_item[count], root first */
+};
+
+/* sqe->cmd of IORING_OP_URING_CMD, fits a plain 64-byte SQE */
+struct snap_uring_cmd {
+    __s32 pid;
+    union {
+        __u32 flags;    /* IOCTL_SNAPSHOT_EX: SNAP_F_* */
+        __s32 newpid;   /* IOCTL_RESTORE: 0 = release */
+    };
+    __u64 info;         /* IOCTL_QUERY: user pointer to struct snap_info;
+                           IOCTL_SNAPSHOT_EX: optional, filled on success */
+};
+
+#define SNAP_SESSION_DEFAULT_MAX 1024
+
+struct snap_session {
+    __u32 max_entries;  /* quota, 0 = SNAP_SESSION_DEFAULT_MAX; over it -EDQUOT */
+    __u32 flags;        /* must be 0 */
+};
+
+/* snap_event.type */
+#define SNAP_EV_SNAPSHOT 1 /* pid snapshotted, arg = SNAP_F_* flags */
+#define SNAP_EV_REBIND   2 /* pid rebound to newpid */
+#define SNAP_EV_RELEASE  3 /* pid's entry released, arg = 1 if it was thawed,
+                              2 if something else had continued it already */
+#define SNAP_EV_EXIT     4 /* the task of pid's entry exited, arg = wait status */
+
+struct snap_event {
+    __u64 seq;          /* global event number, gaps = events before setup */
+    __u64 time_ns;      /* CLOCK_MONOTONIC */
+    __u32 type;         /* SNAP_EV_* */
+    __s32 pid;          /* registry key the event is about */
+    __s32 newpid;       /* SNAP_EV_REBIND only */
+    __s32 arg;
+};
+
+#define SNAP_RING_OFFSET 0ULL /* pid 0 never has an image */
+#define SNAP_RING_MAX    (1U << 16)
+
+struct snap_ring_hdr {
+    __u64 head;         /* kernel: events produced */
+    __u64 tail;         /* consumer: events consumed */
+    __u64 lost;         /* kernel: events dropped while full */
+    __u32 nr_events;    /* power of two */
+    __u32 event_offset; /* byte offset of the event array in the mapping */
+};
+
+struct snap_ring_setup {
+    __u32 nr_events;    /* in: capacity, rounded up to a power of two; out: actual */
+    __u32 pad;
+    __u64 mmap_size;    /* out */
+    __u64 mmap_offset;  /* out: SNAP_RING_OFFSET */
+};
+
+/* snap_info.state */
+#define SNAP_STATE_FROZEN  0x1 /* stopped in place, restore thaws */
+#define SNAP_STATE_IMAGE   0x2 /* holds a memory image */
+#define SNAP_STATE_THREADS 0x4 /* holds per-thread state */
+#define SNAP_STATE_REBOUND 0x8 /* pid != orig_pid */
+#define SNAP_STATE_CONTINUED 0x10 /* frozen, but continued by someone else since */
+
+#define SNAP_COMM_LEN 16
+
+struct snap_info {
+    __s32 pid;          /* current registry key */
+    __s32 orig_pid;     /* pid at snapshot time */
+    __u32 uid;          /* in the reader's user namespace */
+    __u32 state;        /* SNAP_STATE_* */
+    __u64 time_ns;      /* CLOCK_REALTIME of the snapshot */
+    __u64 image_size;   /* bytes mappable at SNAP_IMAGE_OFFSET(pid), 0 if none */
+    __u32 nr_threads;
+    __u32 pad;
+    char comm[SNAP_COMM_LEN];
+};
+
+/* snap_thread.flags */
+#define SNAP_THREAD_LEADER 0x1 /* thread-group leader */
+
+#define SNAP_THREAD_NREGS 34
+#define SNAP_THREADS_MAX  65536
+
+/* one stopped thread; regs is a prefix of the arch's struct pt_regs
+ * (x86_64: all of it, arm64: struct user_pt_regs)
+ */
+struct snap_thread {
+    __s32 tid;
+    __u32 flags;        /* SNAP_THREAD_* */
+    __u64 sigmask;      /* blocked signals, bit n-1 = signal n */
+    __u64 tls;          /* x86_64: fs base, arm64: tpidr_el0 */
+    __u64 tls2;         /* x86_64: gs base, 0 elsewhere */
+    __u32 nr_regs;      /* valid words in regs */
+    __u32 pad;
+    __u64 regs[SNAP_THREAD_NREGS];
+};
+
+struct snap_threads {
+    __s32 pid;
+    __u32 count;        /* in: capacity of threads[], out: threads recorded */
+    __u64 threads;      /* user pointer to struct snap_thread[count] */
+};
+
+#define IOCTL_SNAPSHOT _IOW('s', 1, int)
+#define IOCTL_RESTORE  _IOW('s', 2, struct snap_ioc)
+#define IOCTL_BATCH    _IOWR('s', 3, struct snap_batch)
+#define IOCTL_SNAPSHOT_EX _IOWR('s', 4, struct snap_req)
+#define IOCTL_GET_THREADS _IOWR('s', 5, struct snap_threads)
+#define IOCTL_QUERY    _IOWR('s', 6, struct snap_info)
+#define IOCTL_EVENTS   _IOWR('s', 7, struct snap_ring_setup)
+#define IOCTL_SNAPSHOT_TREE _IOWR('s', 8, struct snap_tree)
+#define IOCTL_SESSION  _IOW('s', 9, struct snap_session)
+
+#endif /* SNAPSHOT_UAPI_H */
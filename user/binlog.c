@@ -0,0 +1,429 @@
+// ==== user/binlog.c ====
+// Binary event log, see binlog.h.
+// The ring is a bounded queue in Vyukov's style used with a single consumer:
+// a producer claims slot head with one compare-and-swap when the slot's
+// sequence says it is free, fills it and publishes it with a release store of
+// the sequence. The flusher (or binlog_close()) drains published slots in
+// order and hands each batch to one write(). The ring is allocated once and
+// never freed, so a producer that saw the log active just before
+// binlog_close() still writes into valid memory; a reopen picks its record up.
+// A new file is written to a
+// temporary name with its header and link()ed into place, so a reader or a
+// second writer never sees a log without a header.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "binlog.h"
+
+#define MASK (BINLOG_RING - 1)
+#define BATCH 512 /* records per write() */
+
+typedef struct
+{
+	_Atomic uint64_t seq; /* pos: free for the producer of pos; pos + 1: published */
+	BinlogRec rec;
+} Slot;
+
+static struct
+{
+	Slot *ring;
+	_Atomic uint64_t head; /* next position to claim */
+	_Atomic uint64_t tail; /* next position to drain */
+	_Atomic uint64_t dropped;
+	_Atomic uint32_t flags;
+	_Atomic int active;
+	_Atomic int stopping;
+	_Atomic int kicked; /* flusher woken early and not yet run */
+	int fd;	  /* the log, O_APPEND */
+	int wake; /* eventfd kicking the flusher */
+	int src;
+	pid_t writer;
+	int running; /* flusher thread started */
+	pthread_t flusher;
+	pthread_mutex_t drain_mu; /* one consumer at a time */
+} lg = {.fd = -1, .wake = -1, .drain_mu = PTHREAD_MUTEX_INITIALIZER};
+
+static const struct
+{
+	const char *name, *pid2, *aux;
+} ops[BINLOG_OP_MAX + 1] = {
+	[BINLOG_OP_SNAPSHOT] = {"snapshot", NULL, "mode"},
+	[BINLOG_OP_SNAPSHOT_TREE] = {"snapshot-tree", NULL, "procs"},
+	[BINLOG_OP_SNAPSHOT_MEM] = {"snapshot-mem", NULL, "kib"},
+	[BINLOG_OP_FREEZE] = {"freeze", NULL, "threads"},
+	[BINLOG_OP_RESTORE] = {"restore", "new", NULL},
+	[BINLOG_OP_BATCH] = {"batch", NULL, "ok"},
+	[BINLOG_OP_SPAWN] = {"spawn", "old", "stage"},
+	[BINLOG_OP_ATTACH] = {"attach", "old", "attached"},
+	[BINLOG_OP_IMAGE] = {"image", NULL, "mib"},
+	[BINLOG_OP_REAP] = {"reap", NULL, "killed"},
+	[BINLOG_OP_CATALOG] = {"catalog", NULL, NULL},
+	[BINLOG_OP_LIST] = {"list", NULL, "entries"},
+	[BINLOG_OP_QUERY] = {"query", NULL, NULL},
+	[BINLOG_OP_EVENTS] = {"events", NULL, "nr"},
+	[BINLOG_OP_THREADS] = {"threads", NULL, "threads"},
+	[BINLOG_OP_OPEN] = {"open", NULL, NULL},
+	[BINLOG_OP_USAGE] = {"usage", NULL, NULL},
+	[BINLOG_OP_DROPPED] = {"dropped", NULL, "records"},
+	[BINLOG_OP_ATTRS] = {"attrs", "old", "failed"},
+};
+
+const char *binlog_default_path(void)
+{
+	const char *p = getenv("SNAPSHOT_LOG");
+	return p && *p ? p : BINLOG_DEFAULT_PATH;
+}
+
+const char *binlog_op_name(int op)
+{
+	return op > 0 && op <= BINLOG_OP_MAX && ops[op].name ? ops[op].name : "?";
+}
+
+static void kick(void)
+{
+	uint64_t one = 1;
+	if (lg.wake < 0 || atomic_exchange_explicit(&lg.kicked, 1, memory_order_relaxed))
+		return;
+	ssize_t r = write(lg.wake, &one, sizeof(one));
+	(void)r; /* EAGAIN only if the counter is saturated: the flusher is woken anyway */
+}
+
+void binlog_put(int op, pid_t pid, pid_t pid2, int err, double ms, uint32_t aux)
+{
+	if (!atomic_load_explicit(&lg.active, memory_order_acquire))
+		return;
+
+	uint64_t pos = atomic_load_explicit(&lg.head, memory_order_relaxed);
+	Slot *s;
+	for (;;)
+	{
+		s = &lg.ring[pos & MASK];
+		uint64_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		int64_t d = (int64_t)(seq - pos);
+		if (d == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&lg.head, &pos, pos + 1, memory_order_relaxed,
+													  memory_order_relaxed))
+				break;
+		}
+		else if (d < 0)
+		{
+			/* a full ring wrap ahead of the flusher */
+			atomic_fetch_add_explicit(&lg.dropped, 1, memory_order_relaxed);
+			kick();
+			return;
+		}
+		else
+			pos = atomic_load_explicit(&lg.head, memory_order_relaxed);
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts); /* vDSO */
+	s->rec = (BinlogRec){
+		.time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec,
+		.dur_us = ms > 0 ? (uint32_t)(ms * 1e3) : 0,
+		.op = (uint16_t)op,
+		.src = (uint16_t)lg.src,
+		.writer = lg.writer,
+		.pid = pid,
+		.pid2 = pid2,
+		.err = err,
+		.aux = aux,
+		.flags = atomic_load_explicit(&lg.flags, memory_order_relaxed),
+	};
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+
+	if (pos - atomic_load_explicit(&lg.tail, memory_order_relaxed) >= BINLOG_RING * 3 / 4)
+		kick();
+}
+
+void binlog_set_flags(uint32_t flags)
+{
+	atomic_store_explicit(&lg.flags, flags, memory_order_relaxed);
+}
+
+static void write_batch(const BinlogRec *r, int n)
+{
+	const char *p = (const char *)r;
+	size_t left = (size_t)n * sizeof(*r);
+	while (left > 0)
+	{
+		ssize_t w = write(lg.fd, p, left);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return; /* disk full or the like: nothing better to do with a log */
+		p += w;
+		left -= (size_t)w;
+	}
+}
+
+/* move every published record to the file */
+static void drain(void)
+{
+	static BinlogRec buf[BATCH];
+	int n = 0;
+
+	pthread_mutex_lock(&lg.drain_mu);
+	uint64_t tail = atomic_load_explicit(&lg.tail, memory_order_relaxed);
+	uint64_t dropped = atomic_exchange_explicit(&lg.dropped, 0, memory_order_relaxed);
+	if (dropped)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		buf[n++] = (BinlogRec){.time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec,
+							   .op = BINLOG_OP_DROPPED,
+							   .src = (uint16_t)lg.src,
+							   .writer = lg.writer,
+							   .aux = (uint32_t)dropped};
+	}
+	for (;;)
+	{
+		Slot *s = &lg.ring[tail & MASK];
+		if (atomic_load_explicit(&s->seq, memory_order_acquire) != tail + 1)
+			break;
+		buf[n++] = s->rec;
+		atomic_store_explicit(&s->seq, tail + BINLOG_RING, memory_order_release);
+		tail++;
+		if (n == BATCH)
+		{
+			atomic_store_explicit(&lg.tail, tail, memory_order_relaxed);
+			write_batch(buf, n);
+			n = 0;
+		}
+	}
+	atomic_store_explicit(&lg.tail, tail, memory_order_relaxed);
+	if (n)
+		write_batch(buf, n);
+	pthread_mutex_unlock(&lg.drain_mu);
+}
+
+static void *flusher(void *arg)
+{
+	struct pollfd p = {lg.wake, POLLIN, 0};
+	(void)arg;
+	for (;;)
+	{
+		uint64_t v;
+		if (poll(&p, 1, BINLOG_FLUSH_MS) > 0)
+		{
+			ssize_t r = read(lg.wake, &v, sizeof(v)); /* reset the counter */
+			(void)r;
+		}
+		atomic_store_explicit(&lg.kicked, 0, memory_order_relaxed);
+		int stop = atomic_load(&lg.stopping);
+		drain();
+		if (stop)
+			return NULL;
+	}
+}
+
+/* in a forked child: the ring and the file belong to the parent */
+static void forget_in_child(void)
+{
+	atomic_store(&lg.active, 0);
+	lg.running = 0;
+	lg.fd = lg.wake = -1;
+	lg.ring = NULL; /* start empty rather than re-flush the parent's records */
+}
+
+/* open path for appending, creating it with its header in one step if needed */
+static int open_log(const char *path)
+{
+	for (int tries = 0; tries < 2; tries++)
+	{
+		int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			BinlogFileHdr h;
+			if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || memcmp(h.magic, BINLOG_MAGIC, 8) != 0 ||
+				h.rec_size != sizeof(BinlogRec))
+			{
+				close(fd);
+				return -EPROTO;
+			}
+			return fd;
+		}
+		if (errno != ENOENT)
+			return -errno;
+
+		char *tmp;
+		if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+			return -ENOMEM;
+		fd = mkostemp(tmp, O_CLOEXEC);
+		if (fd < 0)
+		{
+			int e = errno;
+			free(tmp);
+			return -e;
+		}
+		BinlogFileHdr h = {.version = BINLOG_VERSION, .rec_size = sizeof(BinlogRec)};
+		memcpy(h.magic, BINLOG_MAGIC, 8);
+		int rc = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && fchmod(fd, 0644) == 0 ? 0 : -errno;
+		close(fd);
+		if (rc == 0 && link(tmp, path) < 0 && errno != EEXIST)
+			rc = -errno;
+		unlink(tmp);
+		free(tmp);
+		if (rc < 0)
+			return rc;
+		/* ours or a racing writer's: either way it has a header now */
+	}
+	return -ENOENT;
+}
+
+int binlog_open(const char *path, int src)
+{
+	static int registered;
+
+	if (atomic_load(&lg.active))
+		return 0;
+	int fd = open_log(path);
+	if (fd < 0)
+		return fd;
+	if (!lg.ring)
+	{
+		Slot *ring = malloc(BINLOG_RING * sizeof(*ring));
+		if (!ring)
+		{
+			close(fd);
+			return -ENOMEM;
+		}
+		for (uint64_t i = 0; i < BINLOG_RING; i++)
+			atomic_init(&ring[i].seq, i);
+		atomic_store(&lg.head, 0);
+		atomic_store(&lg.tail, 0);
+		atomic_store(&lg.dropped, 0);
+		lg.ring = ring;
+	}
+
+	atomic_store(&lg.stopping, 0);
+	atomic_store(&lg.kicked, 0);
+	lg.fd = fd;
+	lg.src = src;
+	lg.writer = getpid();
+	lg.wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	/* without a flusher (no eventfd or thread), records wait for binlog_close() */
+	lg.running = lg.wake >= 0 && pthread_create(&lg.flusher, NULL, flusher, NULL) == 0;
+	if (!registered)
+	{
+		atexit(binlog_close);
+		pthread_atfork(NULL, NULL, forget_in_child);
+		registered = 1;
+	}
+	atomic_store_explicit(&lg.active, 1, memory_order_release);
+	return 0;
+}
+
+void binlog_close(void)
+{
+	if (!atomic_exchange(&lg.active, 0))
+		return;
+	if (lg.running)
+	{
+		atomic_store(&lg.stopping, 1);
+		atomic_store(&lg.kicked, 0);
+		kick();
+		pthread_join(lg.flusher, NULL);
+		lg.running = 0;
+	}
+	drain(); /* what was put after the flusher's last pass */
+	close(lg.fd);
+	if (lg.wake >= 0)
+		close(lg.wake);
+	lg.fd = lg.wake = -1;
+	/* lg.ring stays: a binlog_put() racing with us may still be filling a slot */
+}
+
+/* ---- decoding ---- */
+
+static void print_rec(FILE *out, const BinlogRec *r, int json)
+{
+	const char *src = r->src == BINLOG_SRC_CLI ? "cli" : r->src == BINLOG_SRC_HELPER ? "helper" : "?";
+	const char *pid2 = r->op <= BINLOG_OP_MAX ? ops[r->op].pid2 : NULL;
+	const char *aux = r->op <= BINLOG_OP_MAX ? ops[r->op].aux : NULL;
+
+	if (json)
+	{
+		fprintf(out, "{\"timeNs\":%llu,\"src\":\"%s\",\"writer\":%d,\"op\":\"%s\",\"pid\":%d,\"pid2\":%d,"
+					 "\"err\":%d,\"durUs\":%u,\"aux\":%u,\"mock\":%s}\n",
+				(unsigned long long)r->time_ns, src, r->writer, binlog_op_name(r->op), r->pid, r->pid2, r->err,
+				r->dur_us, r->aux, (r->flags & BINLOG_F_MOCK) ? "true" : "false");
+		return;
+	}
+
+	time_t sec = (time_t)(r->time_ns / 1000000000ULL);
+	struct tm tm;
+	char when[32];
+	localtime_r(&sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(out, "%s.%06llu %s[%d] %-13s", when, (unsigned long long)(r->time_ns % 1000000000ULL / 1000), src,
+			r->writer, binlog_op_name(r->op));
+	if (r->pid)
+		fprintf(out, " pid=%d", r->pid);
+	if (pid2 && (r->pid2 || r->op == BINLOG_OP_RESTORE))
+		fprintf(out, " %s=%d", pid2, r->pid2);
+	if (r->op == BINLOG_OP_SPAWN && r->aux >= 256)
+	{
+		/* exec'd, then exited within the settle window */
+		int st = (int)r->aux - 256;
+		if (WIFSIGNALED(st))
+			fprintf(out, " signal=%d", WTERMSIG(st));
+		else
+			fprintf(out, " exit=%d", WEXITSTATUS(st));
+	}
+	else if (aux && r->aux)
+		fprintf(out, " %s=%u", aux, r->aux);
+	if (r->dur_us)
+		fprintf(out, " %.3fms", r->dur_us / 1e3);
+	if (r->err)
+		fprintf(out, " err=%d (%s)", r->err, strerror(r->err));
+	if (r->flags & BINLOG_F_MOCK)
+		fprintf(out, " [mock]");
+	fputc('\n', out);
+}
+
+long binlog_dump(int fd, FILE *out, int json)
+{
+	static BinlogRec buf[BATCH];
+	BinlogFileHdr h;
+	long total = 0;
+	size_t have = 0;
+
+	if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || memcmp(h.magic, BINLOG_MAGIC, 8) != 0 ||
+		h.rec_size != sizeof(BinlogRec))
+		return -EPROTO;
+	off_t off = sizeof(h);
+	for (;;)
+	{
+		ssize_t r = pread(fd, (char *)buf + have, sizeof(buf) - have, off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		if (r == 0)
+			break; /* a torn last record (writer died mid-write) is left out */
+		off += r;
+		have += (size_t)r;
+		size_t n = have / sizeof(buf[0]);
+		for (size_t i = 0; i < n; i++)
+			print_rec(out, &buf[i], json);
+		total += (long)n;
+		have -= n * sizeof(buf[0]);
+		memmove(buf, (char *)buf + n * sizeof(buf[0]), have);
+	}
+	return total;
+}
@@ -0,0 +1,97 @@
+// ==== user/binlog.h ====
+// Structured binary event log shared by the CLI and the server helper: fixed
+// size records (time, op, pids, errno, duration) go into an in-process ring
+// without locks or syscalls, and a background flusher appends them to one
+// file in batches. Decode it with logdump (or snapshot_user log).
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define BINLOG_MAGIC "SNAPLOG1"
+#define BINLOG_VERSION 1
+#define BINLOG_DEFAULT_PATH "/tmp/snapshot.binlog"
+#define BINLOG_RING 4096	  /* records in flight, power of two; more are dropped and counted */
+#define BINLOG_FLUSH_MS 100 /* flusher period; a 3/4 full ring wakes it sooner */
+
+/* file layout: BinlogFileHdr, then BinlogRec after BinlogRec. Every writer
+   appends whole batches with O_APPEND, so several processes can share it. */
+typedef struct
+{
+	char magic[8]; /* BINLOG_MAGIC, no NUL */
+	uint32_t version;
+	uint32_t rec_size; /* sizeof(BinlogRec) */
+} BinlogFileHdr;
+
+typedef struct
+{
+	uint64_t time_ns; /* CLOCK_REALTIME */
+	uint32_t dur_us;  /* how long the op took, 0 if not timed */
+	uint16_t op;	  /* BINLOG_OP_* */
+	uint16_t src;	  /* BINLOG_SRC_* */
+	int32_t writer;	  /* pid of the logging process */
+	int32_t pid;	  /* subject */
+	int32_t pid2;	  /* second pid, see binlog_op_name() */
+	int32_t err;	  /* errno, 0 on success */
+	uint32_t aux;	  /* op specific count */
+	uint32_t flags;	  /* BINLOG_F_* */
+} BinlogRec;
+
+/* BinlogRec.src */
+#define BINLOG_SRC_CLI 1
+#define BINLOG_SRC_HELPER 2
+
+/* BinlogRec.flags */
+#define BINLOG_F_MOCK 1 /* helper in SNAPSHOT_MOCK mode: no ioctl was made */
+
+/* BinlogRec.op                   pid2          aux */
+#define BINLOG_OP_SNAPSHOT 1	  /*              arg mode: 1 ptr, 2 val */
+#define BINLOG_OP_SNAPSHOT_TREE 2 /*              processes recorded */
+#define BINLOG_OP_SNAPSHOT_MEM 3  /*              image KiB */
+#define BINLOG_OP_FREEZE 4		  /*              threads recorded */
+#define BINLOG_OP_RESTORE 5		  /* new pid (0 = release/thaw) */
+#define BINLOG_OP_BATCH 6		  /*              items ok */
+#define BINLOG_OP_SPAWN 7		  /* old pid      failed SPAWN_STAGE_*, or wait status + 256 */
+#define BINLOG_OP_ATTACH 8		  /* old pid      1 if the saved tty was reattached */
+#define BINLOG_OP_IMAGE 9		  /*              MiB of anonymous memory */
+#define BINLOG_OP_REAP 10		  /*              processes SIGKILLed after the grace period */
+#define BINLOG_OP_CATALOG 11	  /*              catalog write or open failed */
+#define BINLOG_OP_LIST 12		  /*              entries */
+#define BINLOG_OP_QUERY 13
+#define BINLOG_OP_EVENTS 14		  /*              ring size */
+#define BINLOG_OP_THREADS 15	  /*              threads */
+#define BINLOG_OP_OPEN 16		  /*              device open failed */
+#define BINLOG_OP_USAGE 17		  /*              invalid arguments */
+#define BINLOG_OP_DROPPED 18	  /*              records lost to a full ring */
+#define BINLOG_OP_ATTRS 19		  /* old pid      saved PROCATTR_* that could not be reapplied */
+#define BINLOG_OP_MAX 19
+
+/* $SNAPSHOT_LOG, else BINLOG_DEFAULT_PATH */
+const char *binlog_default_path(void);
+
+/* open (creating if needed) the log at path and start the flusher; records
+   are tagged with src. binlog_close() is registered with atexit(), and a
+   forked child stops logging (its copy of the ring is never flushed).
+   Returns 0 or -errno; binlog_put() is a no-op until this succeeds. */
+int binlog_open(const char *path, int src);
+
+/* log one event; never blocks and never enters the kernel */
+void binlog_put(int op, pid_t pid, pid_t pid2, int err, double ms, uint32_t aux);
+
+/* BINLOG_F_* for every later record of this process */
+void binlog_set_flags(uint32_t flags);
+
+/* flush what is queued, stop the flusher and close the file */
+void binlog_close(void);
+
+/* "snapshot-tree", ...; "?" if unknown */
+const char *binlog_op_name(int op);
+
+/* print every record of the log open at fd, as text or one JSON object per
+   line. Returns the number of records or -errno (-EPROTO: not a log). */
+long binlog_dump(int fd, FILE *out, int json);
+
+#endif /* BINLOG_H */
@@ -0,0 +1,718 @@
+// ==== user/catalog.c ====
+// Persistent saved-process catalog, see catalog.h.
+// Every operation takes flock() on the file (shared to read, exclusive to
+// write) and first checks the header: a STALE flag means compaction renamed
+// a new file over the path, so it is reopened; a larger file_size means
+// another user grew the journal, so it is remapped. Old mappings are kept
+// until close, which is what lets returned entries point into the map: the
+// journal is append-only, so bytes once written never change.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+
+#define HDR_SIZE 4096
+#define MIN_PID_SLOTS 256
+#define MIN_STR_SLOTS 1024
+#define MIN_LOG (64 * 1024)
+#define COMPACT_MIN (64 * 1024) /* journal size below which dead bytes are left alone */
+#define STRS_PER_REC 8
+
+typedef struct
+{
+	void *addr;
+	size_t len;
+} Mapping;
+
+struct Catalog
+{
+	char *path;
+	int fd;
+	char *map;
+	size_t maplen;
+	Mapping *old; /* superseded mappings, unmapped by catalog_close() */
+	uint64_t nold, capold;
+};
+
+#define HDR(c) ((CatalogHeader *)(c)->map)
+#define PID_SLOTS(c) ((CatalogSlot *)((c)->map + HDR_SIZE))
+#define STR_SLOTS(c) ((CatalogStrSlot *)((c)->map + HDR_SIZE + (size_t)HDR(c)->pid_slots * sizeof(CatalogSlot)))
+
+/* growable array helper, as in memdump.c */
+static int grow(void **arr, uint64_t *cap, uint64_t need, size_t elem)
+{
+	if (need <= *cap)
+		return 0;
+	uint64_t n = *cap ? *cap * 2 : 64;
+	while (n < need)
+		n *= 2;
+	void *p = realloc(*arr, n * elem);
+	if (!p)
+		return -ENOMEM;
+	*arr = p;
+	*cap = n;
+	return 0;
+}
+
+static uint64_t pow2_at_least(uint64_t n, uint64_t min)
+{
+	uint64_t p = min;
+	while (p < n)
+		p *= 2;
+	return p;
+}
+
+static uint64_t pad8(uint64_t n)
+{
+	return (n + 7) & ~7ULL;
+}
+
+static uint32_t str_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u; /* FNV-1a */
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+static uint32_t pid_hash(pid_t pid)
+{
+	return (uint32_t)pid * 2654435761u;
+}
+
+static int lock(int fd, int op)
+{
+	while (flock(fd, op) < 0)
+		if (errno != EINTR)
+			return -errno;
+	return 0;
+}
+
+/* map len bytes of c->fd, keeping the previous mapping alive */
+static int remap(Catalog *c, size_t len)
+{
+	void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (m == MAP_FAILED)
+		return -errno;
+	if (c->map)
+	{
+		int rc = grow((void **)&c->old, &c->capold, c->nold + 1, sizeof(*c->old));
+		if (rc < 0)
+		{
+			munmap(m, len);
+			return rc;
+		}
+		c->old[c->nold++] = (Mapping){c->map, c->maplen};
+	}
+	c->map = m;
+	c->maplen = len;
+	return 0;
+}
+
+/* lay out an empty catalog in c->fd (locked, truncated) */
+static int init_file(Catalog *c, uint64_t pid_slots, uint64_t str_slots, uint64_t log_cap)
+{
+	uint64_t log_off = HDR_SIZE + pid_slots * sizeof(CatalogSlot) + str_slots * sizeof(CatalogStrSlot);
+	uint64_t size = log_off + log_cap;
+
+	if (ftruncate(c->fd, (off_t)size) < 0)
+		return -errno;
+	int rc = remap(c, size);
+	if (rc < 0)
+		return rc;
+	CatalogHeader *h = HDR(c);
+	memset(h, 0, sizeof(*h));
+	h->version = CATALOG_VERSION;
+	h->pid_slots = (uint32_t)pid_slots;
+	h->str_slots = (uint32_t)str_slots;
+	h->log_off = log_off;
+	h->file_size = size;
+	h->magic = CATALOG_MAGIC; /* last: a file without it is re-initialised */
+	return 0;
+}
+
+static int check_header(const Catalog *c)
+{
+	const CatalogHeader *h = HDR(c);
+	if (h->magic != CATALOG_MAGIC || h->version != CATALOG_VERSION)
+		return -EPROTO;
+	if (!h->pid_slots || (h->pid_slots & (h->pid_slots - 1)) || !h->str_slots ||
+		(h->str_slots & (h->str_slots - 1)) ||
+		h->log_off != HDR_SIZE + (uint64_t)h->pid_slots * sizeof(CatalogSlot) +
+						  (uint64_t)h->str_slots * sizeof(CatalogStrSlot) ||
+		h->log_off + h->log_len > h->file_size || h->file_size > c->maplen)
+		return -EPROTO;
+	return 0;
+}
+
+/* append one journal entry (a then b as its payload) past log_len and commit
+   it; *payload_off gets the file offset of the payload */
+static int log_append(Catalog *c, uint32_t type, const void *a, size_t alen, const void *b, size_t blen,
+					  uint64_t *payload_off)
+{
+	CatalogLogHdr lh = {type, (uint32_t)(alen + blen)};
+	uint64_t need = sizeof(lh) + pad8(alen + blen);
+	uint64_t at = HDR(c)->log_off + HDR(c)->log_len;
+
+	if (at + need > HDR(c)->file_size)
+	{
+		uint64_t size = HDR(c)->file_size;
+		while (at + need > size)
+			size *= 2;
+		if (ftruncate(c->fd, (off_t)size) < 0)
+			return -errno;
+		int rc = remap(c, size);
+		if (rc < 0)
+			return rc;
+		HDR(c)->file_size = size;
+	}
+	char *p = c->map + at;
+	memcpy(p, &lh, sizeof(lh));
+	if (alen)
+		memcpy(p + sizeof(lh), a, alen);
+	if (blen)
+		memcpy(p + sizeof(lh) + alen, b, blen);
+	memset(p + sizeof(lh) + alen + blen, 0, pad8(alen + blen) - (alen + blen));
+	__atomic_store_n(&HDR(c)->log_len, HDR(c)->log_len + need, __ATOMIC_RELEASE);
+	*payload_off = at + sizeof(lh);
+	return 0;
+}
+
+/* journal bytes taken by the entry whose payload is at off */
+static uint64_t entry_size(const Catalog *c, uint64_t off)
+{
+	const CatalogLogHdr *lh = (const CatalogLogHdr *)(c->map + off - sizeof(*lh));
+	return sizeof(*lh) + pad8(lh->len);
+}
+
+/* ---- string index ---- */
+
+/* slot holding s, or the empty slot where it would go */
+static uint64_t str_slot(const Catalog *c, const char *s, uint32_t len, uint32_t hash)
+{
+	const CatalogStrSlot *slots = STR_SLOTS(c);
+	uint64_t mask = HDR(c)->str_slots - 1;
+	uint64_t i = hash & mask;
+
+	while (slots[i].off &&
+		   !(slots[i].hash == hash && slots[i].len == len && memcmp(c->map + slots[i].off, s, len) == 0))
+		i = (i + 1) & mask;
+	return i;
+}
+
+/* the interned copy of s (len bytes), appending it if new. Every string is
+   stored with two '\0' after it, which terminates argv blobs too. */
+static int intern(Catalog *c, const char *s, size_t len, CatalogStrRef *ref)
+{
+	static const char nul[2];
+
+	memset(ref, 0, sizeof(*ref));
+	if (!s || !len)
+		return 0;
+	uint32_t hash = str_hash(s, len);
+	uint64_t i = str_slot(c, s, (uint32_t)len, hash);
+	if (!STR_SLOTS(c)[i].off)
+	{
+		uint64_t off;
+		int rc = log_append(c, CATALOG_LOG_STR, s, len, nul, sizeof(nul), &off);
+		if (rc < 0)
+			return rc;
+		STR_SLOTS(c)[i] = (CatalogStrSlot){hash, (uint32_t)len, off};
+		HDR(c)->str_used++;
+	}
+	ref->off = STR_SLOTS(c)[i].off;
+	ref->len = (uint32_t)len;
+	return 0;
+}
+
+/* ---- pid index ---- */
+
+/* slot of pid's live record, or -1; *insert (optional) gets where a new
+   record for pid would go (the first tombstone on the way, else the empty
+   slot that ended the probe) */
+static int64_t pid_slot(const Catalog *c, pid_t pid, uint64_t *insert)
+{
+	const CatalogSlot *slots = PID_SLOTS(c);
+	uint64_t mask = HDR(c)->pid_slots - 1;
+	uint64_t i = pid_hash(pid) & mask;
+	int64_t tomb = -1;
+
+	for (; slots[i].off; i = (i + 1) & mask)
+	{
+		if (slots[i].off == CATALOG_TOMB)
+		{
+			if (tomb < 0)
+				tomb = (int64_t)i;
+		}
+		else if (slots[i].pid == pid)
+			return (int64_t)i;
+	}
+	if (insert)
+		*insert = tomb >= 0 ? (uint64_t)tomb : i;
+	return -1;
+}
+
+/* point pid's slot at the record at off (0: remove it) */
+static void index_record(Catalog *c, pid_t pid, uint64_t off)
+{
+	CatalogHeader *h = HDR(c);
+	uint64_t ins = 0;
+	int64_t i = pid_slot(c, pid, &ins);
+
+	if (i >= 0)
+	{
+		h->dead_bytes += entry_size(c, PID_SLOTS(c)[i].off);
+		if (off)
+			PID_SLOTS(c)[i].off = off;
+		else
+		{
+			PID_SLOTS(c)[i].off = CATALOG_TOMB;
+			h->live--;
+		}
+		return;
+	}
+	if (!off)
+		return;
+	if (!PID_SLOTS(c)[ins].off)
+		h->pid_used++;
+	PID_SLOTS(c)[ins] = (CatalogSlot){pid, 0, off};
+	h->live++;
+}
+
+static void fill_entry(const Catalog *c, uint64_t off, CatalogEntry *e)
+{
+	const CatalogRecord *r = (const CatalogRecord *)(c->map + off);
+#define STR(ref) ((ref).off ? c->map + (ref).off : "")
+	e->pid = r->pid;
+	e->flags = r->flags;
+	e->saved_at_ms = r->saved_at_ms;
+	e->name = STR(r->name);
+	e->exe = STR(r->exe);
+	e->tty = STR(r->tty);
+	e->cwd = STR(r->cwd);
+	e->dump = STR(r->dump);
+	e->argv = r->argv.off ? c->map + r->argv.off : NULL;
+	e->argv_len = r->argv.len;
+	e->cgroup = STR(r->cgroup);
+	e->attrs = r->attrs.off ? c->map + r->attrs.off : NULL;
+	e->attrs_len = r->attrs.len;
+	e->ntree = r->ntree;
+	e->tree = (const pid_t *)r->tree;
+#undef STR
+}
+
+/* rebuild both indexes from the journal after a writer died mid-update */
+static void replay(Catalog *c)
+{
+	CatalogHeader *h = HDR(c);
+	uint64_t end = h->log_off + h->log_len;
+	uint64_t at = h->log_off;
+
+	memset(PID_SLOTS(c), 0, (size_t)h->pid_slots * sizeof(CatalogSlot));
+	memset(STR_SLOTS(c), 0, (size_t)h->str_slots * sizeof(CatalogStrSlot));
+	h->live = h->pid_used = h->str_used = h->dead_bytes = 0;
+	while (at + sizeof(CatalogLogHdr) <= end)
+	{
+		const CatalogLogHdr *lh = (const CatalogLogHdr *)(c->map + at);
+		uint64_t size = sizeof(*lh) + pad8(lh->len);
+		uint64_t off = at + sizeof(*lh);
+		if (at + size > end)
+			break;
+		if (lh->type == CATALOG_LOG_STR && lh->len >= 2)
+		{
+			const char *s = c->map + off;
+			uint32_t len = lh->len - 2, hash = str_hash(s, len);
+			uint64_t i = str_slot(c, s, len, hash);
+			if (!STR_SLOTS(c)[i].off)
+			{
+				STR_SLOTS(c)[i] = (CatalogStrSlot){hash, len, off};
+				h->str_used++;
+			}
+		}
+		else if (lh->type == CATALOG_LOG_REC && lh->len >= sizeof(CatalogRecord))
+			index_record(c, ((const CatalogRecord *)(c->map + off))->pid, off);
+		else if (lh->type == CATALOG_LOG_DEL && lh->len >= sizeof(int32_t))
+		{
+			index_record(c, *(const int32_t *)(c->map + off), 0);
+			h->dead_bytes += size;
+		}
+		else
+			break; /* torn or unknown: the journal ends here */
+		at += size;
+	}
+	h->log_len = at - h->log_off;
+	h->dirty = 0;
+}
+
+/* the directory of path, created if missing: only we or root may write it,
+   so nobody else can plant the file or swap it for a link */
+static int check_dir(const char *path)
+{
+	char *dir = strdup(path);
+	struct stat st;
+	int rc = 0;
+
+	if (!dir)
+		return -ENOMEM;
+	char *slash = strrchr(dir, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		rc = -errno;
+	else if (lstat(dir, &st) < 0)
+		rc = -errno;
+	else if (!S_ISDIR(st.st_mode) || (st.st_uid != geteuid() && st.st_uid != 0) ||
+			 (st.st_mode & (S_IWGRP | S_IWOTH)))
+		rc = -EPERM;
+	free(dir);
+	return rc;
+}
+
+/* fd is a regular file of ours that nobody else can write */
+static int check_file(int fd, struct stat *st)
+{
+	if (fstat(fd, st) < 0)
+		return -errno;
+	if (!S_ISREG(st->st_mode) || st->st_uid != geteuid() || (st->st_mode & (S_IWGRP | S_IWOTH)))
+		return -EPERM;
+	return 0;
+}
+
+static int open_file(Catalog *c)
+{
+	struct stat st;
+	int rc;
+
+	rc = check_dir(c->path);
+	if (rc < 0)
+		return rc;
+	c->fd = open(c->path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (c->fd < 0)
+		return errno == ELOOP ? -EPERM : -errno;
+	rc = lock(c->fd, LOCK_EX);
+	if (rc < 0)
+		return rc;
+	rc = check_file(c->fd, &st);
+	if (rc == 0 && (size_t)st.st_size < HDR_SIZE)
+		rc = init_file(c, MIN_PID_SLOTS, MIN_STR_SLOTS, MIN_LOG);
+	else if (rc == 0)
+	{
+		rc = remap(c, (size_t)st.st_size);
+		if (rc == 0 && HDR(c)->magic == 0)
+			rc = init_file(c, MIN_PID_SLOTS, MIN_STR_SLOTS, MIN_LOG); /* creator died before finishing */
+		else if (rc == 0 && HDR(c)->file_size > c->maplen)
+			rc = -EPROTO;
+		else if (rc == 0 && (rc = check_header(c)) == 0 && HDR(c)->dirty)
+			replay(c);
+	}
+	lock(c->fd, LOCK_UN);
+	return rc;
+}
+
+/* lock c for op (LOCK_SH or LOCK_EX) on the current file, mapped in full and
+   with consistent indexes */
+static int lock_fresh(Catalog *c, int op)
+{
+	for (;;)
+	{
+		int rc = lock(c->fd, op);
+		if (rc < 0)
+			return rc;
+		CatalogHeader *h = HDR(c);
+		if (h->flags & CATALOG_HDR_STALE)
+		{
+			/* compacted into a new file at the same path */
+			lock(c->fd, LOCK_UN);
+			close(c->fd);
+			rc = open_file(c);
+			if (rc < 0)
+				return rc;
+			continue;
+		}
+		if (h->file_size > c->maplen && (rc = remap(c, h->file_size)) < 0)
+		{
+			lock(c->fd, LOCK_UN);
+			return rc;
+		}
+		if (HDR(c)->dirty)
+		{
+			/* a writer died mid-update (a live one would hold LOCK_EX) */
+			if (op != LOCK_EX && (rc = lock(c->fd, LOCK_EX)) < 0)
+				return rc;
+			if (HDR(c)->dirty)
+				replay(c);
+			if (op != LOCK_EX)
+				lock(c->fd, op);
+		}
+		return 0;
+	}
+}
+
+static void unlock(Catalog *c)
+{
+	lock(c->fd, LOCK_UN);
+}
+
+const char *catalog_default_path(void)
+{
+	const char *p = getenv("SNAPSHOT_CATALOG");
+	return p && p[0] ? p : CATALOG_DEFAULT_PATH;
+}
+
+int catalog_open(const char *path, Catalog **out)
+{
+	Catalog *c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+	c->fd = -1;
+	c->path = strdup(path);
+	int rc = c->path ? open_file(c) : -ENOMEM;
+	if (rc < 0)
+	{
+		catalog_close(c);
+		return rc;
+	}
+	*out = c;
+	return 0;
+}
+
+void catalog_close(Catalog *c)
+{
+	if (!c)
+		return;
+	for (uint64_t i = 0; i < c->nold; i++)
+		munmap(c->old[i].addr, c->old[i].len);
+	if (c->map)
+		munmap(c->map, c->maplen);
+	if (c->fd >= 0)
+		close(c->fd);
+	free(c->old);
+	free(c->path);
+	free(c);
+}
+
+/* the write side of catalog_put(), c locked exclusively */
+static int put_locked(Catalog *c, const CatalogEntry *e)
+{
+	CatalogRecord r;
+	uint64_t off;
+	int rc = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.pid = e->pid;
+	r.flags = e->flags;
+	r.saved_at_ms = e->saved_at_ms;
+	if (!r.saved_at_ms)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		r.saved_at_ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+	}
+	r.ntree = e->tree ? e->ntree : 0;
+
+	HDR(c)->dirty = 1;
+	if ((rc = intern(c, e->name, e->name ? strlen(e->name) : 0, &r.name)) < 0 ||
+		(rc = intern(c, e->exe, e->exe ? strlen(e->exe) : 0, &r.exe)) < 0 ||
+		(rc = intern(c, e->argv, e->argv ? e->argv_len : 0, &r.argv)) < 0 ||
+		(rc = intern(c, e->tty, e->tty ? strlen(e->tty) : 0, &r.tty)) < 0 ||
+		(rc = intern(c, e->cwd, e->cwd ? strlen(e->cwd) : 0, &r.cwd)) < 0 ||
+		(rc = intern(c, e->dump, e->dump ? strlen(e->dump) : 0, &r.dump)) < 0 ||
+		(rc = intern(c, e->cgroup, e->cgroup ? strlen(e->cgroup) : 0, &r.cgroup)) < 0 ||
+		(rc = intern(c, e->attrs, e->attrs ? e->attrs_len : 0, &r.attrs)) < 0 ||
+		(rc = log_append(c, CATALOG_LOG_REC, &r, sizeof(r), e->tree, r.ntree * sizeof(int32_t), &off)) < 0)
+		return rc; /* stays dirty: the next user replays what was committed */
+	index_record(c, e->pid, off);
+	HDR(c)->dirty = 0;
+	return 0;
+}
+
+/* rewrite the live records into path.tmp, rename it over path and switch c
+   to it; c locked exclusively, and the new file is locked the same way */
+static int compact_locked(Catalog *c)
+{
+	CatalogHeader *h = HDR(c);
+	Catalog n;
+	char *tmp;
+	int rc;
+
+	memset(&n, 0, sizeof(n));
+	if (asprintf(&tmp, "%s.tmp", c->path) < 0)
+		return -ENOMEM;
+	n.path = tmp;
+	/* a leftover of a compaction that died: the directory is ours (check_dir) */
+	n.fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (n.fd < 0 && errno == EEXIST && unlink(tmp) == 0)
+		n.fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (n.fd < 0)
+	{
+		rc = -errno;
+		free(tmp);
+		return rc;
+	}
+	lock(n.fd, LOCK_EX);
+	/* a quarter full after compaction, so it is not due again soon */
+	uint64_t live_bytes = h->log_len - h->dead_bytes;
+	rc = init_file(&n, pow2_at_least(h->live * 4, MIN_PID_SLOTS),
+				   pow2_at_least(h->live * STRS_PER_REC * 4, MIN_STR_SLOTS), pow2_at_least(live_bytes * 2, MIN_LOG));
+	for (uint64_t i = 0; rc == 0 && i < h->pid_slots; i++)
+	{
+		const CatalogSlot *s = &PID_SLOTS(c)[i];
+		if (s->off > CATALOG_TOMB)
+		{
+			CatalogEntry e;
+			fill_entry(c, s->off, &e);
+			rc = put_locked(&n, &e);
+		}
+	}
+	if (rc == 0 && (fsync(n.fd) < 0 || rename(tmp, c->path) < 0))
+		rc = -errno;
+	if (rc < 0)
+	{
+		unlink(tmp);
+		for (uint64_t i = 0; i < n.nold; i++)
+			munmap(n.old[i].addr, n.old[i].len);
+		if (n.map)
+			munmap(n.map, n.maplen);
+		close(n.fd);
+		free(n.old);
+		free(tmp);
+		return rc;
+	}
+	free(tmp);
+
+	/* users of the old file reopen the path when they next lock it; entries
+	   handed out from our old mappings stay valid (a failed grow leaks them) */
+	h->flags |= CATALOG_HDR_STALE;
+	if (grow((void **)&c->old, &c->capold, c->nold + 1 + n.nold, sizeof(*c->old)) == 0)
+	{
+		c->old[c->nold++] = (Mapping){c->map, c->maplen};
+		for (uint64_t i = 0; i < n.nold; i++)
+			c->old[c->nold++] = n.old[i];
+	}
+	free(n.old);
+	close(c->fd); /* drops the old file's lock */
+	c->fd = n.fd;
+	c->map = n.map;
+	c->maplen = n.maplen;
+	return 0;
+}
+
+/* compact when the indexes are half full or the journal is mostly dead */
+static int maybe_compact(Catalog *c, int adding)
+{
+	CatalogHeader *h = HDR(c);
+	if ((h->pid_used + adding) * 2 > h->pid_slots || (h->str_used + adding * STRS_PER_REC) * 2 > h->str_slots ||
+		(h->log_len > COMPACT_MIN && h->dead_bytes * 2 > h->log_len))
+		return compact_locked(c);
+	return 0;
+}
+
+int catalog_put(Catalog *c, const CatalogEntry *e)
+{
+	int rc = lock_fresh(c, LOCK_EX);
+	if (rc < 0)
+		return rc;
+	rc = maybe_compact(c, 1);
+	if (rc == 0)
+		rc = put_locked(c, e);
+	unlock(c);
+	return rc;
+}
+
+int catalog_get(Catalog *c, pid_t pid, CatalogEntry *e)
+{
+	int rc = lock_fresh(c, LOCK_SH);
+	if (rc < 0)
+		return rc;
+	int64_t i = pid_slot(c, pid, NULL);
+	if (i >= 0)
+		fill_entry(c, PID_SLOTS(c)[i].off, e);
+	unlock(c);
+	return i >= 0 ? 0 : -ENOENT;
+}
+
+int catalog_remove(Catalog *c, pid_t pid)
+{
+	int32_t p = pid;
+	uint64_t off;
+	int rc = lock_fresh(c, LOCK_EX);
+
+	if (rc < 0)
+		return rc;
+	if (pid_slot(c, pid, NULL) < 0)
+	{
+		unlock(c);
+		return -ENOENT;
+	}
+	HDR(c)->dirty = 1;
+	rc = log_append(c, CATALOG_LOG_DEL, &p, sizeof(p), NULL, 0, &off);
+	if (rc == 0)
+	{
+		index_record(c, pid, 0);
+		HDR(c)->dead_bytes += entry_size(c, off);
+		HDR(c)->dirty = 0;
+		rc = maybe_compact(c, 0);
+	}
+	unlock(c);
+	return rc;
+}
+
+static int cmp_saved_at(const void *a, const void *b)
+{
+	const CatalogEntry *x = a, *y = b;
+	if (x->saved_at_ms != y->saved_at_ms)
+		return x->saved_at_ms < y->saved_at_ms ? -1 : 1;
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+int catalog_list(Catalog *c, CatalogEntry **out)
+{
+	int rc = lock_fresh(c, LOCK_SH);
+	if (rc < 0)
+		return rc;
+	CatalogEntry *v = malloc((HDR(c)->live ? HDR(c)->live : 1) * sizeof(*v));
+	int n = 0;
+	for (uint64_t i = 0; v && i < HDR(c)->pid_slots && (uint64_t)n < HDR(c)->live; i++)
+		if (PID_SLOTS(c)[i].off > CATALOG_TOMB)
+			fill_entry(c, PID_SLOTS(c)[i].off, &v[n++]);
+	unlock(c);
+	if (!v)
+		return -ENOMEM;
+	qsort(v, n, sizeof(*v), cmp_saved_at);
+	*out = v;
+	return n;
+}
+
+int catalog_count(Catalog *c)
+{
+	int rc = lock_fresh(c, LOCK_SH);
+	if (rc < 0)
+		return rc;
+	int n = (int)HDR(c)->live;
+	unlock(c);
+	return n;
+}
+
+int catalog_compact(Catalog *c)
+{
+	int rc = lock_fresh(c, LOCK_EX);
+	if (rc < 0)
+		return rc;
+	rc = compact_locked(c);
+	unlock(c);
+	return rc;
+}
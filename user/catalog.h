@@ -0,0 +1,149 @@
+// ==== user/catalog.h ====
+// Persistent catalog of saved (snapshotted) processes, shared by the CLI and
+// the server helper: everything needed to respawn an entry, keyed by its
+// original pid. One file, mapped MAP_SHARED by every user: an append-only
+// journal of records and interned strings, plus a pid index and a string
+// index kept in the file itself, so opening it is a mmap() and a lookup or a
+// removal touches one index slot. Removed and replaced records are reclaimed
+// by compaction, which rewrites the live ones into a new file.
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CATALOG_MAGIC 0x31544143504e53ULL /* "SNPCAT1" */
+#define CATALOG_VERSION 2 /* files of another version are refused (-EPROTO) */
+#define CATALOG_DEFAULT_PATH "/run/snapshotctl/catalog" /* kernel entries do not survive a reboot either */
+
+/* file layout:
+ *   CatalogHeader (one page) | CatalogSlot[pid_slots] | CatalogStrSlot[str_slots] | journal
+ * The journal is a sequence of entries, each a CatalogLogHdr and its payload
+ * padded to 8 bytes: CATALOG_LOG_STR (string bytes + '\0'), CATALOG_LOG_REC
+ * (CatalogRecord) or CATALOG_LOG_DEL (pid). Entries are written past
+ * log_len and become part of the journal when log_len moves over them. A
+ * writer sets dirty while it updates the indexes; a catalog found dirty is
+ * re-indexed by replaying the journal, which is the only time it is read in
+ * full.
+ */
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t flags;		 /* CATALOG_HDR_* */
+	uint32_t pid_slots;	 /* power of two */
+	uint32_t str_slots;	 /* power of two */
+	uint64_t log_off;	 /* file offset of the journal */
+	uint64_t log_len;	 /* committed journal bytes */
+	uint64_t file_size;	 /* mapped by every user; they remap when it grows */
+	uint64_t live;		 /* records in the pid index */
+	uint64_t pid_used;	 /* pid slots not empty (live + tombstones) */
+	uint64_t str_used;	 /* strings in the string index */
+	uint64_t dead_bytes; /* journal bytes of replaced and removed records */
+	uint32_t dirty;		 /* indexes being updated (replay on open if set) */
+	uint32_t pad;
+} CatalogHeader;
+
+#define CATALOG_HDR_STALE 1 /* replaced by a compacted file: reopen the path */
+
+typedef struct
+{
+	int32_t pid;
+	uint32_t pad;
+	uint64_t off; /* of the CatalogRecord; 0 empty, CATALOG_TOMB removed */
+} CatalogSlot;
+
+#define CATALOG_TOMB 1
+
+typedef struct
+{
+	uint32_t hash;
+	uint32_t len;
+	uint64_t off; /* of the bytes; 0 empty */
+} CatalogStrSlot;
+
+typedef struct
+{
+	uint32_t type; /* CATALOG_LOG_* */
+	uint32_t len;  /* payload bytes, without padding */
+} CatalogLogHdr;
+
+#define CATALOG_LOG_STR 1
+#define CATALOG_LOG_REC 2
+#define CATALOG_LOG_DEL 3
+
+typedef struct
+{
+	uint64_t off; /* of interned bytes; 0 for none */
+	uint32_t len;
+	uint32_t pad;
+} CatalogStrRef;
+
+typedef struct
+{
+	int32_t pid;
+	uint32_t flags; /* CATALOG_F_* */
+	uint64_t saved_at_ms;
+	CatalogStrRef name, exe, argv, tty, cwd, dump;
+	CatalogStrRef cgroup, attrs; /* attrs: a ProcAttrs blob (procattr.h) */
+	uint32_t ntree;
+	uint32_t pad;
+	int32_t tree[]; /* descendants recorded with it */
+} CatalogRecord;
+
+/* CatalogEntry.flags */
+#define CATALOG_F_FROZEN 1 /* suspended in place: restore thaws */
+
+/* one saved process. Entries returned by the catalog point into its mapping
+   and stay valid until catalog_close(), whatever else happens meanwhile. */
+typedef struct
+{
+	pid_t pid; /* original pid, the key */
+	uint32_t flags;
+	uint64_t saved_at_ms;			 /* wall clock */
+	const char *name, *exe, *tty, *cwd; /* "" when unknown, never NULL */
+	const char *dump;				 /* snapshot image path, "" if none */
+	const char *argv;				 /* '\0' separated and '\0\0' terminated; NULL if unknown */
+	uint32_t argv_len;				 /* bytes of argv, separators included */
+	const char *cgroup;				 /* /proc/<pid>/cgroup as captured, "" if unknown */
+	const void *attrs;				 /* ProcAttrs (procattr.h), NULL if not captured */
+	uint32_t attrs_len;
+	uint32_t ntree;
+	const pid_t *tree;
+} CatalogEntry;
+
+typedef struct Catalog Catalog;
+
+/* $SNAPSHOT_CATALOG, else CATALOG_DEFAULT_PATH */
+const char *catalog_default_path(void);
+
+/* open (creating if needed) the catalog at path. Its directory is created if
+   missing; a directory writable by anyone but us or root, or a file that is a
+   symlink, not ours or group/world-writable, is refused (-EPERM): what the
+   catalog holds gets exec'd, usually as root. Returns 0 or -errno. */
+int catalog_open(const char *path, Catalog **out);
+void catalog_close(Catalog *c);
+
+/* add e, replacing any entry with the same pid. NULL strings are stored as
+   empty. Returns 0 or -errno. */
+int catalog_put(Catalog *c, const CatalogEntry *e);
+
+/* 0 and *e filled, or -ENOENT */
+int catalog_get(Catalog *c, pid_t pid, CatalogEntry *e);
+
+/* 0, or -ENOENT */
+int catalog_remove(Catalog *c, pid_t pid);
+
+/* all entries, oldest first, in a malloc'd array (free it, not the strings).
+   Returns the count or -errno. */
+int catalog_list(Catalog *c, CatalogEntry **out);
+
+/* number of entries */
+int catalog_count(Catalog *c);
+
+/* rewrite the live records into a new file now; puts and removes also do it
+   on their own once more than half the journal is dead */
+int catalog_compact(Catalog *c);
+
+#endif /* CATALOG_H */
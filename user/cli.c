@@ -1,10 +1,11 @@
 // ==== mainCode/user/cli.c ====
 // small fixes applied (typo removal, cleaned includes, minor robustness)
-// Compile: gcc -O2 -Wall -o cli cli.c
+// Compile: gcc -O2 -Wall -pthread -o cli cli.c memdump.c snapimage.c pagestore.c procscan.c pidterm.c catalog.c binlog.c launch.c procattr.c
 
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <dirent.h>
 #include <string.h>
 #include <ctype.h>
@@ -14,46 +15,62 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <libgen.h>
 #include <sys/time.h>
 #include <sys/resource.h>
-#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../module/snapshot_uapi.h"
+#include "memdump.h"
+#include "procscan.h"
+#include "pidterm.h"
+#include "catalog.h"
+#include "binlog.h"
+#include "launch.h"
+#include "procattr.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 /* constants */
 #define MAX_SAVED 64
 #define NAME_LEN 512
+#define MAX_TREE 32
 #define DEVICE "/dev/snapshotctl"
 
-#define IOCTL_SNAPSHOT _IOW('s', 1, int)
-
-struct snap_ioc
-{
-	pid_t oldpid;
-	pid_t newpid;
-};
-#define IOCTL_RESTORE _IOW('s', 2, struct snap_ioc)
-
-typedef struct
-{
-	pid_t pid;
-	char name[NAME_LEN];
-	int is_gui;
-} Process;
-
 typedef struct
 {
 	pid_t old_pid;
 	char name[NAME_LEN];
 	char exe_path[NAME_LEN];
 	char *cmdline;			 // malloc'd buffer with '\0' separated argv
+	size_t cmdline_len;
 	char tty_path[NAME_LEN]; /* e.g. /dev/pts/3 */
-} SavedProcess;
-
-SavedProcess saved[MAX_SAVED];
-int saved_count = 0;
+	char cwd[NAME_LEN];
+	char dump_path[NAME_LEN]; /* snapshot image (SNAPSHOT_DUMP_DIR), empty if none */
+	int frozen;				  /* suspended in place (SNAP_F_FREEZE): restore = thaw */
+	pid_t tree[MAX_TREE];	  /* descendants recorded with it by IOCTL_SNAPSHOT_TREE */
+	int tree_count;
+	ProcAttrs attrs;		  /* scheduling, affinity, NUMA, rlimits (procattr.h) */
+	int have_attrs;
+	char cgroup[2048];		  /* /proc/<pid>/cgroup */
+} SavedProcess; /* captured before the kill; kept in the catalog from then on */
+
+static Catalog *cat;	/* saved processes (catalog.c), shared with the server */
+static pid_t *own;		/* entries added by this run, dropped at exit in a private session */
+static int nown, capown;
+static int snap_fd = -1; /* for releasing descendant entries with their root */
+static PageStore *batch_store; /* SNAPSHOT_STORE, open for a whole batch (store_begin()) */
+static ProcScan *scan;	  /* /proc scanner, keeps GUI classification across listings */
+static FILE *notes;		  /* progress messages: stdout, stderr when stdout carries JSON Lines */
 
 /* helpers */
 int is_number(const char *s)
@@ -68,100 +85,54 @@ int is_number(const char *s)
 	return 1;
 }
 
-int is_gui_process(pid_t pid)
+/* rescan running processes (procscan.c); *list stays valid until the next call */
+static int list_running(const ProcEntry **list)
 {
-	char path[NAME_LEN], buf[NAME_LEN];
-	FILE *f;
-	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
-	f = fopen(path, "r");
-	if (!f)
-		return 0;
-	if (fgets(buf, sizeof(buf), f))
-	{
-		if (strstr(buf, "--type=renderer") || strstr(buf, "--type=gpu-process"))
-		{
-			fclose(f);
-			return 0;
-		}
-	}
-	fclose(f);
-
-	snprintf(path, sizeof(path), "/proc/%d/environ", pid);
-	f = fopen(path, "r");
-	if (!f)
-		return 0;
-	int gui = 0;
-	while (fgets(buf, sizeof(buf), f))
-	{
-		if (strstr(buf, "DISPLAY=") || strstr(buf, "WAYLAND_DISPLAY="))
-		{
-			gui = 1;
-			break;
-		}
-	}
-	fclose(f);
-	return gui;
+	int n = procscan_run(scan, list);
+	return n < 0 ? 0 : n;
 }
 
-int list_running(Process *list, int max)
+static void print_running(const ProcEntry *procs, int running_count)
 {
-	DIR *d = opendir("/proc");
-	struct dirent *e;
-	int i = 0;
-	if (!d)
-		return 0;
-	while ((e = readdir(d)) && i < max)
-	{
-		if (!is_number(e->d_name))
-			continue;
-		pid_t pid = atoi(e->d_name);
-		char path[NAME_LEN], name[NAME_LEN];
-		snprintf(path, sizeof(path), "/proc/%d/comm", pid);
-		FILE *f = fopen(path, "r");
-		if (!f)
-			continue;
-		if (!fgets(name, sizeof(name), f))
-		{
-			fclose(f);
-			continue;
-		}
-		name[strcspn(name, "\n")] = 0;
-		fclose(f);
-		list[i].pid = pid;
-		strncpy(list[i].name, name, NAME_LEN - 1);
-		list[i].name[NAME_LEN - 1] = '\0';
-		list[i].is_gui = is_gui_process(pid);
-		i++;
-	}
-	closedir(d);
-	return i;
+	printf("\n=== Running processes (showing name and PID) ===\n");
+	for (int i = 0; i < running_count; i++)
+		printf("PID: %d\tName: %s%s\n", procs[i].pid, procs[i].comm,
+			   procscan_is_gui(scan, &procs[i]) ? " (GUI)" : "");
 }
 
-/* read /proc/<pid>/cmdline into a single buffer (null-separated) */
-char *read_cmdline(pid_t pid)
+/* read /proc/<pid>/cmdline into a single buffer (null-separated); *len
+   (optional) gets its size */
+char *read_cmdline(pid_t pid, size_t *len)
 {
 	char path[NAME_LEN];
 	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
 	FILE *f = fopen(path, "r");
 	if (!f)
 		return NULL;
-	if (fseek(f, 0, SEEK_END) != 0) { fclose(f); return NULL; }
-	long sz = ftell(f);
-	if (sz <= 0)
+	/* procfs files have no size: read until EOF */
+	size_t cap = 4096, r = 0, n;
+	char *buf = malloc(cap + 1);
+	while (buf && (n = fread(buf + r, 1, cap - r, f)) > 0)
 	{
-		fclose(f);
-		return NULL;
+		r += n;
+		if (r == cap)
+		{
+			char *p = realloc(buf, cap * 2 + 1);
+			if (!p)
+				break;
+			buf = p;
+			cap *= 2;
+		}
 	}
-	if (fseek(f, 0, SEEK_SET) != 0) { fclose(f); return NULL; }
-	char *buf = malloc(sz + 1);
-	if (!buf)
+	fclose(f);
+	if (!buf || r == 0)
 	{
-		fclose(f);
+		free(buf);
 		return NULL;
 	}
-	size_t r = fread(buf, 1, sz, f);
-	fclose(f);
 	buf[r] = '\0';
+	if (len)
+		*len = r;
 	return buf;
 }
 
@@ -179,12 +150,12 @@ int read_exe_path(pid_t pid, char *out, int outlen)
 
 /* parse cmdline buffer into argv array for execv (allocates argv array)
    returned argv points into cmdline buffer when available; otherwise new malloc'd strings */
-char **cmdline_to_argv(char *cmdline)
+char **cmdline_to_argv(const char *cmdline)
 {
 	if (!cmdline)
 		return NULL;
 	int argc = 0;
-	for (char *p = cmdline; *p;)
+	for (const char *p = cmdline; *p;)
 	{
 		size_t len = strlen(p);
 		argc++;
@@ -194,9 +165,9 @@ char **cmdline_to_argv(char *cmdline)
 	if (!argv)
 		return NULL;
 	int i = 0;
-	for (char *p = cmdline; *p;)
+	for (const char *p = cmdline; *p;)
 	{
-		argv[i++] = p;
+		argv[i++] = (char *)p;
 		p += strlen(p) + 1;
 	}
 	argv[i] = NULL;
@@ -224,304 +195,1193 @@ static const char *path_basename_ptr(const char *p)
 	return b ? b + 1 : p;
 }
 
-/* Attempt to launch the saved program in a new terminal window */
-static int launch_in_new_terminal(const SavedProcess *sp)
+/* argv for respawning sp: its saved cmdline, else just its exe or name.
+   malloc'd array (free it, not the strings) or NULL */
+static char **saved_argv(const CatalogEntry *sp)
 {
-	static const char *term_list[] = {
-		"terminator", "x-terminal-emulator", "gnome-terminal", "konsole",
-		"xfce4-terminal", "lxterminal", "urxvt", "xterm", NULL};
+	if (sp->argv)
+		return cmdline_to_argv(sp->argv);
+	char **argv = malloc(2 * sizeof(char *));
+	if (!argv)
+		return NULL;
+	argv[0] = (char *)(sp->exe[0] ? sp->exe : sp->name[0] ? sp->name : "(unknown)");
+	argv[1] = NULL;
+	return argv;
+}
 
-	char cmdline_buf[4096] = {0};
-	if (sp->cmdline)
+/* Attempt to launch the saved program in a new terminal window (the emulator
+   launch.c found, if any) */
+static int launch_in_new_terminal(const CatalogEntry *sp)
+{
+	const char *opt, *term = launch_terminal(&opt);
+	if (!term)
 	{
-		char *p = sp->cmdline;
-		int first = 1;
-		while (p && *p)
+		printf("No terminal emulator found (or no display); not launching %s.\n", sp->name);
+		return -1;
+	}
+
+	char **argv = saved_argv(sp);
+	if (!argv)
+		return -1;
+	LaunchSpec ls = {sp->exe, argv, NULL, 1, NULL, procattr_from(sp->attrs, sp->attrs_len), sp->cgroup};
+	LaunchResult lr;
+	int r = launch(&ls, &lr);
+	free(argv);
+	if (r < 0)
+		return -1;
+	/* the window outlives this call; it is reaped with the other children */
+	if (lr.pidfd >= 0)
+		close(lr.pidfd);
+	return lr.exec_err ? -1 : 0;
+}
+
+/* a spawned restore: launch() returns with the exec result, confirm_spawns()
+   then watches the pidfd for an early exit */
+typedef struct
+{
+	pid_t pid;
+	pid_t oldpid;	 /* the catalog entry it restores */
+	int pidfd;		 /* exit notification, -1 if pidfds are unavailable */
+	int in_terminal; /* pid is the terminal emulator the program runs in */
+	unsigned attr_failed; /* saved PROCATTR_* it could not be given */
+	double exec_ms;	 /* launch to exec (or to the failure) */
+	/* outcome, filled in by confirm_spawns() */
+	int ok;		/* exec'd and still running after the settle window */
+	int stage;	/* SPAWN_STAGE_* that failed, 0 if none */
+	int err;	/* errno of that stage */
+	int exited; /* exit status collected (status is valid) */
+	int status;
+} Spawn;
+
+#define SPAWN_STAGE_ARGV 1 /* building argv */
+#define SPAWN_STAGE_EXEC 2 /* the final execve()/execvp() */
+
+#define SPAWN_DEFAULT_SETTLE_MS 20 /* how long an exec'd child must survive */
+
+static double mono_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Final spawn_from_saved(): launch() (launch.c) reattaches the saved TTY if
+   it can, otherwise runs the program in a new terminal window (terminator
+   preferred) or, without one, detached with its output in
+   LAUNCH_OUT_PATH. sw gets what confirm_spawns() needs; returns the child
+   pid or -1.
+*/
+pid_t spawn_from_saved(const CatalogEntry *sp, Spawn *sw)
+{
+	memset(sw, 0, sizeof(*sw));
+	sw->pidfd = -1;
+	if (!sp)
+		return -1;
+	sw->oldpid = sp->pid;
+
+	char **argv = saved_argv(sp);
+	if (!argv)
+	{
+		binlog_put(BINLOG_OP_SPAWN, 0, sp->pid, ENOMEM, 0, SPAWN_STAGE_ARGV);
+		return -1;
+	}
+	LaunchSpec ls = {sp->exe, argv, sp->tty, 1, LAUNCH_OUT_PATH, procattr_from(sp->attrs, sp->attrs_len),
+					 sp->cgroup};
+	LaunchResult lr;
+	int r = launch(&ls, &lr);
+	free(argv);
+	if (r < 0)
+	{
+		binlog_put(BINLOG_OP_SPAWN, 0, sp->pid, -r, 0, 0);
+		return -1;
+	}
+
+	binlog_put(BINLOG_OP_ATTACH, lr.pid, sp->pid, lr.attach_err, 0, lr.attach_err == 0);
+	if (ls.attrs || sp->cgroup[0])
+		binlog_put(BINLOG_OP_ATTRS, lr.pid, sp->pid, 0, 0, lr.attr_failed);
+	sw->pid = lr.pid;
+	sw->attr_failed = lr.attr_failed;
+	sw->pidfd = lr.pidfd; /* our child: cannot be reused before we reap it */
+	sw->in_terminal = lr.in_terminal;
+	sw->exec_ms = lr.exec_ms;
+	if (lr.exec_err)
+	{
+		sw->stage = SPAWN_STAGE_EXEC;
+		sw->err = lr.exec_err;
+	}
+	return lr.pid;
+}
+
+/* settle window for restored children, $SNAPSHOT_RESTORE_SETTLE_MS */
+static int spawn_settle_ms(void)
+{
+	const char *s = getenv("SNAPSHOT_RESTORE_SETTLE_MS");
+	return s && *s >= '0' && *s <= '9' ? atoi(s) : SPAWN_DEFAULT_SETTLE_MS;
+}
+
+/* Find out how each spawn went without sleeping: launch() already knows
+   whether the exec went through, so only the pidfds of the exec'd ones are
+   polled, for settle_ms, to catch a program that dies right after exec
+   (missing library, bad arguments); poll() returns as soon as all of them
+   have exited. Exited children are reaped. One opened in a terminal window
+   is left running but is not ok: its pid is the emulator's. Returns the
+   number ok. */
+static int confirm_spawns(Spawn *sw, int n, int settle_ms)
+{
+	int ok = 0;
+
+	for (int i = 0; i < n; i++)
+		sw[i].ok = sw[i].pid > 0 && !sw[i].stage && !sw[i].in_terminal;
+
+	/* settle: watch the exec'd ones together */
+	struct pollfd *pfd = calloc(n ? n : 1, sizeof(*pfd));
+	int *idx = calloc(n ? n : 1, sizeof(*idx));
+	double deadline = mono_now() + settle_ms / 1e3;
+	while (pfd && idx)
+	{
+		int m = 0;
+		for (int i = 0; i < n; i++)
+			if (sw[i].ok && sw[i].pidfd >= 0 && !sw[i].exited)
+			{
+				pfd[m] = (struct pollfd){sw[i].pidfd, POLLIN, 0};
+				idx[m++] = i;
+			}
+		double left = deadline - mono_now();
+		if (m == 0 || left <= 0)
+			break;
+		if (poll(pfd, m, (int)(left * 1e3) + 1) <= 0)
+			continue;
+		for (int k = 0; k < m; k++)
+			if (pfd[k].revents)
+				sw[idx[k]].exited = 1;
+	}
+	free(pfd);
+	free(idx);
+
+	for (int i = 0; i < n; i++)
+	{
+		Spawn *s = &sw[i];
+		if (s->pid <= 0)
+			continue;
+		/* without a pidfd (or for a terminal window), fall back to one non-blocking look */
+		int st;
+		if ((s->exited || !s->ok || s->pidfd < 0) &&
+			waitpid(s->pid, &st, s->exited || (!s->ok && !s->in_terminal) ? 0 : WNOHANG) == s->pid)
 		{
-			if (!first)
-				strncat(cmdline_buf, " ", sizeof(cmdline_buf) - strlen(cmdline_buf) - 1);
-			strncat(cmdline_buf, p, sizeof(cmdline_buf) - strlen(cmdline_buf) - 1);
-			p += strlen(p) + 1;
-			first = 0;
+			s->exited = 1;
+			s->status = st;
 		}
+		else
+			s->exited = 0;
+		if (s->exited)
+			s->ok = 0;
+		if (s->pidfd >= 0)
+			close(s->pidfd);
+		s->pidfd = -1;
+		ok += s->ok;
+		binlog_put(BINLOG_OP_SPAWN, s->pid, s->oldpid, s->stage ? s->err : 0, s->exec_ms,
+				   s->stage ? (uint32_t)s->stage : s->exited ? 256 + (uint32_t)s->status : 0);
+	}
+	return ok;
+}
+
+/* why a spawn is not ok, e.g. "exec failed: No such file or directory (errno 2)" */
+static void spawn_error(const Spawn *s, char *buf, size_t len)
+{
+	if (s->stage)
+		snprintf(buf, len, "%s failed: %s (errno %d)", s->stage == SPAWN_STAGE_ARGV ? "building argv" : "exec",
+				 strerror(s->err), s->err);
+	else if (s->exited && WIFEXITED(s->status))
+		snprintf(buf, len, "exec'd but exited with status %d", WEXITSTATUS(s->status));
+	else if (s->exited && WIFSIGNALED(s->status))
+		snprintf(buf, len, "exec'd but was killed by signal %d (%s)", WTERMSIG(s->status),
+				 strsignal(WTERMSIG(s->status)));
+	else if (s->in_terminal)
+		snprintf(buf, len, "opened in a terminal window, not rebound");
+	else
+		snprintf(buf, len, "did not start");
+}
+
+/* one line on how a spawn went */
+static void print_spawn(pid_t oldpid, const Spawn *s)
+{
+	char why[160];
+	if (s->ok)
+	{
+		printf("Old PID %d: exec'd as PID %d in %.2f ms\n", oldpid, s->pid, s->exec_ms);
+		return;
 	}
-	else if (sp->exe_path[0])
+	spawn_error(s, why, sizeof(why));
+	printf("Old PID %d: PID %d %s after %.2f ms\n", oldpid, s->pid, why, s->exec_ms);
+}
+
+/* IOCTL_RESTORE (newpid 0 releases, or thaws a frozen entry), logged.
+   Returns 0 or -1 with errno set. */
+static int restore_ioctl(int fd, pid_t oldpid, pid_t newpid)
+{
+	struct snap_ioc ioc = {oldpid, newpid};
+	double t0 = mono_now();
+	int r = ioctl(fd, IOCTL_RESTORE, &ioc);
+	int err = r < 0 ? errno : 0;
+	binlog_put(BINLOG_OP_RESTORE, oldpid, newpid, err, (mono_now() - t0) * 1e3, 0);
+	errno = err;
+	return r;
+}
+
+/* stop pid in place recording its threads (restore thaws it), logged.
+   Returns 0 or -1 with errno set. */
+static int freeze_ioctl(int fd, pid_t pid)
+{
+	struct snap_req req;
+	memset(&req, 0, sizeof(req));
+	req.pid = pid;
+	req.flags = SNAP_F_FREEZE | SNAP_F_THREADS;
+	double t0 = mono_now();
+	int r = ioctl(fd, IOCTL_SNAPSHOT_EX, &req);
+	int err = r < 0 ? errno : 0;
+	binlog_put(BINLOG_OP_FREEZE, pid, 0, err, (mono_now() - t0) * 1e3, 0);
+	errno = err;
+	return r;
+}
+
+/* drop a saved entry from the catalog, releasing the kernel entries of the
+   descendants recorded with it */
+void remove_saved(const CatalogEntry *e)
+{
+	pid_t pid = e->pid;
+	if (e->ntree > 0 && snap_fd >= 0)
 	{
-		snprintf(cmdline_buf, sizeof(cmdline_buf), "%s", sp->exe_path);
+		/* the root is restored or released; its descendants' entries go with it */
+		struct snap_batch_item *items = calloc(e->ntree, sizeof(*items));
+		for (uint32_t i = 0; items && i < e->ntree; i++)
+		{
+			items[i].op = SNAP_OP_RESTORE;
+			items[i].pid = e->tree[i];
+		}
+		struct snap_batch b = {.count = e->ntree, .flags = 0, .items = (__u64)(uintptr_t)items};
+		if (items)
+			ioctl(snap_fd, IOCTL_BATCH, &b);
+		free(items);
 	}
-	else
+	catalog_remove(cat, pid);
+}
+
+/* open SNAPSHOT_STORE once for the snapshots that follow, instead of once per
+   image; each image still commits its own pages. Closed by store_end(). */
+static void store_begin(void)
+{
+	const char *storedir = getenv("SNAPSHOT_STORE");
+	const char *dump_dir = getenv("SNAPSHOT_DUMP_DIR");
+
+	if (batch_store || !storedir || !storedir[0] || !dump_dir || !dump_dir[0])
+		return;
+	int rc = pagestore_open(storedir, &batch_store);
+	if (rc < 0)
+		fprintf(notes, "page store %s: %s (opened per image instead)\n", storedir, strerror(-rc));
+}
+
+static void store_end(void)
+{
+	pagestore_close(batch_store, 1);
+	batch_store = NULL;
+}
+
+/* move the image written to tmp over path. The refs the image it replaces
+   held in store are dropped once it is gone, so re-snapshotting a reused pid
+   does not leak them. Returns 0 or -errno (tmp is removed). */
+static int replace_image(const char *tmp, const char *path, PageStore *store)
+{
+	SnapImg old;
+	int have_old = store && snapimg_open(path, &old) == 0;
+
+	if (rename(tmp, path) < 0)
 	{
-		snprintf(cmdline_buf, sizeof(cmdline_buf), "%s", sp->name[0] ? sp->name : "(unknown)");
+		int rc = -errno;
+		unlink(tmp);
+		if (have_old)
+			snapimg_close(&old);
+		return rc;
 	}
+	if (have_old)
+	{
+		if (old.hdr->flags & SNAPIMG_F_PAGE_REFS)
+			pagestore_release_image(store, &old);
+		snapimg_close(&old);
+	}
+	return 0;
+}
 
-	/* wrapped to ensure shell exec semantics */
-	char wrapped_cmd[8192];
-	snprintf(wrapped_cmd, sizeof(wrapped_cmd), "sh -c 'exec %s'", cmdline_buf);
+/* fill *sp with everything needed to restore pid later (call BEFORE killing).
+   sp->cmdline is malloc'd (may be NULL) and owned by the caller. Returns 1 if
+   a pre-copy left pid stopped (SIGCONT it if it is not killed after all). */
+static int capture_saved(SavedProcess *sp, pid_t pid, const ProcEntry *procs, int running_count)
+{
+	memset(sp, 0, sizeof(*sp));
+	sp->old_pid = pid;
+	sp->cmdline = read_cmdline(pid, &sp->cmdline_len);
+	if (read_exe_path(pid, sp->exe_path, sizeof(sp->exe_path)) != 0)
+		sp->exe_path[0] = '\0';
+
+	// find the chosen process name from procs[] (matching the PID we killed)
+	for (int j = 0; j < running_count; j++)
+	{
+		if (procs[j].pid == pid)
+		{
+			strncpy(sp->name, procs[j].comm, NAME_LEN - 1);
+			break;
+		}
+	}
+	if (sp->cmdline)
+		strncpy(sp->name, sp->cmdline, NAME_LEN - 1);
+	sp->name[NAME_LEN - 1] = '\0';
 
-	for (const char **t = term_list; *t; ++t)
+	/* save controlling terminal (fd0 or fd1) */
 	{
-		/* try to find terminal in PATH */
-		if (access(*t, X_OK) == 0 || getenv("PATH"))
+		char fd0path[NAME_LEN];
+		ssize_t r;
+		snprintf(fd0path, sizeof(fd0path), "/proc/%d/fd/0", pid);
+		r = readlink(fd0path, sp->tty_path, sizeof(sp->tty_path) - 1);
+		if (r <= 0)
 		{
-			pid_t tf = fork();
-			if (tf == 0)
-			{
-				/* child: attempt common exec variants */
-				execlp(*t, *t, "-e", "sh", "-c", wrapped_cmd, (char *)NULL);
-				execlp(*t, *t, "--", "sh", "-c", wrapped_cmd, (char *)NULL);
-				execlp(*t, *t, "-x", wrapped_cmd, (char *)NULL);
-				/* if fails, exit child */
-				_exit(127);
-			}
-			else if (tf > 0)
-			{
-				/* parent: we launched a terminal */
-				return 0;
-			}
-			else
+			snprintf(fd0path, sizeof(fd0path), "/proc/%d/fd/1", pid);
+			r = readlink(fd0path, sp->tty_path, sizeof(sp->tty_path) - 1);
+		}
+		if (r > 0)
+			sp->tty_path[r] = '\0';
+		else
+			sp->tty_path[0] = '\0';
+	}
+
+	{
+		char cwdpath[64];
+		snprintf(cwdpath, sizeof(cwdpath), "/proc/%d/cwd", pid);
+		ssize_t r = readlink(cwdpath, sp->cwd, sizeof(sp->cwd) - 1);
+		sp->cwd[r > 0 ? r : 0] = '\0';
+	}
+
+	/* what it ran with: reapplied to the respawned process before exec */
+	sp->have_attrs = procattr_capture(pid, &sp->attrs) == 0;
+	if (procattr_cgroup(pid, sp->cgroup, sizeof(sp->cgroup)) < 0)
+		sp->cgroup[0] = '\0';
+
+	/* optional snapshot image, taken while the process is still alive */
+	const char *dump_dir = getenv("SNAPSHOT_DUMP_DIR");
+	const char *precopy = getenv("SNAPSHOT_PRECOPY");
+	const char *storedir = getenv("SNAPSHOT_STORE");
+	int stopped = 0;
+	if (dump_dir && dump_dir[0])
+	{
+		MemDumpStats st;
+		MemDumpPrecopyStats pst;
+		char tmp[sizeof(sp->dump_path) + 8];
+		PageStore *store = batch_store, *own_store = NULL;
+		int src = 0;
+
+		if (!store && storedir && storedir[0])
+		{
+			src = pagestore_open(storedir, &own_store);
+			store = own_store;
+		}
+		snprintf(sp->dump_path, sizeof(sp->dump_path), "%s/%d.snap", dump_dir, pid);
+		snprintf(tmp, sizeof(tmp), "%s.tmp", sp->dump_path);
+		int dfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+		int rc = -errno;
+		if (dfd >= 0 && precopy && precopy[0])
+		{
+			rc = memdump_pid_precopy(pid, dfd, atoi(precopy), 0, &st, &pst);
+			if (rc == 0)
 			{
-				continue;
+				stopped = 1;
+				memdump_precopy_report(notes, &pst);
 			}
 		}
+		else if (dfd >= 0 && storedir && storedir[0])
+			rc = store ? memdump_pid_image_store(pid, dfd, store, NULL, &st) : src;
+		else if (dfd >= 0)
+			rc = memdump_pid_image(pid, dfd, &st);
+		if (dfd >= 0)
+			close(dfd);
+		/* the new pages are durable before the image that refers to them
+		   appears; the refs of the image it replaces go after it is gone */
+		if (rc == 0 && store)
+			rc = pagestore_commit(store);
+		if (rc == 0)
+			rc = replace_image(tmp, sp->dump_path, store);
+		else if (dfd >= 0)
+			unlink(tmp);
+		if (store && rc == 0)
+			pagestore_commit(store);
+		else if (store)
+			pagestore_rollback(store);
+		pagestore_close(own_store, 0);
+		binlog_put(BINLOG_OP_IMAGE, pid, 0, rc < 0 ? -rc : 0, rc < 0 ? 0 : st.seconds * 1e3,
+				   rc < 0 ? 0 : (uint32_t)(st.bytes >> 20));
+		if (rc < 0)
+		{
+			fprintf(notes, "snapshot image of PID %d failed: %s\n", pid, strerror(-rc));
+			sp->dump_path[0] = '\0';
+		}
+		else
+			fprintf(notes, "snapshot image of PID %d: %.1f MiB anon (%llu file pages by reference) in %.1f ms, %.2f GB/s -> %s\n",
+					pid, st.bytes / 1048576.0, (unsigned long long)st.file_pages, st.seconds * 1e3, st.gbps,
+					sp->dump_path);
 	}
+	return stopped;
+}
 
-	/* fallback: best-effort system() */
-	char syscmd[8192];
-	snprintf(syscmd, sizeof(syscmd), "x-terminal-emulator -e sh -c '%s' &", cmdline_buf);
-	system(syscmd);
+/* append pid to a growing array; 0 or -ENOMEM */
+static int push_pid(pid_t **v, int *n, int *cap, pid_t pid)
+{
+	if (*n == *cap)
+	{
+		int ncap = *cap ? *cap * 2 : 64;
+		pid_t *p = realloc(*v, ncap * sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		*v = p;
+		*cap = ncap;
+	}
+	(*v)[(*n)++] = pid;
 	return 0;
 }
 
-/* Final spawn_from_saved(): attempts to reattach to saved TTY, otherwise
-   launches the restored program in a quiet new terminal (terminator preferred),
-   falls back to other emulators, then to nohup/ detached mode.
-*/
-pid_t spawn_from_saved(const SavedProcess *sp)
+/* record a captured entry in the catalog (frees sp->cmdline) */
+static int add_saved(SavedProcess *sp)
 {
-	if (!sp)
+	CatalogEntry e = {
+		.pid = sp->old_pid,
+		.flags = sp->frozen ? CATALOG_F_FROZEN : 0,
+		.name = sp->name,
+		.exe = sp->exe_path,
+		.tty = sp->tty_path,
+		.cwd = sp->cwd,
+		.dump = sp->dump_path,
+		.argv = sp->cmdline,
+		.argv_len = (uint32_t)sp->cmdline_len,
+		.ntree = (uint32_t)sp->tree_count,
+		.tree = sp->tree,
+		.cgroup = sp->cgroup,
+		.attrs = sp->have_attrs ? &sp->attrs : NULL,
+		.attrs_len = sizeof(sp->attrs),
+	};
+	int rc = catalog_put(cat, &e);
+	free(sp->cmdline);
+	sp->cmdline = NULL;
+	if (rc < 0)
+	{
+		binlog_put(BINLOG_OP_CATALOG, sp->old_pid, 0, -rc, 0, 0);
+		fprintf(notes, "Saving PID %d in the catalog failed: %s\n", sp->old_pid, strerror(-rc));
 		return -1;
+	}
+	push_pid(&own, &nown, &capown, sp->old_pid);
+	return 0;
+}
 
-	pid_t child = fork();
-	if (child < 0)
-		return -1;
+static int find_saved(pid_t oldpid, CatalogEntry *e)
+{
+	return catalog_get(cat, oldpid, e) == 0 ? 0 : -1;
+}
 
-	if (child == 0)
-	{
-		/* ===== CHILD ===== */
-		/* Unblock signals and restore default handlers so the exec'd program
-		   receives signals normally. */
-		sigset_t sset;
-		sigemptyset(&sset);
-		sigprocmask(SIG_SETMASK, &sset, NULL);
-		signal(SIGINT, SIG_DFL);
-		signal(SIGTERM, SIG_DFL);
-		signal(SIGQUIT, SIG_DFL);
-		signal(SIGTSTP, SIG_DFL);
-		signal(SIGTTIN, SIG_DFL);
-		signal(SIGTTOU, SIG_DFL);
-
-		/* Build argv from saved cmdline if available */
-		char **argv = NULL;
-		if (sp->cmdline)
-		{
-			argv = cmdline_to_argv(sp->cmdline);
-			if (!argv)
-				_exit(127);
-		}
+/* kill process and its children (do this AFTER saving info) */
+/* stop pid and its descendants, record all of them and signal the tree in one
+   ioctl (children get SIGTERM, the root SIGKILL). The tree is pinned with
+   pidfds into *pt first so the caller can confirm the exits with
+   pidtree_wait(). Returns processes recorded or -1 with errno set; nothing
+   is killed on failure. */
+static int snapshot_tree(int fd, pid_t pid, SavedProcess *sp, PidTree *pt)
+{
+	static struct snap_tree_item items[SNAP_TREE_MAX];
+	struct snap_tree tr;
+	int pinned = pidtree_collect(pid, pt);
+	if (pinned < 0)
+	{
+		/* without the pidfds the exits could not be confirmed: kill nothing */
+		binlog_put(BINLOG_OP_SNAPSHOT_TREE, pid, 0, -pinned, 0, 0);
+		errno = -pinned;
+		return -1;
+	}
+	memset(&tr, 0, sizeof(tr));
+	tr.pid = pid;
+	tr.sig = SIGKILL;
+	tr.child_sig = SIGTERM;
+	tr.count = SNAP_TREE_MAX;
+	tr.items = (__u64)(uintptr_t)items;
+
+	double t0 = mono_now();
+	int ok = ioctl(fd, IOCTL_SNAPSHOT_TREE, &tr);
+	int ioctl_err = ok < 0 ? errno : 0;
+	binlog_put(BINLOG_OP_SNAPSHOT_TREE, pid, 0, ioctl_err, (mono_now() - t0) * 1e3, ok < 0 ? 0 : (uint32_t)ok);
+	if (ok < 0)
+	{
+		/* not signalled: let go of what we pinned */
+		pidtree_truncate(pt, pt->n - pinned);
+		errno = ioctl_err;
+		return -1;
+	}
+	sp->tree_count = 0;
+	for (__u32 i = 1; i < tr.count; i++)
+	{
+		if (items[i].result != 0)
+			continue;
+		if (sp->tree_count < MAX_TREE)
+			sp->tree[sp->tree_count++] = items[i].pid;
 		else
 		{
-			argv = malloc(2 * sizeof(char *));
-			if (!argv)
-				_exit(127);
-			if (sp->exe_path[0])
-				argv[0] = strdup(sp->exe_path);
-			else if (sp->name[0])
-				argv[0] = strdup(sp->name);
-			else
-				argv[0] = strdup("(unknown)");
-			argv[1] = NULL;
+			/* no room to track it: do not leave it registered */
+			restore_ioctl(fd, items[i].pid, 0);
+			ok--;
 		}
+	}
+	return ok;
+}
 
-		/* Try to reattach to saved tty (best-effort). */
-		int attached = 0;
-		int tcres = -1;
-		if (sp->tty_path[0])
-		{
-			/* Become session leader first */
-			setsid(); /* ignore failure */
+/* confirm that a tree signalled by snapshot_tree() is gone, SIGKILLing what
+   is left after the grace period ($SNAPSHOT_KILL_GRACE_MS), and free it */
+static void reap_tree(PidTree *pt)
+{
+	PidTermStats st;
+	int grace = pidterm_grace_from_env();
 
-			/* Open slave PTY without O_NOCTTY so open may make it controlling tty */
-			int ttyfd = open(sp->tty_path, O_RDWR);
-			if (ttyfd >= 0)
-			{
-				/* Put ourselves in a fresh process group */
-				setpgid(0, 0); /* ignore failure */
-
-				/* Temporarily ignore SIGTTOU to avoid being stopped when changing FG */
-				struct sigaction sa_old, sa_ignore;
-				sa_ignore.sa_handler = SIG_IGN;
-				sigemptyset(&sa_ignore.sa_mask);
-				sa_ignore.sa_flags = 0;
-				sigaction(SIGTTOU, &sa_ignore, &sa_old);
-
-				pid_t mypgid = getpgrp();
-				tcres = tcsetpgrp(ttyfd, mypgid);
-				if (tcres == -1)
-				{
-					/* try ioctl fallback to become controlling tty, then try again */
-					ioctl(ttyfd, TIOCSCTTY, 0);
-					tcres = tcsetpgrp(ttyfd, mypgid);
-				}
+	if (pt->n == 0)
+		return;
+	int left = pidtree_wait(pt, grace, &st);
+	binlog_put(BINLOG_OP_REAP, 0, 0, left ? ETIMEDOUT : 0, st.seconds * 1e3, st.killed);
+	if (st.killed)
+		printf("%d process(es) outlived SIGTERM for %d ms and were killed\n", st.killed, grace);
+	if (left)
+		printf("%d process(es) still alive after SIGKILL\n", left);
+	pidtree_free(pt);
+}
 
-				/* restore SIGTTOU handler */
-				sigaction(SIGTTOU, &sa_old, NULL);
+/* read a line of whitespace separated PIDs; returns count, or -1 for "all" */
+static int read_pid_list(pid_t *out, int max)
+{
+	char line[4096];
+	int n = 0;
+	if (!fgets(line, sizeof(line), stdin))
+		return 0;
+	for (char *tok = strtok(line, " \t\n,"); tok && n < max; tok = strtok(NULL, " \t\n,"))
+	{
+		if (strcmp(tok, "all") == 0)
+			return -1;
+		if (is_number(tok))
+			out[n++] = (pid_t)atoi(tok);
+	}
+	return n;
+}
 
-				/* Redirect stdio to tty */
-				dup2(ttyfd, STDIN_FILENO);
-				dup2(ttyfd, STDOUT_FILENO);
-				dup2(ttyfd, STDERR_FILENO);
-				if (ttyfd > 2)
-					close(ttyfd);
+/* print the catalog; returns the number of entries */
+static int print_saved(void)
+{
+	CatalogEntry *v;
+	int n = catalog_list(cat, &v);
+	if (n < 0)
+	{
+		printf("catalog: %s\n", strerror(-n));
+		return 0;
+	}
+	if (n == 0)
+	{
+		printf("No saved processes\n");
+		free(v);
+		return 0;
+	}
+	printf("\nSaved processes:\n");
+	for (int i = 0; i < n; i++)
+		printf("[%d] oldPID=%d name=%s exe=%s tty=%s%s%s%s\n", i + 1, v[i].pid, v[i].name,
+			   v[i].exe[0] ? v[i].exe : "(no exe)",
+			   v[i].tty[0] ? v[i].tty : "(no tty)",
+			   v[i].dump[0] ? " dump=" : "", v[i].dump,
+			   (v[i].flags & CATALOG_F_FROZEN) ? " [frozen]" : "");
+	free(v);
+	return n;
+}
 
-				attached = (tcres == 0);
-			}
-			else
+/* list the kernel's own view of the registry: one read() per 1 MiB of entries */
+static void print_registry(int fd)
+{
+	static struct snap_info buf[4096];
+	long total = 0;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+	{
+		perror("registry lseek");
+		return;
+	}
+	printf("\n=== Kernel registry ===\n");
+	for (;;)
+	{
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("registry read");
+			return;
+		}
+		if (r == 0)
+			break;
+		for (size_t i = 0; i < (size_t)r / sizeof(buf[0]); i++)
+		{
+			const struct snap_info *in = &buf[i];
+			time_t at = (time_t)(in->time_ns / 1000000000ULL);
+			char when[32];
+			strftime(when, sizeof(when), "%H:%M:%S", localtime(&at));
+			printf("PID %d (orig %d) uid=%u comm=%.*s at %s%s%s%s", in->pid, in->orig_pid, in->uid,
+				   SNAP_COMM_LEN, in->comm, when,
+				   (in->state & SNAP_STATE_FROZEN) ? " [frozen]" : "",
+				   (in->state & SNAP_STATE_CONTINUED) ? " [continued since]" : "",
+				   (in->state & SNAP_STATE_REBOUND) ? " [rebound]" : "");
+			if (in->state & SNAP_STATE_THREADS)
+				printf(" threads=%u", in->nr_threads);
+			if (in->state & SNAP_STATE_IMAGE)
+				printf(" image=%.1fMiB", in->image_size / 1048576.0);
+			printf("\n");
+		}
+		total += r / (ssize_t)sizeof(buf[0]);
+	}
+	printf("%ld entr%s\n", total, total == 1 ? "y" : "ies");
+}
+
+/* push a stopped process's private anonymous memory to swap with
+   process_madvise(MADV_PAGEOUT); returns bytes advised or -errno */
+static long pageout_pid(pid_t pid)
+{
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+	char path[64], line[NAME_LEN * 2];
+	struct iovec iov[512];
+	int n = 0;
+	long total = 0;
+
+	int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd < 0)
+		return -errno;
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		int e = errno;
+		close(pidfd);
+		return -e;
+	}
+	for (;;)
+	{
+		int more = fgets(line, sizeof(line), f) != NULL;
+		if (more)
+		{
+			unsigned long start, end;
+			char perms[8];
+			int pathpos = 0;
+			line[strcspn(line, "\n")] = 0;
+			if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %n", &start, &end, perms, &pathpos) < 3)
+				continue;
+			const char *rpath = pathpos ? line + pathpos : "";
+			/* private writable anonymous memory only: heap, stack, anon mmaps */
+			if (perms[1] != 'w' || perms[3] != 'p' || (rpath[0] && strcmp(rpath, "[heap]") != 0 && strcmp(rpath, "[stack]") != 0))
+				continue;
+			iov[n].iov_base = (void *)start;
+			iov[n].iov_len = end - start;
+			n++;
+		}
+		if (n == (int)(sizeof(iov) / sizeof(iov[0])) || (!more && n > 0))
+		{
+			long r = syscall(SYS_process_madvise, pidfd, iov, n, MADV_PAGEOUT, 0);
+			if (r < 0)
 			{
-				/* log open failure */
-				int lf = open("/tmp/snapshot_attach_log", O_WRONLY | O_CREAT | O_APPEND, 0644);
-				if (lf >= 0)
-				{
-					dprintf(lf, "attach: pid=%d open(%s) failed errno=%d\n",
-							getpid(), sp->tty_path, errno);
-					close(lf);
-				}
+				total = -errno;
+				break;
 			}
+			total += r;
+			n = 0;
 		}
+		if (!more)
+			break;
+	}
+	fclose(f);
+	close(pidfd);
+	return total;
+}
+
+/* thaw a frozen entry in place: the kernel sends SIGCONT and drops the entry */
+static void thaw_saved(int fd, const CatalogEntry *e)
+{
+	/* a SIGCONT from anyone else already let it run since the freeze */
+	struct snap_info in = {.pid = e->pid};
+	int continued = ioctl(fd, IOCTL_QUERY, &in) == 0 && (in.state & SNAP_STATE_CONTINUED);
+	double t0 = mono_now();
+	int r = restore_ioctl(fd, e->pid, 0);
+	double us = (mono_now() - t0) * 1e6;
+
+	if (r < 0)
+		printf("Thaw of PID %d failed: %s (entry released)\n", e->pid, strerror(errno));
+	else
+		printf("PID %d thawed in place in %.1f us%s\n", e->pid, us,
+			   continued ? " (it had been continued by something else since the freeze)" : "");
+	remove_saved(e);
+}
 
-		/* Log attach attempt result */
-		int attachfd = open("/tmp/snapshot_attach_log", O_WRONLY | O_CREAT | O_APPEND, 0644);
-		if (attachfd >= 0)
+/* snapshot and kill several process trees */
+static void batch_snapshot(int fd, const pid_t *pids, int n, const ProcEntry *procs, int running_count)
+{
+	SavedProcess *caps = calloc(n, sizeof(*caps));
+	if (!caps)
+		return;
+
+	int *stopped = calloc(n, sizeof(*stopped));
+	if (!stopped)
+	{
+		free(caps);
+		return;
+	}
+	store_begin();
+	for (int i = 0; i < n; i++)
+		stopped[i] = capture_saved(&caps[i], pids[i], procs, running_count);
+	store_end();
+
+	/* one tree ioctl per root: each records and kills its own descendants,
+	   then all of them are waited for together */
+	PidTree pt = {0};
+	int ok = 0;
+	for (int i = 0; i < n; i++)
+	{
+		int r = snapshot_tree(fd, pids[i], &caps[i], &pt);
+		if (r < 0)
 		{
-			dprintf(attachfd,
-					"attach: pid=%d exe='%s' tty='%s' attached=%d tcsetpgrp_res=%d errno=%d\n",
-					getpid(),
-					sp->exe_path[0] ? sp->exe_path : "(empty)",
-					sp->tty_path[0] ? sp->tty_path : "(none)",
-					attached, tcres, (tcres == -1 ? errno : 0));
-			close(attachfd);
+			printf("PID %d: snapshot failed: %s\n", pids[i], strerror(errno));
+			if (stopped[i])
+				kill(pids[i], SIGCONT);
+			free(caps[i].cmdline);
+			continue;
 		}
+		add_saved(&caps[i]);
+		ok++;
+		printf("PID %d: snapshot recorded and killed (%d processes)\n", pids[i], r);
+	}
+	reap_tree(&pt);
+	printf("Batch snapshot: %d/%d recorded\n", ok, n);
+	free(stopped);
+	free(caps);
+}
+
+/* one JSON Lines result of a batch restore */
+static int print_restore_json(pid_t oldpid, int found, const CatalogEntry *e, const Spawn *s,
+							  const struct snap_batch_item *it, int batch_err)
+{
+	char why[200] = "";
+	int frozen = found && (e->flags & CATALOG_F_FROZEN);
+
+	if (!found)
+		snprintf(why, sizeof(why), "not found");
+	else if (batch_err)
+		snprintf(why, sizeof(why), "restore ioctl failed: %s", strerror(batch_err));
+	else if (it->result != 0)
+		snprintf(why, sizeof(why), "kernel restore failed: %s", strerror(-it->result));
+	else if (!frozen && s->pid <= 0)
+		snprintf(why, sizeof(why), "spawn failed, kernel snapshot released");
+	else if (!frozen && !s->ok)
+	{
+		spawn_error(s, why, sizeof(why));
+		strncat(why, ", kernel snapshot released", sizeof(why) - strlen(why) - 1);
+	}
+
+	printf("{\"op\":\"restore\",\"oldpid\":%d,\"ok\":%s", oldpid, why[0] ? "false" : "true");
+	if (frozen && !why[0])
+		printf(",\"thawed\":true");
+	else if (s->pid > 0)
+		printf(",\"newpid\":%d,\"execMs\":%.3f", s->ok ? s->pid : 0, s->exec_ms);
+	if (s->attr_failed)
+		printf(",\"attrsFailed\":%u", s->attr_failed); /* PROCATTR_* bits */
+	if (why[0])
+		printf(",\"error\":\"%s\"", why); /* strerror/strsignal text: nothing to escape */
+	printf("}\n");
+	return !why[0];
+}
 
-		/* If not attached, try to launch in a new (quiet) terminal emulator. */
-		if (!attached)
+/* respawn several saved entries, then rebind (or release) all of them with one
+   IOCTL_BATCH. With json, one JSON Lines object per entry goes to stdout
+   instead of the messages. Returns the number restored. */
+static int batch_restore(int fd, const pid_t *oldpids, int n, int json)
+{
+	struct snap_batch_item *items = calloc(n, sizeof(*items));
+	struct snap_batch_item *sent = calloc(n, sizeof(*sent));
+	int *exited = calloc(n, sizeof(int));
+	Spawn *sw = calloc(n, sizeof(*sw));
+	CatalogEntry *ents = calloc(n, sizeof(*ents));
+	int *found = calloc(n, sizeof(int));
+	int restored = 0;
+	if (!items || !sent || !exited || !sw || !ents || !found)
+	{
+		free(items);
+		free(sent);
+		free(exited);
+		free(sw);
+		free(ents);
+		free(found);
+		return 0;
+	}
+
+	for (int i = 0; i < n; i++)
+		sw[i].pidfd = -1;
+	for (int i = 0; i < n; i++)
+	{
+		found[i] = find_saved(oldpids[i], &ents[i]) == 0;
+		items[i].op = SNAP_OP_RESTORE;
+		items[i].pid = oldpids[i];
+		if (found[i] && (ents[i].flags & CATALOG_F_FROZEN))
+		{
+			/* restore(pid, 0) of a frozen entry thaws it in place */
+			items[i].newpid = 0;
+			exited[i] = 1;
+			continue;
+		}
+		items[i].newpid = found[i] ? spawn_from_saved(&ents[i], &sw[i]) : -1;
+		if (items[i].newpid < 0)
 		{
-			const char *exe = sp->exe_path[0] ? sp->exe_path : (argv && argv[0] ? argv[0] : "(unknown)");
-			const char *terminal = getenv("TERM_PROGRAM"); /* optional hint */
+			if (!json)
+				printf("Old PID %d: %s\n", oldpids[i], !found[i] ? "not found" : "spawn failed");
+			items[i].newpid = 0;
+			exited[i] = 1;
+		}
+	}
 
-			/* Terminator (priority) */
-			if ((terminal && strstr(terminal, "terminator")) || access("/usr/bin/terminator", X_OK) == 0)
-			{
-				execl("/bin/sh", "sh", "-c",
-					  "(exec terminator -x \"$1\" >/dev/null 2>&1) &",
-					  "sh", exe, NULL);
-			}
+	/* one settle window for all of them; failed ones are released instead of rebound */
+	confirm_spawns(sw, n, spawn_settle_ms());
+	for (int i = 0; i < n; i++)
+	{
+		if (exited[i])
+			continue;
+		if (!sw[i].ok)
+		{
+			if (!json)
+				print_spawn(oldpids[i], &sw[i]);
+			items[i].newpid = 0;
+		}
+	}
 
-			/* GNOME Terminal */
-			if ((terminal && strstr(terminal, "gnome")) || access("/usr/bin/gnome-terminal", X_OK) == 0)
-			{
-				execl("/bin/sh", "sh", "-c",
-					  "(exec gnome-terminal -- \"$1\" >/dev/null 2>&1) &",
-					  "sh", exe, NULL);
-			}
+	/* pids the catalog does not know never reach the kernel: a typo must not
+	   release (or thaw) somebody else's entry */
+	int nsent = 0;
+	for (int i = 0; i < n; i++)
+		if (found[i])
+			sent[nsent++] = items[i];
+	int ok = 0, batch_err = 0;
+	if (nsent > 0)
+	{
+		struct snap_batch b = {.count = (__u32)nsent, .flags = 0, .items = (__u64)(uintptr_t)sent};
+		double t0 = mono_now();
+		ok = ioctl(fd, IOCTL_BATCH, &b);
+		batch_err = ok < 0 ? errno : 0;
+		binlog_put(BINLOG_OP_BATCH, 0, 0, batch_err, (mono_now() - t0) * 1e3, ok < 0 ? 0 : (uint32_t)ok);
+		for (int i = 0, j = 0; i < n; i++)
+			if (found[i])
+				items[i] = sent[j++];
+	}
+	for (int i = 0; i < n && ok >= 0; i++)
+		if (found[i])
+			binlog_put(BINLOG_OP_RESTORE, items[i].pid, items[i].newpid, -items[i].result, 0, 0);
+	if (ok < 0 && !json)
+		perror("Batch restore ioctl failed");
 
-			/* Konsole */
-			if ((terminal && strstr(terminal, "konsole")) || access("/usr/bin/konsole", X_OK) == 0)
-			{
-				execl("/bin/sh", "sh", "-c",
-					  "(exec konsole -e \"$1\" >/dev/null 2>&1) &",
-					  "sh", exe, NULL);
-			}
+	for (int i = 0; i < n; i++)
+	{
+		if (json)
+			restored += print_restore_json(oldpids[i], found[i], &ents[i], &sw[i], &items[i], batch_err);
+		if (!found[i] || ok < 0)
+			continue;
+		if (!json)
+		{
+			if (items[i].result != 0)
+				printf("Old PID %d: kernel restore failed: %s\n", oldpids[i], strerror(-items[i].result));
+			else if (ents[i].flags & CATALOG_F_FROZEN)
+				printf("Old PID %d: thawed in place\n", oldpids[i]);
+			else if (items[i].newpid)
+				printf("Old PID %d: rebound to new PID %d\n", oldpids[i], items[i].newpid);
+			else
+				printf("Old PID %d: spawn failed, kernel snapshot released\n", oldpids[i]);
+		}
+		remove_saved(&ents[i]);
+	}
+	if (ok >= 0 && !json)
+	{
+		printf("Batch restore: %d/%d ok\n", ok, n);
+		restored = ok;
+	}
+	free(items);
+	free(sent);
+	free(exited);
+	free(sw);
+	free(ents);
+	free(found);
+	return restored;
+}
 
-			/* XFCE4 Terminal */
-			if ((terminal && strstr(terminal, "xfce4")) || access("/usr/bin/xfce4-terminal", X_OK) == 0)
-			{
-				execl("/bin/sh", "sh", "-c",
-					  "(exec xfce4-terminal -e \"$1\" >/dev/null 2>&1) &",
-					  "sh", exe, NULL);
-			}
+/* ---- non-interactive commands: snapshotctl snapshot|restore ... ---- */
 
-			/* XTerm */
-			if (access("/usr/bin/xterm", X_OK) == 0)
-			{
-				execl("/bin/sh", "sh", "-c",
-					  "(exec xterm -hold -e \"$1\" >/dev/null 2>&1) &",
-					  "sh", exe, NULL);
-			}
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+			"usage: %s                              (interactive menu)\n"
+			"       %s snapshot [--tree | --freeze] [-f pidfile] pid...\n"
+			"       %s restore [--all] [-f pidfile] oldpid...\n"
+			"Results go to stdout as JSON Lines: one object per pid, then a summary.\n"
+			"A pidfile holds whitespace separated pids; \"-f -\" reads them from stdin.\n"
+			"Environment: SNAPSHOT_CATALOG, SNAPSHOT_SESSION=1, SNAPSHOT_DUMP_DIR, SNAPSHOT_PRECOPY,\n"
+			"SNAPSHOT_STORE, SNAPSHOT_KILL_GRACE_MS, SNAPSHOT_RESTORE_SETTLE_MS, SNAPSHOT_LOG (see README).\n",
+			prog, prog, prog);
+}
 
-			/* Nohup/headless fallback (background to /tmp/restore.out) */
-			if (access("/usr/bin/nohup", X_OK) == 0)
-			{
-				execl("/bin/sh", "sh", "-c",
-					  "setsid nohup \"$1\" >/tmp/restore.out 2>&1 & disown",
-					  "sh", exe, NULL);
-			}
+/* append the pids listed in path ("-" for stdin); 0 or -errno */
+static int read_pid_file(const char *path, pid_t **pids, int *n, int *cap)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "re");
+	char tok[64];
+	int rc = 0;
 
-			/* Final fallback: detach to /dev/null */
-			fprintf(stderr, "⚠️  No terminal emulator found; running detached.\n");
-			setsid();
-			int nullfd = open("/dev/null", O_RDWR);
-			if (nullfd >= 0)
-			{
-				dup2(nullfd, STDIN_FILENO);
-				dup2(nullfd, STDOUT_FILENO);
-				dup2(nullfd, STDERR_FILENO);
-				if (nullfd > 2)
-					close(nullfd);
-			}
+	if (!f)
+		return -errno;
+	while (rc == 0 && fscanf(f, "%63s", tok) == 1)
+	{
+		if (!is_number(tok) || atoi(tok) <= 0)
+		{
+			fprintf(stderr, "%s: not a pid: %s\n", path, tok);
+			rc = -EINVAL;
 		}
+		else
+			rc = push_pid(pids, n, cap, (pid_t)atoi(tok));
+	}
+	if (f != stdin)
+		fclose(f);
+	return rc;
+}
 
-		/* Exec the restored program (last step) */
-		if (sp->exe_path[0])
-			execv(sp->exe_path, argv);
+/* metadata capture runs on its own thread, ahead of the kills: while the main
+   thread signals one tree, the next pid is already being read from /proc */
+typedef struct
+{
+	const pid_t *pids;
+	int n;
+	SavedProcess *caps;
+	int *stopped;
+	double *capture_ms;
+	int done; /* captures finished, under mu */
+	pthread_mutex_t mu;
+	pthread_cond_t cv;
+} CapturePipe;
+
+static void *capture_worker(void *arg)
+{
+	CapturePipe *cp = arg;
+	for (int i = 0; i < cp->n; i++)
+	{
+		double t0 = mono_now();
+		cp->stopped[i] = capture_saved(&cp->caps[i], cp->pids[i], NULL, 0);
+		cp->capture_ms[i] = (mono_now() - t0) * 1e3;
+		pthread_mutex_lock(&cp->mu);
+		cp->done = i + 1;
+		pthread_cond_signal(&cp->cv);
+		pthread_mutex_unlock(&cp->mu);
+	}
+	return NULL;
+}
+
+/* let go of the kernel entries of a tree that could not be catalogued */
+static void release_tree(int fd, const SavedProcess *sp)
+{
+	restore_ioctl(fd, sp->old_pid, 0);
+	for (int i = 0; i < sp->tree_count; i++)
+		restore_ioctl(fd, sp->tree[i], 0);
+}
+
+/* snapshot (or freeze) every pid, one JSON line each as soon as its ioctl
+   returns; the killed trees are confirmed gone with one pidtree_wait() at the
+   end. Returns the number saved. */
+static int cmd_snapshot(int fd, const pid_t *pids, int n, int freeze)
+{
+	CapturePipe cp = {pids, n, calloc(n, sizeof(SavedProcess)), calloc(n, sizeof(int)), calloc(n, sizeof(double)), 0,
+					  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+	PidTree pt = {0};
+	PidTermStats st;
+	int ok = 0;
+	double t0 = mono_now();
+
+	if (!cp.caps || !cp.stopped || !cp.capture_ms)
+	{
+		free(cp.caps);
+		free(cp.stopped);
+		free(cp.capture_ms);
+		fprintf(stderr, "snapshot: out of memory\n");
+		return 0;
+	}
+	store_begin(); /* used by the capture thread only, closed once it is joined */
+	pthread_t th;
+	int threaded = pthread_create(&th, NULL, capture_worker, &cp) == 0;
+	if (!threaded)
+		capture_worker(&cp);
+
+	for (int i = 0; i < n; i++)
+	{
+		SavedProcess *sp = &cp.caps[i];
+		pthread_mutex_lock(&cp.mu);
+		while (cp.done <= i)
+			pthread_cond_wait(&cp.cv, &cp.mu);
+		pthread_mutex_unlock(&cp.mu);
+
+		double ts = mono_now();
+		int r;
+		if (freeze)
+			r = freeze_ioctl(fd, pids[i]) < 0 ? -1 : 1;
 		else
-			execvp(argv[0], argv);
+			r = snapshot_tree(fd, pids[i], sp, &pt);
+		int err = errno;
+		double snap_ms = (mono_now() - ts) * 1e3;
 
-		/* If exec fails, log error and exit child */
+		printf("{\"op\":\"snapshot\",\"pid\":%d", pids[i]);
+		if (r < 0)
 		{
-			int e = errno;
-			int ffd = open("/tmp/snapshot_exec_err", O_WRONLY | O_CREAT | O_APPEND, 0644);
-			if (ffd >= 0)
-			{
-				dprintf(ffd, "exec failed errno=%d (%s) exe='%s' argv0='%s' pid=%d\n",
-						e, strerror(e),
-						sp->exe_path[0] ? sp->exe_path : "(none)",
-						argv[0] ? argv[0] : "(null)", getpid());
-				close(ffd);
-			}
+			if (cp.stopped[i])
+				kill(pids[i], SIGCONT);
+			free(sp->cmdline);
+			printf(",\"ok\":false,\"error\":\"%s\"", strerror(err));
 		}
+		else
+		{
+			sp->frozen = freeze;
+			int saved = add_saved(sp) == 0;
+			if (!saved)
+				release_tree(fd, sp);
+			ok += saved;
+			printf(",\"ok\":%s,\"procs\":%d%s", saved ? "true" : "false", r, freeze ? ",\"frozen\":true" : "");
+			if (!saved)
+				printf(",\"error\":\"catalog write failed, kernel snapshot released\"");
+		}
+		printf(",\"captureMs\":%.3f,\"snapshotMs\":%.3f}\n", cp.capture_ms[i], snap_ms);
+		fflush(stdout);
+	}
+	if (threaded)
+		pthread_join(th, NULL);
+	store_end();
 
-		_exit(127);
+	double tr = mono_now();
+	memset(&st, 0, sizeof(st));
+	if (pt.n)
+	{
+		pidtree_wait(&pt, pidterm_grace_from_env(), &st);
+		binlog_put(BINLOG_OP_REAP, 0, 0, st.survivors ? ETIMEDOUT : 0, st.seconds * 1e3, st.killed);
 	}
+	pidtree_free(&pt);
+	printf("{\"op\":\"snapshot\",\"summary\":true,\"requested\":%d,\"ok\":%d,\"failed\":%d,\"procs\":%d,"
+		   "\"killed\":%d,\"survivors\":%d,\"reapMs\":%.3f,\"totalMs\":%.3f}\n",
+		   n, ok, n - ok, st.procs, st.killed, st.survivors, (mono_now() - tr) * 1e3, (mono_now() - t0) * 1e3);
+	free(cp.caps);
+	free(cp.stopped);
+	free(cp.capture_ms);
+	return ok;
+}
 
-	/* ===== PARENT ===== */
-	return child;
+/* restore every old pid, SNAP_BATCH_MAX per batch_restore(); returns the number restored */
+static int cmd_restore(int fd, const pid_t *pids, int n)
+{
+	double t0 = mono_now();
+	int ok = 0;
+	for (int off = 0; off < n; off += SNAP_BATCH_MAX)
+	{
+		ok += batch_restore(fd, pids + off, n - off < SNAP_BATCH_MAX ? n - off : SNAP_BATCH_MAX, 1);
+		fflush(stdout);
+	}
+	printf("{\"op\":\"restore\",\"summary\":true,\"requested\":%d,\"ok\":%d,\"failed\":%d,\"totalMs\":%.3f}\n", n, ok,
+		   n - ok, (mono_now() - t0) * 1e3);
+	return ok;
 }
 
-/* remove saved entry with index idx */
-void remove_saved_index(int idx)
+/* snapshotctl <command> ...: one device open, the shared registry (so what a
+   snapshot parks outlives this run and a later restore finds it) and JSON Lines
+   on stdout. Exit status 0 when every pid succeeded, 1 otherwise, 2 for usage. */
+static int run_command(int argc, char **argv)
 {
-	if (idx < 0 || idx >= saved_count)
-		return;
-	if (saved[idx].cmdline)
-		free(saved[idx].cmdline);
-	// shift remaining
-	for (int i = idx; i < saved_count - 1; i++)
-		saved[i] = saved[i + 1];
-	saved_count--;
+	int snapshot = strcmp(argv[1], "snapshot") == 0;
+	int freeze = 0, all = 0;
+	pid_t *pids = NULL;
+	int n = 0, cap = 0, rc = 0;
+
+	if (!snapshot && strcmp(argv[1], "restore") != 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+	for (int i = 2; i < argc && rc == 0; i++)
+	{
+		if (snapshot && strcmp(argv[i], "--tree") == 0)
+			freeze = 0;
+		else if (snapshot && strcmp(argv[i], "--freeze") == 0)
+			freeze = 1;
+		else if (!snapshot && strcmp(argv[i], "--all") == 0)
+			all = 1;
+		else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+		{
+			rc = read_pid_file(argv[++i], &pids, &n, &cap);
+			if (rc < 0 && rc != -EINVAL)
+				fprintf(stderr, "%s: %s\n", argv[i], strerror(-rc));
+		}
+		else if (is_number(argv[i]) && atoi(argv[i]) > 0)
+			rc = push_pid(&pids, &n, &cap, (pid_t)atoi(argv[i]));
+		else
+			rc = -EINVAL;
+	}
+	if (rc < 0 || (n == 0 && !all))
+	{
+		if (rc == 0 || rc == -EINVAL)
+			usage(argv[0]);
+		free(pids);
+		return 2;
+	}
+
+	notes = stderr; /* stdout is for the JSON Lines */
+	int fd = open(DEVICE, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+	{
+		perror("open " DEVICE);
+		free(pids);
+		return 1;
+	}
+	snap_fd = fd;
+	int crc = catalog_open(catalog_default_path(), &cat);
+	if (crc < 0)
+	{
+		fprintf(stderr, "catalog %s: %s\n", catalog_default_path(), strerror(-crc));
+		close(fd);
+		free(pids);
+		return 1;
+	}
+	if (all)
+	{
+		CatalogEntry *v;
+		int total = catalog_list(cat, &v);
+		for (int i = 0; i < total; i++)
+			push_pid(&pids, &n, &cap, v[i].pid);
+		if (total >= 0)
+			free(v);
+	}
+
+	int ok = snapshot ? cmd_snapshot(fd, pids, n, freeze) : cmd_restore(fd, pids, n);
+	catalog_close(cat);
+	close(fd);
+	free(pids);
+	free(own);
+	return ok == n ? 0 : 1;
 }
 
 /* main */
-int main(void)
+int main(int argc, char **argv)
 {
+	notes = stdout;
+	int lrc = binlog_open(binlog_default_path(), BINLOG_SRC_CLI);
+	if (lrc < 0)
+		fprintf(stderr, "event log %s: %s\n", binlog_default_path(), strerror(-lrc));
+	if (argc > 1)
+		return run_command(argc, argv);
+
 	int fd = open(DEVICE, O_RDWR);
 	if (fd < 0)
 	{
@@ -529,12 +1389,41 @@ int main(void)
 		fprintf(stderr, "Make sure kernel module is loaded and /dev/snapshotctl exists\n");
 		return 1;
 	}
+	snap_fd = fd;
+
+	/* opt-in private session: our entries cannot be starved by other clients
+	   and are released (frozen ones thawed) by the kernel if we exit or crash */
+	const char *session = getenv("SNAPSHOT_SESSION");
+	int private_session = 0;
+	if (session && strcmp(session, "1") == 0)
+	{
+		struct snap_session sess = {MAX_SAVED * (MAX_TREE + 1), 0};
+		if (ioctl(fd, IOCTL_SESSION, &sess) < 0)
+			perror("session ioctl (using the shared registry)");
+		else
+			private_session = 1;
+	}
+
+	int crc = catalog_open(catalog_default_path(), &cat);
+	if (crc < 0)
+	{
+		fprintf(stderr, "catalog %s: %s\n", catalog_default_path(), strerror(-crc));
+		return 1;
+	}
 
-	Process procs[1024];
+	const ProcEntry *procs = NULL;
 	int running_count = 0;
+	scan = procscan_new(0);
+	if (!scan)
+	{
+		perror("procscan");
+		return 1;
+	}
 	while (1)
 	{
-		printf("\nMenu:\n1. Snapshot & Kill (enter PID)\n2. Restore (enter old PID)\n3. Show Saved\n4. Exit\nChoice: ");
+		printf("\nMenu:\n1. Snapshot & Kill (enter PID)\n2. Restore (enter old PID)\n3. Show Saved\n4. Exit\n"
+			   "5. Batch Snapshot & Kill (enter PIDs)\n6. Batch Restore (enter old PIDs or 'all')\n"
+			   "7. Suspend in place (freeze, restore thaws)\n8. Show kernel registry\nChoice: ");
 		int choice;
 		if (scanf("%d", &choice) != 1)
 		{
@@ -546,15 +1435,13 @@ int main(void)
 			;
 		if (choice == 1)
 		{
-			running_count = list_running(procs, 1024);
+			running_count = list_running(&procs);
 			if (running_count == 0)
 			{
 				printf("no processes found\n");
 				continue;
 			}
-			printf("\n=== Running processes (showing name and PID) ===\n");
-			for (int i = 0; i < running_count; i++)
-				printf("PID: %d\tName: %s%s\n", procs[i].pid, procs[i].name, procs[i].is_gui ? " (GUI)" : "");
+			print_running(procs, running_count);
 
 			printf("\nEnter PID to snapshot & kill: ");
 			pid_t pid;
@@ -581,98 +1468,42 @@ int main(void)
 				continue;
 			}
 
-			// read cmdline and exe path BEFORE killing
-			char *cmdline = read_cmdline(pid);
-			char exe_path[NAME_LEN] = {0};
-			if (read_exe_path(pid, exe_path, sizeof(exe_path)) != 0)
-				exe_path[0] = '\0';
+			// read cmdline, exe path and tty BEFORE killing
+			SavedProcess sp;
+			int stopped = capture_saved(&sp, pid, procs, running_count);
 
-			// Call kernel ioctl to record snapshot entry (kernel will hold ref)
-			if (ioctl(fd, IOCTL_SNAPSHOT, pid) < 0)
+			// kernel records the whole tree (holding refs) and kills it in one step
+			PidTree pt = {0};
+			int recorded = snapshot_tree(fd, pid, &sp, &pt);
+			if (recorded < 0)
 			{
 				perror("Snapshot ioctl failed");
-				if (cmdline)
-					free(cmdline);
+				pidtree_free(&pt);
+				if (stopped)
+					kill(pid, SIGCONT);
+				if (sp.cmdline)
+					free(sp.cmdline);
 				continue;
 			}
+			reap_tree(&pt);
 
-			// store saved info in userland saved[] for restore
-			if (saved_count < MAX_SAVED)
-			{
-				saved[saved_count].old_pid = pid;
-				saved[saved_count].cmdline = cmdline; // may be NULL
-
-				// find the chosen process name from procs[] (matching the PID we killed)
-				for (int j = 0; j < running_count; j++)
-				{
-					if (procs[j].pid == pid)
-					{
-						strncpy(saved[saved_count].name, procs[j].name, NAME_LEN - 1);
-						break;
-					}
-				}
-				if (cmdline)
-				{
-					char *first = cmdline;
-					strncpy(saved[saved_count].name, first, NAME_LEN - 1);
-				}
-				strncpy(saved[saved_count].exe_path, exe_path, NAME_LEN - 1);
-				saved[saved_count].name[NAME_LEN - 1] = '\0';
-				saved[saved_count].exe_path[NAME_LEN - 1] = '\0';
-
-				/* save controlling terminal (fd0 or fd1) */
-				saved[saved_count].tty_path[0] = '\0';
-				{
-					char fd0path[NAME_LEN];
-					ssize_t r;
-					snprintf(fd0path, sizeof(fd0path), "/proc/%d/fd/0", pid);
-					r = readlink(fd0path, saved[saved_count].tty_path, sizeof(saved[saved_count].tty_path) - 1);
-					if (r <= 0)
-					{
-						snprintf(fd0path, sizeof(fd0path), "/proc/%d/fd/1", pid);
-						r = readlink(fd0path, saved[saved_count].tty_path, sizeof(saved[saved_count].tty_path) - 1);
-					}
-					if (r > 0)
-						saved[saved_count].tty_path[r] = '\0';
-					else
-						saved[saved_count].tty_path[0] = '\0';
-				}
+			/* debug print */
+			printf("DEBUG snapshot: pid=%d exe_path='%s' tty='%s' cmdline=%s\n",
+				   pid,
+				   sp.exe_path[0] ? sp.exe_path : "(none)",
+				   sp.tty_path[0] ? sp.tty_path : "(none)",
+				   sp.cmdline ? sp.cmdline : "(null)");
 
-				/* debug print */
-				printf("DEBUG snapshot: pid=%d exe_path='%s' tty='%s' cmdline=%s\n",
-					   pid,
-					   saved[saved_count].exe_path[0] ? saved[saved_count].exe_path : "(none)",
-					   saved[saved_count].tty_path[0] ? saved[saved_count].tty_path : "(none)",
-					   cmdline ? cmdline : "(null)");
+			// store saved info in the catalog for restore
+			add_saved(&sp);
 
-				saved_count++;
-			}
-			else
-			{
-				if (cmdline)
-					free(cmdline);
-				printf("Saved table full\n");
-			}
-
-			// kill process and its children (do this AFTER saving info)
-			char cmd[256];
-			snprintf(cmd, sizeof(cmd), "pkill -TERM -P %d; kill -9 %d", pid, pid);
-			system(cmd);
-
-			printf("Snapshot recorded and PID %d killed (process saved for restore)\n", pid);
+			printf("Snapshot recorded and PID %d killed with %d descendant(s) (process saved for restore)\n",
+				   pid, recorded - 1);
 		}
 		else if (choice == 2)
 		{
-			if (saved_count == 0)
-			{
-				printf("No saved processes\n");
+			if (print_saved() == 0)
 				continue;
-			}
-			printf("\nSaved processes:\n");
-			for (int i = 0; i < saved_count; i++)
-				printf("[%d] oldPID=%d name=%s exe=%s tty=%s\n", i + 1, saved[i].old_pid, saved[i].name,
-					   saved[i].exe_path[0] ? saved[i].exe_path : "(no exe)",
-					   saved[i].tty_path[0] ? saved[i].tty_path : "(no tty)");
 
 			printf("\nEnter old PID to restore: ");
 			pid_t oldpid;
@@ -685,118 +1516,52 @@ int main(void)
 			while (getchar() != '\n')
 				;
 
-			int idx = -1;
-			for (int i = 0; i < saved_count; i++)
-				if (saved[i].old_pid == oldpid)
-				{
-					idx = i;
-					break;
-				}
-			if (idx < 0)
+			CatalogEntry se;
+			if (find_saved(oldpid, &se) < 0)
 			{
 				printf("Old PID %d not found\n", oldpid);
 				continue;
 			}
+			if (se.flags & CATALOG_F_FROZEN)
+			{
+				thaw_saved(fd, &se);
+				continue;
+			}
 
-			printf("DEBUG restore: oldpid=%d saved.exe_path='%s' saved.cmdline=%s saved.tty='%s'\n",
-				   saved[idx].old_pid,
-				   saved[idx].exe_path[0] ? saved[idx].exe_path : "(empty)",
-				   saved[idx].cmdline ? saved[idx].cmdline : "(null)",
-				   saved[idx].tty_path[0] ? saved[idx].tty_path : "(none)");
+			printf("DEBUG restore: oldpid=%d saved.exe='%s' saved.argv=%s saved.tty='%s'\n",
+				   se.pid,
+				   se.exe[0] ? se.exe : "(empty)",
+				   se.argv ? se.argv : "(null)",
+				   se.tty[0] ? se.tty : "(none)");
 
 			// spawn new process using saved metadata
-			pid_t newpid = spawn_from_saved(&saved[idx]);
+			Spawn sw;
+			pid_t newpid = spawn_from_saved(&se, &sw);
 			if (newpid < 0)
 			{
 				perror("spawn failed");
 				continue;
 			}
 
-			/* --- improved parent wait + immediate-exit capture --- */
-			int status = 0;
-			int child_exited = 0;
-			pid_t wr = 0;
-
-			/* poll waitpid for up to 500ms */
-			for (int iter = 0; iter < 25; iter++)
-			{ // 25 * 20ms = 500ms
-				wr = waitpid(newpid, &status, WNOHANG);
-				if (wr == -1)
-				{
-					perror("waitpid");
-					break;
-				}
-				else if (wr == 0)
-				{
-					/* still running; wait a bit and retry */
-					usleep(20000); /* 20ms */
-					continue;
-				}
-				else if (wr == newpid)
-				{
-					/* child exited quickly */
-					child_exited = 1;
-					break;
-				}
-			}
+			/* exec result from the status pipe, early exits from the pidfd */
+			int alive = confirm_spawns(&sw, 1, spawn_settle_ms());
+			print_spawn(oldpid, &sw);
 
-			if (child_exited)
+			if (!alive)
 			{
-				if (WIFEXITED(status))
-				{
-					printf("Child PID=%d exited with status %d\n", newpid, WEXITSTATUS(status));
-				}
-				else if (WIFSIGNALED(status))
-				{
-					printf("Child PID=%d killed by signal %d (%s)\n", newpid, WTERMSIG(status), strsignal(WTERMSIG(status)));
-				}
-				else
-				{
-					printf("Child PID=%d changed state (status=0x%x)\n", newpid, status);
-				}
-
-				/* show any logs the child wrote (spawn_log and exec_err) */
-				printf("---- /tmp/snapshot_child_start_log ----\n");
-				system("sed -n '1,200p' /tmp/snapshot_child_start_log 2>/dev/null || true");
-				printf("---- /tmp/snapshot_spawn_log ----\n");
-				system("sed -n '1,200p' /tmp/snapshot_spawn_log 2>/dev/null || true");
-				printf("---- /tmp/snapshot_exec_err ----\n");
-				system("sed -n '1,200p' /tmp/snapshot_exec_err 2>/dev/null || true");
-
 				/* since child exited, treat spawn as failed and do not rebind */
-				printf("Spawn failed (child exited). Will request kernel to release snapshot.\n");
-				struct snap_ioc ioc;
-				ioc.oldpid = oldpid;
-				ioc.newpid = 0;
-				if (ioctl(fd, IOCTL_RESTORE, &ioc) < 0)
+				printf("Spawn failed. Will request kernel to release snapshot.\n");
+				if (restore_ioctl(fd, oldpid, 0) < 0)
 					perror("Restore ioctl failed");
 				else
 					printf("Kernel released snapshot for oldpid=%d\n", oldpid);
 
 				/* remove saved entry locally */
-				remove_saved_index(idx);
+				remove_saved(&se);
 				continue; /* go back to menu */
 			}
 
-			/* If child didn't exit, proceed with the earlier validation (reads /proc/<newpid>/exe etc.) */
-			int alive = 0;
-			/* wait briefly for child to appear (non-blocking already used above) */
-			for (int t = 0; t < 20; t++)
-			{
-				if (kill(newpid, 0) == 0)
-				{
-					alive = 1;
-					break;
-				}
-				if (errno == ESRCH)
-				{
-					usleep(20000);
-					continue;
-				}
-				alive = 1;
-				break;
-			}
-
+			/* If child is running, proceed with the validation (reads /proc/<newpid>/exe etc.) */
 			if (alive)
 			{
 				/* stronger validation: read /proc/<newpid>/exe and /proc/<newpid>/comm */
@@ -822,21 +1587,21 @@ int main(void)
 				}
 
 				int valid = 0;
-				if (saved[idx].exe_path[0] && exe_read[0])
+				if (se.exe[0] && exe_read[0])
 				{
-					if (strcmp(saved[idx].exe_path, exe_read) == 0)
+					if (strcmp(se.exe, exe_read) == 0)
 						valid = 1;
 					else
 					{
-						const char *exp_base = path_basename_ptr(saved[idx].exe_path);
+						const char *exp_base = path_basename_ptr(se.exe);
 						const char *got_base = path_basename_ptr(exe_read);
 						if (exp_base && got_base && strcmp(exp_base, got_base) == 0)
 							valid = 1;
 					}
 				}
-				else if (saved[idx].name[0] && comm_read[0])
+				else if (se.name[0] && comm_read[0])
 				{
-					if (strcmp(saved[idx].name, comm_read) == 0)
+					if (strcmp(se.name, comm_read) == 0)
 						valid = 1;
 				}
 				else
@@ -853,22 +1618,19 @@ int main(void)
 					alive = 0;
 					printf("Spawn validation failed: newpid=%d exe='%s' comm='%s' expected exe='%s' name='%s'\n",
 						   newpid, exe_read[0] ? exe_read : "(none)", comm_read[0] ? comm_read : "(none)",
-						   saved[idx].exe_path[0] ? saved[idx].exe_path : "(none)", saved[idx].name);
+						   se.exe[0] ? se.exe : "(none)", se.name);
 					printf("Will try to launch restored program in a NEW terminal and release kernel snapshot.\n");
 
 					/* fallback: launch in new terminal */
-					launch_in_new_terminal(&saved[idx]);
+					launch_in_new_terminal(&se);
 
-					struct snap_ioc ioc;
-					ioc.oldpid = saved[idx].old_pid;
-					ioc.newpid = 0;
-					if (ioctl(fd, IOCTL_RESTORE, &ioc) < 0)
+					if (restore_ioctl(fd, se.pid, 0) < 0)
 						perror("Restore ioctl failed");
 					else
-						printf("Kernel released snapshot for oldpid=%d (launched in new terminal)\n", saved[idx].old_pid);
+						printf("Kernel released snapshot for oldpid=%d (launched in new terminal)\n", se.pid);
 
 					/* remove saved entry locally */
-					remove_saved_index(idx);
+					remove_saved(&se);
 					continue;
 				}
 				else
@@ -881,57 +1643,147 @@ int main(void)
 				printf("Spawned child PID=%d does not exist or died immediately.\n", newpid);
 
 				/* fallback: launch in new terminal */
-				launch_in_new_terminal(&saved[idx]);
+				launch_in_new_terminal(&se);
 
-				struct snap_ioc ioc;
-				ioc.oldpid = saved[idx].old_pid;
-				ioc.newpid = 0;
-				if (ioctl(fd, IOCTL_RESTORE, &ioc) < 0)
+				if (restore_ioctl(fd, se.pid, 0) < 0)
 					perror("Restore ioctl failed");
 				else
-					printf("Kernel released snapshot for oldpid=%d (launched in new terminal)\n", saved[idx].old_pid);
+					printf("Kernel released snapshot for oldpid=%d (launched in new terminal)\n", se.pid);
 
 				/* remove saved entry locally */
-				remove_saved_index(idx);
+				remove_saved(&se);
 				continue;
 			}
 
 			// send ioctl - rebind only if alive and validated
-			struct snap_ioc ioc;
-			ioc.oldpid = oldpid;
-			ioc.newpid = alive ? newpid : 0;
+			pid_t bind = alive ? newpid : 0;
 
-			if (ioctl(fd, IOCTL_RESTORE, &ioc) < 0)
+			if (restore_ioctl(fd, oldpid, bind) < 0)
 			{
 				perror("Restore ioctl failed");
 			}
 			else
 			{
-				if (ioc.newpid)
-					printf("Kernel rebind/restore ok for oldpid=%d -> newpid=%d\n", oldpid, ioc.newpid);
+				if (bind)
+					printf("Kernel rebind/restore ok for oldpid=%d -> newpid=%d\n", oldpid, bind);
 				else
 					printf("Kernel released snapshot for oldpid=%d (spawn failed or validation failed)\n", oldpid);
 			}
 
-			// remove saved entry from userland table
-			remove_saved_index(idx);
+			// remove saved entry from the catalog
+			remove_saved(&se);
 		}
 		else if (choice == 3)
 		{
-			if (saved_count == 0)
+			print_saved();
+		}
+		else if (choice == 4)
+		{
+			break;
+		}
+		else if (choice == 5)
+		{
+			running_count = list_running(&procs);
+			if (running_count == 0)
 			{
-				printf("No saved processes\n");
+				printf("no processes found\n");
 				continue;
 			}
-			printf("\nSaved processes:\n");
-			for (int i = 0; i < saved_count; i++)
-				printf("[%d] oldPID=%d name=%s exe=%s tty=%s\n", i + 1, saved[i].old_pid, saved[i].name,
-					   saved[i].exe_path[0] ? saved[i].exe_path : "(no exe)",
-					   saved[i].tty_path[0] ? saved[i].tty_path : "(no tty)");
+			print_running(procs, running_count);
+
+			printf("\nEnter PIDs to snapshot & kill (space separated): ");
+			pid_t pids[SNAP_BATCH_MAX];
+			int n = read_pid_list(pids, SNAP_BATCH_MAX);
+			int m = 0;
+			for (int k = 0; k < n; k++)
+			{
+				int found = 0;
+				for (int i = 0; i < running_count; i++)
+					if (procs[i].pid == pids[k])
+					{
+						found = 1;
+						break;
+					}
+				if (found)
+					pids[m++] = pids[k];
+				else
+					printf("PID %d not found in running list\n", pids[k]);
+			}
+			if (m == 0)
+				continue;
+			batch_snapshot(fd, pids, m, procs, running_count);
 		}
-		else if (choice == 4)
+		else if (choice == 8)
 		{
-			break;
+			print_registry(fd);
+		}
+		else if (choice == 7)
+		{
+			running_count = list_running(&procs);
+			print_running(procs, running_count);
+
+			printf("\nEnter PID to suspend: ");
+			pid_t pid;
+			if (scanf("%d", &pid) != 1)
+			{
+				while (getchar() != '\n')
+					;
+				continue;
+			}
+			while (getchar() != '\n')
+				;
+			printf("Also push its memory to swap (MADV_PAGEOUT)? [y/N]: ");
+			int c = getchar();
+			if (c != '\n')
+				while (getchar() != '\n')
+					;
+
+			SavedProcess sp;
+			int stopped = capture_saved(&sp, pid, procs, running_count);
+			if (freeze_ioctl(fd, pid) < 0)
+			{
+				perror("Suspend ioctl failed");
+				if (stopped)
+					kill(pid, SIGCONT);
+				free(sp.cmdline);
+				continue;
+			}
+			sp.frozen = 1;
+			add_saved(&sp);
+			struct snap_threads tq = {pid, 0, 0};
+			if (ioctl(fd, IOCTL_GET_THREADS, &tq) == 0)
+				printf("PID %d frozen in place with %u threads recorded (restore thaws)\n", pid, tq.count);
+			else
+				printf("PID %d frozen in place (kernel holds it; restore thaws)\n", pid);
+
+			if (c == 'y' || c == 'Y')
+			{
+				long r = pageout_pid(pid);
+				if (r < 0)
+					printf("pageout failed: %s\n", strerror((int)-r));
+				else
+					printf("advised %.1f MiB for pageout\n", r / 1048576.0);
+			}
+		}
+		else if (choice == 6)
+		{
+			if (print_saved() == 0)
+				continue;
+			printf("\nEnter old PIDs to restore (space separated, or 'all'): ");
+			pid_t pids[SNAP_BATCH_MAX];
+			int n = read_pid_list(pids, SNAP_BATCH_MAX);
+			if (n < 0)
+			{
+				CatalogEntry *v;
+				int total = catalog_list(cat, &v);
+				for (n = 0; n < total && n < SNAP_BATCH_MAX; n++)
+					pids[n] = v[n].pid;
+				if (total >= 0)
+					free(v);
+			}
+			if (n == 0)
+				continue;
+			batch_restore(fd, pids, n, 0);
 		}
 		else
 		{
@@ -939,6 +1791,13 @@ int main(void)
 		}
 	}
 
+	/* the kernel drops a private session's entries when we close it */
+	if (private_session)
+		for (int i = 0; i < nown; i++)
+			catalog_remove(cat, own[i]);
+	free(own);
+	catalog_close(cat);
+	procscan_free(scan);
 	close(fd);
 	return 0;
 }
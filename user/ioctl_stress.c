@@ -0,0 +1,424 @@
+// ==== user/ioctl_stress.c ====
+// Multi-threaded IOCTL_SNAPSHOT/IOCTL_RESTORE stress and throughput tool.
+// Forks idle child processes to act as snapshot targets, then runs
+// snapshot -> rebind -> release cycles from 1..N threads and prints ops/sec.
+// Compile: gcc -O2 -Wall -pthread -o ioctl_stress ioctl_stress.c
+// Usage: ./ioctl_stress [-t max_threads] [-d seconds] [-p pids_per_thread] [-s | -S] [-u]
+//   -s  shared mode: every thread hammers the same pids (checks for races;
+//       EEXIST/EINVAL are expected and counted as "lost" races, not failures)
+//   -S  session mode: every thread opens its own fd with a private session
+//       (IOCTL_SESSION), so threads never touch the same registry
+//   -u  drive the cycles through one io_uring per thread (IORING_OP_URING_CMD):
+//       every pair of the thread's pids is one linked 3-SQE chain and the whole
+//       set goes in with a single io_uring_enter()
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/io_uring.h>
+
+#include "../module/snapshot_uapi.h"
+
+#define DEVICE "/dev/snapshotctl"
+
+typedef struct
+{
+	int fd;
+	pid_t *pids; /* pids this worker cycles through (pairs: a, b) */
+	int npids;
+	volatile int *stop;
+	unsigned long ops;
+	unsigned long lost;	  /* EEXIST/EINVAL in shared mode */
+	unsigned long errors; /* anything else */
+	int uring;
+	pthread_t th;
+} Worker;
+
+/* minimal raw io_uring, no liburing dependency */
+typedef struct
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len, sqes_len;
+} Ring;
+
+static pid_t *targets;
+static int ntargets;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_err(Worker *w, int e)
+{
+	if (e == EEXIST || e == EINVAL)
+		w->lost++;
+	else
+		w->errors++;
+}
+
+/* one cycle per pair: snapshot a, rebind a -> b, release b (3 ioctls) */
+static void *worker_main(void *arg)
+{
+	Worker *w = arg;
+	int i = 0;
+
+	while (!*w->stop)
+	{
+		pid_t a = w->pids[i];
+		pid_t b = w->pids[(i + 1) % w->npids];
+		struct snap_ioc ioc;
+
+		i = (i + 2) % w->npids;
+
+		if (ioctl(w->fd, IOCTL_SNAPSHOT, a) < 0)
+		{
+			count_err(w, errno);
+			continue;
+		}
+		w->ops++;
+
+		ioc.oldpid = a;
+		ioc.newpid = b;
+		if (ioctl(w->fd, IOCTL_RESTORE, &ioc) < 0)
+		{
+			count_err(w, errno);
+			/* still try to release whatever we hold */
+			ioc.newpid = 0;
+			if (ioctl(w->fd, IOCTL_RESTORE, &ioc) == 0)
+				w->ops++;
+			continue;
+		}
+		w->ops++;
+
+		ioc.oldpid = b;
+		ioc.newpid = 0;
+		if (ioctl(w->fd, IOCTL_RESTORE, &ioc) < 0)
+			count_err(w, errno);
+		else
+			w->ops++;
+	}
+	return NULL;
+}
+
+static int ring_init(Ring *r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		int e = errno;
+		if (r->sq_ring != MAP_FAILED)
+			munmap(r->sq_ring, r->sq_len);
+		if (r->cq_ring != MAP_FAILED)
+			munmap(r->cq_ring, r->cq_len);
+		if (r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqes_len);
+		close(r->fd);
+		return -e;
+	}
+
+	r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+	return 0;
+}
+
+static void ring_exit(Ring *r)
+{
+	munmap(r->sqes, r->sqes_len);
+	munmap(r->cq_ring, r->cq_len);
+	munmap(r->sq_ring, r->sq_len);
+	close(r->fd);
+}
+
+/* user_data of a cycle step: pid << 8 | step */
+enum
+{
+	STEP_SNAPSHOT,
+	STEP_REBIND,
+	STEP_RELEASE
+};
+
+static void ring_cmd(Ring *r, int fd, unsigned op, pid_t pid, int arg, int link, int step)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	struct snap_uring_cmd *cmd = (struct snap_uring_cmd *)sqe->cmd;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = op;
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = (__u64)pid << 8 | step;
+	cmd->pid = pid;
+	cmd->newpid = arg;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* same cycle as worker_main, every pair of pids in flight at once */
+static void *worker_uring(void *arg)
+{
+	Worker *w = arg;
+	int pairs = w->npids / 2;
+	Ring r;
+
+	if (ring_init(&r, pairs * 3) < 0)
+	{
+		w->errors++;
+		return NULL;
+	}
+	while (!*w->stop)
+	{
+		for (int i = 0; i < w->npids; i += 2)
+		{
+			pid_t a = w->pids[i], b = w->pids[i + 1];
+			ring_cmd(&r, w->fd, IOCTL_SNAPSHOT_EX, a, 0, 1, STEP_SNAPSHOT);
+			ring_cmd(&r, w->fd, IOCTL_RESTORE, a, b, 1, STEP_REBIND);
+			ring_cmd(&r, w->fd, IOCTL_RESTORE, b, 0, 0, STEP_RELEASE);
+		}
+		if (syscall(__NR_io_uring_enter, r.fd, pairs * 3, pairs * 3, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		{
+			w->errors++;
+			break;
+		}
+
+		unsigned head = *r.cq_head;
+		unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+			int step = cqe->user_data & 0xff;
+
+			if (cqe->res == 0)
+				w->ops++;
+			else if (cqe->res != -ECANCELED) /* a failed link cancels the rest */
+			{
+				count_err(w, -cqe->res);
+				if (step == STEP_REBIND)
+				{
+					/* still release whatever we hold */
+					struct snap_ioc ioc = {(pid_t)(cqe->user_data >> 8), 0};
+					if (ioctl(w->fd, IOCTL_RESTORE, &ioc) == 0)
+						w->ops++;
+				}
+			}
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	ring_exit(&r);
+	return NULL;
+}
+
+static pid_t spawn_idle_child(void)
+{
+	pid_t p = fork();
+	if (p == 0)
+	{
+		for (;;)
+			pause();
+	}
+	return p;
+}
+
+/* drop any registry entries left behind by lost races, then kill targets */
+static void reap_targets(int fd)
+{
+	for (int i = 0; i < ntargets; i++)
+	{
+		struct snap_ioc ioc = {targets[i], 0};
+		if (targets[i] > 0)
+			ioctl(fd, IOCTL_RESTORE, &ioc);
+	}
+	for (int i = 0; i < ntargets; i++)
+	{
+		if (targets[i] > 0)
+		{
+			kill(targets[i], SIGKILL);
+			waitpid(targets[i], NULL, 0);
+		}
+	}
+}
+
+/* an fd with its own private registry */
+static int open_session(void)
+{
+	struct snap_session sess = {0, 0};
+	int fd = open(DEVICE, O_RDWR);
+
+	if (fd >= 0 && ioctl(fd, IOCTL_SESSION, &sess) < 0)
+	{
+		perror("IOCTL_SESSION");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void run_round(int fd, int nthreads, int per_thread, int shared, int sessions, int uring, double secs)
+{
+	Worker *w = calloc(nthreads, sizeof(*w));
+	volatile int stop = 0;
+	unsigned long ops = 0, lost = 0, errors = 0;
+
+	if (!w)
+		return;
+	for (int t = 0; t < nthreads; t++)
+	{
+		w[t].fd = sessions ? open_session() : fd;
+		if (w[t].fd < 0)
+		{
+			for (int i = 0; i < t; i++)
+				close(w[i].fd);
+			free(w);
+			return;
+		}
+		w[t].stop = &stop;
+		w[t].uring = uring;
+		w[t].npids = per_thread;
+		w[t].pids = shared ? targets : targets + t * per_thread;
+	}
+
+	double t0 = now_sec();
+	for (int t = 0; t < nthreads; t++)
+		pthread_create(&w[t].th, NULL, w[t].uring ? worker_uring : worker_main, &w[t]);
+	usleep((useconds_t)(secs * 1e6));
+	stop = 1;
+	for (int t = 0; t < nthreads; t++)
+	{
+		pthread_join(w[t].th, NULL);
+		ops += w[t].ops;
+		lost += w[t].lost;
+		errors += w[t].errors;
+	}
+	double el = now_sec() - t0;
+	if (sessions)
+		for (int t = 0; t < nthreads; t++)
+			close(w[t].fd); /* releases anything a lost cycle left behind */
+
+	printf("%7d %14.0f %14.0f %10lu %8lu\n", nthreads, ops / el, ops / el / nthreads, lost, errors);
+	fflush(stdout);
+	free(w);
+}
+
+int main(int argc, char **argv)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = ncpu > 0 ? (int)ncpu : 1;
+	int per_thread = 8;
+	int shared = 0;
+	int sessions = 0;
+	int uring = 0;
+	double secs = 2.0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:d:p:sSu")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			secs = atof(optarg);
+			break;
+		case 'p':
+			per_thread = atoi(optarg);
+			break;
+		case 's':
+			shared = 1;
+			break;
+		case 'S':
+			sessions = 1;
+			break;
+		case 'u':
+			uring = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] [-d seconds] [-p pids_per_thread] [-s | -S] [-u]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (max_threads < 1 || per_thread < 2 || secs <= 0 || (shared && sessions))
+	{
+		fprintf(stderr, "invalid arguments\n");
+		return 2;
+	}
+	per_thread &= ~1; /* workers consume pids in pairs */
+
+	int fd = open(DEVICE, O_RDWR);
+	if (fd < 0)
+	{
+		perror("open " DEVICE);
+		return 1;
+	}
+
+	ntargets = shared ? per_thread : max_threads * per_thread;
+	targets = calloc(ntargets, sizeof(pid_t));
+	if (!targets)
+	{
+		close(fd);
+		return 1;
+	}
+	for (int i = 0; i < ntargets; i++)
+	{
+		targets[i] = spawn_idle_child();
+		if (targets[i] < 0)
+		{
+			perror("fork");
+			reap_targets(fd);
+			close(fd);
+			return 1;
+		}
+	}
+
+	printf("targets=%d mode=%s%s duration=%.1fs\n", ntargets, shared ? "shared" : sessions ? "sessions" : "private",
+		   uring ? "+uring" : "", secs);
+	printf("%7s %14s %14s %10s %8s\n", "threads", "ops/sec", "ops/sec/thr", "lost", "errors");
+	for (int n = 1; n <= max_threads; n = (n * 2 > max_threads && n != max_threads) ? max_threads : n * 2)
+		run_round(fd, n, per_thread, shared, sessions, uring, secs);
+
+	reap_targets(fd);
+	free(targets);
+	close(fd);
+	return 0;
+}
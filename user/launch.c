@@ -0,0 +1,330 @@
+// ==== user/launch.c ====
+// Restore launcher, see launch.h.
+// The child shares our memory and runs on its own small stack until it
+// execs: it must not allocate, lock or touch stdio, so argv, the terminal
+// argv, the tty check and opening cgroup.procs are all done here first.
+// Signals are blocked around clone() so no handler of ours can run in the
+// child before it has reset them, as glibc does for posix_spawn().
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "launch.h"
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define LAUNCH_STACK (64 * 1024) /* the child's, until it execs */
+
+extern char **environ;
+
+/* terminal emulators to fall back to, in order of preference */
+static const struct
+{
+	const char *name;
+	const char *hint; /* matched against $TERM_PROGRAM */
+	const char *opt;  /* takes the command and its arguments */
+} terms[] = {
+	{"terminator", "terminator", "-x"},
+	{"gnome-terminal", "gnome", "--"},
+	{"konsole", "konsole", "-e"},
+	{"xfce4-terminal", "xfce4", "-x"},
+	{"x-terminal-emulator", "x-terminal", "-e"},
+	{"lxterminal", "lxterminal", "-e"},
+	{"urxvt", "urxvt", "-e"},
+	{"xterm", "xterm", "-e"},
+};
+
+static pthread_once_t term_once = PTHREAD_ONCE_INIT;
+static char term_path[4096];
+static const char *term_opt;
+
+static pthread_mutex_t launch_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *launch_stack; /* LAUNCH_STACK bytes, mapped on first use */
+
+/* what the child is given, and what it leaves behind if it does not exec */
+typedef struct
+{
+	const LaunchSpec *spec;
+	char *const *targv; /* terminal emulator argv, NULL for none */
+	int tty_ok;			/* spec->tty is a character device */
+	int cgfds[PROCATTR_MAX_CGROUPS]; /* cgroup.procs to join */
+	int ncg;
+	int attach_err;
+	int in_terminal;
+	int exec_err;
+	unsigned attr_failed;
+} LaunchChild;
+
+static double launch_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* first executable name in $PATH into out; 0 or -1 */
+static int find_in_path(const char *name, char *out, size_t len)
+{
+	const char *p = getenv("PATH");
+	if (!p || !*p)
+		p = "/usr/local/bin:/usr/bin:/bin";
+	for (;;)
+	{
+		const char *e = strchr(p, ':');
+		size_t n = e ? (size_t)(e - p) : strlen(p);
+		if (n && n + strlen(name) + 2 <= len)
+		{
+			memcpy(out, p, n);
+			out[n] = '/';
+			strcpy(out + n + 1, name);
+			if (access(out, X_OK) == 0)
+				return 0;
+		}
+		if (!e)
+			return -1;
+		p = e + 1;
+	}
+}
+
+static void detect_terminal(void)
+{
+	const char *hint = getenv("TERM_PROGRAM");
+	size_t nterms = sizeof(terms) / sizeof(terms[0]);
+
+	/* a terminal emulator cannot open a window without a display */
+	if (!getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY"))
+		return;
+	for (int pass = hint ? 0 : 1; pass < 2; pass++)
+		for (size_t i = 0; i < nterms; i++)
+		{
+			if (pass == 0 && !strstr(hint, terms[i].hint))
+				continue;
+			if (find_in_path(terms[i].name, term_path, sizeof(term_path)) == 0)
+			{
+				term_opt = terms[i].opt;
+				return;
+			}
+		}
+	term_path[0] = '\0';
+}
+
+const char *launch_terminal(const char **opt)
+{
+	pthread_once(&term_once, detect_terminal);
+	if (opt)
+		*opt = term_opt;
+	return term_opt ? term_path : NULL;
+}
+
+/* make fd the controlling terminal with us in the foreground; 0 or errno */
+static int attach_tty(int fd)
+{
+	struct sigaction ign = {.sa_handler = SIG_IGN}, old;
+	pid_t pg = getpgrp();
+	int r, err = 0;
+
+	/* changing the foreground group from outside it would stop us */
+	sigaction(SIGTTOU, &ign, &old);
+	r = tcsetpgrp(fd, pg);
+	if (r == -1)
+	{
+		ioctl(fd, TIOCSCTTY, 0);
+		r = tcsetpgrp(fd, pg);
+	}
+	if (r == -1)
+		err = errno;
+	sigaction(SIGTTOU, &old, NULL);
+	return err;
+}
+
+/* point stdin at in and stdout/stderr at out, closing both */
+static void redirect(int in, int out)
+{
+	if (in >= 0)
+		dup2(in, STDIN_FILENO);
+	if (out >= 0)
+	{
+		dup2(out, STDOUT_FILENO);
+		dup2(out, STDERR_FILENO);
+	}
+	if (out > 2 && out != in)
+		close(out);
+	if (in > 2)
+		close(in);
+}
+
+/* runs in the child, on launch_stack, sharing our memory: only syscalls */
+static int launch_child(void *arg)
+{
+	LaunchChild *c = arg;
+	const LaunchSpec *s = c->spec;
+	struct sigaction dfl = {.sa_handler = SIG_DFL}, cur;
+	sigset_t none;
+
+	/* default handlers for whatever we catch, and for job control as before */
+	for (int sig = 1; sig < NSIG; sig++)
+		if (sig == SIGINT || sig == SIGTERM || sig == SIGQUIT || sig == SIGTSTP || sig == SIGTTIN ||
+			sig == SIGTTOU ||
+			(sigaction(sig, NULL, &cur) == 0 && cur.sa_handler != SIG_IGN && cur.sa_handler != SIG_DFL))
+			sigaction(sig, &dfl, NULL);
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+
+	setsid();
+	int attached = 0;
+	if (c->tty_ok)
+	{
+		/* no O_NOCTTY: opening it as a session leader makes it our terminal */
+		int fd = open(s->tty, O_RDWR | O_NONBLOCK);
+		if (fd >= 0)
+		{
+			fcntl(fd, F_SETFL, 0);
+			c->attach_err = attach_tty(fd);
+			attached = c->attach_err == 0;
+			if (attached)
+				redirect(fd, fd);
+			else
+				close(fd);
+		}
+		else
+			c->attach_err = errno;
+	}
+
+	if (!attached)
+	{
+		int in = open("/dev/null", O_RDWR);
+		int out = c->targv || !s->out ? in : open(s->out, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		redirect(in, out);
+	}
+
+	/* the terminal emulator gets them too, and passes them on */
+	if (s->attrs || c->ncg)
+		c->attr_failed |= procattr_apply(s->attrs, c->cgfds, c->ncg);
+
+	if (!attached && c->targv)
+	{
+		c->in_terminal = 1;
+		execve(c->targv[0], c->targv, environ);
+		c->in_terminal = 0;
+	}
+
+	if (s->exe && s->exe[0])
+		execve(s->exe, s->argv, environ);
+	else
+		execvp(s->argv[0], s->argv);
+	c->exec_err = errno;
+	_exit(127);
+}
+
+int launch(const LaunchSpec *spec, LaunchResult *res)
+{
+	LaunchChild c = {.spec = spec, .attach_err = ENOTTY};
+	char **targv = NULL;
+	const char *opt, *term;
+	struct stat st;
+	sigset_t all, old;
+	int pidfd = -1, err = 0;
+	pid_t pid;
+
+	memset(res, 0, sizeof(*res));
+	res->pid = -1;
+	res->pidfd = -1;
+	res->attach_err = ENOTTY;
+	if (!spec || !spec->argv || !spec->argv[0])
+		return -EINVAL;
+
+	if (spec->cgroup && spec->cgroup[0])
+	{
+		c.ncg = procattr_open_cgroups(spec->cgroup, c.cgfds, PROCATTR_MAX_CGROUPS);
+		if (c.ncg < 0)
+		{
+			c.attr_failed = PROCATTR_CGROUP; /* gone, or not ours to join */
+			c.ncg = 0;
+		}
+	}
+
+	/* anything but a terminal could block the open, and us with it */
+	c.tty_ok = spec->tty && spec->tty[0] && stat(spec->tty, &st) == 0 && S_ISCHR(st.st_mode);
+
+	term = spec->terminal ? launch_terminal(&opt) : NULL;
+	if (term)
+	{
+		int argc = 0;
+		while (spec->argv[argc])
+			argc++;
+		targv = malloc((argc + 3) * sizeof(*targv));
+		if (!targv)
+		{
+			err = ENOMEM;
+			goto out;
+		}
+		targv[0] = (char *)term;
+		targv[1] = (char *)opt;
+		targv[2] = (char *)(spec->exe && spec->exe[0] ? spec->exe : spec->argv[0]);
+		memcpy(targv + 3, spec->argv + 1, argc * sizeof(*targv)); /* the rest and the NULL */
+		c.targv = targv;
+	}
+
+	pthread_mutex_lock(&launch_lock);
+	if (!launch_stack)
+	{
+		void *m = mmap(NULL, LAUNCH_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		launch_stack = m == MAP_FAILED ? NULL : m;
+	}
+	if (!launch_stack)
+	{
+		err = errno;
+		pthread_mutex_unlock(&launch_lock);
+		goto out;
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	double t0 = launch_now();
+	/* returns once the child has exec'd or exited */
+	pid = clone(launch_child, launch_stack + LAUNCH_STACK, CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &c,
+				&pidfd);
+	if (pid < 0 && errno == EINVAL)
+	{
+		/* no CLONE_PIDFD before Linux 5.2 */
+		pid = clone(launch_child, launch_stack + LAUNCH_STACK, CLONE_VM | CLONE_VFORK | SIGCHLD, &c);
+		if (pid > 0)
+			pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+	}
+	err = errno;
+	res->exec_ms = (launch_now() - t0) * 1e3;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_mutex_unlock(&launch_lock);
+	if (pid < 0)
+		goto out;
+	err = 0;
+	res->pid = pid;
+	res->pidfd = pidfd;
+	res->attach_err = c.attach_err;
+	res->in_terminal = c.in_terminal;
+	res->exec_err = c.exec_err;
+	res->attr_failed = c.attr_failed;
+out:
+	for (int i = 0; i < c.ncg; i++)
+		close(c.cgfds[i]);
+	free(targv);
+	return -err;
+}
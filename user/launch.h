@@ -0,0 +1,54 @@
+// ==== user/launch.h ====
+// Restore launcher: starts a saved program with everything prepared in the
+// parent (argv, terminal argv, tty check) and a child created with
+// clone(CLONE_VM | CLONE_VFORK | CLONE_PIDFD), the way posix_spawn() does it:
+// no address space copy, the child only does the tty handover and the exec,
+// and the call returns once the child has exec'd, with its exec result and a
+// pidfd, so nothing has to be read back from a pipe. The terminal emulator
+// to fall back to is looked up once per process and exec'd directly. Saved
+// execution attributes (procattr.h) are applied by the child right before
+// the exec, so the program never runs without them.
+
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <sys/types.h>
+
+#include "procattr.h"
+
+#define LAUNCH_OUT_PATH "/tmp/restore.out" /* stdout/stderr of a detached launch */
+
+typedef struct
+{
+	const char *exe;   /* execve() this; NULL or "": search PATH for argv[0] */
+	char *const *argv; /* argv[0] and on, NULL terminated */
+	const char *tty;   /* reattach to this terminal first; NULL or "": don't */
+	int terminal;	   /* not reattached: run it in a new terminal emulator if there is one */
+	const char *out;   /* not reattached and no terminal: stdout/stderr (NULL: /dev/null) */
+	const ProcAttrs *attrs; /* apply these first (NULL: inherit ours) */
+	const char *cgroup;		/* and move into these cgroups (procattr_cgroup() text) */
+} LaunchSpec;
+
+typedef struct
+{
+	pid_t pid;		/* the child, still to be reaped; -1 if none was created */
+	int pidfd;		/* -1 on kernels without CLONE_PIDFD and pidfd_open() */
+	int attach_err; /* 0 if spec->tty became its controlling terminal, else why not */
+	int in_terminal; /* pid is a terminal emulator running argv, not argv itself */
+	int exec_err;	/* errno of the failed exec (the child exited 127), 0 if it exec'd */
+	unsigned attr_failed; /* PROCATTR_* that could not be applied */
+	double exec_ms; /* launch() call to exec */
+} LaunchResult;
+
+/* start spec as described above. Returns 0 (res->pid is a child, check
+   res->exec_err) or -errno if no child could be created. Calls are
+   serialized; the caller's thread is held only until the child execs. */
+int launch(const LaunchSpec *spec, LaunchResult *res);
+
+/* the terminal emulator launch() uses: its path, and the option that takes
+   the command (e.g. "-e"); NULL if there is none (no display, none found).
+   Looked up on the first call ($TERM_PROGRAM first, then the usual ones on
+   $PATH) and cached. */
+const char *launch_terminal(const char **opt);
+
+#endif /* LAUNCH_H */
@@ -0,0 +1,50 @@
+// ==== user/logdump.c ====
+// Decoder for the binary event log (binlog.h) written by snapshotctl and
+// snapshot_user.
+// Compile: gcc -O2 -Wall -pthread -o logdump logdump.c binlog.c
+// Usage: ./logdump [-j] [logfile]
+//   -j  one JSON object per record instead of text
+//   logfile defaults to $SNAPSHOT_LOG, else /tmp/snapshot.binlog
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "binlog.h"
+
+int main(int argc, char **argv)
+{
+	int json = 0, opt;
+
+	while ((opt = getopt(argc, argv, "j")) != -1)
+	{
+		if (opt == 'j')
+			json = 1;
+		else
+		{
+			fprintf(stderr, "usage: %s [-j] [logfile]\n", argv[0]);
+			return 2;
+		}
+	}
+	const char *path = optind < argc ? argv[optind] : binlog_default_path();
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		perror(path);
+		return 1;
+	}
+	long n = binlog_dump(fd, stdout, json);
+	close(fd);
+	if (n < 0)
+	{
+		fprintf(stderr, "%s: %s\n", path, n == -EPROTO ? "not an event log" : strerror((int)-n));
+		return 1;
+	}
+	if (!json)
+		fprintf(stderr, "%ld record%s\n", n, n == 1 ? "" : "s");
+	return 0;
+}
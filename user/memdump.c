@@ -0,0 +1,1117 @@
+// ==== user/memdump.c ====
+// Parallel memory dumper, see memdump.h.
+// Phase 1 (serial, cheap): parse maps, scan pagemap, build runs of pages to copy.
+// Phase 2 (parallel): runs are cut into chunks of at most CHUNK_BYTES / IOV_BATCH
+// iovecs; workers pull chunks, read each with one process_vm_readv() and
+// pwrite() it at its precomputed offset in the output file.
+// memdump_pid_image() shares phase 1 and then streams the pages in address
+// order through a snapimage.c writer instead; memdump_pid_image_store() does
+// the same but puts each page into a pagestore.c store and writes its ref.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "memdump.h"
+#include "snapimage.h"
+
+#define PM_PRESENT (1ULL << 63)
+#define PM_SWAPPED (1ULL << 62)
+#define PM_FILE (1ULL << 61) /* file page or shared anon */
+#define PM_SOFT_DIRTY (1ULL << 55)
+
+#define PAGEMAP_BATCH 4096		   /* pagemap entries per pread */
+#define CHUNK_BYTES (4UL << 20)	   /* per process_vm_readv call */
+#define IOV_BATCH 1024			   /* UIO_MAXIOV */
+#define MAX_AUTO_THREADS 8
+
+typedef struct
+{
+	uint64_t first_run; /* runs[first_run..last_run] (inclusive) */
+	uint64_t last_run;
+	uint64_t head_skip; /* bytes of first run already covered by the previous chunk */
+	uint64_t bytes;
+	uint64_t out_off;
+} Chunk;
+
+typedef struct
+{
+	pid_t pid;
+	int outfd;
+	size_t page_size;
+	MemDumpRun *runs;
+	Chunk *chunks;
+	uint64_t nr_chunks;
+	uint64_t next; /* atomic: next chunk to take */
+	uint64_t skipped_bytes; /* atomic */
+	int err;				/* first fatal error (atomic) */
+} DumpJob;
+
+/* what phase 1 finds */
+typedef struct
+{
+	MemDumpRegion *regions;
+	uint64_t nreg, capreg;
+	MemDumpRun *runs;
+	uint64_t nruns, capruns;
+	char *strtab;
+	uint64_t strlen_, strcap;
+} Layout;
+
+static double md_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* growable array helper */
+static int grow(void **arr, uint64_t *cap, uint64_t need, size_t elem)
+{
+	if (need <= *cap)
+		return 0;
+	uint64_t n = *cap ? *cap * 2 : 256;
+	while (n < need)
+		n *= 2;
+	void *p = realloc(*arr, n * elem);
+	if (!p)
+		return -ENOMEM;
+	*arr = p;
+	*cap = n;
+	return 0;
+}
+
+static uint32_t strtab_add(char **tab, uint64_t *len, uint64_t *cap, const char *s)
+{
+	size_t n = strlen(s) + 1;
+	if (grow((void **)tab, cap, *len + n, 1) < 0)
+		return 0;
+	uint32_t off = (uint32_t)*len;
+	memcpy(*tab + *len, s, n);
+	*len += n;
+	return off;
+}
+
+static int is_file_path(const char *path)
+{
+	return path[0] == '/' && !strstr(path, " (deleted)");
+}
+
+static void *dump_worker(void *arg)
+{
+	DumpJob *job = arg;
+	struct iovec local, *remote = calloc(IOV_BATCH, sizeof(*remote));
+	void *buf = NULL;
+
+	if (!remote || posix_memalign(&buf, job->page_size, CHUNK_BYTES) != 0)
+	{
+		__atomic_compare_exchange_n(&job->err, &(int){0}, -ENOMEM, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		free(remote);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		uint64_t ci = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (ci >= job->nr_chunks || __atomic_load_n(&job->err, __ATOMIC_RELAXED))
+			break;
+		Chunk *c = &job->chunks[ci];
+		uint64_t left = c->bytes;
+		int niov = 0;
+
+		for (uint64_t r = c->first_run; r <= c->last_run && left > 0; r++)
+		{
+			uint64_t skip = (r == c->first_run) ? c->head_skip : 0;
+			uint64_t len = job->runs[r].nr_pages * job->page_size - skip;
+			if (len > left)
+				len = left;
+			remote[niov].iov_base = (void *)(uintptr_t)(job->runs[r].vaddr + skip);
+			remote[niov].iov_len = len;
+			niov++;
+			left -= len;
+		}
+		local.iov_base = buf;
+		local.iov_len = c->bytes;
+
+		ssize_t got = process_vm_readv(job->pid, &local, 1, remote, niov, 0);
+		if (got < 0)
+		{
+			if (errno == ESRCH || errno == EPERM)
+			{
+				int e = -errno;
+				__atomic_compare_exchange_n(&job->err, &(int){0}, e, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				break;
+			}
+			got = 0;
+		}
+		if ((uint64_t)got < c->bytes)
+		{
+			/* a page went away after the pagemap scan: keep layout, zero-fill */
+			memset((char *)buf + got, 0, c->bytes - got);
+			__atomic_fetch_add(&job->skipped_bytes, c->bytes - got, __ATOMIC_RELAXED);
+		}
+
+		uint64_t done = 0;
+		while (done < c->bytes)
+		{
+			ssize_t w = pwrite(job->outfd, (char *)buf + done, c->bytes - done, (off_t)(c->out_off + done));
+			if (w < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				int e = -errno;
+				__atomic_compare_exchange_n(&job->err, &(int){0}, e, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				break;
+			}
+			done += (uint64_t)w;
+		}
+	}
+
+	free(buf);
+	free(remote);
+	return NULL;
+}
+
+/* cut runs into chunks of <= CHUNK_BYTES and <= IOV_BATCH iovecs each */
+static int plan_chunks(DumpJob *job, uint64_t nr_runs, uint64_t data_offset)
+{
+	uint64_t cap = 0, n = 0, out = data_offset;
+	Chunk *chunks = NULL;
+	uint64_t r = 0, skip = 0;
+
+	while (r < nr_runs)
+	{
+		if (grow((void **)&chunks, &cap, n + 1, sizeof(*chunks)) < 0)
+		{
+			free(chunks);
+			return -ENOMEM;
+		}
+		Chunk *c = &chunks[n++];
+		c->first_run = r;
+		c->head_skip = skip;
+		c->bytes = 0;
+		c->out_off = out;
+		int niov = 0;
+		while (r < nr_runs && niov < IOV_BATCH && c->bytes < CHUNK_BYTES)
+		{
+			uint64_t run_left = job->runs[r].nr_pages * job->page_size - skip;
+			uint64_t room = CHUNK_BYTES - c->bytes;
+			c->last_run = r;
+			niov++;
+			if (run_left > room)
+			{
+				c->bytes += room;
+				skip += room;
+				break;
+			}
+			c->bytes += run_left;
+			skip = 0;
+			r++;
+		}
+		out += c->bytes;
+	}
+	job->chunks = chunks;
+	job->nr_chunks = n;
+	return 0;
+}
+
+static void layout_free(Layout *L)
+{
+	free(L->regions);
+	free(L->runs);
+	free(L->strtab);
+}
+
+/* phase 1: regions from maps, runs of pages to copy from pagemap
+   (dirty_only: just the soft-dirty ones) */
+static int scan_layout(pid_t pid, size_t ps, Layout *L, MemDumpStats *st, int dirty_only)
+{
+	uint64_t *pm = NULL;
+	char path[64];
+	char *line = NULL;
+	size_t linecap = 0;
+	FILE *maps = NULL;
+	int pmfd = -1, rc = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	maps = fopen(path, "r");
+	snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+	pmfd = open(path, O_RDONLY | O_CLOEXEC);
+	pm = malloc(PAGEMAP_BATCH * sizeof(*pm));
+	if (!maps || pmfd < 0 || !pm)
+	{
+		rc = pm ? -errno : -ENOMEM;
+		goto out;
+	}
+	strtab_add(&L->strtab, &L->strlen_, &L->strcap, ""); /* offset 0 = no path */
+
+	while (getline(&line, &linecap, maps) > 0)
+	{
+		unsigned long start, end, off;
+		char perms[8] = {0};
+		int pathpos = 0;
+
+		line[strcspn(line, "\n")] = 0;
+		if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &off, &pathpos) < 4)
+			continue;
+		const char *rpath = pathpos ? line + pathpos : "";
+		if (perms[0] != 'r' || strcmp(rpath, "[vvar]") == 0 || strcmp(rpath, "[vsyscall]") == 0 ||
+			strcmp(rpath, "[vvar_vclock]") == 0)
+			continue;
+
+		if (grow((void **)&L->regions, &L->capreg, L->nreg + 1, sizeof(*L->regions)) < 0)
+		{
+			rc = -ENOMEM;
+			goto out;
+		}
+		MemDumpRegion *rg = &L->regions[L->nreg++];
+		int file = is_file_path(rpath);
+		memset(rg, 0, sizeof(*rg));
+		rg->start = start;
+		rg->end = end;
+		rg->file_offset = off;
+		rg->prot = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) |
+				   (perms[2] == 'x' ? PROT_EXEC : 0);
+		rg->flags = (file ? 0 : MD_REGION_ANON) | (perms[3] == 'p' ? MD_REGION_PRIVATE : 0);
+		rg->path = rpath[0] ? strtab_add(&L->strtab, &L->strlen_, &L->strcap, rpath) : 0;
+
+		/* scan pagemap and collect runs of pages that must be copied */
+		uint64_t npages = (end - start) / ps;
+		uint64_t run_start = 0, run_len = 0;
+		for (uint64_t base = 0; base < npages; base += PAGEMAP_BATCH)
+		{
+			uint64_t cnt = npages - base < PAGEMAP_BATCH ? npages - base : PAGEMAP_BATCH;
+			ssize_t r = pread(pmfd, pm, cnt * sizeof(*pm), (off_t)((start / ps + base) * sizeof(*pm)));
+			if (r < 0)
+			{
+				rc = -errno;
+				goto out;
+			}
+			cnt = (uint64_t)r / sizeof(*pm);
+			for (uint64_t i = 0; i < cnt; i++)
+			{
+				uint64_t e = pm[i];
+				int populated = (e & (PM_PRESENT | PM_SWAPPED)) != 0;
+				/* in a file mapping only private COW copies are anonymous */
+				int copy = populated && (!file || !(e & PM_FILE)) && (!dirty_only || (e & PM_SOFT_DIRTY));
+				if (populated && !copy)
+					st->file_pages++;
+				if (copy)
+				{
+					uint64_t va = start + (base + i) * ps;
+					if (run_len && run_start + run_len * ps == va)
+						run_len++;
+					else
+					{
+						if (run_len)
+						{
+							if (grow((void **)&L->runs, &L->capruns, L->nruns + 1, sizeof(*L->runs)) < 0)
+							{
+								rc = -ENOMEM;
+								goto out;
+							}
+							L->runs[L->nruns++] = (MemDumpRun){run_start, run_len, 0};
+						}
+						run_start = va;
+						run_len = 1;
+					}
+					st->anon_pages++;
+				}
+			}
+			if (cnt == 0)
+				break;
+		}
+		if (run_len)
+		{
+			if (grow((void **)&L->runs, &L->capruns, L->nruns + 1, sizeof(*L->runs)) < 0)
+			{
+				rc = -ENOMEM;
+				goto out;
+			}
+			L->runs[L->nruns++] = (MemDumpRun){run_start, run_len, 0};
+		}
+	}
+
+out:
+	if (pmfd >= 0)
+		close(pmfd);
+	if (maps)
+		fclose(maps);
+	free(line);
+	free(pm);
+	return rc;
+}
+
+/* run a planned job on up to nthreads workers; returns how many ran it */
+static int run_job(DumpJob *job, int nthreads)
+{
+	if ((uint64_t)nthreads > job->nr_chunks)
+		nthreads = job->nr_chunks ? (int)job->nr_chunks : 1;
+
+	pthread_t *th = calloc(nthreads, sizeof(*th));
+	int started = 0;
+	for (int i = 0; th && i < nthreads; i++)
+		if (pthread_create(&th[i], NULL, dump_worker, job) == 0)
+			started++;
+	if (!started)
+		dump_worker(job); /* no threads available: do it inline */
+	for (int i = 0; i < started; i++)
+		pthread_join(th[i], NULL);
+	free(th);
+	return started ? started : 1;
+}
+
+static int auto_threads(int nthreads)
+{
+	if (nthreads > 0)
+		return nthreads;
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > MAX_AUTO_THREADS ? MAX_AUTO_THREADS : (n > 0 ? (int)n : 1);
+}
+
+int memdump_pid(pid_t pid, const char *outpath, int nthreads, MemDumpStats *st)
+{
+	MemDumpStats local_st;
+	Layout L;
+	int outfd = -1, rc = 0;
+	size_t ps = (size_t)sysconf(_SC_PAGESIZE);
+	double t0 = md_now();
+
+	if (!st)
+		st = &local_st;
+	memset(st, 0, sizeof(*st));
+	memset(&L, 0, sizeof(L));
+	nthreads = auto_threads(nthreads);
+
+	/* ---- phase 1: regions and runs ---- */
+	rc = scan_layout(pid, ps, &L, st, 0);
+	if (rc < 0)
+		goto out;
+
+	/* ---- layout ---- */
+	MemDumpHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = MEMDUMP_MAGIC;
+	hdr.pid = pid;
+	hdr.page_size = (uint32_t)ps;
+	hdr.nr_regions = L.nreg;
+	hdr.nr_runs = L.nruns;
+	hdr.strtab_size = L.strlen_;
+	uint64_t meta = sizeof(hdr) + L.nreg * sizeof(*L.regions) + L.nruns * sizeof(*L.runs) + L.strlen_;
+	hdr.data_offset = (meta + ps - 1) / ps * ps;
+	uint64_t off = hdr.data_offset;
+	for (uint64_t i = 0; i < L.nruns; i++)
+	{
+		L.runs[i].data_offset = off;
+		off += L.runs[i].nr_pages * ps;
+	}
+	hdr.data_bytes = off - hdr.data_offset;
+
+	outfd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (outfd < 0 || ftruncate(outfd, (off_t)off) < 0)
+	{
+		rc = -errno;
+		goto out;
+	}
+	struct iovec meta_iov[4] = {
+		{&hdr, sizeof(hdr)},
+		{L.regions, L.nreg * sizeof(*L.regions)},
+		{L.runs, L.nruns * sizeof(*L.runs)},
+		{L.strtab, L.strlen_},
+	};
+	if (pwritev(outfd, meta_iov, 4, 0) != (ssize_t)meta)
+	{
+		rc = errno ? -errno : -EIO;
+		goto out;
+	}
+
+	/* ---- phase 2: parallel copy ---- */
+	DumpJob job;
+	memset(&job, 0, sizeof(job));
+	job.pid = pid;
+	job.outfd = outfd;
+	job.page_size = ps;
+	job.runs = L.runs;
+	if (plan_chunks(&job, L.nruns, hdr.data_offset) < 0)
+	{
+		rc = -ENOMEM;
+		goto out;
+	}
+	st->threads = run_job(&job, nthreads);
+	free(job.chunks);
+
+	rc = job.err;
+	st->skipped_pages = job.skipped_bytes / ps;
+	st->bytes = hdr.data_bytes;
+
+out:
+	st->regions = L.nreg;
+	st->runs = L.nruns;
+	st->seconds = md_now() - t0;
+	st->gbps = st->seconds > 0 ? st->bytes / st->seconds / 1e9 : 0;
+	if (outfd >= 0)
+		close(outfd);
+	layout_free(&L);
+	return rc;
+}
+
+/* readlink() of /proc/<pid>/<name> into out */
+static int read_proc_link(pid_t pid, const char *name, char *out, size_t outlen)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+	ssize_t r = readlink(path, out, outlen - 1);
+	if (r < 0)
+		return -errno;
+	out[r] = '\0';
+	return 0;
+}
+
+/* argv, exe, cwd, tty, uid and comm of pid as image metadata */
+static void add_proc_meta(SnapImgWriter *w, pid_t pid)
+{
+	char path[64], buf[4096];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		n = read(fd, buf, sizeof(buf));
+		if (n > 0)
+			snapimg_add_meta(w, SNAPIMG_META_ARGV, buf, (uint32_t)n);
+		close(fd);
+	}
+	if (read_proc_link(pid, "exe", buf, sizeof(buf)) == 0)
+		snapimg_add_meta(w, SNAPIMG_META_EXE, buf, (uint32_t)strlen(buf));
+	if (read_proc_link(pid, "cwd", buf, sizeof(buf)) == 0)
+		snapimg_add_meta(w, SNAPIMG_META_CWD, buf, (uint32_t)strlen(buf));
+	if (read_proc_link(pid, "fd/0", buf, sizeof(buf)) == 0 || read_proc_link(pid, "fd/1", buf, sizeof(buf)) == 0)
+		snapimg_add_meta(w, SNAPIMG_META_TTY, buf, (uint32_t)strlen(buf));
+
+	snprintf(path, sizeof(path), "/proc/%d", pid);
+	struct stat sb;
+	if (stat(path, &sb) == 0)
+	{
+		uint32_t uid = (uint32_t)sb.st_uid;
+		snapimg_add_meta(w, SNAPIMG_META_UID, &uid, sizeof(uid));
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		n = read(fd, buf, sizeof(buf));
+		while (n > 0 && buf[n - 1] == '\n')
+			n--;
+		if (n > 0)
+			snapimg_add_meta(w, SNAPIMG_META_COMM, buf, (uint32_t)n);
+		close(fd);
+	}
+}
+
+static int add_regions(SnapImgWriter *w, const Layout *L)
+{
+	for (uint64_t i = 0; i < L->nreg; i++)
+	{
+		const MemDumpRegion *rg = &L->regions[i];
+		SnapImgRegion ir = {rg->start, rg->end, rg->file_offset, rg->prot, 0, 0, 0};
+		ir.flags = ((rg->flags & MD_REGION_ANON) ? SNAPIMG_REGION_ANON : 0) |
+				   ((rg->flags & MD_REGION_PRIVATE) ? SNAPIMG_REGION_PRIVATE : 0);
+		int rc = snapimg_add_region(w, &ir, rg->path ? L->strtab + rg->path : NULL);
+		if (rc < 0)
+			return rc;
+	}
+	return 0;
+}
+
+/* nr_pages pages at vaddr into the image, or into store with only refs in the image */
+static int add_image_pages(SnapImgWriter *w, PageStore *store, SnapImgPageRef *refs, uint64_t vaddr,
+						   const char *data, uint64_t nr_pages, size_t ps, MemDumpStats *st)
+{
+	if (!store)
+		return snapimg_add_pages(w, vaddr, data, nr_pages);
+	for (uint64_t i = 0; i < nr_pages; i++)
+	{
+		int is_new;
+		int rc = pagestore_put(store, data + i * ps, &refs[i], &is_new);
+		if (rc < 0)
+			return rc;
+		st->stored_pages += is_new;
+	}
+	return snapimg_add_refs(w, vaddr, refs, nr_pages);
+}
+
+static int image_pid(pid_t pid, int outfd, PageStore *store, const char *parent, MemDumpStats *st)
+{
+	MemDumpStats local_st;
+	Layout L;
+	struct iovec local, remote[IOV_BATCH];
+	SnapImgPageRef *refs = NULL;
+	void *buf = NULL;
+	size_t ps = (size_t)sysconf(_SC_PAGESIZE);
+	double t0 = md_now();
+	int rc;
+
+	if (!st)
+		st = &local_st;
+	memset(st, 0, sizeof(*st));
+	memset(&L, 0, sizeof(L));
+	st->threads = 1;
+
+	SnapImgWriter *w = snapimg_writer_new(outfd, pid);
+	if (store)
+		refs = malloc(CHUNK_BYTES / ps * sizeof(*refs));
+	if (!w || (store && !refs) || posix_memalign(&buf, ps, CHUNK_BYTES) != 0)
+	{
+		rc = -ENOMEM;
+		goto out;
+	}
+	add_proc_meta(w, pid);
+	if (parent)
+		snapimg_add_meta(w, SNAPIMG_META_PARENT, parent, (uint32_t)strlen(parent));
+
+	rc = scan_layout(pid, ps, &L, st, 0);
+	if (rc < 0)
+		goto out;
+	rc = add_regions(w, &L);
+	if (rc < 0)
+		goto out;
+
+	/* same chunking as the parallel dump, but read and appended in order */
+	DumpJob job;
+	memset(&job, 0, sizeof(job));
+	job.page_size = ps;
+	job.runs = L.runs;
+	rc = plan_chunks(&job, L.nruns, 0);
+	if (rc < 0)
+		goto out;
+	for (uint64_t ci = 0; ci < job.nr_chunks && rc == 0; ci++)
+	{
+		Chunk *c = &job.chunks[ci];
+		uint64_t left = c->bytes;
+		int niov = 0;
+
+		for (uint64_t r = c->first_run; r <= c->last_run && left > 0; r++)
+		{
+			uint64_t skip = (r == c->first_run) ? c->head_skip : 0;
+			uint64_t len = L.runs[r].nr_pages * ps - skip;
+			if (len > left)
+				len = left;
+			remote[niov].iov_base = (void *)(uintptr_t)(L.runs[r].vaddr + skip);
+			remote[niov].iov_len = len;
+			niov++;
+			left -= len;
+		}
+		local.iov_base = buf;
+		local.iov_len = c->bytes;
+
+		ssize_t got = process_vm_readv(pid, &local, 1, remote, niov, 0);
+		if (got < 0)
+		{
+			if (errno == ESRCH || errno == EPERM)
+			{
+				rc = -errno;
+				break;
+			}
+			got = 0;
+		}
+		if ((uint64_t)got < c->bytes)
+		{
+			/* a page went away after the pagemap scan: keep layout, zero-fill */
+			memset((char *)buf + got, 0, c->bytes - got);
+			st->skipped_pages += (c->bytes - got) / ps;
+		}
+
+		/* one index entry per remote range; the writer merges neighbours */
+		char *p = buf;
+		for (int k = 0; k < niov && rc == 0; k++)
+		{
+			rc = add_image_pages(w, store, refs, (uint64_t)(uintptr_t)remote[k].iov_base, p,
+								 remote[k].iov_len / ps, ps, st);
+			p += remote[k].iov_len;
+		}
+		st->bytes += c->bytes;
+	}
+	free(job.chunks);
+	if (rc == 0)
+		rc = snapimg_finish(w);
+	else
+		snapimg_writer_abort(w);
+	w = NULL;
+
+out:
+	snapimg_writer_abort(w);
+	st->regions = L.nreg;
+	st->runs = L.nruns;
+	st->seconds = md_now() - t0;
+	st->gbps = st->seconds > 0 ? st->bytes / st->seconds / 1e9 : 0;
+	free(refs);
+	free(buf);
+	layout_free(&L);
+	return rc;
+}
+
+int memdump_pid_image(pid_t pid, int outfd, MemDumpStats *st)
+{
+	return image_pid(pid, outfd, NULL, NULL, st);
+}
+
+int memdump_pid_image_store(pid_t pid, int outfd, PageStore *store, const char *parent, MemDumpStats *st)
+{
+	return image_pid(pid, outfd, store, parent, st);
+}
+
+/* ---- iterative pre-copy ----
+ * Round 0 resets the soft-dirty bits and copies every populated page into a
+ * staging file while pid runs. Each further round briefly stops pid to read
+ * the pages dirtied since the last reset and to reset the bits again, lets it
+ * go, and copies just those pages. Then pid is stopped for good and only the
+ * final dirty set (plus anything populated that was never staged) is copied;
+ * the image is written from the staging file after that.
+ * The stop around the read-and-reset is what keeps it exact: a page first
+ * written between reading pagemap and writing clear_refs would lose its
+ * soft-dirty bit without ever having been seen.
+ */
+
+#define PRECOPY_CONVERGED 256 /* dirty pages small enough to stop iterating */
+
+/* vaddr -> staging offset of its latest copy; open addressing, key 0 = empty */
+typedef struct
+{
+	uint64_t *keys;
+	uint64_t *vals;
+	uint64_t cap; /* power of two */
+	uint64_t n;
+} PageMap;
+
+static uint64_t pm_slot(const PageMap *m, uint64_t key)
+{
+	uint64_t i = ((key >> 12) * 0x9E3779B97F4A7C15ULL) & (m->cap - 1);
+	while (m->keys[i] && m->keys[i] != key)
+		i = (i + 1) & (m->cap - 1);
+	return i;
+}
+
+static int pm_put(PageMap *m, uint64_t key, uint64_t val)
+{
+	if ((m->n + 1) * 2 > m->cap)
+	{
+		PageMap g = {NULL, NULL, m->cap ? m->cap * 2 : 4096, 0};
+		g.keys = calloc(g.cap, sizeof(*g.keys));
+		g.vals = malloc(g.cap * sizeof(*g.vals));
+		if (!g.keys || !g.vals)
+		{
+			free(g.keys);
+			free(g.vals);
+			return -ENOMEM;
+		}
+		for (uint64_t i = 0; i < m->cap; i++)
+			if (m->keys[i])
+			{
+				uint64_t j = pm_slot(&g, m->keys[i]);
+				g.keys[j] = m->keys[i];
+				g.vals[j] = m->vals[i];
+				g.n++;
+			}
+		free(m->keys);
+		free(m->vals);
+		*m = g;
+	}
+	uint64_t i = pm_slot(m, key);
+	if (!m->keys[i])
+	{
+		m->keys[i] = key;
+		m->n++;
+	}
+	m->vals[i] = val;
+	return 0;
+}
+
+static int pm_get(const PageMap *m, uint64_t key, uint64_t *val)
+{
+	if (!m->cap)
+		return 0;
+	uint64_t i = pm_slot(m, key);
+	if (!m->keys[i])
+		return 0;
+	if (val)
+		*val = m->vals[i];
+	return 1;
+}
+
+static void pm_free(PageMap *m)
+{
+	free(m->keys);
+	free(m->vals);
+	memset(m, 0, sizeof(*m));
+}
+
+typedef struct
+{
+	pid_t pid;
+	size_t ps;
+	int nthreads;
+	int stagefd;
+	uint64_t staged; /* bytes appended to the staging file */
+	PageMap map;
+	uint64_t skipped_pages;
+} PreCopy;
+
+static int clear_soft_dirty(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/clear_refs", pid);
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	int rc = write(fd, "4", 1) == 1 ? 0 : -errno;
+	close(fd);
+	return rc;
+}
+
+/* clear_refs accepts "4" even on kernels built without CONFIG_MEM_SOFT_DIRTY,
+   where the bit then simply never shows up: try it on a page of our own */
+static int soft_dirty_works(size_t ps)
+{
+	static int cached = -1;
+	uint64_t e = 0;
+
+	if (cached >= 0)
+		return cached;
+	volatile char *p = mmap(NULL, ps, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (p != MAP_FAILED && fd >= 0)
+	{
+		p[0] = 1;
+		if (clear_soft_dirty(getpid()) == 0)
+		{
+			p[0] = 2;
+			if (pread(fd, &e, sizeof(e), (off_t)((uintptr_t)p / ps * sizeof(e))) != sizeof(e))
+				e = 0;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	if (p != MAP_FAILED)
+		munmap((void *)p, ps);
+	cached = (e & PM_SOFT_DIRTY) != 0;
+	return cached;
+}
+
+/* every thread of pid in a stopped state (T or t), or -ETIMEDOUT after ~2 s */
+static int wait_stopped(pid_t pid)
+{
+	char path[300];
+
+	for (int tries = 0; tries < 2000; tries++)
+	{
+		int running = 0;
+		snprintf(path, sizeof(path), "/proc/%d/task", pid);
+		DIR *d = opendir(path);
+		if (!d)
+			return -errno;
+		struct dirent *de;
+		while ((de = readdir(d)) && !running)
+		{
+			char buf[512];
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "/proc/%d/task/%s/stat", pid, de->d_name);
+			int fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				continue; /* thread exited */
+			ssize_t n = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			if (n <= 0)
+				continue;
+			buf[n] = '\0';
+			char *p = strrchr(buf, ')');
+			if (p && p[1] == ' ' && p[2] != 'T' && p[2] != 't' && p[2] != 'Z' && p[2] != 'X')
+				running = 1;
+		}
+		closedir(d);
+		if (!running)
+			return 0;
+		usleep(1000);
+	}
+	return -ETIMEDOUT;
+}
+
+static int stop_pid(pid_t pid)
+{
+	if (kill(pid, SIGSTOP) < 0)
+		return -errno;
+	return wait_stopped(pid);
+}
+
+/* append runs to the staging file and remember where each page went */
+static int stage_runs(PreCopy *pc, MemDumpRun *runs, uint64_t nruns)
+{
+	uint64_t off = pc->staged;
+	DumpJob job;
+
+	for (uint64_t i = 0; i < nruns; i++)
+	{
+		runs[i].data_offset = off;
+		off += runs[i].nr_pages * pc->ps;
+	}
+	memset(&job, 0, sizeof(job));
+	job.pid = pc->pid;
+	job.outfd = pc->stagefd;
+	job.page_size = pc->ps;
+	job.runs = runs;
+	if (plan_chunks(&job, nruns, pc->staged) < 0)
+		return -ENOMEM;
+	run_job(&job, pc->nthreads);
+	free(job.chunks);
+	if (job.err)
+		return job.err;
+	pc->skipped_pages += job.skipped_bytes / pc->ps;
+
+	for (uint64_t i = 0; i < nruns; i++)
+		for (uint64_t p = 0; p < runs[i].nr_pages; p++)
+			if (pm_put(&pc->map, runs[i].vaddr + p * pc->ps, runs[i].data_offset + p * pc->ps) < 0)
+				return -ENOMEM;
+	pc->staged = off;
+	return 0;
+}
+
+static uint64_t runs_pages(const Layout *L)
+{
+	uint64_t n = 0;
+	for (uint64_t i = 0; i < L->nruns; i++)
+		n += L->runs[i].nr_pages;
+	return n;
+}
+
+/* pages of all[] that are dirty or were never staged, as runs */
+static int final_runs(PreCopy *pc, const Layout *all, const Layout *dirty, Layout *out)
+{
+	PageMap d = {0};
+	int rc = 0;
+
+	for (uint64_t i = 0; i < dirty->nruns && !rc; i++)
+		for (uint64_t p = 0; p < dirty->runs[i].nr_pages && !rc; p++)
+			rc = pm_put(&d, dirty->runs[i].vaddr + p * pc->ps, 1);
+
+	for (uint64_t i = 0; i < all->nruns && !rc; i++)
+		for (uint64_t p = 0; p < all->runs[i].nr_pages && !rc; p++)
+		{
+			uint64_t va = all->runs[i].vaddr + p * pc->ps;
+			if (!pm_get(&d, va, NULL) && pm_get(&pc->map, va, NULL))
+				continue;
+			MemDumpRun *last = out->nruns ? &out->runs[out->nruns - 1] : NULL;
+			if (last && last->vaddr + last->nr_pages * pc->ps == va)
+				last->nr_pages++;
+			else if ((rc = grow((void **)&out->runs, &out->capruns, out->nruns + 1, sizeof(*out->runs))) == 0)
+				out->runs[out->nruns++] = (MemDumpRun){va, 1, 0};
+		}
+	pm_free(&d);
+	return rc;
+}
+
+/* stream the pages of L's runs from the staging file into the image */
+static int emit_staged(PreCopy *pc, SnapImgWriter *w, const Layout *L, void *buf, MemDumpStats *st)
+{
+	uint64_t max = CHUNK_BYTES / pc->ps;
+
+	for (uint64_t i = 0; i < L->nruns; i++)
+	{
+		uint64_t va = L->runs[i].vaddr, left = L->runs[i].nr_pages;
+		while (left)
+		{
+			uint64_t first, off, n = 1;
+			if (!pm_get(&pc->map, va, &first))
+				return -EIO; /* final_runs() staged every page of L */
+			/* extend while the staged copies are contiguous too */
+			while (n < left && n < max && pm_get(&pc->map, va + n * pc->ps, &off) && off == first + n * pc->ps)
+				n++;
+			ssize_t got = pread(pc->stagefd, buf, n * pc->ps, (off_t)first);
+			if (got != (ssize_t)(n * pc->ps))
+				return got < 0 ? -errno : -EIO;
+			int rc = snapimg_add_pages(w, va, buf, n);
+			if (rc < 0)
+				return rc;
+			st->bytes += n * pc->ps;
+			va += n * pc->ps;
+			left -= n;
+		}
+	}
+	return 0;
+}
+
+static int open_staging(void)
+{
+	const char *dir = getenv("TMPDIR");
+	int fd = open(dir && dir[0] ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0)
+		fd = memfd_create("memdump-precopy", MFD_CLOEXEC);
+	return fd < 0 ? -errno : fd;
+}
+
+int memdump_pid_precopy(pid_t pid, int outfd, int max_rounds, int nthreads, MemDumpStats *st,
+						MemDumpPrecopyStats *pst)
+{
+	MemDumpStats local_st, scratch;
+	MemDumpPrecopyStats local_pst;
+	PreCopy pc;
+	Layout L, all, dirty, fin;
+	SnapImgWriter *w = NULL;
+	void *buf = NULL;
+	int stopped = 0, rc;
+	double t0 = md_now(), t_clear;
+
+	if (!st)
+		st = &local_st;
+	if (!pst)
+		pst = &local_pst;
+	memset(st, 0, sizeof(*st));
+	memset(pst, 0, sizeof(*pst));
+	memset(&pc, 0, sizeof(pc));
+	memset(&L, 0, sizeof(L));
+	memset(&all, 0, sizeof(all));
+	memset(&dirty, 0, sizeof(dirty));
+	memset(&fin, 0, sizeof(fin));
+	if (max_rounds > MEMDUMP_PRECOPY_MAX_ROUNDS)
+		max_rounds = MEMDUMP_PRECOPY_MAX_ROUNDS;
+	pc.pid = pid;
+	pc.ps = (size_t)sysconf(_SC_PAGESIZE);
+	pc.nthreads = auto_threads(nthreads);
+	pc.stagefd = open_staging();
+	if (pc.stagefd < 0)
+		return pc.stagefd;
+	st->threads = pc.nthreads;
+
+	/* ---- round 0: everything, pid running ---- */
+	int tracking = soft_dirty_works(pc.ps) && clear_soft_dirty(pid) == 0;
+	t_clear = md_now();
+	if (!tracking)
+		max_rounds = 0; /* no soft-dirty bits: plain stop-and-copy below */
+	else
+	{
+		rc = scan_layout(pid, pc.ps, &L, &scratch, 0);
+		if (rc == 0)
+			rc = stage_runs(&pc, L.runs, L.nruns);
+		if (rc < 0)
+			goto out;
+		pst->round[0].pages = runs_pages(&L);
+		pst->round[0].seconds = md_now() - t_clear;
+		pst->rounds = 1;
+		layout_free(&L);
+		memset(&L, 0, sizeof(L));
+	}
+
+	/* ---- live rounds: just what was dirtied meanwhile ---- */
+	for (int r = 1; r <= max_rounds; r++)
+	{
+		double t = md_now();
+		rc = stop_pid(pid);
+		stopped = 1;
+		if (rc == 0)
+			rc = scan_layout(pid, pc.ps, &L, &scratch, 1);
+		if (rc == 0)
+			rc = clear_soft_dirty(pid);
+		double now = md_now();
+		kill(pid, SIGCONT);
+		stopped = 0;
+		pst->pause_seconds += now - t;
+		if (rc < 0)
+			goto out;
+
+		uint64_t pages = runs_pages(&L);
+		pst->round[r].dirty_rate = t > t_clear ? pages / (t - t_clear) : 0;
+		t_clear = now;
+		rc = stage_runs(&pc, L.runs, L.nruns);
+		if (rc < 0)
+			goto out;
+		pst->round[r].pages = pages;
+		pst->round[r].seconds = md_now() - now;
+		pst->rounds = r + 1;
+		layout_free(&L);
+		memset(&L, 0, sizeof(L));
+		if (pages <= PRECOPY_CONVERGED || pages >= pst->round[r - 1].pages)
+			break; /* small enough, or not shrinking any more */
+	}
+
+	/* ---- final: pid stopped, copy what is left ---- */
+	double t_stop = md_now();
+	rc = stop_pid(pid);
+	stopped = 1;
+	if (rc == 0)
+		rc = scan_layout(pid, pc.ps, &all, st, 0);
+	if (rc == 0 && tracking)
+		rc = scan_layout(pid, pc.ps, &dirty, &scratch, 1);
+	if (rc == 0)
+		rc = final_runs(&pc, &all, &dirty, &fin);
+	if (rc == 0)
+		rc = stage_runs(&pc, fin.runs, fin.nruns);
+	if (rc < 0)
+		goto out;
+	int f = pst->rounds;
+	pst->round[f].pages = runs_pages(&fin);
+	pst->round[f].dirty_rate = tracking && t_stop > t_clear ? runs_pages(&dirty) / (t_stop - t_clear) : 0;
+	pst->round[f].seconds = md_now() - t_stop;
+	pst->rounds = f + 1;
+	pst->stop_seconds = md_now() - t_stop;
+
+	/* ---- image from the staging file; pid may be killed meanwhile ---- */
+	w = snapimg_writer_new(outfd, pid);
+	if (!w || posix_memalign(&buf, pc.ps, CHUNK_BYTES) != 0)
+	{
+		rc = -ENOMEM;
+		goto out;
+	}
+	add_proc_meta(w, pid);
+	rc = add_regions(w, &all);
+	if (rc == 0)
+		rc = emit_staged(&pc, w, &all, buf, st);
+	if (rc == 0)
+		rc = snapimg_finish(w);
+	else
+		snapimg_writer_abort(w);
+	w = NULL;
+	st->skipped_pages = pc.skipped_pages;
+
+out:
+	if (rc < 0 && stopped)
+		kill(pid, SIGCONT);
+	snapimg_writer_abort(w);
+	st->regions = all.nreg;
+	st->runs = all.nruns;
+	st->seconds = md_now() - t0;
+	st->gbps = st->seconds > 0 ? st->bytes / st->seconds / 1e9 : 0;
+	free(buf);
+	layout_free(&L);
+	layout_free(&all);
+	layout_free(&dirty);
+	layout_free(&fin);
+	pm_free(&pc.map);
+	close(pc.stagefd);
+	return rc;
+}
+
+void memdump_precopy_report(FILE *f, const MemDumpPrecopyStats *pst)
+{
+	double ps = (double)sysconf(_SC_PAGESIZE);
+
+	for (int r = 0; r < pst->rounds; r++)
+		fprintf(f, "  round %d%s: %llu pages (%.1f MiB) in %.1f ms, dirty rate %.0f pages/s (%.1f MiB/s)\n", r,
+				r == pst->rounds - 1 ? " (stopped)" : "", (unsigned long long)pst->round[r].pages,
+				pst->round[r].pages * ps / 1048576.0, pst->round[r].seconds * 1e3, pst->round[r].dirty_rate,
+				pst->round[r].dirty_rate * ps / 1048576.0);
+	fprintf(f, "  stopped %.1f ms at the end (plus %.1f ms of soft-dirty resets)\n", pst->stop_seconds * 1e3,
+			pst->pause_seconds * 1e3);
+}
@@ -0,0 +1,112 @@
+// ==== user/memdump.h ====
+// Userspace memory dumper: reads /proc/<pid>/maps and /proc/<pid>/pagemap and
+// copies only populated anonymous pages with batched process_vm_readv() calls,
+// split across a pool of worker threads. Clean file-backed pages are recorded
+// as (file, offset) only.
+
+#ifndef MEMDUMP_H
+#define MEMDUMP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "pagestore.h"
+
+#define MEMDUMP_MAGIC 0x31504d4450414e53ULL /* "SNAPDMP1" */
+
+/* file layout:
+ *   MemDumpHeader | MemDumpRegion[nr_regions] | MemDumpRun[nr_runs] | strtab
+ *   | zero pad to page_size | page data (data_bytes)
+ */
+typedef struct
+{
+	uint64_t magic;
+	int32_t pid;
+	uint32_t page_size;
+	uint64_t nr_regions;
+	uint64_t nr_runs;
+	uint64_t strtab_size;
+	uint64_t data_offset; /* page aligned */
+	uint64_t data_bytes;
+} MemDumpHeader;
+
+/* MemDumpRegion.flags */
+#define MD_REGION_ANON 0x1	  /* no backing file: heap, stack, anonymous mmap */
+#define MD_REGION_PRIVATE 0x2 /* MAP_PRIVATE ('p' in maps) */
+
+typedef struct
+{
+	uint64_t start;
+	uint64_t end;
+	uint64_t file_offset; /* offset into path for file-backed regions */
+	uint32_t prot;		  /* PROT_* */
+	uint32_t flags;		  /* MD_REGION_* */
+	uint32_t path;		  /* offset into strtab, 0 = none */
+	uint32_t pad;
+} MemDumpRegion;
+
+/* contiguous copied pages; data_offset is relative to the file start */
+typedef struct
+{
+	uint64_t vaddr;
+	uint64_t nr_pages;
+	uint64_t data_offset;
+} MemDumpRun;
+
+typedef struct
+{
+	uint64_t regions;
+	uint64_t runs;
+	uint64_t anon_pages;	/* copied */
+	uint64_t file_pages;	/* present but only referenced as (file, offset) */
+	uint64_t skipped_pages; /* vanished between pagemap scan and copy */
+	uint64_t stored_pages;	/* new to the page store (the rest were shared) */
+	uint64_t bytes;
+	int threads;
+	double seconds;
+	double gbps;
+} MemDumpStats;
+
+/* dump pid's memory to outpath using nthreads workers (<= 0: one per CPU, max 8).
+   Returns 0 or -errno; st (optional) is filled in either way. */
+int memdump_pid(pid_t pid, const char *outpath, int nthreads, MemDumpStats *st);
+
+/* write pid's metadata (argv, exe, cwd, tty, uid, comm) and memory to outfd
+   as a snapimage.h image in one sequential pass; outfd may be a pipe.
+   Returns 0 or -errno; st (optional) is filled in either way. */
+int memdump_pid_image(pid_t pid, int outfd, MemDumpStats *st);
+
+/* same, but every page goes into store and the image holds only its ref
+   (SNAPIMG_F_PAGE_REFS); pages already in the store, from other processes
+   or from parent (recorded as SNAPIMG_META_PARENT, may be NULL), are not
+   stored again. The caller commits the store with pagestore_close(). */
+int memdump_pid_image_store(pid_t pid, int outfd, PageStore *store, const char *parent, MemDumpStats *st);
+
+#define MEMDUMP_PRECOPY_MAX_ROUNDS 8
+
+typedef struct
+{
+	int rounds; /* entries used in round[]: 0 = full copy, last = pid stopped */
+	struct
+	{
+		uint64_t pages;	   /* copied in this round */
+		double seconds;	   /* spent copying them */
+		double dirty_rate; /* pages/s dirtied since the previous round (0 for round 0) */
+	} round[MEMDUMP_PRECOPY_MAX_ROUNDS + 2];
+	double pause_seconds; /* brief stops of the live rounds to read and reset soft-dirty bits */
+	double stop_seconds;  /* final stop until every page was copied */
+} MemDumpPrecopyStats;
+
+/* like memdump_pid_image() but iterative: copy everything while pid runs,
+   then up to max_rounds rounds of only the pages soft-dirtied since the
+   previous one, then stop pid (SIGSTOP) and copy the remainder. pid is left
+   stopped on success, ready to be snapshotted and killed, and continued on
+   failure. Without soft-dirty support it is a plain stop-and-copy. */
+int memdump_pid_precopy(pid_t pid, int outfd, int max_rounds, int nthreads, MemDumpStats *st,
+						MemDumpPrecopyStats *pst);
+
+/* one line per round: pages, MiB, copy time and dirty rate, then the stop windows */
+void memdump_precopy_report(FILE *f, const MemDumpPrecopyStats *pst);
+
+#endif /* MEMDUMP_H */
@@ -0,0 +1,476 @@
+// ==== user/memrestore.c ====
+// Lazy restore of a snapshot image, see memrestore.h.
+// The image file is mapped read-only once (snapimg_open()). Every dumped
+// region is mapped again at its original address (MAP_FIXED_NOREPLACE, so
+// nothing of ours is ever replaced): file-backed regions from their file,
+// anonymous ones empty and registered with userfaultfd in MISSING mode. A
+// handler thread answers each fault with one UFFDIO_COPY of up to FAULT_AHEAD
+// pages of the run that holds the address, or UFFDIO_ZEROPAGE for pages the
+// image does not have. The pages of an image with page refs are read from the
+// store into a bounce buffer first. userfaultfd cannot register private file
+// mappings, so the COW pages inside them are copied while mapping.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "memrestore.h"
+#include "pagestore.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+
+#define FAULT_AHEAD 16 /* pages per UFFDIO_COPY, bounded by the run */
+#define VERIFY_CHUNK 256 /* pages per memrestore_for_each_run() call, page ref images */
+
+struct MemRestore
+{
+	SnapImg img; /* whole image file, read-only */
+	size_t page_size;
+	uint64_t nr_regions, nr_runs;
+	const SnapImgRegion *regions;
+	const SnapImgIndex *runs;
+	PageStore *store; /* SNAPIMG_F_PAGE_REFS: where the pages are */
+	void *bounce;	  /* FAULT_AHEAD pages read from the store, fault thread only */
+	char *region_mapped;
+	int uffd;
+	int stop_pipe[2];
+	pthread_t th;
+	int th_started;
+	MemRestoreStats st;
+};
+
+static double mr_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* nr_pages of run from vaddr on: in place in the image, or read from the
+   store into buf. NULL if the store could not supply them. */
+static const void *run_pages(MemRestore *mr, uint64_t vaddr, uint64_t nr_pages, void *buf)
+{
+	if (!mr->store)
+		return snapimg_page(&mr->img, vaddr); /* a run's pages are contiguous */
+
+	const SnapImgPageRef *refs = snapimg_page_ref(&mr->img, vaddr);
+	for (uint64_t i = 0; i < nr_pages; i++)
+		if (!refs || pagestore_read(mr->store, &refs[i], (char *)buf + i * mr->page_size) < 0)
+			return NULL;
+	return buf;
+}
+
+static uint64_t run_end(MemRestore *mr, const SnapImgIndex *run)
+{
+	return run->vaddr + run->nr_pages * mr->page_size;
+}
+
+/* index of the first run ending past vaddr; runs are sorted by address */
+static uint64_t first_run(MemRestore *mr, uint64_t vaddr)
+{
+	uint64_t lo = 0, hi = mr->nr_runs;
+
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (mr->runs[mid].vaddr <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo && vaddr < run_end(mr, &mr->runs[lo - 1]) ? lo - 1 : lo;
+}
+
+/* region holding vaddr, or NULL; regions are sorted by address too */
+static const SnapImgRegion *find_region(MemRestore *mr, uint64_t vaddr)
+{
+	uint64_t lo = 0, hi = mr->nr_regions;
+
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (mr->regions[mid].start <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo && vaddr < mr->regions[lo - 1].end ? &mr->regions[lo - 1] : NULL;
+}
+
+/* the part [*lo, *hi) of runs[i] inside rg; 0 once the runs are past it.
+   The writer merges runs across adjacent regions, so one may span several. */
+static int clip_run(MemRestore *mr, const SnapImgRegion *rg, uint64_t i, uint64_t *lo, uint64_t *hi)
+{
+	if (i >= mr->nr_runs || mr->runs[i].vaddr >= rg->end)
+		return 0;
+	*lo = mr->runs[i].vaddr > rg->start ? mr->runs[i].vaddr : rg->start;
+	*hi = run_end(mr, &mr->runs[i]) < rg->end ? run_end(mr, &mr->runs[i]) : rg->end;
+	return 1;
+}
+
+/* copy len bytes of the run holding page into place, falling back to one
+   page at a time when part of the range is already populated (a racing
+   fault, or a page the process wrote before faulting on its neighbour) */
+static void serve_run(MemRestore *mr, uint64_t page, uint64_t len)
+{
+	const char *src = run_pages(mr, page, len / mr->page_size, mr->bounce);
+	struct uffdio_copy cp = {
+		.dst = page,
+		.src = (uint64_t)(uintptr_t)src,
+		.len = len,
+	};
+
+	if (!src)
+	{
+		/* the faulting thread must not wait forever: zeroes, and counted */
+		struct uffdio_zeropage zp = {.range = {.start = page, .len = len}};
+		if (ioctl(mr->uffd, UFFDIO_ZEROPAGE, &zp) == 0)
+			__atomic_fetch_add(&mr->st.unreadable_pages, len / mr->page_size, __ATOMIC_RELAXED);
+		return;
+	}
+	if (ioctl(mr->uffd, UFFDIO_COPY, &cp) == 0)
+	{
+		__atomic_fetch_add(&mr->st.served_pages, len / mr->page_size, __ATOMIC_RELAXED);
+		return;
+	}
+	if (errno != EEXIST || len == mr->page_size)
+		return; /* EEXIST: already there, the faulting thread is woken anyway */
+
+	for (uint64_t off = 0; off < len; off += mr->page_size)
+	{
+		cp.dst = page + off;
+		cp.src = (uint64_t)(uintptr_t)(src + off);
+		cp.len = mr->page_size;
+		cp.copy = 0;
+		if (ioctl(mr->uffd, UFFDIO_COPY, &cp) == 0)
+			__atomic_fetch_add(&mr->st.served_pages, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void handle_fault(MemRestore *mr, uint64_t addr)
+{
+	uint64_t page = addr & ~(uint64_t)(mr->page_size - 1);
+	uint64_t i = first_run(mr, page);
+	const SnapImgRegion *rg = find_region(mr, page);
+	uint64_t start, end;
+
+	__atomic_fetch_add(&mr->st.faults, 1, __ATOMIC_RELAXED);
+	if (rg && clip_run(mr, rg, i, &start, &end) && start <= page)
+	{
+		uint64_t len = FAULT_AHEAD * mr->page_size;
+		if (len > end - page)
+			len = end - page;
+		serve_run(mr, page, len);
+		return;
+	}
+
+	/* never populated in the dumped process: it would have read zeroes too */
+	struct uffdio_zeropage zp = {.range = {.start = page, .len = mr->page_size}};
+	if (ioctl(mr->uffd, UFFDIO_ZEROPAGE, &zp) == 0)
+		__atomic_fetch_add(&mr->st.zero_pages, 1, __ATOMIC_RELAXED);
+}
+
+static void *fault_thread(void *arg)
+{
+	MemRestore *mr = arg;
+	struct uffd_msg msg[32];
+	struct pollfd pfd[2] = {
+		{.fd = mr->uffd, .events = POLLIN},
+		{.fd = mr->stop_pipe[0], .events = POLLIN},
+	};
+
+	for (;;)
+	{
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+
+		ssize_t n = read(mr->uffd, msg, sizeof(msg));
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			break;
+		}
+		for (ssize_t i = 0; i < n / (ssize_t)sizeof(msg[0]); i++)
+			if (msg[i].event == UFFD_EVENT_PAGEFAULT)
+				handle_fault(mr, msg[i].arg.pagefault.address);
+	}
+	return NULL;
+}
+
+static int open_uffd(void)
+{
+	/* user-mode-only faults are all we need and work without privileges */
+	int fd = (int)syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (fd < 0 && errno == EINVAL)
+		fd = (int)syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0)
+		return -errno;
+
+	struct uffdio_api api = {.api = UFFD_API};
+	if (ioctl(fd, UFFDIO_API, &api) < 0)
+	{
+		int e = -errno;
+		close(fd);
+		return e;
+	}
+	return fd;
+}
+
+/* copy the image pages of rg now; it is writable until the caller puts the
+   final protection back. Store pages are read straight into place. */
+static void copy_region_now(MemRestore *mr, const SnapImgRegion *rg)
+{
+	uint64_t lo, hi;
+
+	for (uint64_t i = first_run(mr, rg->start); clip_run(mr, rg, i, &lo, &hi); i++)
+	{
+		void *dst = (void *)(uintptr_t)lo;
+		uint64_t n = (hi - lo) / mr->page_size;
+		const void *src = run_pages(mr, lo, n, dst);
+
+		if (!src)
+		{
+			mr->st.unreadable_pages += n;
+			continue;
+		}
+		if (src != dst)
+			memcpy(dst, src, n * mr->page_size);
+		mr->st.eager_pages += n;
+	}
+}
+
+static int map_region(MemRestore *mr, uint64_t ri, unsigned flags)
+{
+	const SnapImgRegion *rg = &mr->regions[ri];
+	size_t len = rg->end - rg->start;
+	int file = !(rg->flags & SNAPIMG_REGION_ANON) && rg->path;
+	int lazy = !file && (rg->flags & SNAPIMG_REGION_PRIVATE) && !(flags & MR_EAGER);
+	uint64_t lo, hi;
+	int has_runs = clip_run(mr, rg, first_run(mr, rg->start), &lo, &hi);
+	int prot = rg->prot;
+	void *p;
+
+	/* writable while we fill it in, final protection afterwards */
+	if (has_runs && !lazy)
+		prot |= PROT_WRITE;
+
+	int fd = file ? open(mr->img.strtab + rg->path, O_RDONLY | O_CLOEXEC) : -1;
+	if (fd >= 0)
+	{
+		/* always private: restoring must never write through to the file */
+		p = mmap((void *)(uintptr_t)rg->start, len, prot, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd,
+				 (off_t)rg->file_offset);
+		close(fd);
+	}
+	else
+		p = mmap((void *)(uintptr_t)rg->start, len, prot,
+				 ((rg->flags & SNAPIMG_REGION_PRIVATE) ? MAP_PRIVATE : MAP_SHARED) | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+				 -1, 0);
+	if (p == MAP_FAILED)
+		return -errno;
+	if (p != (void *)(uintptr_t)rg->start)
+	{
+		/* kernel without MAP_FIXED_NOREPLACE treated it as a hint */
+		munmap(p, len);
+		return -EEXIST;
+	}
+	mr->region_mapped[ri] = 1;
+
+	if (lazy)
+	{
+		struct uffdio_register reg = {
+			.range = {.start = rg->start, .len = len},
+			.mode = UFFDIO_REGISTER_MODE_MISSING,
+		};
+		if (ioctl(mr->uffd, UFFDIO_REGISTER, &reg) == 0)
+		{
+			for (uint64_t i = first_run(mr, rg->start); clip_run(mr, rg, i, &lo, &hi); i++)
+				mr->st.lazy_pages += (hi - lo) / mr->page_size;
+			return 0;
+		}
+		/* registration refused: fill it in now instead */
+		if (has_runs && mprotect(p, len, rg->prot | PROT_WRITE) < 0)
+			return -errno;
+	}
+
+	copy_region_now(mr, rg);
+	if (has_runs && prot != (int)rg->prot)
+		mprotect(p, len, rg->prot);
+	return 0;
+}
+
+static int load_image(MemRestore *mr, const char *path, const char *storedir)
+{
+	int rc = snapimg_open(path, &mr->img);
+
+	if (rc < 0)
+		return rc;
+	if (mr->img.hdr->page_size != mr->page_size)
+		return -EINVAL;
+	mr->nr_regions = mr->img.trailer->nr_regions;
+	mr->nr_runs = mr->img.trailer->nr_index;
+	mr->regions = mr->img.regions;
+	mr->runs = mr->img.index;
+	if (!(mr->img.hdr->flags & SNAPIMG_F_PAGE_REFS))
+		return 0;
+
+	/* the pages are in a store: all of them must be there before we start */
+	if (!storedir || !storedir[0])
+		return -EINVAL;
+	rc = pagestore_open_reader(storedir, &mr->store);
+	if (rc == 0)
+		rc = pagestore_check_image(mr->store, &mr->img);
+	if (rc == 0 && !(mr->bounce = malloc(FAULT_AHEAD * mr->page_size)))
+		rc = -ENOMEM;
+	return rc;
+}
+
+int memrestore_open(const char *path, const char *storedir, unsigned flags, MemRestore **out)
+{
+	MemRestore *mr = calloc(1, sizeof(*mr));
+	double t0 = mr_now();
+	int rc;
+
+	if (!mr)
+		return -ENOMEM;
+	mr->uffd = -1;
+	mr->stop_pipe[0] = mr->stop_pipe[1] = -1;
+	mr->page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+	rc = load_image(mr, path, storedir);
+	if (rc < 0)
+		goto fail;
+	mr->region_mapped = calloc(mr->nr_regions + 1, 1);
+	if (!mr->region_mapped)
+	{
+		rc = -ENOMEM;
+		goto fail;
+	}
+	if (!(flags & MR_EAGER))
+	{
+		mr->uffd = open_uffd();
+		if (mr->uffd < 0)
+		{
+			rc = mr->uffd;
+			goto fail;
+		}
+	}
+
+	for (uint64_t i = 0; i < mr->nr_regions; i++)
+	{
+		if (map_region(mr, i, flags) < 0)
+			mr->st.regions_skipped++;
+		else
+			mr->st.regions++;
+	}
+
+	if (mr->uffd >= 0)
+	{
+		if (pipe2(mr->stop_pipe, O_CLOEXEC) < 0)
+		{
+			rc = -errno;
+			goto fail;
+		}
+		rc = pthread_create(&mr->th, NULL, fault_thread, mr);
+		if (rc)
+		{
+			rc = -rc;
+			goto fail;
+		}
+		mr->th_started = 1;
+	}
+	mr->st.map_seconds = mr_now() - t0;
+	*out = mr;
+	return 0;
+
+fail:
+	memrestore_close(mr);
+	return rc;
+}
+
+void memrestore_stats(MemRestore *mr, MemRestoreStats *st)
+{
+	*st = mr->st;
+	st->faults = __atomic_load_n(&mr->st.faults, __ATOMIC_RELAXED);
+	st->served_pages = __atomic_load_n(&mr->st.served_pages, __ATOMIC_RELAXED);
+	st->zero_pages = __atomic_load_n(&mr->st.zero_pages, __ATOMIC_RELAXED);
+	st->unreadable_pages = __atomic_load_n(&mr->st.unreadable_pages, __ATOMIC_RELAXED);
+}
+
+int memrestore_for_each_run(MemRestore *mr,
+							int (*fn)(void *addr, const void *image, uint64_t bytes, void *arg), void *arg)
+{
+	uint64_t chunk = mr->store ? VERIFY_CHUNK : UINT64_MAX;
+	void *buf = mr->store ? malloc(VERIFY_CHUNK * mr->page_size) : NULL;
+	int rc = 0;
+
+	if (mr->store && !buf)
+		return -ENOMEM;
+	for (uint64_t r = 0; r < mr->nr_regions && !rc; r++)
+	{
+		const SnapImgRegion *rg = &mr->regions[r];
+		uint64_t lo, hi;
+		if (!mr->region_mapped[r])
+			continue;
+		for (uint64_t i = first_run(mr, rg->start); !rc && clip_run(mr, rg, i, &lo, &hi); i++)
+			for (uint64_t vaddr = lo, n; vaddr < hi && !rc; vaddr += n * mr->page_size)
+			{
+				n = (hi - vaddr) / mr->page_size < chunk ? (hi - vaddr) / mr->page_size : chunk;
+				const void *src = run_pages(mr, vaddr, n, buf);
+				rc = src ? fn((void *)(uintptr_t)vaddr, src, n * mr->page_size, arg) : -EIO;
+			}
+	}
+	free(buf);
+	return rc;
+}
+
+void memrestore_close(MemRestore *mr)
+{
+	if (!mr)
+		return;
+	if (mr->th_started)
+	{
+		ssize_t w = write(mr->stop_pipe[1], "", 1);
+		(void)w;
+		pthread_join(mr->th, NULL);
+	}
+	if (mr->region_mapped)
+		for (uint64_t i = 0; i < mr->nr_regions; i++)
+			if (mr->region_mapped[i])
+				munmap((void *)(uintptr_t)mr->regions[i].start, mr->regions[i].end - mr->regions[i].start);
+	if (mr->stop_pipe[0] >= 0)
+		close(mr->stop_pipe[0]);
+	if (mr->stop_pipe[1] >= 0)
+		close(mr->stop_pipe[1]);
+	if (mr->uffd >= 0)
+		close(mr->uffd);
+	pagestore_close(mr->store, 0);
+	snapimg_close(&mr->img);
+	free(mr->bounce);
+	free(mr->region_mapped);
+	free(mr);
+}
@@ -0,0 +1,50 @@
+// ==== user/memrestore.h ====
+// Lazy restore of a snapshot image (snapimage.h): recreates the dumped
+// address-space layout in the calling process and serves anonymous pages from
+// the image, or from its page store, on first touch through userfaultfd, so
+// the layout is usable long before every page has been copied and pages that
+// are never touched are never read.
+
+#ifndef MEMRESTORE_H
+#define MEMRESTORE_H
+
+#include <stdint.h>
+
+typedef struct MemRestore MemRestore;
+
+/* memrestore_open() flags */
+#define MR_EAGER 0x1 /* copy every page up front instead of on first touch */
+
+typedef struct
+{
+	uint64_t regions;		  /* mapped at their original address */
+	uint64_t regions_skipped; /* overlap a mapping of the calling process */
+	uint64_t lazy_pages;	  /* in the image, served on first touch */
+	uint64_t eager_pages;	  /* copied while mapping (MR_EAGER, file-backed COW pages) */
+	uint64_t faults;		  /* userfaultfd page faults handled */
+	uint64_t served_pages;	  /* pages copied from the image by the fault handler */
+	uint64_t zero_pages;	  /* faults on pages the image does not hold */
+	uint64_t unreadable_pages; /* could not be read from the page store: zeroes */
+	double map_seconds;		  /* until the layout was ready */
+} MemRestoreStats;
+
+/* map the layout of the image at path and, unless MR_EAGER, start the fault
+   handler thread. An image with page refs (SNAPIMG_F_PAGE_REFS) reads its
+   pages from the store in storedir (-EINVAL without one, -ENOENT if the
+   store lacks some). Returns 0 or -errno. */
+int memrestore_open(const char *path, const char *storedir, unsigned flags, MemRestore **out);
+
+/* fault-handler counters are sampled, the rest is final after open */
+void memrestore_stats(MemRestore *mr, MemRestoreStats *st);
+
+/* call fn for every run of image pages that was restored (in pieces, for an
+   image with page refs), with its address in this process and its bytes in
+   the image; stops at the first nonzero return and passes it on (touching
+   addr faults the run in) */
+int memrestore_for_each_run(MemRestore *mr,
+							int (*fn)(void *addr, const void *image, uint64_t bytes, void *arg), void *arg);
+
+/* stop the fault handler and unmap everything */
+void memrestore_close(MemRestore *mr);
+
+#endif /* MEMRESTORE_H */
@@ -0,0 +1,858 @@
+// ==== user/pagestore.c ====
+// Content-addressed page store, see pagestore.h.
+// The whole index lives in memory while the store is open: an array of
+// entries plus an open-addressing table over it keyed by the ref. A hash hit
+// is confirmed against the stored bytes, read through a mapping of the data
+// file, before it is shared; a genuine collision moves the new page to the
+// next free ref (refs are opaque keys, not recomputed on read), so equal refs
+// always mean equal pages. Entries changed since the last commit are kept on
+// a dirty list, which is all a commit has to write.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pagestore.h"
+
+#define INDEX_NAME "pages.idx"
+#define INDEX_TMP_NAME "pages.idx.tmp"
+#define LOG_NAME "pages.log"
+#define LOG_MIN_ENTRIES 4096 /* below this the log is never compacted */
+
+struct PageStore
+{
+	int dirfd; /* flock()ed for the whole session */
+	int datafd;
+	uint64_t gen;
+	size_t page_size;
+	uint64_t data_end; /* next append offset */
+	PageStoreEntry *ents;
+	uint64_t count, cap;
+	uint64_t *slots; /* entry index + 1, 0 = empty */
+	uint64_t nslots; /* power of two */
+	void *scratch;	 /* one page, for gc and when the data file is not mapped */
+	const char *map; /* data file, read-only, map_len bytes (may run past EOF) */
+	size_t map_len;
+	struct
+	{
+		uint64_t i, refs; /* entry and its committed refs, for rollback */
+	} *dirty;			  /* entries changed since the last commit */
+	uint64_t ndirty, capdirty;
+	uint64_t committed; /* entries as of the last commit; later ones are new */
+	unsigned char *marked; /* entry is on the dirty list */
+	uint64_t capmarked;
+	int logfd;			  /* pages.log, -1 if not open */
+	uint64_t log_end;	  /* append offset, 0: rewrite the log before appending */
+	uint64_t log_entries; /* entries in the log, compacted once above count */
+	int readonly;		  /* pagestore_open_reader(): unlocked, reads only */
+};
+
+/* growable array helper, as in memdump.c */
+static int grow(void **arr, uint64_t *cap, uint64_t need, size_t elem)
+{
+	if (need <= *cap)
+		return 0;
+	uint64_t n = *cap ? *cap * 2 : 64;
+	while (n < need)
+		n *= 2;
+	void *p = realloc(*arr, n * elem);
+	if (!p)
+		return -ENOMEM;
+	*arr = p;
+	*cap = n;
+	return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		off += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int pread_all(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = pread(fd, p, len, off);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0)
+			return -EIO;
+		p += n;
+		off += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/* ---- hashing ----
+ * Four independent multiply-rotate lanes over 8-byte words (the xxHash64
+ * round), folded into two 64-bit halves; a page hashes at memory speed. */
+#define P1 0x9e3779b185ebca87ULL
+#define P2 0xc2b2ae3d27d4eb4fULL
+#define P3 0x165667b19e3779f9ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t lane(uint64_t acc, uint64_t w)
+{
+	return rotl(acc + w * P2, 31) * P1;
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static SnapImgPageRef page_hash(const void *page, size_t len)
+{
+	const uint64_t *w = page;
+	uint64_t a = P1 + P2, b = P2, c = 0, d = -P1;
+
+	for (size_t i = 0; i + 4 <= len / 8; i += 4)
+	{
+		a = lane(a, w[i]);
+		b = lane(b, w[i + 1]);
+		c = lane(c, w[i + 2]);
+		d = lane(d, w[i + 3]);
+	}
+	SnapImgPageRef ref = {{avalanche(rotl(a, 1) ^ rotl(c, 12) ^ len), avalanche(rotl(b, 7) ^ rotl(d, 18) ^ P3)}};
+	if (ref.h[0] == 0 && ref.h[1] == 0)
+		ref.h[1] = 1; /* reserved for the zero page */
+	return ref;
+}
+
+static int is_zero_page(const void *page, size_t len)
+{
+	const uint64_t *w = page;
+
+	for (size_t i = 0; i < len / 8; i++)
+		if (w[i])
+			return 0;
+	return 1;
+}
+
+static int ref_is_zero(const SnapImgPageRef *ref)
+{
+	return ref->h[0] == 0 && ref->h[1] == 0;
+}
+
+/* ---- index table ---- */
+static uint64_t *find_slot(const PageStore *ps, const SnapImgPageRef *ref)
+{
+	uint64_t mask = ps->nslots - 1;
+
+	for (uint64_t i = ref->h[0] & mask;; i = (i + 1) & mask)
+	{
+		uint64_t e = ps->slots[i];
+		if (!e)
+			return &ps->slots[i];
+		const SnapImgPageRef *k = &ps->ents[e - 1].ref;
+		if (k->h[0] == ref->h[0] && k->h[1] == ref->h[1])
+			return &ps->slots[i];
+	}
+}
+
+static PageStoreEntry *lookup(const PageStore *ps, const SnapImgPageRef *ref)
+{
+	uint64_t e = *find_slot(ps, ref);
+	return e ? &ps->ents[e - 1] : NULL;
+}
+
+static int mark_dirty(PageStore *ps, uint64_t i)
+{
+	uint64_t had = ps->capmarked;
+	int rc = grow((void **)&ps->marked, &ps->capmarked, ps->count, 1);
+	if (rc < 0)
+		return rc;
+	memset(ps->marked + had, 0, ps->capmarked - had);
+	if (ps->marked[i])
+		return 0;
+	rc = grow((void **)&ps->dirty, &ps->capdirty, ps->ndirty + 1, sizeof(*ps->dirty));
+	if (rc < 0)
+		return rc;
+	ps->marked[i] = 1;
+	ps->dirty[ps->ndirty].i = i;
+	ps->dirty[ps->ndirty++].refs = ps->ents[i].refs;
+	return 0;
+}
+
+static void clear_dirty(PageStore *ps)
+{
+	for (uint64_t i = 0; i < ps->ndirty; i++)
+		ps->marked[ps->dirty[i].i] = 0;
+	ps->ndirty = 0;
+	ps->committed = ps->count;
+}
+
+static void unmap_data(PageStore *ps)
+{
+	if (ps->map)
+		munmap((void *)ps->map, ps->map_len);
+	ps->map = NULL;
+	ps->map_len = 0;
+}
+
+/* map the data file so that the page at off is in the mapping, with some
+   slack as a writer appends. A reader maps once at open and never remaps
+   here, so concurrent pagestore_read() calls are safe. */
+static int map_data(PageStore *ps, uint64_t off)
+{
+	if (off + ps->page_size <= ps->map_len)
+		return 1;
+	if (ps->readonly && ps->map)
+		return 0;
+	size_t len = ps->data_end + (ps->readonly ? 0 : ps->data_end / 2 + (1 << 20));
+	unmap_data(ps);
+	void *p = len ? mmap(NULL, len, PROT_READ, MAP_SHARED, ps->datafd, 0) : MAP_FAILED;
+	if (p == MAP_FAILED)
+		return 0;
+	ps->map = p;
+	ps->map_len = len;
+	return off + ps->page_size <= len;
+}
+
+/* the stored page at off, or NULL; read into the scratch page if it cannot
+   be mapped */
+static const void *data_at(PageStore *ps, uint64_t off)
+{
+	if (map_data(ps, off))
+		return ps->map + off;
+	return pread_all(ps->datafd, ps->scratch, ps->page_size, (off_t)off) == 0 ? ps->scratch : NULL;
+}
+
+static void reindex(PageStore *ps)
+{
+	memset(ps->slots, 0, ps->nslots * sizeof(*ps->slots));
+	for (uint64_t i = 0; i < ps->count; i++)
+		*find_slot(ps, &ps->ents[i].ref) = i + 1;
+}
+
+/* size the table for count + extra entries at most half full and reinsert */
+static int rehash(PageStore *ps, uint64_t extra)
+{
+	uint64_t n = 1024;
+	while (n < (ps->count + extra) * 2)
+		n *= 2;
+	if (n == ps->nslots)
+		return 0;
+	uint64_t *slots = calloc(n, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	free(ps->slots);
+	ps->slots = slots;
+	ps->nslots = n;
+	reindex(ps);
+	return 0;
+}
+
+/* ---- files ---- */
+static int open_data(PageStore *ps, uint64_t gen, int flags)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "pages-%llu.dat", (unsigned long long)gen);
+	int fd = openat(ps->dirfd, name, flags | O_CLOEXEC, 0600);
+	return fd < 0 ? -errno : fd;
+}
+
+static void unlink_data(PageStore *ps, uint64_t gen)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "pages-%llu.dat", (unsigned long long)gen);
+	unlinkat(ps->dirfd, name, 0);
+}
+
+static int load_index(PageStore *ps)
+{
+	PageStoreIndexHeader h;
+	struct stat sb;
+	int rc;
+
+	int fd = openat(ps->dirfd, INDEX_NAME, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno; /* new store */
+	if (fstat(fd, &sb) < 0)
+	{
+		rc = -errno;
+		goto out;
+	}
+	rc = pread_all(fd, &h, sizeof(h), 0);
+	if (rc < 0)
+		goto out;
+	rc = -EINVAL;
+	if (h.magic != PAGESTORE_MAGIC || h.version != PAGESTORE_VERSION || h.page_size != ps->page_size ||
+		h.count > ((uint64_t)sb.st_size - sizeof(h)) / sizeof(PageStoreEntry))
+		goto out;
+	rc = grow((void **)&ps->ents, &ps->cap, h.count, sizeof(*ps->ents));
+	if (rc < 0)
+		goto out;
+	rc = pread_all(fd, ps->ents, h.count * sizeof(*ps->ents), sizeof(h));
+	if (rc < 0)
+		goto out;
+	ps->count = h.count;
+	ps->gen = h.gen;
+out:
+	close(fd);
+	return rc;
+}
+
+/* set entry ref to its logged state, adding it if it is new */
+static int apply_entry(PageStore *ps, const PageStoreEntry *le)
+{
+	uint64_t *slot = find_slot(ps, &le->ref);
+	int rc;
+
+	if (*slot)
+	{
+		ps->ents[*slot - 1] = *le;
+		return 0;
+	}
+	if (ps->count + 1 > ps->nslots / 2)
+	{
+		rc = rehash(ps, 1);
+		if (rc < 0)
+			return rc;
+		slot = find_slot(ps, &le->ref);
+	}
+	rc = grow((void **)&ps->ents, &ps->cap, ps->count + 1, sizeof(*ps->ents));
+	if (rc < 0)
+		return rc;
+	ps->ents[ps->count] = *le;
+	*slot = ++ps->count;
+	return 0;
+}
+
+/* replay the batches of pages.log over the loaded index, up to the first torn
+   one; the writer keeps the log open and appends after the last good batch */
+static int replay_log(PageStore *ps)
+{
+	PageStoreLogHeader h;
+	PageStoreLogBatch b;
+	PageStoreEntry *buf = NULL;
+	uint64_t capbuf = 0;
+	struct stat sb;
+	int rc;
+
+	int fd = openat(ps->dirfd, LOG_NAME, (ps->readonly ? O_RDONLY : O_RDWR | O_CREAT) | O_NOFOLLOW | O_CLOEXEC,
+					0600);
+	if (fd < 0)
+		return errno == ENOENT && ps->readonly ? 0 : -errno;
+	if (fstat(fd, &sb) < 0)
+	{
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+	uint64_t size = (uint64_t)sb.st_size, off = sizeof(h);
+	if (size < sizeof(h) || pread_all(fd, &h, sizeof(h), 0) < 0 || h.magic != PAGESTORE_LOG_MAGIC ||
+		h.version != PAGESTORE_VERSION || h.page_size != ps->page_size || h.gen != ps->gen)
+		off = 0; /* new, or stale from before a gc: rewritten on the next commit */
+
+	rc = 0;
+	while (off && off + sizeof(b) <= size && rc == 0)
+	{
+		if (pread_all(fd, &b, sizeof(b), (off_t)off) < 0 ||
+			b.count > (size - off - sizeof(b)) / sizeof(PageStoreEntry))
+			break;
+		rc = grow((void **)&buf, &capbuf, b.count ? b.count : 1, sizeof(*buf));
+		if (rc < 0)
+			break;
+		if (pread_all(fd, buf, b.count * sizeof(*buf), (off_t)(off + sizeof(b))) < 0)
+			break;
+		SnapImgPageRef sum = page_hash(buf, b.count * sizeof(*buf));
+		if (sum.h[0] != b.sum.h[0] || sum.h[1] != b.sum.h[1])
+			break;
+		for (uint64_t i = 0; i < b.count && rc == 0; i++)
+			rc = apply_entry(ps, &buf[i]);
+		off += sizeof(b) + b.count * sizeof(*buf);
+		ps->log_entries += b.count;
+	}
+	free(buf);
+	if (rc < 0 || ps->readonly)
+	{
+		close(fd);
+		return rc;
+	}
+	/* drop a torn batch, so what we append next is all that follows */
+	if (off && off < size && ftruncate(fd, (off_t)off) < 0)
+		off = 0;
+	ps->logfd = fd;
+	ps->log_end = off;
+	return 0;
+}
+
+/* start the log over, empty, for the current gen */
+static int reset_log(PageStore *ps)
+{
+	PageStoreLogHeader h = {PAGESTORE_LOG_MAGIC, PAGESTORE_VERSION, (uint32_t)ps->page_size, ps->gen};
+
+	ps->log_end = 0;
+	ps->log_entries = 0;
+	if (ftruncate(ps->logfd, 0) < 0)
+		return -errno;
+	int rc = pwrite_all(ps->logfd, &h, sizeof(h), 0);
+	if (rc == 0 && fdatasync(ps->logfd) < 0)
+		rc = -errno;
+	if (rc == 0)
+		ps->log_end = sizeof(h);
+	return rc;
+}
+
+/* append the dirty entries to the log as one batch; the data file is synced */
+static int append_log(PageStore *ps)
+{
+	uint64_t n = ps->ndirty;
+	size_t len = sizeof(PageStoreLogBatch) + n * sizeof(PageStoreEntry);
+	char *buf = malloc(len);
+	int rc;
+
+	if (!buf)
+		return -ENOMEM;
+	PageStoreLogBatch *b = (PageStoreLogBatch *)buf;
+	PageStoreEntry *le = (PageStoreEntry *)(b + 1);
+	for (uint64_t i = 0; i < n; i++)
+		le[i] = ps->ents[ps->dirty[i].i];
+	b->count = n;
+	b->sum = page_hash(le, n * sizeof(*le));
+	rc = pwrite_all(ps->logfd, buf, len, (off_t)ps->log_end);
+	if (rc == 0 && fdatasync(ps->logfd) < 0)
+		rc = -errno;
+	free(buf);
+	if (rc < 0)
+	{
+		/* a torn batch would hide every later one: start over next time */
+		ps->log_end = 0;
+		return rc;
+	}
+	ps->log_end += len;
+	ps->log_entries += n;
+	return 0;
+}
+
+/* replace pages.idx with the in-memory index, data file first */
+static int commit_index(PageStore *ps)
+{
+	PageStoreIndexHeader h = {PAGESTORE_MAGIC, PAGESTORE_VERSION, (uint32_t)ps->page_size, ps->gen, ps->count};
+	int rc;
+
+	if (fdatasync(ps->datafd) < 0)
+		return -errno;
+	int fd = openat(ps->dirfd, INDEX_TMP_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+	rc = pwrite_all(fd, &h, sizeof(h), 0);
+	if (rc == 0)
+		rc = pwrite_all(fd, ps->ents, ps->count * sizeof(*ps->ents), sizeof(h));
+	if (rc == 0 && fsync(fd) < 0)
+		rc = -errno;
+	close(fd);
+	if (rc == 0 && renameat(ps->dirfd, INDEX_TMP_NAME, ps->dirfd, INDEX_NAME) < 0)
+		rc = -errno;
+	if (rc < 0)
+	{
+		unlinkat(ps->dirfd, INDEX_TMP_NAME, 0);
+		return rc;
+	}
+	fsync(ps->dirfd);
+	return 0;
+}
+
+static void free_store(PageStore *ps)
+{
+	unmap_data(ps);
+	if (ps->logfd >= 0)
+		close(ps->logfd);
+	if (ps->datafd >= 0)
+		close(ps->datafd);
+	if (ps->dirfd >= 0)
+		close(ps->dirfd); /* drops the flock */
+	free(ps->ents);
+	free(ps->slots);
+	free(ps->scratch);
+	free(ps->dirty);
+	free(ps->marked);
+	free(ps);
+}
+
+static int open_store(const char *dir, int readonly, PageStore **out)
+{
+	struct stat sb;
+	int rc;
+
+	*out = NULL;
+	if (!readonly && mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -errno;
+	PageStore *ps = calloc(1, sizeof(*ps));
+	if (!ps)
+		return -ENOMEM;
+	ps->datafd = -1;
+	ps->logfd = -1;
+	ps->readonly = readonly;
+	ps->page_size = (size_t)sysconf(_SC_PAGESIZE);
+	ps->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ps->dirfd < 0 || flock(ps->dirfd, readonly ? LOCK_SH : LOCK_EX) < 0)
+	{
+		rc = -errno;
+		goto fail;
+	}
+	if (posix_memalign(&ps->scratch, ps->page_size, ps->page_size) != 0)
+	{
+		ps->scratch = NULL;
+		rc = -ENOMEM;
+		goto fail;
+	}
+	rc = load_index(ps);
+	if (rc == 0)
+		rc = rehash(ps, 0);
+	if (rc == 0)
+		rc = replay_log(ps);
+	if (rc < 0)
+		goto fail;
+	rc = open_data(ps, ps->gen, readonly ? O_RDONLY : O_RDWR | O_CREAT);
+	if (rc < 0)
+		goto fail;
+	ps->datafd = rc;
+	if (fstat(ps->datafd, &sb) < 0)
+	{
+		rc = -errno;
+		goto fail;
+	}
+	/* uncommitted pages of an earlier session stay as garbage past the end */
+	ps->data_end = ((uint64_t)sb.st_size + ps->page_size - 1) / ps->page_size * ps->page_size;
+	for (uint64_t i = 0; i < ps->count; i++)
+		if (ps->ents[i].offset + ps->page_size > ps->data_end)
+		{
+			rc = -EINVAL;
+			goto fail;
+		}
+	ps->committed = ps->count;
+	/* a gc only unlinks the data file we hold open; our index matches it */
+	if (readonly)
+	{
+		map_data(ps, 0);
+		flock(ps->dirfd, LOCK_UN);
+	}
+	*out = ps;
+	return 0;
+
+fail:
+	free_store(ps);
+	return rc;
+}
+
+int pagestore_open(const char *dir, PageStore **out)
+{
+	return open_store(dir, 0, out);
+}
+
+int pagestore_open_reader(const char *dir, PageStore **out)
+{
+	return open_store(dir, 1, out);
+}
+
+int pagestore_put(PageStore *ps, const void *page, SnapImgPageRef *ref, int *is_new)
+{
+	size_t len = ps->page_size;
+	int rc;
+
+	if (is_new)
+		*is_new = 0;
+	if (ps->readonly)
+		return -EROFS;
+	if (is_zero_page(page, len))
+	{
+		*ref = PAGESTORE_ZERO_REF;
+		return 0;
+	}
+
+	SnapImgPageRef key = page_hash(page, len);
+	for (;;)
+	{
+		PageStoreEntry *e = lookup(ps, &key);
+		if (!e)
+			break;
+		const void *stored = data_at(ps, e->offset);
+		if (!stored)
+			return -EIO;
+		if (memcmp(stored, page, len) == 0)
+		{
+			rc = mark_dirty(ps, (uint64_t)(e - ps->ents));
+			if (rc < 0)
+				return rc;
+			e->refs++;
+			*ref = key;
+			return 0;
+		}
+		if (++key.h[1] == 0 && key.h[0] == 0) /* collision: next ref */
+			key.h[1] = 1;
+	}
+
+	if (ps->count + 1 > ps->nslots / 2)
+	{
+		rc = rehash(ps, 1);
+		if (rc < 0)
+			return rc;
+	}
+	rc = grow((void **)&ps->ents, &ps->cap, ps->count + 1, sizeof(*ps->ents));
+	if (rc < 0)
+		return rc;
+	rc = pwrite_all(ps->datafd, page, len, (off_t)ps->data_end);
+	if (rc < 0)
+		return rc;
+	ps->ents[ps->count] = (PageStoreEntry){key, ps->data_end, 1};
+	*find_slot(ps, &key) = ++ps->count;
+	rc = mark_dirty(ps, ps->count - 1);
+	if (rc < 0)
+	{
+		/* forget it again: its bytes are garbage past the end until a gc */
+		*find_slot(ps, &key) = 0;
+		ps->count--;
+		return rc;
+	}
+	ps->data_end += len;
+	*ref = key;
+	if (is_new)
+		*is_new = 1;
+	return 0;
+}
+
+int pagestore_read(PageStore *ps, const SnapImgPageRef *ref, void *buf)
+{
+	if (ref_is_zero(ref))
+	{
+		memset(buf, 0, ps->page_size);
+		return 0;
+	}
+	PageStoreEntry *e = lookup(ps, ref);
+	if (!e)
+		return -ENOENT;
+	if (!map_data(ps, e->offset))
+		return pread_all(ps->datafd, buf, ps->page_size, (off_t)e->offset);
+	memcpy(buf, ps->map + e->offset, ps->page_size);
+	return 0;
+}
+
+int pagestore_unref(PageStore *ps, const SnapImgPageRef *ref)
+{
+	if (ps->readonly)
+		return -EROFS;
+	if (ref_is_zero(ref))
+		return 0;
+	PageStoreEntry *e = lookup(ps, ref);
+	if (!e)
+		return -ENOENT;
+	if (!e->refs)
+		return -EINVAL;
+	int rc = mark_dirty(ps, (uint64_t)(e - ps->ents));
+	if (rc < 0)
+		return rc;
+	e->refs--;
+	return 0;
+}
+
+/* unref every ref of img, or (check) only see that they are all there */
+static int walk_image(PageStore *ps, const SnapImg *img, int check)
+{
+	if (!(img->hdr->flags & SNAPIMG_F_PAGE_REFS) || img->hdr->page_size != ps->page_size)
+		return -EINVAL;
+	for (uint64_t i = 0; i < img->trailer->nr_index; i++)
+	{
+		const SnapImgIndex *ix = &img->index[i];
+		const SnapImgPageRef *refs = (const SnapImgPageRef *)(img->base + ix->file_offset);
+		for (uint64_t p = 0; p < ix->nr_pages; p++)
+		{
+			if (!check)
+				pagestore_unref(ps, &refs[p]);
+			else if (!ref_is_zero(&refs[p]) && !lookup(ps, &refs[p]))
+				return -ENOENT;
+		}
+	}
+	return 0;
+}
+
+int pagestore_check_image(PageStore *ps, const SnapImg *img)
+{
+	return walk_image(ps, img, 1);
+}
+
+int pagestore_release_image(PageStore *ps, const SnapImg *img)
+{
+	if (ps->readonly)
+		return -EROFS;
+	/* check every ref first so a foreign image releases nothing */
+	int rc = walk_image(ps, img, 1);
+	return rc ? rc : walk_image(ps, img, 0);
+}
+
+int pagestore_gc(PageStore *ps, uint64_t *freed)
+{
+	PageStoreEntry *live = NULL;
+	uint64_t nlive = 0, caplive = 0, end = 0;
+	uint64_t gen = ps->gen + 1;
+	int rc;
+
+	if (freed)
+		*freed = 0;
+	if (ps->readonly)
+		return -EROFS;
+	int fd = open_data(ps, gen, O_RDWR | O_CREAT | O_TRUNC);
+	if (fd < 0)
+		return fd;
+	rc = grow((void **)&live, &caplive, ps->count ? ps->count : 1, sizeof(*live));
+	for (uint64_t i = 0; i < ps->count && rc == 0; i++)
+	{
+		if (!ps->ents[i].refs)
+			continue;
+		rc = pread_all(ps->datafd, ps->scratch, ps->page_size, (off_t)ps->ents[i].offset);
+		if (rc == 0)
+			rc = pwrite_all(fd, ps->scratch, ps->page_size, (off_t)end);
+		live[nlive] = ps->ents[i];
+		live[nlive++].offset = end;
+		end += ps->page_size;
+	}
+
+	/* switch to the new generation; the index rename commits it */
+	PageStoreEntry *old_ents = ps->ents;
+	uint64_t old_count = ps->count, old_cap = ps->cap, old_gen = ps->gen;
+	int old_fd = ps->datafd;
+	if (rc == 0)
+	{
+		ps->ents = live;
+		ps->count = nlive;
+		ps->cap = caplive;
+		ps->gen = gen;
+		ps->datafd = fd;
+		rc = commit_index(ps);
+	}
+	if (rc < 0)
+	{
+		ps->ents = old_ents;
+		ps->count = old_count;
+		ps->cap = old_cap;
+		ps->gen = old_gen;
+		ps->datafd = old_fd;
+		free(live);
+		close(fd);
+		unlink_data(ps, gen);
+		return rc;
+	}
+	free(old_ents);
+	unmap_data(ps);
+	close(old_fd);
+	unlink_data(ps, old_gen);
+	clear_dirty(ps);
+	/* the log of the old gen is ignored from now on; on failure the next
+	   commit rewrites the index again */
+	reset_log(ps);
+	if (freed)
+		*freed = ps->data_end - end;
+	ps->data_end = end;
+	reindex(ps);
+	return 0;
+}
+
+void pagestore_stats(PageStore *ps, PageStoreStats *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->pages = ps->count;
+	for (uint64_t i = 0; i < ps->count; i++)
+	{
+		st->live_pages += ps->ents[i].refs != 0;
+		st->refs += ps->ents[i].refs;
+	}
+	st->data_bytes = ps->data_end;
+	st->gen = ps->gen;
+	st->page_size = (uint32_t)ps->page_size;
+}
+
+int pagestore_commit(PageStore *ps)
+{
+	uint64_t limit = ps->count > LOG_MIN_ENTRIES ? ps->count : LOG_MIN_ENTRIES;
+	int rc;
+
+	if (ps->readonly)
+		return -EROFS;
+	if (!ps->ndirty && ps->log_end)
+		return 0;
+	if (ps->log_end && ps->log_entries + ps->ndirty <= limit)
+	{
+		if (fdatasync(ps->datafd) < 0)
+			return -errno;
+		rc = append_log(ps);
+	}
+	else
+	{
+		/* the log would outgrow the index (or has to start over): fold it in */
+		rc = commit_index(ps);
+		if (rc == 0)
+			rc = reset_log(ps);
+	}
+	if (rc == 0)
+		clear_dirty(ps);
+	return rc;
+}
+
+void pagestore_rollback(PageStore *ps)
+{
+	for (uint64_t i = 0; i < ps->ndirty; i++)
+	{
+		uint64_t e = ps->dirty[i].i;
+		if (e < ps->committed)
+			ps->ents[e].refs = ps->dirty[i].refs;
+		ps->marked[e] = 0;
+	}
+	ps->ndirty = 0;
+	if (ps->count > ps->committed)
+	{
+		/* their bytes stay as garbage past the end until a gc */
+		ps->count = ps->committed;
+		reindex(ps);
+	}
+}
+
+int pagestore_close(PageStore *ps, int commit)
+{
+	int rc = 0;
+
+	if (!ps)
+		return 0;
+	if (commit && !ps->readonly)
+		rc = pagestore_commit(ps);
+	free_store(ps);
+	return rc;
+}
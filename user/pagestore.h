@@ -0,0 +1,122 @@
+// ==== user/pagestore.h ====
+// Content-addressed page store: a directory holding each distinct page once,
+// keyed by a 128-bit hash of its contents and reference counted, so that
+// snapshot images of near-identical processes, and successive generations of
+// one process, share every page they have in common. Images written against
+// a store (SNAPIMG_F_PAGE_REFS) carry 16-byte refs instead of page data.
+
+#ifndef PAGESTORE_H
+#define PAGESTORE_H
+
+#include <stdint.h>
+
+#include "snapimage.h"
+
+#define PAGESTORE_MAGIC 0x3158494750504e53ULL /* "SNPPGIX1" */
+#define PAGESTORE_VERSION 1
+
+/* store directory:
+ *   pages.idx        PageStoreIndexHeader | PageStoreEntry[count]
+ *   pages.log        PageStoreLogHeader | { PageStoreLogBatch | PageStoreEntry[n] }...
+ *   pages-<gen>.dat  page data, appended; entries point into it
+ * A commit appends the entries it changed to pages.log as one checksummed
+ * batch; loading replays the batches of a log of the index's gen over it, up
+ * to the first torn one. Once the log outgrows the index, pages.idx is
+ * rewritten and replaced with rename() and the log starts over; garbage
+ * collection does the same with a new gen. Pages appended by a session that
+ * never commits are unreferenced bytes at the end of the data file until the
+ * next gc.
+ */
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	uint64_t gen; /* names the data file */
+	uint64_t count;
+} PageStoreIndexHeader;
+
+typedef struct
+{
+	SnapImgPageRef ref;
+	uint64_t offset; /* in pages-<gen>.dat */
+	uint64_t refs;	 /* 0: garbage, dropped by the next gc */
+} PageStoreEntry;
+
+#define PAGESTORE_LOG_MAGIC 0x31474c4750504e53ULL /* "SNPPGLG1" */
+
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	uint64_t gen; /* a log of another gen is stale and ignored */
+} PageStoreLogHeader;
+
+typedef struct
+{
+	uint64_t count;		/* entries that follow: their new state, by ref */
+	SnapImgPageRef sum; /* of those entries, to spot a torn append */
+} PageStoreLogBatch;
+
+/* the all-zero page is never stored; its ref is all zero */
+#define PAGESTORE_ZERO_REF ((SnapImgPageRef){{0, 0}})
+
+typedef struct PageStore PageStore;
+
+typedef struct
+{
+	uint64_t pages;		 /* distinct pages in the index */
+	uint64_t live_pages; /* with refs > 0 */
+	uint64_t refs;		 /* sum of refs: pages as seen by all images */
+	uint64_t data_bytes; /* size of the data file, garbage included */
+	uint64_t gen;
+	uint32_t page_size;
+} PageStoreStats;
+
+/* open (creating if needed) the store in dir and lock it for this process
+   until pagestore_close(). Returns 0 or -errno. */
+int pagestore_open(const char *dir, PageStore **out);
+
+/* open the store in dir for pagestore_read() only: the index is loaded
+   under a shared lock that is dropped again, so writers are not held up and
+   the pages stay readable as they were, even across a gc. Everything else
+   fails with -EROFS. Returns 0 or -errno. */
+int pagestore_open_reader(const char *dir, PageStore **out);
+
+/* store one page (or take another reference to an identical stored one) and
+   return its ref; *is_new (optional) says whether data was written */
+int pagestore_put(PageStore *ps, const void *page, SnapImgPageRef *ref, int *is_new);
+
+/* copy the page behind ref into buf (page_size bytes). Returns 0 or -errno. */
+int pagestore_read(PageStore *ps, const SnapImgPageRef *ref, void *buf);
+
+/* drop one reference; the page itself goes at the next pagestore_gc() */
+int pagestore_unref(PageStore *ps, const SnapImgPageRef *ref);
+
+/* 0 if every page of a SNAPIMG_F_PAGE_REFS image is in the store, else
+   -ENOENT (-EINVAL if it is not such an image of our page size) */
+int pagestore_check_image(PageStore *ps, const SnapImg *img);
+
+/* drop every reference held by a SNAPIMG_F_PAGE_REFS image */
+int pagestore_release_image(PageStore *ps, const SnapImg *img);
+
+/* rewrite the live pages into a new data file and drop the rest; *freed
+   (optional) gets the bytes reclaimed. Commits the session. */
+int pagestore_gc(PageStore *ps, uint64_t *freed);
+
+void pagestore_stats(PageStore *ps, PageStoreStats *st);
+
+/* make the puts and unrefs so far durable, keeping the store open: appends
+   only the changed entries to the log. Returns 0 or -errno. */
+int pagestore_commit(PageStore *ps);
+
+/* forget the puts and unrefs since the last commit, keeping the store open */
+void pagestore_rollback(PageStore *ps);
+
+/* with commit, make this session's puts and unrefs durable (otherwise those
+   since the last pagestore_commit() are forgotten); unlock and free ps either
+   way. Returns 0 or -errno. */
+int pagestore_close(PageStore *ps, int commit);
+
+#endif /* PAGESTORE_H */
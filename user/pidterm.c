@@ -0,0 +1,369 @@
+// ==== user/pidterm.c ====
+// pidfd-based process-tree termination, see pidterm.h.
+// A child found in a children file (or, on kernels without them, in one pass
+// over /proc) is pinned with pidfd_open() first and then checked to still have
+// the expected parent in its stat; only then can the pidfd not belong to an
+// unrelated process that reused the number.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "pidterm.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+static int pidfd_open(pid_t pid)
+{
+	return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int pidfd_send_signal(int pidfd, int sig)
+{
+	return (int)syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+static double pt_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* field 4 of /proc/<pid>/stat, or -1 */
+static pid_t read_ppid(pid_t pid)
+{
+	char path[64], buf[512];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	char *p = strrchr(buf, ')'); /* comm may contain spaces and parens */
+	int ppid;
+	if (!p || sscanf(p + 1, " %*c %d", &ppid) != 1)
+		return -1;
+	return ppid;
+}
+
+static unsigned set_slot(pid_t pid, int cap)
+{
+	return ((uint32_t)pid * 2654435761u) & (unsigned)(cap - 1);
+}
+
+static int tree_has(const PidTree *t, pid_t pid)
+{
+	if (!t->set_cap)
+		return 0;
+	for (unsigned i = set_slot(pid, t->set_cap);; i = (i + 1) & (unsigned)(t->set_cap - 1))
+	{
+		if (t->set[i] == pid)
+			return 1;
+		if (t->set[i] == 0)
+			return 0;
+	}
+}
+
+static void set_put(PidTree *t, pid_t pid)
+{
+	unsigned i = set_slot(pid, t->set_cap);
+	while (t->set[i] != 0 && t->set[i] != pid)
+		i = (i + 1) & (unsigned)(t->set_cap - 1);
+	t->set[i] = pid;
+}
+
+/* rehash procs[0..n) into a table of cap slots (0: keep the size) */
+static int set_rebuild(PidTree *t, int cap)
+{
+	if (cap == 0)
+		cap = t->set_cap;
+	if (cap != t->set_cap)
+	{
+		pid_t *s = malloc(cap * sizeof(*s));
+		if (!s)
+			return -ENOMEM;
+		free(t->set);
+		t->set = s;
+		t->set_cap = cap;
+	}
+	memset(t->set, 0, t->set_cap * sizeof(*t->set));
+	for (int i = 0; i < t->n; i++)
+		set_put(t, t->procs[i].pid);
+	return 0;
+}
+
+static int tree_add(PidTree *t, pid_t pid, pid_t ppid, int pidfd)
+{
+	if (t->n == t->cap)
+	{
+		int ncap = t->cap ? t->cap * 2 : 16;
+		PidTermProc *p = realloc(t->procs, ncap * sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		t->procs = p;
+		t->cap = ncap;
+	}
+	if ((t->n + 1) * 2 > t->set_cap && set_rebuild(t, t->set_cap ? t->set_cap * 2 : 64) < 0)
+		return -ENOMEM;
+	t->procs[t->n++] = (PidTermProc){pid, ppid, pidfd};
+	set_put(t, pid);
+	return 0;
+}
+
+void pidtree_truncate(PidTree *t, int keep)
+{
+	while (t->n > keep)
+		close(t->procs[--t->n].pidfd);
+	if (t->set_cap)
+		set_rebuild(t, 0);
+}
+
+/* pin child if it is still parent's child */
+static int add_child(PidTree *t, pid_t parent, pid_t child)
+{
+	if (tree_has(t, child))
+		return 0;
+	int fd = pidfd_open(child);
+	if (fd < 0)
+		return 0; /* already gone */
+	if (read_ppid(child) != parent)
+	{
+		close(fd); /* exited and the pid was reused */
+		return 0;
+	}
+	int rc = tree_add(t, child, parent, fd);
+	if (rc < 0)
+		close(fd);
+	return rc;
+}
+
+/* children of every thread of parent from /proc/<pid>/task/<tid>/children;
+   -ENOENT when the kernel lacks CONFIG_PROC_CHILDREN */
+static int add_children(PidTree *t, pid_t parent)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task", parent);
+	DIR *d = opendir(path);
+	if (!d)
+		return 0; /* exited meanwhile */
+	struct dirent *e;
+	int rc = 0, seen = 0;
+	while (rc == 0 && (e = readdir(d)))
+	{
+		if (e->d_name[0] < '0' || e->d_name[0] > '9')
+			continue;
+		char cpath[300];
+		snprintf(cpath, sizeof(cpath), "/proc/%d/task/%s/children", parent, e->d_name);
+		FILE *f = fopen(cpath, "re");
+		if (!f)
+		{
+			if (errno == ENOENT && !seen)
+				rc = -ENOENT;
+			continue;
+		}
+		seen = 1;
+		rc = 0;
+		int child;
+		while (rc == 0 && fscanf(f, "%d", &child) == 1)
+			rc = add_child(t, parent, child);
+		fclose(f);
+	}
+	closedir(d);
+	return rc;
+}
+
+static int by_ppid(const void *a, const void *b)
+{
+	pid_t x = ((const pid_t *)a)[1], y = ((const pid_t *)b)[1];
+	return (x > y) - (x < y);
+}
+
+/* without children files: one pass over /proc for every (pid, ppid), sorted
+   by ppid, then the same breadth-first walk looking children up in it */
+static int add_descendants_scan(PidTree *t, int first)
+{
+	pid_t(*pairs)[2] = NULL;
+	int n = 0, cap = 0, rc = 0;
+	DIR *d = opendir("/proc");
+	struct dirent *e;
+
+	if (!d)
+		return -errno;
+	while ((e = readdir(d)))
+	{
+		if (e->d_name[0] < '1' || e->d_name[0] > '9')
+			continue;
+		pid_t pid = atoi(e->d_name);
+		pid_t ppid = read_ppid(pid);
+		if (ppid <= 0)
+			continue;
+		if (n == cap)
+		{
+			int ncap = cap ? cap * 2 : 1024;
+			void *p = realloc(pairs, ncap * sizeof(*pairs));
+			if (!p)
+			{
+				rc = -ENOMEM;
+				break;
+			}
+			pairs = p;
+			cap = ncap;
+		}
+		pairs[n][0] = pid;
+		pairs[n++][1] = ppid;
+	}
+	closedir(d);
+	if (n)
+		qsort(pairs, n, sizeof(*pairs), by_ppid);
+	for (int i = first; i < t->n && rc == 0; i++)
+	{
+		pid_t parent = t->procs[i].pid;
+		int lo = 0, hi = n; /* first pair with ppid >= parent */
+		while (lo < hi)
+		{
+			int mid = lo + (hi - lo) / 2;
+			if (pairs[mid][1] < parent)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (int k = lo; k < n && pairs[k][1] == parent && rc == 0; k++)
+			rc = add_child(t, parent, pairs[k][0]);
+	}
+	free(pairs);
+	return rc;
+}
+
+int pidtree_collect(pid_t root, PidTree *t)
+{
+	int first = t->n;
+	int fd = pidfd_open(root);
+	if (fd < 0)
+		return -errno;
+	int rc = tree_add(t, root, 0, fd);
+	if (rc < 0)
+	{
+		close(fd);
+		return rc;
+	}
+	/* t->n grows while we walk it: breadth first */
+	for (int i = first; i < t->n && rc == 0; i++)
+		rc = add_children(t, t->procs[i].pid);
+	if (rc == -ENOENT)
+	{
+		pidtree_truncate(t, first + 1);
+		rc = add_descendants_scan(t, first);
+	}
+	if (rc < 0)
+	{
+		pidtree_truncate(t, first);
+		return rc;
+	}
+	return t->n - first;
+}
+
+int pidtree_wait(PidTree *t, int grace_ms, PidTermStats *st)
+{
+	PidTermStats local_st;
+	struct pollfd *pfd = calloc(t->n ? t->n : 1, sizeof(*pfd));
+	int *idx = calloc(t->n ? t->n : 1, sizeof(*idx));
+	double t0 = pt_now();
+	double deadline = t0 + grace_ms / 1e3;
+	int killing = 0;
+
+	if (!st)
+		st = &local_st;
+	memset(st, 0, sizeof(*st));
+	st->procs = t->n;
+	if (!pfd || !idx)
+	{
+		free(pfd);
+		free(idx);
+		return t->n;
+	}
+
+	for (;;)
+	{
+		int n = 0;
+		for (int i = 0; i < t->n; i++)
+			if (t->procs[i].pidfd >= 0)
+			{
+				pfd[n] = (struct pollfd){t->procs[i].pidfd, POLLIN, 0};
+				idx[n++] = i;
+			}
+		if (n == 0)
+			break;
+
+		double left = deadline - pt_now();
+		if (left <= 0)
+		{
+			if (killing)
+				break;
+			/* grace period over: escalate */
+			for (int k = 0; k < n; k++)
+				if (pidfd_send_signal(pfd[k].fd, SIGKILL) == 0)
+					st->killed++;
+			killing = 1;
+			deadline = pt_now() + PIDTERM_KILL_WAIT_MS / 1e3;
+			continue;
+		}
+
+		int r = poll(pfd, n, (int)(left * 1e3) + 1);
+		if (r < 0 && errno != EINTR)
+			break;
+		for (int k = 0; k < n && r > 0; k++)
+		{
+			if (!pfd[k].revents)
+				continue;
+			PidTermProc *p = &t->procs[idx[k]];
+			close(p->pidfd);
+			p->pidfd = -1;
+			if (!killing)
+				st->exited++;
+			st->seconds = pt_now() - t0;
+		}
+	}
+
+	for (int i = 0; i < t->n; i++)
+		st->survivors += t->procs[i].pidfd >= 0;
+	free(pfd);
+	free(idx);
+	return st->survivors;
+}
+
+void pidtree_free(PidTree *t)
+{
+	for (int i = 0; i < t->n; i++)
+		if (t->procs[i].pidfd >= 0)
+			close(t->procs[i].pidfd);
+	free(t->procs);
+	free(t->set);
+	memset(t, 0, sizeof(*t));
+}
+
+int pidterm_grace_from_env(void)
+{
+	const char *s = getenv("SNAPSHOT_KILL_GRACE_MS");
+	if (s && *s >= '0' && *s <= '9')
+		return atoi(s);
+	return PIDTERM_DEFAULT_GRACE_MS;
+}
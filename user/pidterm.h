@@ -0,0 +1,60 @@
+// ==== user/pidterm.h ====
+// Confirming the termination of a process tree through pidfds: the tree is
+// walked once (/proc/<pid>/task/<tid>/children) and every member is pinned
+// with pidfd_open() before anything is signalled. The signals themselves are
+// sent by the kernel (IOCTL_SNAPSHOT_TREE) as it records the tree; exits are
+// then confirmed by polling the pidfds, with pidfd_send_signal(SIGKILL) for
+// whatever outlives the grace period. Holding the pidfds makes it immune to
+// pid reuse, and nothing forks a shell or scans all of /proc.
+
+#ifndef PIDTERM_H
+#define PIDTERM_H
+
+#include <sys/types.h>
+
+#define PIDTERM_DEFAULT_GRACE_MS 2000
+#define PIDTERM_KILL_WAIT_MS 1000 /* after SIGKILL, before giving up */
+
+typedef struct
+{
+	pid_t pid;
+	pid_t ppid; /* 0 for a root */
+	int pidfd;	/* -1 once it has exited */
+} PidTermProc;
+
+typedef struct
+{
+	PidTermProc *procs; /* each root followed by its descendants, breadth first */
+	int n, cap;
+	pid_t *set; /* the pids of procs, open addressing (0 = empty), at most half full */
+	int set_cap;
+} PidTree; /* zero-initialize before the first pidtree_collect() */
+
+typedef struct
+{
+	int procs;		   /* in the tree */
+	int exited;		   /* within the grace period */
+	int killed;		   /* needed SIGKILL */
+	int survivors;	   /* still there after SIGKILL (e.g. stuck in D state) */
+	double seconds;	   /* until the last exit was seen */
+} PidTermStats;
+
+/* pin root and all its descendants and add them to t, so one wait can cover
+   several trees. Returns the number added or -errno (-ESRCH if root is gone);
+   t is unchanged on error. */
+int pidtree_collect(pid_t root, PidTree *t);
+
+/* wait up to grace_ms for every member to exit, SIGKILL the rest and wait
+   PIDTERM_KILL_WAIT_MS more. Returns the number still alive. */
+int pidtree_wait(PidTree *t, int grace_ms, PidTermStats *st);
+
+/* close and forget every member from index keep on, e.g. the trees a
+   failed pidtree_collect() caller added last */
+void pidtree_truncate(PidTree *t, int keep);
+
+void pidtree_free(PidTree *t);
+
+/* grace period from $SNAPSHOT_KILL_GRACE_MS, else PIDTERM_DEFAULT_GRACE_MS */
+int pidterm_grace_from_env(void);
+
+#endif /* PIDTERM_H */
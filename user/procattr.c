@@ -0,0 +1,404 @@
+// ==== user/procattr.c ====
+// Capture and reapplication of execution attributes, see procattr.h.
+// Everything is read with the pid-taking syscalls (sched_getattr,
+// sched_getaffinity, prlimit) except the memory policy, which only shows in
+// numa_maps: each VMA line carries the VMA's policy, or the task's when the
+// VMA has none, so the heap line (else the first) gives the task policy, and
+// the N<node>=<pages> counts give where its memory actually is.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "procattr.h"
+
+#ifndef MPOL_WEIGHTED_INTERLEAVE
+#define MPOL_WEIGHTED_INTERLEAVE 6
+#endif
+#define PROCATTR_SCHED_FLAGS 0x7 /* RESET_ON_FORK, RECLAIM, DL_OVERRUN */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* struct sched_attr as of Linux 3.14 (SCHED_ATTR_SIZE_VER0) */
+typedef struct
+{
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+} SchedAttr;
+
+/* numa_maps policy names, longest first where one is a prefix of another */
+static const struct
+{
+	const char *name;
+	int mode;
+} mpol_names[] = {
+	{"weighted interleave", MPOL_WEIGHTED_INTERLEAVE},
+	{"prefer (many)", MPOL_PREFERRED_MANY},
+	{"interleave", MPOL_INTERLEAVE},
+	{"default", MPOL_DEFAULT},
+	{"prefer", MPOL_PREFERRED},
+	{"bind", MPOL_BIND},
+	{"local", MPOL_LOCAL},
+};
+
+static void set_bit(uint64_t *bits, unsigned nbits, unsigned b)
+{
+	if (b < nbits)
+		bits[b / 64] |= 1ULL << (b % 64);
+}
+
+static int test_bit(const uint64_t *bits, unsigned b)
+{
+	return (bits[b / 64] >> (b % 64)) & 1;
+}
+
+/* "0-3,5" into bits; returns where parsing stopped */
+static const char *parse_list(const char *s, uint64_t *bits, unsigned nbits)
+{
+	while (*s >= '0' && *s <= '9')
+	{
+		char *e;
+		unsigned long lo = strtoul(s, &e, 10), hi = lo;
+		if (*e == '-')
+			hi = strtoul(e + 1, &e, 10);
+		for (unsigned long b = lo; b <= hi && b < nbits; b++)
+			set_bit(bits, nbits, (unsigned)b);
+		s = *e == ',' ? e + 1 : e;
+	}
+	return s;
+}
+
+/* bits as "0-3,5" */
+static int format_list(const uint64_t *bits, unsigned nbits, char *buf, size_t len)
+{
+	int n = 0;
+	buf[0] = '\0';
+	for (unsigned b = 0; b < nbits; b++)
+	{
+		if (!test_bit(bits, b))
+			continue;
+		unsigned e = b;
+		while (e + 1 < nbits && test_bit(bits, e + 1))
+			e++;
+		if (n < (int)len)
+			n += e > b ? snprintf(buf + n, len - n, "%s%u-%u", n ? "," : "", b, e)
+					   : snprintf(buf + n, len - n, "%s%u", n ? "," : "", b);
+		b = e;
+	}
+	return n;
+}
+
+/* the policy part of a numa_maps line (after the address) into a */
+static void parse_policy(const char *p, ProcAttrs *a)
+{
+	size_t i, nnames = sizeof(mpol_names) / sizeof(mpol_names[0]);
+	for (i = 0; i < nnames; i++)
+		if (strncmp(p, mpol_names[i].name, strlen(mpol_names[i].name)) == 0)
+			break;
+	if (i == nnames)
+		return;
+	a->mempolicy = mpol_names[i].mode;
+	memset(a->nodes, 0, sizeof(a->nodes));
+	p += strlen(mpol_names[i].name);
+	if (*p == '=')
+	{
+		/* mode flags, e.g. "bind=static:0-1" */
+		size_t fl = strcspn(p, ": ");
+		if (memmem(p, fl, "static", 6))
+			a->mempolicy |= MPOL_F_STATIC_NODES;
+		else if (memmem(p, fl, "relative", 8))
+			a->mempolicy |= MPOL_F_RELATIVE_NODES;
+		p += fl;
+	}
+	if (*p == ':')
+		parse_list(p + 1, a->nodes, PROCATTR_MAX_NODES);
+}
+
+/* number of online NUMA nodes, 1 if unknown */
+static int online_nodes(void)
+{
+	uint64_t bits[PROCATTR_MAX_NODES / 64] = {0};
+	char buf[256];
+	int n = 0;
+	int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+	ssize_t r = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+	if (fd >= 0)
+		close(fd);
+	if (r <= 0)
+		return 1;
+	buf[r] = '\0';
+	parse_list(buf, bits, PROCATTR_MAX_NODES);
+	for (unsigned b = 0; b < PROCATTR_MAX_NODES; b++)
+		n += test_bit(bits, b);
+	return n ? n : 1;
+}
+
+static int capture_numa(pid_t pid, ProcAttrs *a)
+{
+	uint64_t pages[PROCATTR_MAX_NODES] = {0};
+	char path[64], *line = NULL;
+	size_t cap = 0;
+	int have_policy = 0, from_heap = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/numa_maps", pid);
+	FILE *f = fopen(path, "re");
+	if (!f)
+		return -errno;
+	while (getline(&line, &cap, f) > 0)
+	{
+		char *p = strchr(line, ' ');
+		if (!p)
+			continue;
+		int heap = strstr(p, " heap") != NULL;
+		if (!from_heap && (heap || !have_policy))
+		{
+			parse_policy(p + 1, a);
+			have_policy = 1;
+			from_heap = heap;
+		}
+		for (char *n = strstr(p, " N"); n; n = strstr(n + 1, " N"))
+		{
+			char *e;
+			unsigned long node = strtoul(n + 2, &e, 10);
+			if (e != n + 2 && *e == '=' && node < PROCATTR_MAX_NODES)
+				pages[node] += strtoull(e + 1, NULL, 10);
+		}
+	}
+	free(line);
+	fclose(f);
+	if (!have_policy)
+		return -ENODATA;
+
+	a->home_node = PROCATTR_NO_NODE;
+	if ((a->mempolicy & ~(MPOL_F_STATIC_NODES | MPOL_F_RELATIVE_NODES)) == MPOL_DEFAULT && online_nodes() > 1)
+	{
+		uint64_t best = 0;
+		for (unsigned n = 0; n < PROCATTR_MAX_NODES; n++)
+			if (pages[n] > best)
+			{
+				best = pages[n];
+				a->home_node = n;
+			}
+	}
+	return 0;
+}
+
+int procattr_capture(pid_t pid, ProcAttrs *a)
+{
+	SchedAttr sa;
+	int err = 0;
+
+	memset(a, 0, sizeof(*a));
+	a->version = PROCATTR_VERSION;
+	a->home_node = PROCATTR_NO_NODE;
+
+	memset(&sa, 0, sizeof(sa));
+	if (syscall(SYS_sched_getattr, pid, &sa, sizeof(sa), 0) == 0)
+	{
+		a->policy = sa.sched_policy;
+		a->priority = sa.sched_priority;
+		a->nice = sa.sched_nice;
+		a->sched_flags = sa.sched_flags & PROCATTR_SCHED_FLAGS;
+		a->runtime = sa.sched_runtime;
+		a->deadline = sa.sched_deadline;
+		a->period = sa.sched_period;
+		a->have |= PROCATTR_SCHED;
+	}
+	else
+		err = errno;
+
+	if (sched_getaffinity(pid, sizeof(a->cpus), (cpu_set_t *)a->cpus) == 0)
+		a->have |= PROCATTR_AFFINITY;
+	else
+		err = errno;
+
+	int r, nlim = 0;
+	for (r = 0; r < PROCATTR_NLIMITS; r++)
+	{
+		struct rlimit rl;
+		if (prlimit(pid, r, NULL, &rl) < 0)
+			break;
+		a->rlim[r].cur = rl.rlim_cur;
+		a->rlim[r].max = rl.rlim_max;
+		nlim++;
+	}
+	if (nlim == PROCATTR_NLIMITS)
+		a->have |= PROCATTR_RLIMITS;
+	else
+		err = errno;
+
+	if (capture_numa(pid, a) == 0)
+		a->have |= PROCATTR_NUMA;
+
+	return a->have ? 0 : -(err ? err : ESRCH);
+}
+
+int procattr_cgroup(pid_t pid, char *buf, size_t len)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	ssize_t r = read(fd, buf, len - 1);
+	int err = errno;
+	close(fd);
+	if (r < 0)
+		return -err;
+	buf[r] = '\0';
+	return 0;
+}
+
+const ProcAttrs *procattr_from(const void *blob, size_t len)
+{
+	const ProcAttrs *a = blob;
+	return blob && len == sizeof(*a) && a->version == PROCATTR_VERSION ? a : NULL;
+}
+
+/* is line (len bytes, no newline) one of the lines of text? */
+static int has_line(const char *text, const char *line, size_t len)
+{
+	for (const char *p = text; *p;)
+	{
+		if (strncmp(p, line, len) == 0 && (p[len] == '\n' || p[len] == '\0'))
+			return 1;
+		p += strcspn(p, "\n");
+		p += *p == '\n';
+	}
+	return 0;
+}
+
+int procattr_open_cgroups(const char *cgroups, int *fds, int max)
+{
+	char self[4096], path[4096];
+	int n = 0;
+
+	if (!cgroups || procattr_cgroup(getpid(), self, sizeof(self)) < 0)
+		self[0] = '\0';
+	for (const char *l = cgroups; l && *l && n < max;)
+	{
+		size_t len = strcspn(l, "\n");
+		const char *next = l[len] ? l + len + 1 : l + len;
+		/* "<id>:<controllers>:<path>" */
+		const char *c1 = memchr(l, ':', len), *c2 = c1 ? memchr(c1 + 1, ':', len - (c1 + 1 - l)) : NULL;
+		if (!c2 || has_line(self, l, len))
+		{
+			l = next;
+			continue;
+		}
+		int plen = (int)(len - (c2 + 1 - l));
+		if (c2 == c1 + 1)
+		{
+			/* the v2 hierarchy: on its own, or under unified/ next to v1 ones */
+			const char *base = access(CGROUP_ROOT "/cgroup.procs", F_OK) == 0 ? CGROUP_ROOT : CGROUP_ROOT "/unified";
+			snprintf(path, sizeof(path), "%s%.*s/cgroup.procs", base, plen, c2 + 1);
+		}
+		else
+		{
+			const char *ctl = c1 + 1;
+			if (strncmp(ctl, "name=", 5) == 0)
+				ctl += 5;
+			snprintf(path, sizeof(path), CGROUP_ROOT "/%.*s%.*s/cgroup.procs", (int)(c2 - ctl), ctl, plen, c2 + 1);
+		}
+		int fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			int err = errno;
+			while (n > 0)
+				close(fds[--n]);
+			return -err;
+		}
+		fds[n++] = fd;
+		l = next;
+	}
+	return n;
+}
+
+unsigned procattr_apply(const ProcAttrs *a, const int *fds, int n)
+{
+	unsigned failed = 0;
+
+	/* first, so a cpuset cgroup does not reject the affinity */
+	for (int i = 0; i < n; i++)
+		if (write(fds[i], "0", 1) != 1) /* 0: the writer itself */
+			failed |= PROCATTR_CGROUP;
+	if (!a)
+		return failed;
+
+	if (a->have & PROCATTR_RLIMITS)
+		for (int r = 0; r < PROCATTR_NLIMITS; r++)
+		{
+			struct rlimit rl = {a->rlim[r].cur, a->rlim[r].max};
+			if (setrlimit(r, &rl) < 0)
+				failed |= PROCATTR_RLIMITS;
+		}
+
+	if (a->have & PROCATTR_NUMA)
+	{
+		int mode = a->mempolicy & ~(MPOL_F_STATIC_NODES | MPOL_F_RELATIVE_NODES);
+		uint64_t home[PROCATTR_MAX_NODES / 64] = {0};
+		long rc;
+		if (mode == MPOL_DEFAULT && a->home_node != PROCATTR_NO_NODE)
+		{
+			/* keep its memory where it was */
+			set_bit(home, PROCATTR_MAX_NODES, a->home_node);
+			rc = syscall(SYS_set_mempolicy, MPOL_PREFERRED, home, PROCATTR_MAX_NODES + 1);
+		}
+		else if (mode == MPOL_DEFAULT || mode == MPOL_LOCAL)
+			rc = syscall(SYS_set_mempolicy, a->mempolicy, NULL, 0);
+		else
+			rc = syscall(SYS_set_mempolicy, a->mempolicy, a->nodes, PROCATTR_MAX_NODES + 1);
+		if (rc < 0)
+			failed |= PROCATTR_NUMA;
+	}
+
+	if ((a->have & PROCATTR_AFFINITY) && sched_setaffinity(0, sizeof(a->cpus), (const cpu_set_t *)a->cpus) < 0)
+		failed |= PROCATTR_AFFINITY;
+
+	/* last: a real-time policy should not cover the setup above */
+	if (a->have & PROCATTR_SCHED)
+	{
+		SchedAttr sa = {sizeof(sa), a->policy, a->sched_flags, a->nice, a->priority,
+						a->runtime, a->deadline, a->period};
+		if (syscall(SYS_sched_setattr, 0, &sa, 0) < 0)
+			failed |= PROCATTR_SCHED;
+	}
+	return failed;
+}
+
+int procattr_json(const ProcAttrs *a, char *buf, size_t len)
+{
+	static const char *policies[] = {"other", "fifo", "rr", "batch", "?", "idle", "deadline", "ext"};
+	char cpus[512], nodes[256];
+	int n;
+
+	format_list(a->cpus, PROCATTR_MAX_CPUS, cpus, sizeof(cpus));
+	format_list(a->nodes, PROCATTR_MAX_NODES, nodes, sizeof(nodes));
+	int mode = a->mempolicy & ~(MPOL_F_STATIC_NODES | MPOL_F_RELATIVE_NODES);
+	const char *mname = "?";
+	for (size_t i = 0; i < sizeof(mpol_names) / sizeof(mpol_names[0]); i++)
+		if (mpol_names[i].mode == mode)
+			mname = mpol_names[i].name;
+
+	n = snprintf(buf, len, "{\"policy\":\"%s\",\"priority\":%u,\"nice\":%d,\"cpus\":\"%s\",\"mempolicy\":\"%s%s%s\",",
+				 a->policy < sizeof(policies) / sizeof(policies[0]) ? policies[a->policy] : "?", a->priority,
+				 a->nice, (a->have & PROCATTR_AFFINITY) ? cpus : "", (a->have & PROCATTR_NUMA) ? mname : "",
+				 nodes[0] ? ":" : "", nodes);
+	if (n >= 0 && (size_t)n < len)
+		n += a->home_node == PROCATTR_NO_NODE ? snprintf(buf + n, len - n, "\"homeNode\":null}")
+											  : snprintf(buf + n, len - n, "\"homeNode\":%u}", a->home_node);
+	return n < 0 ? 0 : (size_t)n >= len ? (int)len - 1 : n;
+}
@@ -0,0 +1,81 @@
+// ==== user/procattr.h ====
+// Execution attributes of a process that a respawn would otherwise lose:
+// CPU affinity, scheduling policy/priority/nice (sched_getattr()), NUMA
+// memory policy and home node (from /proc/<pid>/numa_maps; another process's
+// policy cannot be queried directly), resource limits and cgroups.
+// Captured at snapshot time into a fixed-size blob kept in the catalog, and
+// applied by the restored child to itself between clone() and exec.
+
+#ifndef PROCATTR_H
+#define PROCATTR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PROCATTR_VERSION 1
+#define PROCATTR_MAX_CPUS 1024
+#define PROCATTR_MAX_NODES 64
+#define PROCATTR_NLIMITS 16 /* RLIMIT_CPU .. RLIMIT_RTTIME */
+#define PROCATTR_NO_NODE 0xffffffffu
+#define PROCATTR_MAX_CGROUPS 16 /* hierarchies (one on a cgroup v2 only host) */
+
+/* ProcAttrs.have, and what procattr_apply() reports as failed */
+#define PROCATTR_SCHED 1	/* policy, priority, nice, sched flags */
+#define PROCATTR_AFFINITY 2 /* CPU mask */
+#define PROCATTR_NUMA 4		/* memory policy, or home node as preferred */
+#define PROCATTR_RLIMITS 8	/* all of them */
+#define PROCATTR_CGROUP 16	/* only reported: the paths are kept beside the blob */
+
+typedef struct
+{
+	uint32_t version; /* PROCATTR_VERSION */
+	uint32_t have;	  /* PROCATTR_* captured */
+	/* scheduling, as struct sched_attr */
+	uint32_t policy; /* SCHED_* */
+	uint32_t priority;
+	int32_t nice;
+	uint32_t pad;
+	uint64_t sched_flags; /* SCHED_FLAG_RESET_ON_FORK, ... */
+	uint64_t runtime, deadline, period; /* SCHED_DEADLINE, ns */
+	uint64_t cpus[PROCATTR_MAX_CPUS / 64];
+	/* NUMA: the policy its VMAs show (MPOL_* | MPOL_F_STATIC_NODES /
+	   MPOL_F_RELATIVE_NODES) and its nodes; home_node is where most of its
+	   pages were, on a multi-node machine under the default policy */
+	int32_t mempolicy;
+	uint32_t home_node;
+	uint64_t nodes[PROCATTR_MAX_NODES / 64];
+	struct
+	{
+		uint64_t cur, max;
+	} rlim[PROCATTR_NLIMITS];
+} ProcAttrs;
+
+/* fill *a with pid's attributes. Returns 0 (a->have says what could be read)
+   or -errno if none could (-ESRCH: pid is gone). */
+int procattr_capture(pid_t pid, ProcAttrs *a);
+
+/* /proc/<pid>/cgroup as is ("0::/user.slice/...", one line per
+   hierarchy). Returns 0 or -errno. */
+int procattr_cgroup(pid_t pid, char *buf, size_t len);
+
+/* a catalog blob as ProcAttrs, NULL if it is not one (other version or size) */
+const ProcAttrs *procattr_from(const void *blob, size_t len);
+
+/* open for writing (O_CLOEXEC) the cgroup.procs under /sys/fs/cgroup of
+   every hierarchy in cgroups (as procattr_cgroup() read it) where it differs
+   from ours, for procattr_apply(). Returns how many went into fds, or
+   -errno if one cannot be opened (none are left open then). */
+int procattr_open_cgroups(const char *cgroups, int *fds, int max);
+
+/* apply a (what it has) to the calling process, after moving it into the
+   cgroups open at fds. Either may be missing (NULL / n 0). Only makes
+   syscalls, so it can run in a vfork()ed child. Returns the PROCATTR_* that
+   failed, 0 if none. */
+unsigned procattr_apply(const ProcAttrs *a, const int *fds, int n);
+
+/* a as a JSON object: policy, priority, nice, cpus, mempolicy, homeNode.
+   Returns the length written (truncated to len - 1). */
+int procattr_json(const ProcAttrs *a, char *buf, size_t len);
+
+#endif /* PROCATTR_H */
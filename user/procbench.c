@@ -0,0 +1,224 @@
+// ==== user/procbench.c ====
+// Benchmark for procscan.c against the stdio scan list_running() used to do
+// (fopen of comm, cmdline and environ for every pid).
+// Compile: gcc -O2 -Wall -pthread -o procbench procbench.c procscan.c
+// Usage: ./procbench [-n spawn] [-j threads] [-r reps]
+//   -n  fork this many idle children first, to benchmark a crowded host
+//       (20000 gives the 20k+ process case; raise ulimit -u and pid_max)
+//   -j  threads for the parallel scan (default: one per CPU, max 8)
+//   -r  repetitions per variant, best time is reported (default 5)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "procscan.h"
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ---- the previous list_running()/is_gui_process(), for comparison ---- */
+static int legacy_is_gui(pid_t pid)
+{
+	char path[512], buf[512];
+	FILE *f;
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) && (strstr(buf, "--type=renderer") || strstr(buf, "--type=gpu-process")))
+	{
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	snprintf(path, sizeof(path), "/proc/%d/environ", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	int gui = 0;
+	while (fgets(buf, sizeof(buf), f))
+		if (strstr(buf, "DISPLAY=") || strstr(buf, "WAYLAND_DISPLAY="))
+		{
+			gui = 1;
+			break;
+		}
+	fclose(f);
+	return gui;
+}
+
+static int legacy_scan(int *gui)
+{
+	DIR *d = opendir("/proc");
+	struct dirent *e;
+	int n = 0;
+	*gui = 0;
+	if (!d)
+		return 0;
+	while ((e = readdir(d)))
+	{
+		if (!isdigit((unsigned char)e->d_name[0]))
+			continue;
+		pid_t pid = atoi(e->d_name);
+		char path[512], name[512];
+		snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+		FILE *f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(name, sizeof(name), f))
+		{
+			*gui += legacy_is_gui(pid);
+			n++;
+		}
+		fclose(f);
+	}
+	closedir(d);
+	return n;
+}
+
+/* ---- procscan ---- */
+static int procscan_pass(ProcScan *s, int classify, int *gui)
+{
+	const ProcEntry *ents;
+	int n = procscan_run(s, &ents);
+	*gui = 0;
+	for (int i = 0; classify && i < n; i++)
+		*gui += procscan_is_gui(s, &ents[i]);
+	return n;
+}
+
+static void report(const char *what, double best, int n, int gui)
+{
+	printf("%-34s %9.2f ms  %7.2f us/proc  procs=%d gui=%d\n", what, best * 1e3, n ? best * 1e6 / n : 0, n, gui);
+}
+
+static pid_t *spawn_idle(int count, int *spawned)
+{
+	pid_t *kids = calloc(count > 0 ? count : 1, sizeof(*kids));
+	*spawned = 0;
+	if (!kids)
+		return NULL;
+	for (int i = 0; i < count; i++)
+	{
+		pid_t p = fork();
+		if (p < 0)
+		{
+			perror("fork");
+			break;
+		}
+		if (p == 0)
+		{
+			for (;;)
+				pause();
+		}
+		kids[(*spawned)++] = p;
+	}
+	return kids;
+}
+
+int main(int argc, char **argv)
+{
+	int spawn = 0, threads = 0, reps = 5;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:j:r:")) != -1)
+	{
+		if (opt == 'n')
+			spawn = atoi(optarg);
+		else if (opt == 'j')
+			threads = atoi(optarg);
+		else if (opt == 'r')
+			reps = atoi(optarg) > 0 ? atoi(optarg) : 1;
+		else
+		{
+			fprintf(stderr, "usage: %s [-n spawn] [-j threads] [-r reps]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	int spawned = 0;
+	pid_t *kids = spawn_idle(spawn, &spawned);
+	if (spawn)
+		printf("spawned %d idle children\n", spawned);
+
+	ProcScan *serial = procscan_new(1), *parallel = procscan_new(threads);
+	if (!serial || !parallel)
+	{
+		perror("procscan_new");
+		return 1;
+	}
+
+	double best;
+	int n = 0, gui = 0;
+
+	best = 1e9;
+	for (int r = 0; r < reps; r++)
+	{
+		double t0 = now_sec();
+		n = legacy_scan(&gui);
+		double el = now_sec() - t0;
+		best = el < best ? el : best;
+	}
+	report("stdio scan + gui (old)", best, n, gui);
+
+	const char *names[] = {"procscan 1 thread, no gui", "procscan parallel, no gui"};
+	ProcScan *scans[] = {serial, parallel};
+	for (int v = 0; v < 2; v++)
+	{
+		best = 1e9;
+		for (int r = 0; r < reps; r++)
+		{
+			double t0 = now_sec();
+			n = procscan_pass(scans[v], 0, &gui);
+			double el = now_sec() - t0;
+			best = el < best ? el : best;
+		}
+		report(names[v], best, n, gui);
+	}
+
+	/* first classification pays for cmdline+environ, later scans hit the cache */
+	ProcScan *cold = NULL;
+	double t0;
+	best = 1e9;
+	for (int r = 0; r < reps; r++)
+	{
+		procscan_free(cold);
+		cold = procscan_new(threads);
+		t0 = now_sec();
+		n = procscan_pass(cold, 1, &gui);
+		double el = now_sec() - t0;
+		best = el < best ? el : best;
+	}
+	report("procscan parallel + gui, cold", best, n, gui);
+	best = 1e9;
+	for (int r = 0; r < reps; r++)
+	{
+		t0 = now_sec();
+		n = procscan_pass(cold, 1, &gui);
+		double el = now_sec() - t0;
+		best = el < best ? el : best;
+	}
+	report("procscan parallel + gui, cached", best, n, gui);
+
+	procscan_free(cold);
+	procscan_free(serial);
+	procscan_free(parallel);
+	for (int i = 0; i < spawned; i++)
+		kill(kids[i], SIGKILL);
+	for (int i = 0; i < spawned; i++)
+		waitpid(kids[i], NULL, 0);
+	free(kids);
+	return 0;
+}
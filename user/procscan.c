@@ -0,0 +1,377 @@
+// ==== user/procscan.c ====
+// /proc scanner, see procscan.h.
+// A scan lists the numeric entries of /proc with getdents64() on a dirfd that
+// is kept open, then reads <pid>/stat for each with one openat()+read() into a
+// stack buffer: no per-process stdio, no path building from "/proc". Above
+// PARALLEL_MIN pids the reads are split into contiguous slices, one per
+// thread, each writing its own part of the entry array. Cached GUI state is
+// carried over from the previous scan by merging the two pid-sorted arrays.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+#include "procscan.h"
+
+#define DENTS_BUF (64 * 1024)
+#define PARALLEL_MIN 4096		 /* pids below which one thread is faster */
+#define MAX_AUTO_THREADS 8
+#define MAX_THREADS 64
+#define MAX_PROC_FILE (1 << 20) /* cap on cmdline/environ bytes looked at */
+
+struct ProcScan
+{
+	int procfd;
+	int nthreads;
+	ProcEntry *ents; /* this scan, sorted by pid */
+	uint64_t n, cap;
+	ProcEntry *prev; /* the scan before, for its cached GUI state */
+	uint64_t nprev, capprev;
+	pid_t *pids;
+	uint64_t npids, cappids;
+	char *dents;
+	char *buf; /* cmdline / environ */
+	size_t bufcap;
+};
+
+typedef struct
+{
+	ProcScan *s;
+	uint64_t first, last; /* pids[first..last) */
+} Slice;
+
+/* growable array helper, as in memdump.c */
+static int grow(void **arr, uint64_t *cap, uint64_t need, size_t elem)
+{
+	if (need <= *cap)
+		return 0;
+	uint64_t n = *cap ? *cap * 2 : 64;
+	while (n < need)
+		n *= 2;
+	void *p = realloc(*arr, n * elem);
+	if (!p)
+		return -ENOMEM;
+	*arr = p;
+	*cap = n;
+	return 0;
+}
+
+ProcScan *procscan_new(int nthreads)
+{
+	ProcScan *s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	s->dents = malloc(DENTS_BUF);
+	if (s->procfd < 0 || !s->dents)
+	{
+		procscan_free(s);
+		return NULL;
+	}
+	if (nthreads <= 0)
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = n < 1 ? 1 : n > MAX_AUTO_THREADS ? MAX_AUTO_THREADS : (int)n;
+	}
+	s->nthreads = nthreads;
+	return s;
+}
+
+void procscan_free(ProcScan *s)
+{
+	if (!s)
+		return;
+	if (s->procfd >= 0)
+		close(s->procfd);
+	free(s->ents);
+	free(s->prev);
+	free(s->pids);
+	free(s->dents);
+	free(s->buf);
+	free(s);
+}
+
+static int list_pids(ProcScan *s)
+{
+	s->npids = 0;
+	if (lseek(s->procfd, 0, SEEK_SET) < 0)
+		return -errno;
+	for (;;)
+	{
+		long nread = syscall(SYS_getdents64, s->procfd, s->dents, DENTS_BUF);
+		if (nread < 0)
+			return -errno;
+		if (nread == 0)
+			return 0;
+		for (long off = 0; off < nread;)
+		{
+			struct dirent64 *d = (struct dirent64 *)(s->dents + off);
+			off += d->d_reclen;
+			const char *p = d->d_name;
+			pid_t pid = 0;
+			if (*p < '1' || *p > '9')
+				continue;
+			while (*p >= '0' && *p <= '9')
+				pid = pid * 10 + (*p++ - '0');
+			if (*p)
+				continue;
+			int rc = grow((void **)&s->pids, &s->cappids, s->npids + 1, sizeof(*s->pids));
+			if (rc < 0)
+				return rc;
+			s->pids[s->npids++] = pid;
+		}
+	}
+}
+
+/* read <pid>/stat into buf */
+static ssize_t read_stat(int procfd, pid_t pid, char *buf, size_t len)
+{
+	char name[24];
+	snprintf(name, sizeof(name), "%d/stat", pid);
+	int fd = openat(procfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	ssize_t n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0)
+		return n < 0 ? -errno : -EIO;
+	buf[n] = '\0';
+	return n;
+}
+
+/* comm (between the first '(' and the last ')') and field 22, starttime */
+static int parse_stat(char *buf, ProcEntry *e)
+{
+	char *open = strchr(buf, '(');
+	char *close = strrchr(buf, ')');
+	if (!open || !close || close < open)
+		return -EINVAL;
+	size_t len = (size_t)(close - open - 1);
+	if (len >= sizeof(e->comm))
+		len = sizeof(e->comm) - 1;
+	memcpy(e->comm, open + 1, len);
+	e->comm[len] = '\0';
+
+	char *p = close + 2; /* field 3, state */
+	for (int field = 3; field < 22; field++)
+	{
+		p = strchr(p, ' ');
+		if (!p)
+			return -EINVAL;
+		p++;
+	}
+	e->starttime = strtoull(p, NULL, 10);
+	return 0;
+}
+
+/* fill entries for pids[first..last); pid 0 marks one that exited meanwhile */
+static void scan_slice(ProcScan *s, uint64_t first, uint64_t last)
+{
+	char buf[1024];
+
+	for (uint64_t i = first; i < last; i++)
+	{
+		ProcEntry *e = &s->ents[i];
+		e->pid = s->pids[i];
+		e->gui = PROCSCAN_GUI_UNKNOWN;
+		if (read_stat(s->procfd, e->pid, buf, sizeof(buf)) < 0 || parse_stat(buf, e) < 0)
+			e->pid = 0;
+	}
+}
+
+static void *scan_worker(void *arg)
+{
+	Slice *sl = arg;
+	scan_slice(sl->s, sl->first, sl->last);
+	return NULL;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	pid_t x = ((const ProcEntry *)a)->pid, y = ((const ProcEntry *)b)->pid;
+	return (x > y) - (x < y);
+}
+
+int procscan_run(ProcScan *s, const ProcEntry **entries)
+{
+	int rc;
+
+	/* the current scan becomes the previous one */
+	ProcEntry *t = s->prev;
+	uint64_t tcap = s->capprev;
+	s->prev = s->ents;
+	s->capprev = s->cap;
+	s->nprev = s->n;
+	s->ents = t;
+	s->cap = tcap;
+	s->n = 0;
+
+	rc = list_pids(s);
+	if (rc < 0)
+		return rc;
+	rc = grow((void **)&s->ents, &s->cap, s->npids ? s->npids : 1, sizeof(*s->ents));
+	if (rc < 0)
+		return rc;
+
+	/* at least PARALLEL_MIN / 4 pids per thread */
+	int nthreads = s->nthreads;
+	if ((uint64_t)nthreads > s->npids / (PARALLEL_MIN / 4))
+		nthreads = (int)(s->npids / (PARALLEL_MIN / 4));
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if (s->npids < PARALLEL_MIN || nthreads < 2)
+		scan_slice(s, 0, s->npids);
+	else
+	{
+		pthread_t tids[MAX_THREADS];
+		Slice sl[MAX_THREADS];
+		int started[MAX_THREADS];
+
+		for (int k = 0; k < nthreads; k++)
+			sl[k] = (Slice){s, s->npids * k / nthreads, s->npids * (k + 1) / nthreads};
+		/* slice 0 runs on this thread, as does any slice whose thread failed to start */
+		for (int k = 1; k < nthreads; k++)
+			started[k] = pthread_create(&tids[k], NULL, scan_worker, &sl[k]) == 0;
+		scan_slice(s, sl[0].first, sl[0].last);
+		for (int k = 1; k < nthreads; k++)
+		{
+			if (started[k])
+				pthread_join(tids[k], NULL);
+			else
+				scan_slice(s, sl[k].first, sl[k].last);
+		}
+	}
+
+	/* drop exited processes, keep pid order */
+	uint64_t n = 0;
+	int sorted = 1;
+	for (uint64_t i = 0; i < s->npids; i++)
+		if (s->ents[i].pid)
+		{
+			if (n && s->ents[i].pid < s->ents[n - 1].pid)
+				sorted = 0;
+			s->ents[n++] = s->ents[i];
+		}
+	s->n = n;
+	if (!sorted)
+		qsort(s->ents, n, sizeof(*s->ents), cmp_entry);
+
+	/* carry over GUI state of processes that are still the same process */
+	for (uint64_t i = 0, j = 0; i < n && j < s->nprev;)
+	{
+		ProcEntry *e = &s->ents[i];
+		const ProcEntry *p = &s->prev[j];
+		if (p->pid < e->pid)
+			j++;
+		else if (p->pid > e->pid)
+			i++;
+		else
+		{
+			if (p->starttime == e->starttime)
+				e->gui = p->gui;
+			i++;
+			j++;
+		}
+	}
+
+	*entries = s->ents;
+	return (int)n;
+}
+
+const ProcEntry *procscan_find(const ProcScan *s, pid_t pid)
+{
+	uint64_t lo = 0, hi = s->n;
+
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (s->ents[mid].pid < pid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < s->n && s->ents[lo].pid == pid ? &s->ents[lo] : NULL;
+}
+
+/* read all of dirfd/name (up to MAX_PROC_FILE) into s->buf */
+static ssize_t read_file(ProcScan *s, int dirfd, const char *name)
+{
+	int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	size_t len = 0;
+	for (;;)
+	{
+		if (len == s->bufcap)
+		{
+			if (s->bufcap >= MAX_PROC_FILE)
+				break;
+			size_t ncap = s->bufcap ? s->bufcap * 2 : 16384;
+			char *p = realloc(s->buf, ncap);
+			if (!p)
+				break;
+			s->buf = p;
+			s->bufcap = ncap;
+		}
+		ssize_t n = read(fd, s->buf + len, s->bufcap - len);
+		if (n <= 0)
+			break;
+		len += (size_t)n;
+	}
+	close(fd);
+	return (ssize_t)len;
+}
+
+/* whether one of the '\0' separated strings in buf starts with prefix */
+static int has_prefix(const char *buf, size_t len, const char *prefix)
+{
+	size_t plen = strlen(prefix);
+
+	for (size_t off = 0; off < len;)
+	{
+		const char *str = buf + off;
+		size_t slen = strnlen(str, len - off);
+		if (slen >= plen && memcmp(str, prefix, plen) == 0)
+			return 1;
+		off += slen + 1;
+	}
+	return 0;
+}
+
+/* environ first: most processes have no display and need nothing else */
+static int classify(ProcScan *s, const ProcEntry *e)
+{
+	char name[16];
+	int gui = 0;
+
+	snprintf(name, sizeof(name), "%d", e->pid);
+	int dirfd = openat(s->procfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return 0;
+	ssize_t n = read_file(s, dirfd, "environ");
+	if (n > 0 && (has_prefix(s->buf, (size_t)n, "DISPLAY=") || has_prefix(s->buf, (size_t)n, "WAYLAND_DISPLAY=")))
+	{
+		n = read_file(s, dirfd, "cmdline");
+		gui = !(n > 0 && (has_prefix(s->buf, (size_t)n, "--type=renderer") ||
+						  has_prefix(s->buf, (size_t)n, "--type=gpu-process")));
+	}
+	close(dirfd);
+	return gui;
+}
+
+int procscan_is_gui(ProcScan *s, const ProcEntry *e)
+{
+	if (e < s->ents || e >= s->ents + s->n)
+		return 0;
+	ProcEntry *me = &s->ents[e - s->ents];
+	if (me->gui == PROCSCAN_GUI_UNKNOWN)
+		me->gui = classify(s, me);
+	return me->gui;
+}
@@ -0,0 +1,46 @@
+// ==== user/procscan.h ====
+// /proc process scanner: one openat() per process (of <pid>/stat, relative to
+// a long-lived /proc dirfd) yields its name and start time; large scans are
+// split across threads. Classifying a process as GUI needs cmdline and
+// environ, so it is done only when asked and cached by (pid, starttime),
+// which stays valid across scans until the pid is reused.
+
+#ifndef PROCSCAN_H
+#define PROCSCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PROCSCAN_COMM_LEN 64 /* comm is at most 16 bytes today; kthreads may be longer */
+
+/* ProcEntry.gui */
+#define PROCSCAN_GUI_UNKNOWN (-1)
+
+typedef struct
+{
+	pid_t pid;
+	int gui;			/* 0, 1 or PROCSCAN_GUI_UNKNOWN; see procscan_is_gui() */
+	uint64_t starttime; /* clock ticks after boot, field 22 of /proc/<pid>/stat */
+	char comm[PROCSCAN_COMM_LEN];
+} ProcEntry;
+
+typedef struct ProcScan ProcScan;
+
+/* nthreads <= 0: one per CPU (max 8) for scans big enough to be worth it */
+ProcScan *procscan_new(int nthreads);
+void procscan_free(ProcScan *s);
+
+/* rescan /proc; entries are sorted by pid and valid until the next scan, and
+   keep the cached GUI state of processes seen before. Returns the count or -errno. */
+int procscan_run(ProcScan *s, const ProcEntry **entries);
+
+/* the entry for pid in the last scan, or NULL */
+const ProcEntry *procscan_find(const ProcScan *s, pid_t pid);
+
+/* whether e has DISPLAY or WAYLAND_DISPLAY in its environment and is not a
+   browser renderer/GPU helper; classifies e on first use (e must come from
+   the last scan). 0 when the process is gone or unreadable. */
+int procscan_is_gui(ProcScan *s, const ProcEntry *e);
+
+#endif /* PROCSCAN_H */
@@ -0,0 +1,378 @@
+// ==== user/snapimage.c ====
+// Snapshot image writer and reader, see snapimage.h.
+// The writer keeps header and metadata in memory until the first payload page
+// (so the header can carry meta_bytes and data_offset), streams the payload
+// straight through, and collects regions, index and strings for the footer.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapimage.h"
+
+struct SnapImgWriter
+{
+	int fd;
+	int err;		  /* first write error, sticky */
+	int started;	  /* header written, payload begun */
+	uint64_t off;	  /* bytes written so far */
+	size_t page_size;
+	SnapImgHeader hdr;
+	uint8_t *meta;
+	uint64_t meta_len, meta_cap;
+	SnapImgRegion *regions;
+	uint64_t nr_regions, cap_regions;
+	SnapImgIndex *index;
+	uint64_t nr_index, cap_index;
+	char *strtab;
+	uint64_t strtab_len, strtab_cap;
+	uint64_t data_pages;
+};
+
+/* growable array helper, as in memdump.c */
+static int grow(void **arr, uint64_t *cap, uint64_t need, size_t elem)
+{
+	if (need <= *cap)
+		return 0;
+	uint64_t n = *cap ? *cap * 2 : 64;
+	while (n < need)
+		n *= 2;
+	void *p = realloc(*arr, n * elem);
+	if (!p)
+		return -ENOMEM;
+	*arr = p;
+	*cap = n;
+	return 0;
+}
+
+static int put(SnapImgWriter *w, const void *buf, uint64_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0 && !w->err)
+	{
+		ssize_t n = write(w->fd, p, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			w->err = -errno;
+			break;
+		}
+		p += n;
+		len -= (uint64_t)n;
+		w->off += (uint64_t)n;
+	}
+	return w->err;
+}
+
+static int put_zeros(SnapImgWriter *w, uint64_t len)
+{
+	static const uint8_t zeros[4096];
+
+	while (len > 0 && !w->err)
+	{
+		uint64_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+		put(w, zeros, n);
+		len -= n;
+	}
+	return w->err;
+}
+
+SnapImgWriter *snapimg_writer_new(int fd, pid_t pid)
+{
+	SnapImgWriter *w = calloc(1, sizeof(*w));
+	struct timespec ts;
+
+	if (!w)
+		return NULL;
+	w->fd = fd;
+	w->page_size = (size_t)sysconf(_SC_PAGESIZE);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	w->hdr.magic = SNAPIMG_MAGIC;
+	w->hdr.version = SNAPIMG_VERSION;
+	w->hdr.page_size = (uint32_t)w->page_size;
+	w->hdr.pid = pid;
+	w->hdr.time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+	/* offset 0 of the string table means "no path" */
+	if (grow((void **)&w->strtab, &w->strtab_cap, 1, 1) < 0)
+	{
+		free(w);
+		return NULL;
+	}
+	w->strtab[0] = '\0';
+	w->strtab_len = 1;
+	return w;
+}
+
+int snapimg_add_meta(SnapImgWriter *w, uint32_t type, const void *data, uint32_t len)
+{
+	uint64_t rec = sizeof(SnapImgMeta) + ((len + 7ULL) & ~7ULL);
+	SnapImgMeta m = {type, len};
+
+	if (w->started)
+		return -EINVAL;
+	if (grow((void **)&w->meta, &w->meta_cap, w->meta_len + rec, 1) < 0)
+		return -ENOMEM;
+	memset(w->meta + w->meta_len, 0, rec);
+	memcpy(w->meta + w->meta_len, &m, sizeof(m));
+	memcpy(w->meta + w->meta_len + sizeof(m), data, len);
+	w->meta_len += rec;
+	return 0;
+}
+
+int snapimg_add_region(SnapImgWriter *w, const SnapImgRegion *rg, const char *path)
+{
+	if (grow((void **)&w->regions, &w->cap_regions, w->nr_regions + 1, sizeof(*rg)) < 0)
+		return -ENOMEM;
+	SnapImgRegion *r = &w->regions[w->nr_regions];
+	*r = *rg;
+	r->path = 0;
+	r->pad = 0;
+	if (path && path[0])
+	{
+		size_t n = strlen(path) + 1;
+		if (grow((void **)&w->strtab, &w->strtab_cap, w->strtab_len + n, 1) < 0)
+			return -ENOMEM;
+		memcpy(w->strtab + w->strtab_len, path, n);
+		r->path = (uint32_t)w->strtab_len;
+		w->strtab_len += n;
+	}
+	w->nr_regions++;
+	return 0;
+}
+
+/* header, metadata and the pad up to the first payload page */
+static int start_payload(SnapImgWriter *w)
+{
+	uint64_t head = sizeof(w->hdr) + w->meta_len;
+
+	w->started = 1;
+	w->hdr.meta_bytes = w->meta_len;
+	w->hdr.data_offset = (head + w->page_size - 1) / w->page_size * w->page_size;
+	put(w, &w->hdr, sizeof(w->hdr));
+	put(w, w->meta, w->meta_len);
+	return put_zeros(w, w->hdr.data_offset - head);
+}
+
+/* index entry for nr_pages at vaddr whose payload starts at the current offset */
+static int add_range(SnapImgWriter *w, uint64_t vaddr, uint64_t nr_pages, uint32_t flags)
+{
+	if (!w->started)
+	{
+		w->hdr.flags |= flags;
+		if (start_payload(w) < 0)
+			return w->err;
+	}
+	if (w->err)
+		return w->err;
+	if ((w->hdr.flags & SNAPIMG_F_PAGE_REFS) != flags)
+		return -EINVAL;
+
+	SnapImgIndex *last = w->nr_index ? &w->index[w->nr_index - 1] : NULL;
+	if (last && vaddr < last->vaddr + last->nr_pages * w->page_size)
+		return -EINVAL;
+	if (last && last->vaddr + last->nr_pages * w->page_size == vaddr)
+		last->nr_pages += nr_pages; /* payload is contiguous too */
+	else
+	{
+		if (grow((void **)&w->index, &w->cap_index, w->nr_index + 1, sizeof(*w->index)) < 0)
+			return -ENOMEM;
+		w->index[w->nr_index++] = (SnapImgIndex){vaddr, nr_pages, w->off};
+	}
+	w->data_pages += nr_pages;
+	return 0;
+}
+
+int snapimg_add_pages(SnapImgWriter *w, uint64_t vaddr, const void *data, uint64_t nr_pages)
+{
+	int rc = nr_pages ? add_range(w, vaddr, nr_pages, 0) : 0;
+	return rc ? rc : put(w, data, nr_pages * w->page_size);
+}
+
+int snapimg_add_refs(SnapImgWriter *w, uint64_t vaddr, const SnapImgPageRef *refs, uint64_t nr_pages)
+{
+	int rc = nr_pages ? add_range(w, vaddr, nr_pages, SNAPIMG_F_PAGE_REFS) : 0;
+	return rc ? rc : put(w, refs, nr_pages * sizeof(*refs));
+}
+
+void snapimg_writer_abort(SnapImgWriter *w)
+{
+	if (!w)
+		return;
+	free(w->meta);
+	free(w->regions);
+	free(w->index);
+	free(w->strtab);
+	free(w);
+}
+
+int snapimg_finish(SnapImgWriter *w)
+{
+	SnapImgTrailer tr;
+	int rc;
+
+	if (!w->started)
+		start_payload(w);
+
+	memset(&tr, 0, sizeof(tr));
+	tr.footer_offset = w->off;
+	tr.nr_regions = w->nr_regions;
+	tr.nr_index = w->nr_index;
+	tr.strtab_size = (w->strtab_len + 7) & ~7ULL;
+	tr.data_pages = w->data_pages;
+	tr.magic = SNAPIMG_END_MAGIC;
+
+	put(w, w->regions, w->nr_regions * sizeof(*w->regions));
+	put(w, w->index, w->nr_index * sizeof(*w->index));
+	put(w, w->strtab, w->strtab_len);
+	put_zeros(w, tr.strtab_size - w->strtab_len);
+	put(w, &tr, sizeof(tr));
+
+	rc = w->err;
+	snapimg_writer_abort(w);
+	return rc;
+}
+
+int snapimg_open(const char *path, SnapImg *img)
+{
+	struct stat sb;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	memset(img, 0, sizeof(*img));
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(SnapImgHeader) + sizeof(SnapImgTrailer))
+	{
+		close(fd);
+		return -EINVAL;
+	}
+	img->len = (size_t)sb.st_size;
+	void *p = mmap(NULL, img->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -errno;
+	img->base = p;
+
+	const SnapImgHeader *h = (const void *)img->base;
+	const SnapImgTrailer *tr = (const void *)(img->base + img->len - sizeof(*tr));
+	uint64_t end = img->len - sizeof(*tr);
+	if (h->magic != SNAPIMG_MAGIC || h->version != SNAPIMG_VERSION || tr->magic != SNAPIMG_END_MAGIC ||
+		h->page_size == 0 || h->data_offset % h->page_size || h->meta_bytes > h->data_offset ||
+		sizeof(*h) + h->meta_bytes > h->data_offset || h->data_offset > tr->footer_offset ||
+		tr->footer_offset > end || tr->nr_regions > end / sizeof(SnapImgRegion) ||
+		tr->nr_index > end / sizeof(SnapImgIndex) || tr->strtab_size > end ||
+		tr->footer_offset + tr->nr_regions * sizeof(SnapImgRegion) + tr->nr_index * sizeof(SnapImgIndex) +
+				tr->strtab_size != end)
+	{
+		snapimg_close(img);
+		return -EINVAL;
+	}
+
+	img->hdr = h;
+	img->trailer = tr;
+	img->regions = (const void *)(img->base + tr->footer_offset);
+	img->index = (const void *)(img->regions + tr->nr_regions);
+	img->strtab = (const char *)(img->index + tr->nr_index);
+	/* every path must end inside the table: the writer starts it with the
+	   empty string and pads it with zeros, so the last byte is always NUL */
+	if (tr->strtab_size == 0 || img->strtab[tr->strtab_size - 1] != '\0')
+	{
+		snapimg_close(img);
+		return -EINVAL;
+	}
+	uint64_t stride = (h->flags & SNAPIMG_F_PAGE_REFS) ? sizeof(SnapImgPageRef) : h->page_size;
+	for (uint64_t i = 0; i < tr->nr_index; i++)
+	{
+		const SnapImgIndex *ix = &img->index[i];
+		if (ix->file_offset < h->data_offset || ix->nr_pages > tr->footer_offset / stride ||
+			ix->file_offset + ix->nr_pages * stride > tr->footer_offset)
+		{
+			snapimg_close(img);
+			return -EINVAL;
+		}
+	}
+	for (uint64_t i = 0; i < tr->nr_regions; i++)
+		if (img->regions[i].path && img->regions[i].path >= tr->strtab_size)
+		{
+			snapimg_close(img);
+			return -EINVAL;
+		}
+	return 0;
+}
+
+void snapimg_close(SnapImg *img)
+{
+	if (img->base)
+		munmap((void *)img->base, img->len);
+	memset(img, 0, sizeof(*img));
+}
+
+const void *snapimg_meta(const SnapImg *img, uint32_t type, uint32_t *len)
+{
+	const uint8_t *p = img->base + sizeof(*img->hdr);
+	const uint8_t *end = p + img->hdr->meta_bytes;
+
+	while (p + sizeof(SnapImgMeta) <= end)
+	{
+		SnapImgMeta m;
+		memcpy(&m, p, sizeof(m));
+		uint64_t rec = sizeof(m) + ((m.len + 7ULL) & ~7ULL);
+		if (rec > (uint64_t)(end - p))
+			break;
+		if (m.type == type)
+		{
+			if (len)
+				*len = m.len;
+			return p + sizeof(m);
+		}
+		p += rec;
+	}
+	return NULL;
+}
+
+/* index entry holding vaddr, or NULL */
+static const SnapImgIndex *find_index(const SnapImg *img, uint64_t vaddr)
+{
+	uint64_t ps = img->hdr->page_size;
+	uint64_t lo = 0, hi = img->trailer->nr_index;
+
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (img->index[mid].vaddr <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	const SnapImgIndex *ix = &img->index[lo - 1];
+	return vaddr < ix->vaddr + ix->nr_pages * ps ? ix : NULL;
+}
+
+const void *snapimg_page(const SnapImg *img, uint64_t vaddr)
+{
+	uint64_t ps = img->hdr->page_size;
+
+	vaddr &= ~(ps - 1);
+	const SnapImgIndex *ix = (img->hdr->flags & SNAPIMG_F_PAGE_REFS) ? NULL : find_index(img, vaddr);
+	return ix ? img->base + ix->file_offset + (vaddr - ix->vaddr) : NULL;
+}
+
+const SnapImgPageRef *snapimg_page_ref(const SnapImg *img, uint64_t vaddr)
+{
+	uint64_t ps = img->hdr->page_size;
+
+	vaddr &= ~(ps - 1);
+	const SnapImgIndex *ix = (img->hdr->flags & SNAPIMG_F_PAGE_REFS) ? find_index(img, vaddr) : NULL;
+	if (!ix)
+		return NULL;
+	return (const SnapImgPageRef *)(img->base + ix->file_offset) + (vaddr - ix->vaddr) / ps;
+}
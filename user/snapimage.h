@@ -0,0 +1,147 @@
+// ==== user/snapimage.h ====
+// On-disk snapshot image: process metadata plus memory, written front to back
+// in one sequential pass (works on pipes and sockets) and readable in place
+// through a single read-only mmap.
+
+#ifndef SNAPIMAGE_H
+#define SNAPIMAGE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SNAPIMG_MAGIC 0x31474d4946504e53ULL		/* "SNPFIMG1" */
+#define SNAPIMG_END_MAGIC 0x31444e4546504e53ULL /* "SNPFEND1" */
+#define SNAPIMG_VERSION 1
+
+/* file layout:
+ *   SnapImgHeader | SnapImgMeta records (meta_bytes) | zero pad to page_size
+ *   | page payload (data_offset, page aligned, in index order)
+ *   | SnapImgRegion[nr_regions] | SnapImgIndex[nr_index] | strtab (8-byte padded)
+ *   | SnapImgTrailer (last sizeof(SnapImgTrailer) bytes of the file)
+ * Everything the reader needs to find the footer is in the trailer, so the
+ * writer never seeks back.
+ */
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	int32_t pid;
+	uint32_t flags;		  /* SNAPIMG_F_* */
+	uint64_t time_ns;	  /* CLOCK_REALTIME of the capture */
+	uint64_t meta_bytes;  /* SnapImgMeta records right after the header */
+	uint64_t data_offset; /* first payload byte, page aligned */
+} SnapImgHeader;
+
+/* SnapImgHeader.flags */
+#define SNAPIMG_F_PAGE_REFS 0x1 /* payload is one SnapImgPageRef per page, see pagestore.h */
+
+/* content address of a page in a page store */
+typedef struct
+{
+	uint64_t h[2];
+} SnapImgPageRef;
+
+/* SnapImgMeta.type */
+#define SNAPIMG_META_ARGV 1 /* '\0' separated, as /proc/<pid>/cmdline */
+#define SNAPIMG_META_EXE 2	/* path */
+#define SNAPIMG_META_CWD 3	/* path */
+#define SNAPIMG_META_TTY 4	/* path of fd 0 (or 1) */
+#define SNAPIMG_META_UID 5	/* uint32_t real uid */
+#define SNAPIMG_META_COMM 6 /* short name */
+#define SNAPIMG_META_PARENT 7 /* path of the image this one is the next generation of */
+
+/* len bytes of data follow, then zero pad to 8 bytes */
+typedef struct
+{
+	uint32_t type;
+	uint32_t len;
+} SnapImgMeta;
+
+/* SnapImgRegion.flags */
+#define SNAPIMG_REGION_ANON 0x1	   /* no backing file: heap, stack, anonymous mmap */
+#define SNAPIMG_REGION_PRIVATE 0x2 /* MAP_PRIVATE */
+
+/* one mapping of the address space; pages not in the index are either
+   unpopulated or clean file pages, read from (path, file_offset) */
+typedef struct
+{
+	uint64_t start;
+	uint64_t end;
+	uint64_t file_offset;
+	uint32_t prot;	/* PROT_* */
+	uint32_t flags; /* SNAPIMG_REGION_* */
+	uint32_t path;	/* offset into strtab, 0 = none */
+	uint32_t pad;
+} SnapImgRegion;
+
+/* [vaddr, vaddr + nr_pages * page_size) is stored at file_offset (its pages,
+   or with SNAPIMG_F_PAGE_REFS its page refs); sorted by vaddr */
+typedef struct
+{
+	uint64_t vaddr;
+	uint64_t nr_pages;
+	uint64_t file_offset;
+} SnapImgIndex;
+
+typedef struct
+{
+	uint64_t footer_offset; /* SnapImgRegion[0] */
+	uint64_t nr_regions;
+	uint64_t nr_index;
+	uint64_t strtab_size;
+	uint64_t data_pages;
+	uint64_t magic; /* SNAPIMG_END_MAGIC */
+} SnapImgTrailer;
+
+/* ---- streaming writer ---- */
+typedef struct SnapImgWriter SnapImgWriter;
+
+/* writes to fd, which only needs to support write() */
+SnapImgWriter *snapimg_writer_new(int fd, pid_t pid);
+
+/* metadata must come before the first snapimg_add_pages() (-EINVAL after);
+   regions are kept for the footer and can be added any time. path may be NULL. */
+int snapimg_add_meta(SnapImgWriter *w, uint32_t type, const void *data, uint32_t len);
+int snapimg_add_region(SnapImgWriter *w, const SnapImgRegion *rg, const char *path);
+
+/* append nr_pages pages for vaddr; addresses must increase. Returns 0 or -errno. */
+int snapimg_add_pages(SnapImgWriter *w, uint64_t vaddr, const void *data, uint64_t nr_pages);
+
+/* same with page refs instead of page data; the first call makes this a
+   SNAPIMG_F_PAGE_REFS image, and an image cannot mix the two (-EINVAL) */
+int snapimg_add_refs(SnapImgWriter *w, uint64_t vaddr, const SnapImgPageRef *refs, uint64_t nr_pages);
+
+/* write the footer and trailer and free w (also on error). Returns 0 or -errno. */
+int snapimg_finish(SnapImgWriter *w);
+
+/* free w without finishing the file */
+void snapimg_writer_abort(SnapImgWriter *w);
+
+/* ---- reader ---- */
+typedef struct
+{
+	const uint8_t *base; /* the whole file, mapped read-only */
+	size_t len;
+	const SnapImgHeader *hdr;
+	const SnapImgTrailer *trailer;
+	const SnapImgRegion *regions;
+	const SnapImgIndex *index;
+	const char *strtab;
+} SnapImg;
+
+/* map and validate path. Returns 0 or -errno. */
+int snapimg_open(const char *path, SnapImg *img);
+void snapimg_close(SnapImg *img);
+
+/* first metadata record of type, or NULL; *len gets its size */
+const void *snapimg_meta(const SnapImg *img, uint32_t type, uint32_t *len);
+
+/* the stored copy of the page holding vaddr, or NULL (always NULL for a
+   SNAPIMG_F_PAGE_REFS image) */
+const void *snapimg_page(const SnapImg *img, uint64_t vaddr);
+
+/* the ref of the page holding vaddr in a SNAPIMG_F_PAGE_REFS image, or NULL */
+const SnapImgPageRef *snapimg_page_ref(const SnapImg *img, uint64_t vaddr);
+
+#endif /* SNAPIMAGE_H */
@@ -0,0 +1,103 @@
+// ==== user/snaprestore.c ====
+// Front end for memrestore.c: rebuild the address-space layout of a snapshot
+// image in this process, report how long until it was usable, then (with -t)
+// touch and verify every restored run against the image.
+// Compile: gcc -O2 -Wall -pthread -o snaprestore snaprestore.c memrestore.c snapimage.c pagestore.c
+// Usage: ./snaprestore [-e] [-t] [-s storedir] <image>
+//   -e  eager: copy every page while mapping (baseline for the lazy numbers)
+//   -t  touch: read every restored page and compare it with the image
+//   -s  page store of an image with page refs (default $SNAPSHOT_STORE)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memrestore.h"
+
+typedef struct
+{
+	uint64_t bytes;
+	uint64_t mismatches;
+} TouchStats;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int touch_run(void *addr, const void *image, uint64_t bytes, void *arg)
+{
+	TouchStats *ts = arg;
+
+	if (memcmp(addr, image, bytes) != 0)
+		ts->mismatches++;
+	ts->bytes += bytes;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned flags = 0;
+	int touch = 0;
+	const char *storedir = getenv("SNAPSHOT_STORE");
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ets:")) != -1)
+	{
+		if (opt == 'e')
+			flags |= MR_EAGER;
+		else if (opt == 't')
+			touch = 1;
+		else if (opt == 's')
+			storedir = optarg;
+		else
+		{
+			fprintf(stderr, "usage: %s [-e] [-t] [-s storedir] <image>\n", argv[0]);
+			return 2;
+		}
+	}
+	if (argc - optind != 1)
+	{
+		fprintf(stderr, "usage: %s [-e] [-t] [-s storedir] <image>\n", argv[0]);
+		return 2;
+	}
+
+	MemRestore *mr;
+	int rc = memrestore_open(argv[optind], storedir, flags, &mr);
+	if (rc < 0)
+	{
+		fprintf(stderr, "restore of %s failed: %s\n", argv[optind], strerror(-rc));
+		return 1;
+	}
+
+	MemRestoreStats st;
+	memrestore_stats(mr, &st);
+	printf("%s: layout ready in %.3f ms: regions=%llu skipped=%llu lazy_pages=%llu eager_pages=%llu\n",
+		   flags & MR_EAGER ? "eager" : "lazy", st.map_seconds * 1e3, (unsigned long long)st.regions,
+		   (unsigned long long)st.regions_skipped, (unsigned long long)st.lazy_pages,
+		   (unsigned long long)st.eager_pages);
+
+	if (touch)
+	{
+		TouchStats ts = {0, 0};
+		double t0 = now_sec();
+		memrestore_for_each_run(mr, touch_run, &ts);
+		double el = now_sec() - t0;
+
+		memrestore_stats(mr, &st);
+		printf("touched %.1f MiB in %.3f ms (%.2f GB/s): faults=%llu served=%llu zero=%llu unreadable=%llu "
+			   "mismatched_runs=%llu\n",
+			   ts.bytes / 1048576.0, el * 1e3, el > 0 ? ts.bytes / el / 1e9 : 0, (unsigned long long)st.faults,
+			   (unsigned long long)st.served_pages, (unsigned long long)st.zero_pages,
+			   (unsigned long long)st.unreadable_pages, (unsigned long long)ts.mismatches);
+		rc = ts.mismatches || st.unreadable_pages ? 1 : 0;
+	}
+
+	memrestore_close(mr);
+	return rc;
+}
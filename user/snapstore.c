@@ -0,0 +1,190 @@
+// ==== user/snapstore.c ====
+// Maintenance front end for pagestore.c stores.
+// Compile: gcc -O2 -Wall -o snapstore snapstore.c pagestore.c snapimage.c
+// Usage: ./snapstore <storedir> stats
+//        ./snapstore <storedir> rm <image>...      drop the images' page refs, delete them
+//        ./snapstore <storedir> gc                 reclaim pages no image refers to
+//        ./snapstore <storedir> expand <image> <outfile>
+//                                                  rewrite a ref image as a self-contained one
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pagestore.h"
+
+#define EXPAND_BATCH 256 /* pages per snapimg_add_pages() */
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s <storedir> stats | gc | rm <image>... | expand <image> <outfile>\n", argv0);
+}
+
+static void print_stats(PageStore *ps)
+{
+	PageStoreStats st;
+	pagestore_stats(ps, &st);
+	printf("gen=%llu pages=%llu live=%llu refs=%llu data=%.1f MiB", (unsigned long long)st.gen,
+		   (unsigned long long)st.pages, (unsigned long long)st.live_pages, (unsigned long long)st.refs,
+		   st.data_bytes / 1048576.0);
+	if (st.live_pages)
+		printf(" dedup=%.1fx", (double)st.refs / st.live_pages);
+	printf("\n");
+}
+
+static int remove_image(PageStore *ps, const char *path)
+{
+	SnapImg img;
+	int rc = snapimg_open(path, &img);
+	if (rc == 0)
+	{
+		rc = pagestore_release_image(ps, &img);
+		snapimg_close(&img);
+	}
+	if (rc == 0 && unlink(path) < 0)
+		rc = -errno;
+	if (rc < 0)
+		fprintf(stderr, "rm %s: %s\n", path, strerror(-rc));
+	return rc;
+}
+
+/* copy the metadata and regions of img, then every page read back from ps */
+static int expand_image(PageStore *ps, const char *path, const char *outpath)
+{
+	SnapImg img;
+	void *buf = NULL;
+	int rc = snapimg_open(path, &img);
+	if (rc < 0)
+		return rc;
+	uint32_t page_size = img.hdr->page_size;
+	if (!(img.hdr->flags & SNAPIMG_F_PAGE_REFS))
+	{
+		snapimg_close(&img);
+		return -EINVAL;
+	}
+	int fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		rc = -errno;
+		snapimg_close(&img);
+		return rc;
+	}
+	SnapImgWriter *w = snapimg_writer_new(fd, img.hdr->pid);
+	if (!w || posix_memalign(&buf, page_size, (size_t)EXPAND_BATCH * page_size) != 0)
+	{
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	const uint8_t *m = img.base + sizeof(SnapImgHeader);
+	const uint8_t *mend = m + img.hdr->meta_bytes;
+	while (rc == 0 && m + sizeof(SnapImgMeta) <= mend)
+	{
+		SnapImgMeta mh;
+		memcpy(&mh, m, sizeof(mh));
+		uint64_t rec = sizeof(mh) + ((mh.len + 7ULL) & ~7ULL);
+		if (rec > (uint64_t)(mend - m))
+			break;
+		rc = snapimg_add_meta(w, mh.type, m + sizeof(mh), mh.len);
+		m += rec;
+	}
+	for (uint64_t i = 0; rc == 0 && i < img.trailer->nr_regions; i++)
+	{
+		const SnapImgRegion *rg = &img.regions[i];
+		rc = snapimg_add_region(w, rg, rg->path ? img.strtab + rg->path : NULL);
+	}
+	for (uint64_t i = 0; rc == 0 && i < img.trailer->nr_index; i++)
+	{
+		const SnapImgIndex *ix = &img.index[i];
+		const SnapImgPageRef *refs = (const SnapImgPageRef *)(img.base + ix->file_offset);
+		for (uint64_t p = 0; rc == 0 && p < ix->nr_pages; p += EXPAND_BATCH)
+		{
+			uint64_t n = ix->nr_pages - p < EXPAND_BATCH ? ix->nr_pages - p : EXPAND_BATCH;
+			for (uint64_t k = 0; rc == 0 && k < n; k++)
+				rc = pagestore_read(ps, &refs[p + k], (char *)buf + k * page_size);
+			if (rc == 0)
+				rc = snapimg_add_pages(w, ix->vaddr + p * page_size, buf, n);
+		}
+	}
+	if (rc == 0)
+		rc = snapimg_finish(w);
+	w = NULL;
+
+out:
+	snapimg_writer_abort(w);
+	if (close(fd) < 0 && rc == 0)
+		rc = -errno;
+	if (rc < 0)
+		unlink(outpath);
+	free(buf);
+	snapimg_close(&img);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+	const char *dir = argv[1], *cmd = argv[2];
+	int commit = 0;
+	int rc = 0;
+
+	if (!((strcmp(cmd, "stats") == 0 && argc == 3) || (strcmp(cmd, "gc") == 0 && argc == 3) ||
+		  (strcmp(cmd, "rm") == 0 && argc >= 4) || (strcmp(cmd, "expand") == 0 && argc == 5)))
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	PageStore *ps;
+	rc = pagestore_open(dir, &ps);
+	if (rc < 0)
+	{
+		fprintf(stderr, "page store %s: %s\n", dir, strerror(-rc));
+		return 1;
+	}
+
+	if (strcmp(cmd, "stats") == 0)
+		print_stats(ps);
+	else if (strcmp(cmd, "gc") == 0)
+	{
+		uint64_t freed;
+		rc = pagestore_gc(ps, &freed);
+		if (rc == 0)
+		{
+			printf("freed %.1f MiB\n", freed / 1048576.0);
+			print_stats(ps);
+		}
+		else
+			fprintf(stderr, "gc failed: %s\n", strerror(-rc));
+	}
+	else if (strcmp(cmd, "rm") == 0)
+	{
+		/* refs of images that could not be removed stay counted */
+		for (int i = 3; i < argc; i++)
+			if (remove_image(ps, argv[i]) < 0)
+				rc = -1;
+		commit = 1;
+	}
+	else
+	{
+		rc = expand_image(ps, argv[3], argv[4]);
+		if (rc < 0)
+			fprintf(stderr, "expand %s: %s\n", argv[3], strerror(-rc));
+	}
+
+	int crc = pagestore_close(ps, commit);
+	if (crc < 0)
+	{
+		fprintf(stderr, "page store %s: commit failed: %s\n", dir, strerror(-crc));
+		rc = crc;
+	}
+	return rc < 0 ? 1 : 0;
+}
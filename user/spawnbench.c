@@ -0,0 +1,242 @@
+// ==== user/spawnbench.c ====
+// Benchmark of restore-to-exec latency: launch.c against the fork() path
+// spawn_from_saved() used to take (fork of the whole caller, argv malloc'd in
+// the child, a CLOEXEC status pipe read to EOF) and its sh -c fallback. Each
+// launch runs this binary again with -R, which writes one byte to a pipe
+// as soon as it runs; the time until that byte arrives is reported. The last
+// variant also has the child reapply attributes captured from this process
+// (procattr.h), as a restore does.
+// Compile: gcc -O2 -Wall -pthread -o spawnbench spawnbench.c launch.c procattr.c
+// Usage: ./spawnbench [-m MiB] [-r reps]
+//   -m  touch this much heap first: fork() copies the page tables of the
+//       caller, so its cost grows with the CLI's memory (catalog, images)
+//   -r  launches per variant, median and best are reported (default 200)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "launch.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static char self[4096];
+static char ready_arg[16];
+static int ready_rd = -1;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* the launched program has run: one byte from -R */
+static int wait_ready(void)
+{
+	char c;
+	return read(ready_rd, &c, 1) == 1 ? 0 : -1;
+}
+
+/* ---- the previous spawn_from_saved(), detached case, for comparison ---- */
+static pid_t legacy_spawn(const char *cmdline, int sh_hop)
+{
+	int pfd[2];
+	if (pipe2(pfd, O_CLOEXEC) < 0)
+		return -1;
+	pid_t child = fork();
+	if (child == 0)
+	{
+		close(pfd[0]);
+		sigset_t sset;
+		sigemptyset(&sset);
+		sigprocmask(SIG_SETMASK, &sset, NULL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGTTIN, SIG_DFL);
+		signal(SIGTTOU, SIG_DFL);
+
+		/* argv built in the child, as cmdline_to_argv() did there */
+		int argc = 0;
+		for (const char *p = cmdline; *p; p += strlen(p) + 1)
+			argc++;
+		char **argv = malloc((argc + 1) * sizeof(char *));
+		if (!argv)
+			_exit(127);
+		argc = 0;
+		for (const char *p = cmdline; *p; p += strlen(p) + 1)
+			argv[argc++] = (char *)p;
+		argv[argc] = NULL;
+
+		setsid();
+		int nullfd = open("/dev/null", O_RDWR);
+		if (nullfd >= 0)
+		{
+			dup2(nullfd, STDIN_FILENO);
+			dup2(nullfd, STDOUT_FILENO);
+			dup2(nullfd, STDERR_FILENO);
+			if (nullfd > 2)
+				close(nullfd);
+		}
+		if (sh_hop)
+			execl("/bin/sh", "sh", "-c", "exec \"$0\" \"$@\"", argv[0], argv[1], argv[2], (char *)NULL);
+		else
+			execv(argv[0], argv);
+		int err = errno;
+		if (write(pfd[1], &err, sizeof(err)) < 0)
+			_exit(127);
+		_exit(127);
+	}
+	close(pfd[1]);
+	if (child < 0)
+	{
+		close(pfd[0]);
+		return -1;
+	}
+	int err;
+	ssize_t got = read(pfd[0], &err, sizeof(err)); /* EOF: exec'd */
+	close(pfd[0]);
+	int pidfd = (int)syscall(SYS_pidfd_open, child, 0);
+	if (pidfd >= 0)
+		close(pidfd);
+	return got == 0 ? child : -1;
+}
+
+static void report(const char *what, double *t, int n)
+{
+	qsort(t, n, sizeof(*t), cmp_double);
+	printf("%-34s median %8.1f us  best %8.1f us  (%d launches)\n", what, t[n / 2] * 1e6, t[0] * 1e6, n);
+}
+
+int main(int argc, char **argv)
+{
+	int mib = 0, reps = 200;
+	int opt;
+
+	if (argc == 3 && strcmp(argv[1], "-R") == 0)
+	{
+		/* launched: tell the benchmark we are running */
+		int fd = atoi(argv[2]);
+		return write(fd, "r", 1) == 1 ? 0 : 1;
+	}
+
+	while ((opt = getopt(argc, argv, "m:r:")) != -1)
+	{
+		if (opt == 'm')
+			mib = atoi(optarg);
+		else if (opt == 'r')
+			reps = atoi(optarg) > 0 ? atoi(optarg) : 1;
+		else
+		{
+			fprintf(stderr, "usage: %s [-m MiB] [-r reps]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	ssize_t sl = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	int rp[2];
+	if (sl < 0 || pipe(rp) < 0)
+	{
+		perror("spawnbench");
+		return 1;
+	}
+	self[sl] = '\0';
+	ready_rd = rp[0];
+	fcntl(rp[0], F_SETFD, FD_CLOEXEC);
+	snprintf(ready_arg, sizeof(ready_arg), "%d", rp[1]);
+
+	if (mib > 0)
+	{
+		char *ballast = malloc((size_t)mib << 20);
+		if (!ballast)
+		{
+			perror("malloc");
+			return 1;
+		}
+		memset(ballast, 1, (size_t)mib << 20);
+		printf("caller holds %d MiB\n", mib);
+	}
+
+	/* the saved cmdline, '\0' separated as in the catalog */
+	size_t sl2 = strlen(self), al = strlen(ready_arg);
+	char *cmdline = calloc(1, sl2 + al + 8);
+	double *t = calloc(reps, sizeof(*t));
+	if (!cmdline || !t)
+		return 1;
+	memcpy(cmdline, self, sl2);
+	memcpy(cmdline + sl2 + 1, "-R", 2);
+	memcpy(cmdline + sl2 + 4, ready_arg, al);
+
+	const char *names[] = {"fork + status pipe (old)", "fork + sh -c hop (old fallback)"};
+	for (int v = 0; v < 2; v++)
+	{
+		for (int r = 0; r < reps; r++)
+		{
+			double t0 = now_sec();
+			pid_t p = legacy_spawn(cmdline, v);
+			if (p < 0 || wait_ready() < 0)
+			{
+				fprintf(stderr, "%s: launch failed\n", names[v]);
+				return 1;
+			}
+			t[r] = now_sec() - t0;
+			waitpid(p, NULL, 0);
+		}
+		report(names[v], t, reps);
+	}
+
+	/* plain, then with attributes captured from ourselves to reapply */
+	static ProcAttrs attrs;
+	static char cgroup[2048];
+	char *largv[] = {self, "-R", ready_arg, NULL};
+	LaunchSpec ls = {.exe = self, .argv = largv};
+	procattr_capture(getpid(), &attrs);
+	procattr_cgroup(getpid(), cgroup, sizeof(cgroup));
+	const char *lnames[] = {"launch() clone(VM|VFORK|PIDFD)", "launch() + reapplied attributes"};
+	for (int v = 0; v < 2; v++)
+	{
+		unsigned failed = 0;
+		if (v == 1)
+		{
+			ls.attrs = &attrs;
+			ls.cgroup = cgroup;
+		}
+		for (int r = 0; r < reps; r++)
+		{
+			LaunchResult lr;
+			double t0 = now_sec();
+			if (launch(&ls, &lr) < 0 || lr.exec_err || wait_ready() < 0)
+			{
+				fprintf(stderr, "%s: failed\n", lnames[v]);
+				return 1;
+			}
+			t[r] = now_sec() - t0;
+			failed |= lr.attr_failed;
+			if (lr.pidfd >= 0)
+				close(lr.pidfd);
+			waitpid(lr.pid, NULL, 0);
+		}
+		report(lnames[v], t, reps);
+		if (failed)
+			printf("  (could not reapply PROCATTR_* 0x%x)\n", failed);
+	}
+	return 0;
+}